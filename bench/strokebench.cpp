@@ -0,0 +1,322 @@
+// drives Canvassy and Subcanvassy headlessly through QQuickRenderControl and
+// reports throughput per scenario.
+//
+// this needs nothing but a GL 3.3 compatibility context, so it runs on Mesa's
+// llvmpipe in CI, e.g. LIBGL_ALWAYS_SOFTWARE=1 xvfb-run ./brushy-bench
+//
+//   --size WxH        canvas size in pixels (default 2048x2048)
+//   --frames N        frames per synthetic scenario (default 600)
+//   --scenario NAME   taps, strokes, smudge or all (default all)
+//   --script PATH     replay a recorded script instead; one event per line:
+//                     <frame> <press|move|release> <x> <y> [left|right]
+
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QMouseEvent>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QOpenGLTimerQuery>
+#include <QQmlComponent>
+#include <QQmlEngine>
+#include <QQuickItem>
+#include <QQuickRenderControl>
+#include <QQuickWindow>
+#include <QFile>
+#include <QTextStream>
+#include <QtMath>
+#include <algorithm>
+#include "canvas.h"
+#include "dabpipeline.h"
+#include "rendererstats.h"
+#include "subcanvas.h"
+
+struct ScriptEvent {
+    int frame;
+    QEvent::Type type;
+    QPointF pos;
+    Qt::MouseButton button;
+};
+
+struct Scenario {
+    QString name;
+    QVector<ScriptEvent> script;
+    int frames;
+};
+
+struct Result {
+    quint64 dabs = 0;
+    QVector<qint64> frameTimes;
+    QVector<qint64> gpuTimes;
+    /// what both items' workers spent generating each frame's dabs, off the render thread
+    QVector<qint64> workerTimes;
+};
+
+static qreal percentile(QVector<qint64> values, qreal fraction)
+{
+    if (values.isEmpty())
+        return 0.0;
+    const int index = qMin(values.size() - 1, int(fraction * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index] / 1e6;
+}
+
+/// a short dab every few frames, scattered over the canvas
+static Scenario taps(const QSize& size, int frames)
+{
+    Scenario ret{QStringLiteral("taps"), {}, frames};
+    for (int frame = 0; frame < frames; frame += 2) {
+        const QPointF pos((frame * 7919) % size.width(), (frame * 104729) % size.height());
+        ret.script << ScriptEvent{frame, QEvent::MouseButtonPress, pos, Qt::LeftButton}
+                   << ScriptEvent{frame + 1, QEvent::MouseButtonRelease, pos, Qt::LeftButton};
+    }
+    return ret;
+}
+
+/// long diagonal flicks, several hundred pixels per frame
+static Scenario strokes(const QSize& size, int frames, Qt::MouseButton button, const QString& name)
+{
+    Scenario ret{name, {}, frames};
+    const int perStroke = 30;
+    const int eventsPerFrame = 4;
+    for (int start = 0; start + perStroke < frames; start += perStroke + 2) {
+        const qreal phase = start * 0.37;
+        const auto at = [&](qreal t) {
+            return QPointF(size.width() * (0.5 + 0.45 * qSin(phase + t * 6.0)),
+                           size.height() * (0.5 + 0.45 * qCos(phase * 1.3 + t * 4.0)));
+        };
+        ret.script << ScriptEvent{start, QEvent::MouseButtonPress, at(0.0), button};
+        for (int frame = 1; frame < perStroke; frame++) {
+            for (int i = 1; i <= eventsPerFrame; i++) {
+                const qreal t = (frame - 1 + qreal(i) / eventsPerFrame) / perStroke;
+                ret.script << ScriptEvent{start + frame, QEvent::MouseMove, at(t), button};
+            }
+        }
+        ret.script << ScriptEvent{start + perStroke, QEvent::MouseButtonRelease, at(1.0), button};
+    }
+    return ret;
+}
+
+static bool loadScript(const QString& path, Scenario& out)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    out.name = path;
+    out.frames = 0;
+    QTextStream stream(&file);
+    while (!stream.atEnd()) {
+        const auto parts = stream.readLine().simplified().split(QLatin1Char(' '));
+        if (parts.size() < 4 || parts[0].startsWith(QLatin1Char('#')))
+            continue;
+
+        ScriptEvent event;
+        event.frame = parts[0].toInt();
+        if (parts[1] == QLatin1String("press"))
+            event.type = QEvent::MouseButtonPress;
+        else if (parts[1] == QLatin1String("release"))
+            event.type = QEvent::MouseButtonRelease;
+        else
+            event.type = QEvent::MouseMove;
+        event.pos = QPointF(parts[2].toDouble(), parts[3].toDouble());
+        event.button = parts.value(4) == QLatin1String("right") ? Qt::RightButton : Qt::LeftButton;
+        out.script << event;
+        out.frames = qMax(out.frames, event.frame + 1);
+    }
+    std::stable_sort(out.script.begin(), out.script.end(), [](const ScriptEvent& a, const ScriptEvent& b) {
+        return a.frame < b.frame;
+    });
+    return true;
+}
+
+class Bench
+{
+public:
+    Bench(QOpenGLContext* context, QOffscreenSurface* surface, const QSize& size)
+        : m_context(context), m_surface(surface), m_size(size)
+    {
+    }
+
+    bool run(const Scenario& scenario, Result& result)
+    {
+        QQuickRenderControl control;
+        QQuickWindow window(&control);
+        window.setGeometry(0, 0, m_size.width(), m_size.height());
+        window.contentItem()->setSize(m_size);
+
+        QQmlEngine engine;
+        QQmlComponent component(&engine);
+        component.setData(QStringLiteral(R"(
+            import QtQuick 2.12
+            import cc.blackquill.janet.Brushy 1.0
+            Item {
+                anchors.fill: parent
+                Canvassy { anchors.fill: parent; subcanvassy: sub }
+                Subcanvassy { id: sub; anchors.fill: parent }
+            }
+        )").toUtf8(), QUrl());
+        auto root = qobject_cast<QQuickItem*>(component.create());
+        if (root == nullptr) {
+            qWarning() << component.errors();
+            return false;
+        }
+        root->setParentItem(window.contentItem());
+        root->setSize(m_size);
+
+        m_context->makeCurrent(m_surface);
+        QOpenGLFramebufferObject target(m_size, QOpenGLFramebufferObject::CombinedDepthStencil);
+        window.setRenderTarget(&target);
+        control.initialize(m_context);
+
+        // under BRUSHY_TRACE the items time their own passes, and GL can't nest elapsed queries
+        QOpenGLTimerQuery timer;
+        const bool gpuTiming = qEnvironmentVariableIsEmpty("BRUSHY_TRACE") && timer.create();
+
+        auto canvas = root->findChild<Canvassy*>();
+        auto sub = root->findChild<Subcanvassy*>();
+        const auto workTime = [&] {
+            return canvas->dabPipeline()->workTime() + sub->dabPipeline()->workTime();
+        };
+
+        // the workers generate nothing until the first sync gives them a surface
+        control.polishItems();
+        control.sync();
+        control.render();
+
+        Qt::MouseButtons held;
+        int next = 0;
+        for (int frame = 0; frame < scenario.frames; frame++) {
+            int inFrame = 0;
+            for (; next < scenario.script.size() && scenario.script[next].frame == frame; next++) {
+                const auto& event = scenario.script[next];
+                if (event.type == QEvent::MouseButtonPress)
+                    held |= event.button;
+                else if (event.type == QEvent::MouseButtonRelease)
+                    held &= ~event.button;
+
+                QMouseEvent mouse(event.type, event.pos, event.pos, event.pos,
+                                  event.type == QEvent::MouseMove ? Qt::NoButton : event.button,
+                                  held, Qt::NoModifier);
+                // spread a frame's events over its 16 ms
+                mouse.setTimestamp(ulong(frame * 16 + inFrame++));
+                QCoreApplication::sendEvent(&window, &mouse);
+            }
+
+            // every frame draws exactly the dabs of its own events, however the worker is scheduled
+            const qint64 worked = workTime();
+            canvas->dabPipeline()->drain();
+            sub->dabPipeline()->drain();
+            result.workerTimes << workTime() - worked;
+
+            QElapsedTimer elapsed;
+            elapsed.start();
+            control.polishItems();
+            control.sync();
+            if (gpuTiming)
+                timer.begin();
+            control.render();
+            if (gpuTiming)
+                timer.end();
+            m_context->functions()->glFinish();
+            result.frameTimes << elapsed.nsecsElapsed();
+            if (gpuTiming)
+                result.gpuTimes << qint64(timer.waitForResult());
+        }
+
+        result.dabs = canvas->rendererStats()->dabs + sub->rendererStats()->dabs;
+
+        delete root;
+        control.invalidate();
+        return true;
+    }
+
+private:
+    QOpenGLContext* m_context;
+    QOffscreenSurface* m_surface;
+    QSize m_size;
+};
+
+int main(int argc, char* argv[])
+{
+    QSurfaceFormat format;
+    format.setVersion(3, 3);
+    format.setProfile(QSurfaceFormat::CompatibilityProfile);
+    QSurfaceFormat::setDefaultFormat(format);
+
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption({QStringLiteral("size"), QStringLiteral("Canvas size."), QStringLiteral("WxH"), QStringLiteral("2048x2048")});
+    parser.addOption({QStringLiteral("frames"), QStringLiteral("Frames per synthetic scenario."), QStringLiteral("N"), QStringLiteral("600")});
+    parser.addOption({QStringLiteral("scenario"), QStringLiteral("taps, strokes, smudge or all."), QStringLiteral("name"), QStringLiteral("all")});
+    parser.addOption({QStringLiteral("script"), QStringLiteral("Replay a recorded script."), QStringLiteral("path")});
+    parser.process(app);
+
+    const auto dims = parser.value(QStringLiteral("size")).split(QLatin1Char('x'));
+    const QSize size(dims.value(0).toInt(), dims.value(1).toInt());
+    const int frames = parser.value(QStringLiteral("frames")).toInt();
+    if (size.isEmpty() || frames <= 0) {
+        parser.showHelp(1);
+    }
+
+    QVector<Scenario> scenarios;
+    if (parser.isSet(QStringLiteral("script"))) {
+        Scenario scenario;
+        if (!loadScript(parser.value(QStringLiteral("script")), scenario)) {
+            qCritical() << "couldn't read" << parser.value(QStringLiteral("script"));
+            return 1;
+        }
+        scenarios << scenario;
+    } else {
+        const QString which = parser.value(QStringLiteral("scenario"));
+        const bool all = which == QLatin1String("all");
+        if (all || which == QLatin1String("taps"))
+            scenarios << taps(size, frames);
+        if (all || which == QLatin1String("strokes"))
+            scenarios << strokes(size, frames, Qt::LeftButton, QStringLiteral("strokes"));
+        if (all || which == QLatin1String("smudge"))
+            scenarios << strokes(size, frames, Qt::RightButton, QStringLiteral("smudge"));
+    }
+
+    QOpenGLContext context;
+    context.setFormat(format);
+    if (!context.create()) {
+        qCritical() << "couldn't create a GL context";
+        return 1;
+    }
+    QOffscreenSurface surface;
+    surface.setFormat(context.format());
+    surface.create();
+
+    Bench bench(&context, &surface, size);
+    QTextStream out(stdout);
+    out << "scenario\tframes\tdabs\tdabs/s\tframe p50\tframe p95\tframe p99\tgpu p50\tgpu p95\tworker p50\tworker p95\n";
+    for (const auto& scenario : qAsConst(scenarios)) {
+        Result result;
+        if (!bench.run(scenario, result))
+            return 1;
+
+        qint64 total = 0;
+        for (auto time : qAsConst(result.frameTimes))
+            total += time;
+
+        out << scenario.name << '\t'
+            << result.frameTimes.size() << '\t'
+            << result.dabs << '\t'
+            << qRound64(total > 0 ? result.dabs / (total / 1e9) : 0.0) << '\t'
+            << percentile(result.frameTimes, 0.50) << '\t'
+            << percentile(result.frameTimes, 0.95) << '\t'
+            << percentile(result.frameTimes, 0.99) << '\t'
+            << percentile(result.gpuTimes, 0.50) << '\t'
+            << percentile(result.gpuTimes, 0.95) << '\t'
+            << percentile(result.workerTimes, 0.50) << '\t'
+            << percentile(result.workerTimes, 0.95) << '\n';
+        out.flush();
+    }
+    return 0;
+}
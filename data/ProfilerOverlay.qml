@@ -0,0 +1,47 @@
+import QtQuick 2.12
+import QtQuick.Layouts 1.12
+
+// per-pass frame times of a few items, GPU passes first
+Rectangle {
+    id: overlay
+
+    // each entry is {title, profiler}
+    property var items: []
+
+    color: "#c0101010"
+    radius: 4
+    implicitWidth: layout.implicitWidth + 16
+    implicitHeight: layout.implicitHeight + 16
+
+    ColumnLayout {
+        id: layout
+        x: 8
+        y: 8
+        spacing: 2
+
+        Repeater {
+            model: overlay.items
+
+            ColumnLayout {
+                spacing: 2
+
+                Text {
+                    text: modelData.title + " — " + modelData.profiler.frames + " frames"
+                    color: "white"
+                    font.bold: true
+                }
+                Repeater {
+                    model: modelData.profiler.passes
+
+                    Text {
+                        text: (modelData.gpu ? "gpu  " : "cpu  ") + modelData.name + "  "
+                              + modelData.average.toFixed(3) + " ms, max " + modelData.max.toFixed(3)
+                        color: modelData.gpu ? "#9fdfff" : "#dddddd"
+                        font.family: "monospace"
+                        font.pixelSize: 11
+                    }
+                }
+            }
+        }
+    }
+}
@@ -8,13 +8,85 @@ ApplicationWindow {
     width: 800
     height: 800
 
+    Shortcut {
+        sequence: StandardKey.Undo
+        onActivated: canvas.undo()
+    }
+    Shortcut {
+        sequence: StandardKey.Redo
+        onActivated: canvas.redo()
+    }
+    Shortcut {
+        sequence: StandardKey.Save
+        onActivated: canvas.saveProject(canvas.project !== "" ? canvas.project : "canvas.brushy")
+    }
+    Shortcut {
+        sequence: StandardKey.Open
+        onActivated: canvas.openProject("canvas.brushy")
+    }
+    Shortcut {
+        sequence: "Ctrl+Shift+N"
+        onActivated: canvas.addLayer()
+    }
+    Shortcut {
+        sequence: "PgUp"
+        onActivated: canvas.currentLayer += 1
+    }
+    Shortcut {
+        sequence: "PgDown"
+        onActivated: canvas.currentLayer -= 1
+    }
+    Shortcut {
+        sequence: "B"
+        onActivated: canvas.brush = canvas.brushes[(canvas.brushes.indexOf(canvas.brush) + 1) % canvas.brushes.length]
+    }
+    Shortcut {
+        sequence: "Shift+B"
+        onActivated: sub.brush = sub.brushes[(sub.brushes.indexOf(sub.brush) + 1) % sub.brushes.length]
+    }
+    Shortcut {
+        sequence: "F"
+        onActivated: canvas.tool = canvas.tool === Canvassy.Fill ? Canvassy.Paint : Canvassy.Fill
+    }
+    Shortcut {
+        sequence: "Ctrl+Shift+M"
+        onActivated: canvas.gpuMemory.log()
+    }
+    Shortcut {
+        sequence: "Ctrl+Shift+P"
+        onActivated: {
+            const on = !canvas.profiler.enabled
+            canvas.profiler.enabled = on
+            sub.profiler.enabled = on
+        }
+    }
+    Shortcut {
+        sequence: "Ctrl+Shift+T"
+        onActivated: {
+            canvas.profiler.dumpTrace("canvassy-trace.json")
+            sub.profiler.dumpTrace("subcanvassy-trace.json")
+        }
+    }
+    Shortcut {
+        sequence: "0"
+        onActivated: {
+            canvas.zoom = 1
+            canvas.pan = Qt.point(0, 0)
+        }
+    }
+
     Item {
         Canvassy {
+            id: canvas
             width: 800
             height: 800
             implicitWidth: 800
             implicitHeight: 800
             subcanvassy: sub
+            journal: "canvas.brj"
+            // only once there's a project to save to
+            autosave: project !== "" ? 30 : 0
+            documentSize: Qt.size(4096, 4096)
         }
         Subcanvassy {
             id: sub
@@ -22,6 +94,33 @@ ApplicationWindow {
             height: 800
             implicitWidth: 800
             implicitHeight: 800
+            journal: "subcanvas.brj"
+            // smudges sample the canvas's view, so they have to look at the same place
+            documentSize: canvas.documentSize
+            zoom: canvas.zoom
+            pan: canvas.pan
+        }
+        MouseArea {
+            anchors.fill: canvas
+            acceptedButtons: Qt.MiddleButton
+            property point last
+
+            onPressed: last = Qt.point(mouse.x, mouse.y)
+            onPositionChanged: {
+                canvas.pan = Qt.point(canvas.pan.x - (mouse.x - last.x) / canvas.zoom,
+                                      canvas.pan.y - (mouse.y - last.y) / canvas.zoom)
+                last = Qt.point(mouse.x, mouse.y)
+            }
+            onWheel: canvas.zoomAt(Qt.point(wheel.x, wheel.y), Math.pow(1.0015, wheel.angleDelta.y))
+        }
+        ProfilerOverlay {
+            x: 8
+            y: 8
+            visible: canvas.profiler.enabled
+            items: [
+                {title: "Canvassy", profiler: canvas.profiler},
+                {title: "Subcanvassy", profiler: sub.profiler},
+            ]
         }
     }
 }
@@ -0,0 +1,371 @@
+#include <QOpenGLBuffer>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QVector>
+#include <QtMath>
+#include <cmath>
+#include "blur.h"
+#include "glresources.h"
+#include "gpumemory.h"
+#include "profiler.h"
+
+namespace {
+
+/// the gaussian's standard deviation for a kernel reaching radius pixels out
+qreal sigma(int radius)
+{
+    // sixteen pixels out is sigma 10, what the kernel was tuned at
+    return radius / 1.6;
+}
+
+const char* vsrc =
+    R"(
+    #version 330
+    attribute highp vec4 vertex;
+    uniform highp mat4 matrix;
+    uniform highp vec2 size;
+    uniform highp vec2 sourceOffset;
+    uniform highp vec2 textureSize;
+    uniform highp float scale;
+    out highp vec2 TextureCoordinates;
+    void main()
+    {
+        highp vec2 position = vertex.xy * size;
+        gl_Position = matrix * vec4(position, 0.0, 1.0);
+        TextureCoordinates = (position * scale + sourceOffset) / textureSize;
+    }
+    )";
+
+const char* gaussianSrc =
+    R"(
+    #version 330
+    const int Taps = %1;
+    uniform sampler2D inputTexture;
+    uniform highp vec2 textureSize;
+    uniform mediump vec2 direction;
+    uniform mediump float offsets[Taps];
+    uniform mediump float weights[Taps];
+    in highp vec2 TextureCoordinates;
+    void main() {
+        vec2 step = direction / textureSize;
+        vec4 sum = weights[0] * texture(inputTexture, TextureCoordinates);
+        for (int i = 1; i < Taps; ++i) {
+            sum += weights[i] * texture(inputTexture, TextureCoordinates + step * offsets[i]);
+            sum += weights[i] * texture(inputTexture, TextureCoordinates - step * offsets[i]);
+        }
+        gl_FragColor = sum;
+    }
+    )";
+
+const char* downSrc =
+    R"(
+    #version 330
+    uniform sampler2D inputTexture;
+    uniform highp vec2 textureSize;
+    in highp vec2 TextureCoordinates;
+    void main() {
+        vec2 hp = 1.0 / textureSize;
+        vec4 sum = texture(inputTexture, TextureCoordinates) * 4.0;
+        sum += texture(inputTexture, TextureCoordinates - hp);
+        sum += texture(inputTexture, TextureCoordinates + hp);
+        sum += texture(inputTexture, TextureCoordinates + vec2(hp.x, -hp.y));
+        sum += texture(inputTexture, TextureCoordinates - vec2(hp.x, -hp.y));
+        gl_FragColor = sum / 8.0;
+    }
+    )";
+
+const char* upSrc =
+    R"(
+    #version 330
+    uniform sampler2D inputTexture;
+    uniform highp vec2 textureSize;
+    in highp vec2 TextureCoordinates;
+    void main() {
+        vec2 hp = 1.0 / textureSize;
+        vec4 sum = texture(inputTexture, TextureCoordinates + vec2(-hp.x * 2.0, 0.0));
+        sum += texture(inputTexture, TextureCoordinates + vec2(-hp.x, hp.y)) * 2.0;
+        sum += texture(inputTexture, TextureCoordinates + vec2(0.0, hp.y * 2.0));
+        sum += texture(inputTexture, TextureCoordinates + vec2(hp.x, hp.y)) * 2.0;
+        sum += texture(inputTexture, TextureCoordinates + vec2(hp.x * 2.0, 0.0));
+        sum += texture(inputTexture, TextureCoordinates + vec2(hp.x, -hp.y)) * 2.0;
+        sum += texture(inputTexture, TextureCoordinates + vec2(0.0, -hp.y * 2.0));
+        sum += texture(inputTexture, TextureCoordinates + vec2(-hp.x, -hp.y)) * 2.0;
+        gl_FragColor = sum / 12.0;
+    }
+    )";
+
+}
+
+/// the gaussian for one radius, with its taps baked into the shader
+/// a program pass() runs, with the locations every pass sets looked up once
+struct BlurEngine::PassProgram
+{
+    QOpenGLShaderProgram shader;
+    int vertexLocation;
+    int matrixLocation;
+    int sizeLocation;
+    int sourceOffsetLocation;
+    int textureSizeLocation;
+    int scaleLocation;
+
+    void link(const QByteArray& fragment) {
+        shader.addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vsrc);
+        shader.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fragment);
+        shader.link();
+
+        vertexLocation = shader.attributeLocation("vertex");
+        matrixLocation = shader.uniformLocation("matrix");
+        sizeLocation = shader.uniformLocation("size");
+        sourceOffsetLocation = shader.uniformLocation("sourceOffset");
+        textureSizeLocation = shader.uniformLocation("textureSize");
+        scaleLocation = shader.uniformLocation("scale");
+        // the source is always on unit 0
+        shader.bind();
+        shader.setUniformValue(shader.uniformLocation("inputTexture"), 0);
+        shader.release();
+    }
+};
+
+struct BlurEngine::GaussianProgram : GLResources::Resource
+{
+    PassProgram program;
+    int directionLocation;
+
+    explicit GaussianProgram(quint32 radius) {
+        const QVector<float> coeffs = coefficients(int(radius));
+        const int r = int(radius);
+
+        // fold each pair of neighbouring taps into one fetch halfway between them,
+        // weighted so linear filtering reproduces both
+        QVector<GLfloat> offsets;
+        QVector<GLfloat> weights;
+        offsets << 0.0f;
+        weights << coeffs[r];
+        for (int i = 1; i <= r; i += 2) {
+            const float w1 = coeffs[r + i];
+            const float w2 = i + 1 <= r ? coeffs[r + i + 1] : 0.0f;
+            const float w = w1 + w2;
+            offsets << (i * w1 + (i + 1) * w2) / w;
+            weights << w;
+        }
+
+        program.link(QString::fromLatin1(gaussianSrc).arg(offsets.size()).toLatin1());
+        directionLocation = program.shader.uniformLocation("direction");
+        // the taps only depend on the radius, which the program is for
+        auto& shader = program.shader;
+        shader.bind();
+        shader.setUniformValueArray(shader.uniformLocation("offsets"), offsets.constData(), offsets.size(), 1);
+        shader.setUniformValueArray(shader.uniformLocation("weights"), weights.constData(), weights.size(), 1);
+        shader.release();
+    }
+};
+
+struct BlurEngine::Programs : GLResources::Resource
+{
+    PassProgram down;
+    PassProgram up;
+    /// the unit square every pass scales up to its target
+    QOpenGLBuffer quad = QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    QOpenGLBuffer indices = QOpenGLBuffer(QOpenGLBuffer::IndexBuffer);
+    GpuMemory::Allocation memory;
+
+    Programs() {
+        down.link(downSrc);
+        up.link(upSrc);
+
+        const GLfloat corners[] = {
+            0.0f, 0.0f,
+            0.0f, 1.0f,
+            1.0f, 1.0f,
+            1.0f, 0.0f,
+        };
+        const GLubyte squareIndices[] = {
+            0, 1, 2,
+            0, 2, 3
+        };
+
+        quad.create();
+        quad.bind();
+        quad.allocate(corners, sizeof(corners));
+        quad.release();
+
+        indices.create();
+        indices.bind();
+        indices.allocate(squareIndices, sizeof(squareIndices));
+        indices.release();
+        memory.set(nullptr, GpuMemory::Buffers, sizeof(corners) + sizeof(squareIndices), QStringLiteral("blur quad"));
+    }
+};
+
+QVector<float> BlurEngine::coefficients(int radius)
+{
+    const qreal s = sigma(radius);
+    QVector<float> ret(2 * radius + 1);
+    qreal sum = 0.0;
+    for (int i = -radius; i <= radius; i++) {
+        const qreal w = std::exp(-(i * i) / (2.0 * s * s));
+        ret[radius + i] = float(w);
+        sum += w;
+    }
+    // normalized over the taps actually taken, so the blur keeps brightness
+    for (auto& it : ret) {
+        it = float(it / sum);
+    }
+    return ret;
+}
+
+BlurEngine::BlurEngine() : m_programs(GLResources::current()->get<Programs>())
+{
+}
+
+BlurEngine::~BlurEngine()
+{
+}
+
+BlurEngine::Result BlurEngine::blur(GLuint source, const QSize& sourceSize, const QRect& region, const QSize& textureSize)
+{
+    const QRect clipped = region & QRect(QPoint(0, 0), sourceSize);
+    if (clipped.isEmpty())
+        return Result();
+
+    const QSize allocated = textureSize.isEmpty() ? sourceSize : textureSize;
+    switch (m_mode) {
+    case Auto:
+        if (m_radius <= KernelRadius)
+            return gaussian(source, sourceSize, allocated, clipped);
+        return dualKawase(source, sourceSize, allocated, clipped);
+    case Gaussian:
+        return gaussian(source, sourceSize, allocated, clipped);
+    case DualKawase:
+        return dualKawase(source, sourceSize, allocated, clipped);
+    }
+    return Result();
+}
+
+BlurEngine::Result BlurEngine::gaussian(GLuint source, const QSize& sourceSize, const QSize& textureSize, const QRect& region)
+{
+    // the vertical pass reads radius rows above and below the region
+    const QRect horizontal = region.adjusted(0, -m_radius, 0, m_radius) & QRect(QPoint(0, 0), sourceSize);
+
+    auto gaussian = GLResources::current()->get<GaussianProgram>(quint32(m_radius));
+    auto& shader = gaussian->program.shader;
+    shader.bind();
+
+    auto first = scratch(0, horizontal.size());
+    {
+        FrameProfiler::GpuScope scope(m_profiler, "blur horizontal");
+        shader.setUniformValue(gaussian->directionLocation, QVector2D(1.0f, 0.0f));
+        pass(gaussian->program, source, textureSize, first, horizontal.size(), horizontal.topLeft(), 1.0);
+    }
+
+    auto second = scratch(1, region.size());
+    {
+        FrameProfiler::GpuScope scope(m_profiler, "blur vertical");
+        shader.setUniformValue(gaussian->directionLocation, QVector2D(0.0f, 1.0f));
+        pass(gaussian->program, first->texture(), first->size(), second, region.size(), region.topLeft() - horizontal.topLeft(), 1.0);
+    }
+    shader.release();
+
+    Result ret;
+    ret.texture = second->texture();
+    ret.rect = region;
+    ret.textureSize = second->size();
+    return ret;
+}
+
+BlurEngine::Result BlurEngine::dualKawase(GLuint source, const QSize& sourceSize, const QSize& textureSize, const QRect& region)
+{
+    // each level roughly doubles the reach of the blur
+    const int levels = qBound(1, qCeil(std::log2(m_radius / 4.0)), 6);
+    const int margin = m_radius * 2;
+    const QRect rect = region.adjusted(-margin, -margin, margin, margin) & QRect(QPoint(0, 0), sourceSize);
+
+    QVector<QSize> sizes;
+    sizes << rect.size();
+    for (int i = 1; i <= levels; i++) {
+        const QSize prev = sizes.last();
+        sizes << QSize(qMax(1, (prev.width() + 1) / 2), qMax(1, (prev.height() + 1) / 2));
+    }
+
+    // scratch 0 is the full resolution output, 1 + i holds level i
+    GLuint input = source;
+    QSize inputSize = textureSize;
+    QPointF offset = rect.topLeft();
+    {
+        FrameProfiler::GpuScope scope(m_profiler, "blur down");
+        m_programs->down.shader.bind();
+        for (int i = 1; i <= levels; i++) {
+            auto target = scratch(1 + i, sizes[i]);
+            pass(m_programs->down, input, inputSize, target, sizes[i], offset, 2.0);
+            input = target->texture();
+            inputSize = target->size();
+            offset = QPointF(0, 0);
+        }
+        m_programs->down.shader.release();
+    }
+    {
+        FrameProfiler::GpuScope scope(m_profiler, "blur up");
+        m_programs->up.shader.bind();
+        for (int i = levels - 1; i >= 0; i--) {
+            auto target = scratch(i == 0 ? 0 : 1 + i, sizes[i]);
+            pass(m_programs->up, input, inputSize, target, sizes[i], QPointF(0, 0), 0.5);
+            input = target->texture();
+            inputSize = target->size();
+        }
+        m_programs->up.shader.release();
+    }
+
+    Result ret;
+    ret.texture = input;
+    ret.rect = rect;
+    ret.textureSize = inputSize;
+    return ret;
+}
+
+QOpenGLFramebufferObject* BlurEngine::scratch(int index, const QSize& size)
+{
+    auto ret = GLResources::current()->scratch(index, size);
+
+    // both the tap pairing and the kawase offsets rely on bilinear fetches
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+    fns.glBindTexture(GL_TEXTURE_2D, ret->texture());
+    fns.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    fns.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    fns.glBindTexture(GL_TEXTURE_2D, 0);
+    return ret;
+}
+
+void BlurEngine::pass(PassProgram& program, GLuint source, const QSize& sourceSize, QOpenGLFramebufferObject* target, const QSize& size, const QPointF& offset, qreal scale)
+{
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    QMatrix4x4 pmvMatrix;
+    pmvMatrix.ortho(0, size.width(), 0, size.height(), -1, 1);
+
+    target->bind();
+    fns.glViewport(0, 0, size.width(), size.height());
+    fns.glDisable(GL_BLEND);
+    fns.glDisable(GL_DEPTH_TEST);
+
+    fns.glActiveTexture(GL_TEXTURE0);
+    fns.glBindTexture(GL_TEXTURE_2D, source);
+    fns.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    fns.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    auto& shader = program.shader;
+    m_programs->quad.bind();
+    shader.enableAttributeArray(program.vertexLocation);
+    shader.setAttributeBuffer(program.vertexLocation, GL_FLOAT, 0, 2);
+    m_programs->quad.release();
+    shader.setUniformValue(program.matrixLocation, pmvMatrix);
+    shader.setUniformValue(program.sizeLocation, QSizeF(size));
+    shader.setUniformValue(program.sourceOffsetLocation, offset);
+    shader.setUniformValue(program.textureSizeLocation, QSizeF(sourceSize));
+    shader.setUniformValue(program.scaleLocation, GLfloat(scale));
+    m_programs->indices.bind();
+    fns.glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_BYTE, nullptr);
+    m_programs->indices.release();
+    shader.disableAttributeArray(program.vertexLocation);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <QOpenGLShaderProgram>
+#include <QRect>
+#include <QVector>
+#include <qopengl.h>
+
+class FrameProfiler;
+class QOpenGLFramebufferObject;
+
+/// blurs rectangular regions of a texture into scratch textures
+///
+/// the gaussian mode pairs neighbouring taps so linear filtering does half
+/// the fetches; the dual kawase mode works on a downsampled chain, so its
+/// cost barely grows with the radius. programs and scratch textures are
+/// shared with every other engine on the same context.
+class BlurEngine
+{
+public:
+    enum Mode {
+        /// gaussian for radii the kernel covers, dual kawase above that
+        Auto,
+        Gaussian,
+        DualKawase,
+    };
+
+    struct Result {
+        GLuint texture = 0;
+        /// the part of the source the texture's origin lines up with
+        QRect rect;
+        /// the allocated size of the texture, which may be larger than rect
+        QSize textureSize;
+
+        bool isValid() const { return texture != 0; }
+    };
+
+    /// the largest radius Auto blurs with a gaussian, in pixels
+    static constexpr int KernelRadius = 16;
+
+    /// the 2 * radius + 1 weights of the gaussian for radius, centre tap in the middle
+    static QVector<float> coefficients(int radius);
+
+    BlurEngine();
+    ~BlurEngine();
+    Q_DISABLE_COPY(BlurEngine)
+
+    Mode mode() const { return m_mode; }
+    void setMode(Mode mode) { m_mode = mode; }
+    int radius() const { return m_radius; }
+    /// the gaussian's taps are compiled in, so each radius gets its own program
+    void setRadius(int radius) { m_radius = qMax(1, radius); }
+    /// times each pass on profiler's GPU track; may be null
+    void setProfiler(FrameProfiler* profiler) { m_profiler = profiler; }
+
+    /// blurs region (in source pixels) of source, which holds sourceSize worth of pixels
+    /// from its origin and is textureSize large, or sourceSize if that's empty.
+    /// the result stays valid until the next call.
+    Result blur(GLuint source, const QSize& sourceSize, const QRect& region, const QSize& textureSize = QSize());
+
+private:
+    Result gaussian(GLuint source, const QSize& sourceSize, const QSize& textureSize, const QRect& region);
+    Result dualKawase(GLuint source, const QSize& sourceSize, const QSize& textureSize, const QRect& region);
+
+    QOpenGLFramebufferObject* scratch(int index, const QSize& size);
+    struct PassProgram;
+    void pass(PassProgram& program, GLuint source, const QSize& sourceSize, QOpenGLFramebufferObject* target, const QSize& size, const QPointF& offset, qreal scale);
+
+    Mode m_mode = Auto;
+    int m_radius = KernelRadius;
+    FrameProfiler* m_profiler = nullptr;
+
+    struct Programs;
+    struct GaussianProgram;
+    /// shared by every engine on the context
+    Programs* m_programs;
+};
@@ -0,0 +1,138 @@
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include "brush.h"
+#include "brushtips.h"
+
+namespace {
+
+QVector<BrushPreset> load(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning("BrushPreset: couldn't open %s", qPrintable(path));
+        return {};
+    }
+    QJsonParseError error;
+    const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+    if (!document.isArray()) {
+        qWarning("BrushPreset: %s: %s", qPrintable(path), qPrintable(error.errorString()));
+        return {};
+    }
+
+    QVector<BrushPreset> ret;
+    for (const auto& value : document.array()) {
+        const QJsonObject object = value.toObject();
+        BrushPreset it;
+        it.name = object.value("name").toString();
+        it.kind = object.value("kind").toString() == "smudge" ? BrushPreset::Smudge : BrushPreset::Paint;
+        it.size = object.value("size").toDouble(it.size);
+        it.hardness = qBound(0.0, object.value("hardness").toDouble(it.hardness), 1.0);
+        it.opacity = qBound(0.0, object.value("opacity").toDouble(it.opacity), 1.0);
+        if (object.contains("color"))
+            it.color = QColor(object.value("color").toString());
+        it.velocity = object.value("velocity").toDouble(it.velocity);
+        it.pressure = qBound(0.0, object.value("pressure").toDouble(it.pressure), 1.0);
+        it.spacing = object.value("spacing").toDouble(it.spacing);
+        if (object.value("interpolation").toString() == "curve")
+            it.interpolation = StrokeEngine::Curve;
+        it.kernelRadius = qMax(1, object.value("kernelRadius").toInt(it.kernelRadius));
+        for (const auto& tip : object.value("tips").toArray()) {
+            const int index = BrushTip::find(tip.toString());
+            if (index < 0) {
+                qWarning("BrushPreset: %s: no tip called %s", qPrintable(it.name), qPrintable(tip.toString()));
+                continue;
+            }
+            it.tips << index;
+        }
+        it.scatter = qMax(0.0, object.value("scatter").toDouble(it.scatter));
+        it.sizeJitter = qBound(0.0, object.value("sizeJitter").toDouble(it.sizeJitter), 1.0);
+        it.angle = object.value("angle").toDouble(it.angle);
+        it.angleJitter = qBound(0.0, object.value("angleJitter").toDouble(it.angleJitter), 180.0);
+        it.followStroke = object.value("followStroke").toBool(it.followStroke);
+        ret << it;
+    }
+    return ret;
+}
+
+const QVector<BrushPreset>& all()
+{
+    static const QVector<BrushPreset> ret = load(QStringLiteral(":/brushes.json"));
+    return ret;
+}
+
+}
+
+BrushPreset::Features BrushPreset::features() const
+{
+    Features ret;
+    if (hardness < 1.0)
+        ret |= Soft;
+    if (kind == Paint && !tips.isEmpty())
+        ret |= Tipped;
+    return ret;
+}
+
+StrokeEngine::Settings BrushPreset::strokeSettings() const
+{
+    StrokeEngine::Settings ret;
+    ret.baseRadius = size;
+    // the engine's velocity is in pixels per second
+    ret.velocityRadius = velocity / 60.0;
+    ret.pressureRadius = pressure;
+    ret.spacing = spacing;
+    ret.interpolation = interpolation;
+    return ret;
+}
+
+QColor BrushPreset::dabColor() const
+{
+    QColor ret = color;
+    ret.setAlphaF(ret.alphaF() * opacity);
+    return ret;
+}
+
+QVector<BrushPreset> BrushPreset::presets(Kind kind)
+{
+    QVector<BrushPreset> ret;
+    for (const auto& it : all()) {
+        if (it.kind == kind)
+            ret << it;
+    }
+    return ret;
+}
+
+QStringList BrushPreset::names(Kind kind)
+{
+    QStringList ret;
+    for (const auto& it : presets(kind)) {
+        ret << it.name;
+    }
+    return ret;
+}
+
+BrushPreset BrushPreset::find(Kind kind, const QString& name)
+{
+    const auto candidates = presets(kind);
+    for (const auto& it : candidates) {
+        if (it.name == name)
+            return it;
+    }
+    if (!candidates.isEmpty())
+        return candidates.first();
+
+    BrushPreset ret;
+    ret.kind = kind;
+    return ret;
+}
+
+QByteArray BrushPreset::defines(Features features)
+{
+    QByteArray ret;
+    if (features & Soft)
+        ret += "#define SOFT\n";
+    if (features & Tipped)
+        ret += "#define TIPPED\n";
+    return ret;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <QColor>
+#include <QFlags>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include "stroke.h"
+
+/// how a brush paints, as loaded from brushes.json
+///
+/// the numbers go to the stroke engine and the shaders' uniforms; only the
+/// features() of a preset pick which shader permutation draws it, so brushes
+/// that differ in size or colour share one compiled program.
+struct BrushPreset
+{
+    enum Kind {
+        /// solid colour dabs on Canvassy
+        Paint,
+        /// dabs of the blurred canvas on Subcanvassy
+        Smudge,
+    };
+
+    /// what a shader has to be compiled with to draw the preset
+    enum Feature {
+        /// fades out towards the rim instead of cutting off
+        Soft = 0x1,
+        /// dabs are bitmap tips from BrushTipAtlas rather than plain discs
+        Tipped = 0x2,
+    };
+    Q_DECLARE_FLAGS(Features, Feature)
+
+    QString name;
+    Kind kind = Paint;
+    /// radius, in item pixels
+    qreal size = 5.0;
+    /// how much of the radius is fully covered; 1 is a hard edge
+    qreal hardness = 1.0;
+    qreal opacity = 1.0;
+    QColor color = QColor::fromRgbF(0.0, 1.0, 0.0, 1.0);
+    /// radius added per pixel moved between 60 Hz events
+    qreal velocity = 0.0;
+    /// how far pressure scales the radius, 0 to 1
+    qreal pressure = 0.0;
+    /// distance between dabs as a fraction of the diameter
+    qreal spacing = 0.1;
+    StrokeEngine::Interpolation interpolation = StrokeEngine::Linear;
+    /// radius of the smudge blur, in pixels
+    int kernelRadius = 16;
+    /// the BrushTip indices dabs pick from at random; none paints plain discs.
+    /// only paint brushes have tips
+    QVector<int> tips;
+    /// how far dabs stray from the stroke, as a fraction of their radius
+    qreal scatter = 0.0;
+    /// how much smaller than the stroke's a dab's radius may be, 0 to 1
+    qreal sizeJitter = 0.0;
+    /// which way the tips are turned, in degrees
+    qreal angle = 0.0;
+    /// how far a dab's angle may be off either way, in degrees
+    qreal angleJitter = 0.0;
+    /// turns the tips along with the stroke, angle being relative to its direction
+    bool followStroke = false;
+
+    Features features() const;
+    StrokeEngine::Settings strokeSettings() const;
+    /// the colour dabs are drawn in, opacity included
+    QColor dabColor() const;
+
+    /// the presets of one kind shipped with the app, in file order
+    static QVector<BrushPreset> presets(Kind kind);
+    static QStringList names(Kind kind);
+    /// the preset called name, or the first one of that kind
+    static BrushPreset find(Kind kind, const QString& name);
+
+    /// the #defines a shader permutation for features starts with, after #version
+    static QByteArray defines(Features features);
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(BrushPreset::Features)
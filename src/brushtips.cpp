@@ -0,0 +1,134 @@
+#include <QDir>
+#include <QImage>
+#include <QOpenGLExtraFunctions>
+#include <cmath>
+#include <cstring>
+#include "brushtips.h"
+
+namespace {
+
+QVector<BrushTip> load(const QString& path)
+{
+    QVector<BrushTip> ret;
+    const auto entries = QDir(path).entryInfoList({QStringLiteral("*.png")}, QDir::Files, QDir::Name);
+    for (const auto& entry : entries) {
+        QImage image(entry.filePath());
+        if (image.isNull()) {
+            qWarning("BrushTip: couldn't load %s", qPrintable(entry.filePath()));
+            continue;
+        }
+        image = image.convertToFormat(QImage::Format_Grayscale8)
+            .scaled(BrushTip::Size, BrushTip::Size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+        BrushTip it;
+        it.name = entry.completeBaseName();
+        QByteArray level(BrushTip::Size * BrushTip::Size, Qt::Uninitialized);
+        for (int y = 0; y < BrushTip::Size; y++) {
+            std::memcpy(level.data() + y * BrushTip::Size, image.constScanLine(y), BrushTip::Size);
+        }
+        it.levels << level;
+
+        // box filtered, which is what glGenerateMipmap does on most drivers too
+        for (int size = BrushTip::Size / 2; size >= 1; size /= 2) {
+            const auto from = reinterpret_cast<const uchar*>(it.levels.last().constData());
+            QByteArray next(size * size, Qt::Uninitialized);
+            auto to = reinterpret_cast<uchar*>(next.data());
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    const uchar* quad = from + (y * 2) * size * 2 + x * 2;
+                    to[y * size + x] = uchar((quad[0] + quad[1] + quad[size * 2] + quad[size * 2 + 1] + 2) / 4);
+                }
+            }
+            it.levels << next;
+        }
+        ret << it;
+    }
+    return ret;
+}
+
+/// bilinear with clamped edges, between texel centres like GL_LINEAR
+float bilinear(const QByteArray& level, int size, float u, float v)
+{
+    const auto texels = reinterpret_cast<const uchar*>(level.constData());
+    const float x = qBound(0.0f, u * size - 0.5f, float(size - 1));
+    const float y = qBound(0.0f, v * size - 0.5f, float(size - 1));
+    const int x0 = int(x);
+    const int y0 = int(y);
+    const int x1 = qMin(x0 + 1, size - 1);
+    const int y1 = qMin(y0 + 1, size - 1);
+    const float fx = x - x0;
+    const float fy = y - y0;
+    const float top = texels[y0 * size + x0] + (texels[y0 * size + x1] - texels[y0 * size + x0]) * fx;
+    const float bottom = texels[y1 * size + x0] + (texels[y1 * size + x1] - texels[y1 * size + x0]) * fx;
+    return (top + (bottom - top) * fy) / 255.0f;
+}
+
+}
+
+float BrushTip::sample(float u, float v, float diameter) const
+{
+    // trilinear, like GL_LINEAR_MIPMAP_LINEAR: a tip Size texels wide over diameter pixels
+    const float lod = qBound(0.0f, std::log2(Size / qMax(diameter, 1.0f / Size)), float(LevelCount - 1));
+    const int level = qMin(int(lod), LevelCount - 2);
+    const float t = lod - level;
+    const float near = bilinear(levels[level], Size >> level, u, v);
+    if (t <= 0.0f)
+        return near;
+    return near + (bilinear(levels[level + 1], Size >> (level + 1), u, v) - near) * t;
+}
+
+const QVector<BrushTip>& BrushTip::all()
+{
+    static const QVector<BrushTip> ret = load(QStringLiteral(":/tips"));
+    return ret;
+}
+
+int BrushTip::find(const QString& name)
+{
+    const auto& tips = all();
+    for (int i = 0; i < tips.size(); i++) {
+        if (tips[i].name == name)
+            return i;
+    }
+    return -1;
+}
+
+BrushTipAtlas::BrushTipAtlas()
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    const auto& tips = BrushTip::all();
+    // a texture array needs a layer even when there are no tips
+    const int layers = qMax(1, tips.size());
+
+    fns.glGenTextures(1, &texture);
+    fns.glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    fns.glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    qint64 bytes = 0;
+    for (int level = 0; level < BrushTip::LevelCount; level++) {
+        const int size = BrushTip::Size >> level;
+        QByteArray pixels(size * size * layers, '\0');
+        for (int i = 0; i < tips.size(); i++) {
+            std::memcpy(pixels.data() + i * size * size, tips[i].levels[level].constData(), size * size);
+        }
+        fns.glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_R8, size, size, layers, 0, GL_RED, GL_UNSIGNED_BYTE, pixels.constData());
+        bytes += pixels.size();
+    }
+    fns.glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    fns.glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    fns.glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    fns.glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    fns.glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    fns.glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, BrushTip::LevelCount - 1);
+    fns.glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    memory.set(nullptr, GpuMemory::Textures, bytes, QStringLiteral("brush tips"));
+}
+
+BrushTipAtlas::~BrushTipAtlas()
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+    fns.glDeleteTextures(1, &texture);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <qopengl.h>
+#include "glresources.h"
+#include "gpumemory.h"
+
+/// a bitmap brush tip, as loaded from data/tips
+///
+/// a tip is a coverage mask stretched over a dab's disc and turned with it;
+/// whatever lies outside the disc is cut off, so a turned tip never reaches
+/// past the dab's bounds. every tip is brought to Size and box filtered
+/// down to 1x1 once, at load, so the GL path and the software path sample
+/// the same levels.
+struct BrushTip
+{
+    static constexpr int Size = 128;
+    /// Size and every halving of it, down to 1
+    static constexpr int LevelCount = 8;
+
+    QString name;
+    /// coverage, a byte per texel and a row after the other, for every level
+    QVector<QByteArray> levels;
+
+    /// coverage 0 to 1 at u, v across the tip, both 0 to 1. bilinear from the
+    /// level a dab diameter pixels wide would use, like the GL path picks it
+    float sample(float u, float v, float diameter) const;
+
+    /// the tips shipped with the app, sorted by name; a tip's index is its layer in BrushTipAtlas
+    static const QVector<BrushTip>& all();
+    /// the index of the tip called name, or -1
+    static int find(const QString& name);
+};
+
+/// every tip in one texture array, a layer per tip with all its levels, so
+/// a stroke that mixes tips still draws with a single texture bound
+struct BrushTipAtlas : GLResources::Resource
+{
+    GLuint texture = 0;
+    GpuMemory::Allocation memory;
+
+    BrushTipAtlas();
+    ~BrushTipAtlas() override;
+};
@@ -1,227 +1,993 @@
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
 #include <QOpenGLFramebufferObjectFormat>
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
 #include <QQuickWindow>
+#include <QSGSimpleTextureNode>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QLineF>
+#include <QPointer>
+#include <QTimer>
+#include <QtMath>
+#include <algorithm>
+#include <cstring>
+#include <utility>
 #include "canvas.h"
 #include "subcanvas.h"
+#include "brush.h"
+#include "brushtips.h"
+#include "dabpipeline.h"
+#include "stroke.h"
+#include "strokebuffer.h"
+#include "cpusurface.h"
+#include "dirtyregion.h"
+#include "exporter.h"
+#include "glresources.h"
+#include "gpumemory.h"
+#include "history.h"
+#include "inputchannel.h"
+#include "journal.h"
+#include "layerstack.h"
+#include "latency.h"
+#include "paths.h"
+#include "profiler.h"
+#include "project.h"
+#include "rendererstats.h"
+#include "sharedsurface.h"
+#include "tiledsurface.h"
+#include "tilepyramid.h"
+#include "viewbuffer.h"
+#include "viewport.h"
 
-inline float lerp(float a, float b, float f)
+/// what every CanvassyRenderer on a context draws with, compiled for one set of brush features
+struct CanvassyProgram : GLResources::Resource
 {
-    return a * (1.0 - f) + (b * f);
-}
-
-struct CanvassyMessage {
-    enum Type {
-        Down,
-        Move,
-        Up,
-    };
-    Type tag;
-    union {
-        struct {
-            QPointF pos;
-        } down;
-        struct {
-            QPointF pos;
-        } move;
-        struct {
-        } up;
-    };
-    CanvassyMessage() { }
-    static CanvassyMessage CDown(const QPointF& pos) {
-        CanvassyMessage ret; { ret.tag = Down; ret.down = {pos}; }; return ret;
-    }
-    static CanvassyMessage CMove(const QPointF& pos) {
-        CanvassyMessage ret; { ret.tag = Move; ret.move = {pos}; }; return ret;
-    }
-    static CanvassyMessage CUp() {
-        CanvassyMessage ret; { ret.tag = Up; ret.up = {}; }; return ret;
-    }
-};
-
-class CanvassyRenderer : public QQuickFramebufferObject::Renderer
-{
-    // opengl + inputs to opengl
     QOpenGLShaderProgram program;
-    int vertexLocation;
-    int matrixLocation;
-    int colorLocation;
-    int viewportSizeLocation;
+    int cornerLocation;
     int centerLocation;
-    int strokeSizeLocation;
-
-    // inputs from item
-    QPointF m_pos;
-    QPointF m_lastPos;
-    QSize m_size;
-    float m_dpr;
-    qreal m_velocity;
+    int radiusLocation;
+    int colorLocation;
+    int angleLocation;
+    int tipLocation;
+    int matrixLocation;
+    int hardnessLocation;
+    int tipsLocation;
+    QOpenGLBuffer quad = QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    QOpenGLBuffer indices = QOpenGLBuffer(QOpenGLBuffer::IndexBuffer);
+    GpuMemory::Allocation memory;
 
-    // messages
-    QVarLengthArray<CanvassyMessage, 10> m_messages;
-    bool m_initted = false;
-public:
-    CanvassyRenderer(Canvassy*) {
+    explicit CanvassyProgram(quint32 features) {
         const char* vsrc =
             R"(
-            attribute highp vec4 vertex;
+            #version 330
+            in highp vec2 corner;
+            in highp vec2 center;
+            in highp float radius;
+            in mediump vec4 color;
+            in highp float angle;
+            in highp float tip;
             uniform highp mat4 matrix;
+            out highp vec2 local;
+            out highp float dabRadius;
+            out mediump vec4 dabColor;
+            out highp vec3 tipCoord;
             void main()
             {
-                gl_Position = matrix * vertex;
+                // a pixel of slack around the disc for its antialiased rim
+                highp float reach = radius + 1.0;
+                local = corner * reach / radius;
+                dabRadius = radius;
+                dabColor = color;
+                // the tip spans the disc's square, turned by angle; linear, so it's done per vertex
+                highp vec2 turned = mat2(cos(angle), -sin(angle), sin(angle), cos(angle)) * local;
+                tipCoord = vec3(turned * 0.5 + 0.5, tip);
+                gl_Position = matrix * vec4(center + corner * reach, 0.0, 1.0);
             }
             )";
+        // coverage goes into alpha; the stroke buffer keeps the largest a pixel gets
         const char* fsrc =
             R"(
-            uniform mediump vec4 color;
-            uniform mediump vec2 viewportSize;
-            uniform mediump vec2 center;
-            uniform mediump float strokeSize;
+            in highp vec2 local;
+            in highp float dabRadius;
+            in mediump vec4 dabColor;
+            #ifdef SOFT
+            uniform mediump float hardness;
+            #endif
+            #ifdef TIPPED
+            in highp vec3 tipCoord;
+            uniform mediump sampler2DArray tips;
+            #endif
             void main() {
-                vec2 cx = (center);
-                vec2 px = (gl_FragCoord.xy);
-                float dist = distance(cx, px);
-                gl_FragColor = color;
-                if (dist >= strokeSize) {
-                    gl_FragColor.a = 0.0;
-                    gl_FragDepth = 0.0;
-                } else {
-                    gl_FragDepth = 1.0;
-                }
+                highp float d = length(local);
+                // how much of the pixel the disc covers, from its distance to the rim in pixels
+                mediump float coverage = clamp((1.0 - d) * dabRadius + 0.5, 0.0, 1.0);
+            #ifdef SOFT
+                coverage = min(coverage, 1.0 - smoothstep(hardness, 1.0, d));
+            #endif
+            #ifdef TIPPED
+                // the derivatives of tipCoord pick the tip's level for the dab's size
+                coverage *= texture(tips, tipCoord).r;
+            #endif
+                if (coverage <= 0.0)
+                    discard;
+                gl_FragColor = vec4(dabColor.rgb, dabColor.a * coverage);
             }
             )";
         program.addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vsrc);
-        program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fsrc);
+        program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment,
+            "#version 330\n" + BrushPreset::defines(BrushPreset::Features(features)) + fsrc);
         program.link();
 
-        vertexLocation = program.attributeLocation("vertex");
+        cornerLocation = program.attributeLocation("corner");
+        centerLocation = program.attributeLocation("center");
+        radiusLocation = program.attributeLocation("radius");
+        colorLocation = program.attributeLocation("color");
+        angleLocation = program.attributeLocation("angle");
+        tipLocation = program.attributeLocation("tip");
         matrixLocation = program.uniformLocation("matrix");
-        colorLocation = program.uniformLocation("color");
-        viewportSizeLocation = program.uniformLocation("viewportSize");
-        centerLocation = program.uniformLocation("center");
-        strokeSizeLocation = program.uniformLocation("strokeSize");
+        hardnessLocation = program.uniformLocation("hardness");
+        tipsLocation = program.uniformLocation("tips");
+
+        const GLfloat corners[] = {
+            -1.0f, -1.0f,
+            -1.0f, +1.0f,
+            +1.0f, +1.0f,
+            +1.0f, -1.0f,
+        };
+        const GLubyte quadIndices[] = {
+            0, 1, 2,
+            0, 2, 3
+        };
+
+        quad.create();
+        quad.bind();
+        quad.allocate(corners, sizeof(corners));
+        quad.release();
+
+        indices.create();
+        indices.bind();
+        indices.allocate(quadIndices, sizeof(quadIndices));
+        indices.release();
+        memory.set(nullptr, GpuMemory::Buffers, sizeof(corners) + sizeof(quadIndices), QStringLiteral("dab quad"));
     }
-    ~CanvassyRenderer() { }
+};
 
-    void paint(QPointF p, float velocity) {
-        QOpenGLFunctions fns;
+namespace {
+
+/// does to states what the item did when it journaled change; anything about a layer that's gone is ignored
+void apply(const LayerChange& change, QVector<LayerStack::State>& states, quint32& active)
+{
+    int index = -1;
+    for (int i = 0; i < states.size(); i++) {
+        if (states[i].id == change.id)
+            index = i;
+    }
+
+    switch (change.type) {
+    case LayerChange::Select:
+        if (index >= 0)
+            active = change.id;
+        break;
+    case LayerChange::Add:
+        if (index < 0) {
+            LayerStack::State layer;
+            layer.id = change.id;
+            states.insert(qBound(0, change.index, states.size()), layer);
+        }
+        break;
+    case LayerChange::Remove:
+        if (index >= 0 && states.size() > 1) {
+            states.remove(index);
+            // the layer below takes over, as in the item
+            if (active == change.id)
+                active = states[qMax(0, index - 1)].id;
+        }
+        break;
+    case LayerChange::Move:
+        if (index >= 0)
+            states.move(index, qBound(0, change.index, states.size() - 1));
+        break;
+    case LayerChange::Set:
+        if (index >= 0) {
+            states[index].opacity = change.opacity;
+            states[index].mode = LayerStack::BlendMode(change.mode);
+            states[index].visible = change.visible;
+        }
+        break;
+    }
+}
+
+}
+
+class CanvassyRenderer : public QQuickFramebufferObject::Renderer
+{
+    /// first, so it outlives everything accounted to it
+    QSharedPointer<GpuMemory::Account> m_account;
+
+    // opengl + inputs to opengl
+    /// the permutation for m_brush
+    CanvassyProgram* m_gl = nullptr;
+    QOpenGLBuffer m_instances = QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    int m_instanceCapacity = 0;
+    GpuMemory::Allocation m_instanceMemory;
+    /// the item's fbo, which the view is drawn into. Qt owns it, but only
+    /// reallocates it when asked to, which is in ViewBuffer's coarse steps
+    GpuMemory::Allocation m_viewMemory;
+    /// how much of the item's fbo is in use, from its origin; the item shows no more than that
+    QSize m_viewSize = QSize(0, 0);
+    QSize m_viewCapacity;
+    /// GpuMemory's frame at the last resize
+    quint64 m_resized = 0;
+    /// the parts of the view resizes uncovered, which haven't been drawn yet
+    DirtyRegion m_exposed;
+    /// whether the item's fbo is new, so all of the view has to be drawn
+    bool m_fresh = true;
+    /// whether the last frame ended over the GPU budget, so it's only warned about once
+    bool m_overBudget = false;
+
+    // inputs from item
+    QSize m_size;
+    float m_dpr = 0;
+
+    // dabs generated for this frame, binned by the tile they land on
+    DabPipeline* m_pipeline = nullptr;
+    DabPipeline::Frame m_frame;
+
+    // canvas content, in document pixels
+    History m_history;
+    LayerStack m_layers = LayerStack(&m_history, QColor::fromRgbF(0.3, 0.3, 0.3, 1.0));
+    /// the layer the current stroke started on, which it sticks to
+    quint32 m_target = 0;
+    /// the journal has changed m_layers since the item last gave us its layers
+    bool m_layersReplayed = false;
+    /// the stroke in progress, until it's merged into m_target on release
+    StrokeBuffer m_strokeBuffer;
+    /// what the current stroke paints with, from its Begin
+    BrushPreset m_brush;
+    /// what the item has picked, which the pipeline starts the next stroke with
+    BrushPreset m_nextBrush;
+    /// how bucket fills decide where to stop
+    CpuSurface::Fill m_fill;
+    /// the flattened layers, in document pixels; the item's fbo shows part of it
+    TiledSurface m_composite = TiledSurface(m_layers.paper());
+    TilePyramid m_pyramid = TilePyramid(&m_composite);
+    QSize m_documentSize;
+    Viewport m_viewport;
+    /// whether the view has to be redrawn even if the composite didn't change
+    bool m_viewDirty = true;
+    /// what changed on the composite since the view was last updated
+    DirtyRegion m_dirty;
+    CanvasExporter m_exporter;
+    /// exports requested since the last frame, taken once the view is up to date
+    QVector<QPair<QString, CanvasExporter::Done>> m_exports;
+    ProjectSaver m_saver;
+    struct Save {
+        QString path;
+        QPointer<Canvassy> canvas;
+        /// whether the save holds everything journaled before position, so the journal can drop it
+        bool checkpoint;
+        quint64 position;
+        /// the brush strokes used at position
+        uint brush;
+    };
+    /// project saves requested since the last frame, taken with the exports
+    QVector<Save> m_saves;
+    /// tiles of an opened project that are still only in its file, on any layer; they
+    /// haven't been composited yet, so they're brought in a few a frame, visible ones first
+    QSet<quint64> m_loading;
+    /// by layer, tiles of an opened project a software layer's CpuSurface hasn't read yet
+    QHash<quint32, QSet<quint64>> m_unread;
+    /// how many milliseconds a frame spends bringing in tiles of an opened project
+    static constexpr int LoadBudget = 4;
+    /// what other renderers sample instead of our view
+    QSharedPointer<SharedSurface> m_shared;
+
+    // messages
+    QSharedPointer<LatencyTracker> m_latency;
+    QMetaObject::Connection m_swapped;
+    QSharedPointer<RendererStats> m_stats;
+    QSharedPointer<FrameProfiler> m_profiler;
+    /// bracket the scene graph's own drawing of the window, which we time for every item in it
+    QMetaObject::Connection m_sceneBegun;
+    QMetaObject::Connection m_sceneEnded;
+public:
+    CanvassyRenderer(Canvassy* item) : m_account(item->gpuAccount()), m_shared(item->sharedSurface()), m_profiler(item->frameProfiler()) {
+        m_nextBrush = item->brushPreset();
+        setBrush(m_nextBrush);
+
+        // the software path paints into every layer's CpuSurface instead
+        m_layers.setBackend(CpuSurface::preferred());
+        m_layers.setStroke(0, &m_strokeBuffer);
+
+        m_history.setAccount(m_account.data());
+        m_layers.setAccount(m_account.data());
+        m_strokeBuffer.setAccount(m_account.data());
+        m_composite.setAccount(m_account.data(), GpuMemory::Caches);
+        m_pyramid.setAccount(m_account.data());
+        m_exporter.setAccount(m_account.data());
+        m_saver.setAccount(m_account.data());
+        m_shared->setAccount(m_account.data());
+
+        m_instances.create();
+        m_instances.setUsagePattern(QOpenGLBuffer::StreamDraw);
+    }
+    ~CanvassyRenderer() {
+        QObject::disconnect(m_swapped);
+        QObject::disconnect(m_sceneBegun);
+        QObject::disconnect(m_sceneEnded);
+        m_shared->release();
+        m_profiler->release();
+    }
+
+    void setBrush(const BrushPreset& brush) {
+        m_brush = brush;
+        m_gl = GLResources::current()->get<CanvassyProgram>(brush.features());
+    }
+
+    /// the pixels of the view a rect of the document shows up on
+    QRect toView(const QRectF& rect) const {
+        const QPointF origin = m_viewport.origin(m_dpr);
+        return QRectF((rect.topLeft() - origin) * m_viewport.zoom, rect.size() * m_viewport.zoom).toAlignedRect();
+    }
+
+    /// draws a run of the frame's dabs into the stroke buffer with one instanced call per touched tile
+    void draw(const DabPipeline::Op& op) {
+        m_stats->dabs.fetch_add(op.count, std::memory_order_relaxed);
+
+        // the layer may have been deleted mid-stroke
+        auto layer = m_layers.layer(m_target);
+        if (layer == nullptr || op.binCount == 0)
+            return;
+        TiledSurface& surface = layer->surface;
+
+        // dabs only change the tiles they're binned into, and everything
+        // downstream works a tile at a time anyway
+        for (int i = op.firstBin; i < op.firstBin + op.binCount; i++) {
+            m_dirty.add(TiledSurface::tileRect(TiledSurface::fromKey(m_frame.bins[i].key)) & QRect(QPoint(0, 0), m_documentSize));
+        }
+
+        if (layer->cpu) {
+            // the software path paints straight into the layer, so the tiles it paints on have to hold what's in the file
+            QVector<quint64> keys;
+            keys.reserve(op.binCount);
+            for (int i = op.firstBin; i < op.firstBin + op.binCount; i++)
+                keys << m_frame.bins[i].key;
+            readIn(layer, keys);
+            QVector<CpuSurface::Dab> dabs;
+            dabs.reserve(op.count);
+            for (int i = op.first; i < op.first + op.count; i++) {
+                const StrokeDab& dab = m_frame.dabs[i];
+                dabs << CpuSurface::Dab{float(dab.pos.x()), float(dab.pos.y()), float(dab.radius), float(dab.angle), dab.tip};
+            }
+            const QVector<QPoint> tiles = m_brush.features() & BrushPreset::Tipped
+                ? layer->cpu->drawTips(dabs, m_brush.dabColor(), m_brush.hardness)
+                : layer->cpu->drawDabs(dabs, m_brush.dabColor(), m_brush.hardness);
+            layer->cpu->upload(&surface, tiles);
+            m_saver.changed(m_target, tiles);
+            return;
+        }
+
+        QOpenGLExtraFunctions fns;
         fns.initializeOpenGLFunctions();
+        auto& program = m_gl->program;
 
-        QMatrix4x4 pmvMatrix;
-        pmvMatrix.ortho(0, m_size.width(), 0, m_size.height(), -1, 1);
+        // the op's instances are contiguous, bin after bin
+        const DabPipeline::Bin& last = m_frame.bins[op.firstBin + op.binCount - 1];
+        const int first = m_frame.bins[op.firstBin].first;
+        const int count = last.first + last.count - first;
+        const int bytes = count * int(sizeof(DabInstance));
+        m_instances.bind();
+        if (count > m_instanceCapacity) {
+            m_instanceCapacity = qMax(count, m_instanceCapacity * 2);
+            m_instances.allocate(m_instanceCapacity * int(sizeof(DabInstance)));
+            m_instanceMemory.set(m_account.data(), GpuMemory::Buffers, m_instanceCapacity * qint64(sizeof(DabInstance)), QStringLiteral("dab instances"));
+        }
+        // invalidating orphans the storage the previous draws may still be reading,
+        // so the copy doesn't wait for them
+        void* mapped = m_instances.mapRange(0, bytes, QOpenGLBuffer::RangeWrite | QOpenGLBuffer::RangeInvalidateBuffer);
+        if (mapped != nullptr) {
+            std::memcpy(mapped, m_frame.instances.constData() + first, bytes);
+            m_instances.unmap();
+        } else {
+            m_instances.write(0, m_frame.instances.constData() + first, bytes);
+        }
+        m_instances.release();
 
-        auto x = static_cast<GLfloat>(p.x());
-        auto y = static_cast<GLfloat>(p.y());
-        const float pointSize = 5.0f + (velocity/5.0);
+        program.bind();
+        if (m_brush.features() & BrushPreset::Soft)
+            program.setUniformValue(m_gl->hardnessLocation, GLfloat(m_brush.hardness));
+        // every tip is a layer of the one atlas, so dabs of mixed tips still share a draw
+        const bool tipped = m_brush.features() & BrushPreset::Tipped;
+        if (tipped) {
+            fns.glActiveTexture(GL_TEXTURE0);
+            fns.glBindTexture(GL_TEXTURE_2D_ARRAY, GLResources::current()->get<BrushTipAtlas>()->texture);
+            program.setUniformValue(m_gl->tipsLocation, 0);
+        }
 
-        const GLfloat squareVertices[] = {
-            x - pointSize, y - pointSize, 0.0f,
-            x - pointSize, y + pointSize, 0.0f,
-            x + pointSize, y + pointSize, 0.0f,
-            x + pointSize, y - pointSize, 0.0f
-        };
-        const GLubyte squareIndices[] = {
-            0, 1, 2,
-            0, 2, 3
-        };
+        m_gl->quad.bind();
+        program.enableAttributeArray(m_gl->cornerLocation);
+        program.setAttributeBuffer(m_gl->cornerLocation, GL_FLOAT, 0, 2);
+        m_gl->quad.release();
+
+        program.enableAttributeArray(m_gl->centerLocation);
+        program.enableAttributeArray(m_gl->radiusLocation);
+        program.enableAttributeArray(m_gl->colorLocation);
+        fns.glVertexAttribDivisor(m_gl->centerLocation, 1);
+        fns.glVertexAttribDivisor(m_gl->radiusLocation, 1);
+        fns.glVertexAttribDivisor(m_gl->colorLocation, 1);
+        // plain discs don't read them, so the linker may have dropped them
+        if (tipped) {
+            program.enableAttributeArray(m_gl->angleLocation);
+            program.enableAttributeArray(m_gl->tipLocation);
+            fns.glVertexAttribDivisor(m_gl->angleLocation, 1);
+            fns.glVertexAttribDivisor(m_gl->tipLocation, 1);
+        }
 
-        program.enableAttributeArray(vertexLocation);
-        program.setAttributeArray(vertexLocation, squareVertices, 3);
-        program.setUniformValue(matrixLocation, pmvMatrix);
-        program.setUniformValue(colorLocation, QColor(0, 255, 0, 255));
-        program.setUniformValue(viewportSizeLocation, m_size);
-        program.setUniformValue(centerLocation, p * m_dpr);
-        program.setUniformValue(strokeSizeLocation, pointSize * m_dpr);
-
-        fns.glEnable(GL_BLEND);
-        fns.glEnable(GL_DEPTH_TEST);
-        fns.glDepthFunc(GL_GREATER);
-        fns.glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        fns.glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_BYTE, squareIndices);
-        program.disableAttributeArray(vertexLocation);
+        StrokeBuffer::beginDabs();
+
+        const int stride = sizeof(DabInstance);
+        m_gl->indices.bind();
+        for (int i = op.firstBin; i < op.firstBin + op.binCount; i++) {
+            const DabPipeline::Bin& bin = m_frame.bins[i];
+            program.setUniformValue(m_gl->matrixLocation, m_strokeBuffer.bind(TiledSurface::fromKey(bin.key)));
+
+            m_instances.bind();
+            const int offset = (bin.first - first) * stride;
+            program.setAttributeBuffer(m_gl->centerLocation, GL_FLOAT, offset + offsetof(DabInstance, x), 2, stride);
+            program.setAttributeBuffer(m_gl->radiusLocation, GL_FLOAT, offset + offsetof(DabInstance, radius), 1, stride);
+            program.setAttributeBuffer(m_gl->colorLocation, GL_FLOAT, offset + offsetof(DabInstance, r), 4, stride);
+            if (tipped) {
+                program.setAttributeBuffer(m_gl->angleLocation, GL_FLOAT, offset + offsetof(DabInstance, angle), 1, stride);
+                program.setAttributeBuffer(m_gl->tipLocation, GL_FLOAT, offset + offsetof(DabInstance, tip), 1, stride);
+            }
+            m_instances.release();
+
+            fns.glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_BYTE, nullptr, bin.count);
+        }
+        m_gl->indices.release();
+        StrokeBuffer::endDabs();
+
+        // the scene graph shares these attribute slots, so leave them as we found them
+        fns.glVertexAttribDivisor(m_gl->centerLocation, 0);
+        fns.glVertexAttribDivisor(m_gl->radiusLocation, 0);
+        fns.glVertexAttribDivisor(m_gl->colorLocation, 0);
+        program.disableAttributeArray(m_gl->cornerLocation);
+        program.disableAttributeArray(m_gl->centerLocation);
+        program.disableAttributeArray(m_gl->radiusLocation);
+        program.disableAttributeArray(m_gl->colorLocation);
+        if (tipped) {
+            fns.glVertexAttribDivisor(m_gl->angleLocation, 0);
+            fns.glVertexAttribDivisor(m_gl->tipLocation, 0);
+            program.disableAttributeArray(m_gl->angleLocation);
+            program.disableAttributeArray(m_gl->tipLocation);
+            fns.glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        }
+        program.release();
+    }
+
+    /// catches everything else up after history changed region, on any layer
+    void restored(const DirtyRegion& region) {
+        for (auto layer : m_layers.layers()) {
+            if (layer->cpu)
+                layer->cpu->download(&layer->surface, region);
+        }
+        m_layers.invalidate(region);
+        m_layers.invalidateMirrors(nullptr, region);
+        m_dirty.add(region);
+        m_saver.changed(0, region);
+    }
+
+    /// replaces the layers' contents with what's in file, which sync() has just made them for. every tile
+    /// is parked pointing into the file, and only decoded and uploaded once something reads it
+    void open(const QSharedPointer<ProjectFile>& file, const QVector<quint32>& ids) {
+        const auto& index = file->index();
+        m_loading.clear();
+        m_unread.clear();
+        for (int i = 0; i < ids.size() && i < index.layers.size(); i++) {
+            auto layer = m_layers.layer(ids[i]);
+            if (layer == nullptr)
+                continue;
+            const auto& tiles = index.layers[i].tiles;
+            for (auto it = tiles.cbegin(); it != tiles.cend(); it++) {
+                layer->surface.setParked(TiledSurface::fromKey(it.key()), file->chunk(it.value()));
+                m_loading << it.key();
+                if (layer->cpu)
+                    m_unread[ids[i]] << it.key();
+            }
+        }
+        m_saver.opened(file, ids);
+
+        // compositing the whole document now would unpark every tile; the
+        // view shows paper where they haven't come in yet
+        m_composite.clear();
+        m_pyramid.resize();
+        m_dirty.clear();
+        m_viewDirty = true;
+    }
+
+    /// brings tiles of an opened project onto every layer and composites them
+    void load(const QVector<quint64>& keys) {
+        for (auto key : keys) {
+            if (!m_loading.remove(key))
+                continue;
+            const QPoint tile = TiledSurface::fromKey(key);
+            const QRect rect = TiledSurface::tileRect(tile) & QRect(QPoint(0, 0), m_documentSize);
+            for (auto layer : m_layers.layers()) {
+                if (layer->cpu)
+                    readIn(layer, {key});
+                else
+                    layer->surface.tile(tile);
+            }
+            DirtyRegion region;
+            region.add(rect);
+            m_layers.invalidate(region);
+            m_dirty.add(rect);
+        }
+    }
+
+    /// brings tiles of an opened project into a software layer's CpuSurface, and only that layer's
+    void readIn(LayerStack::Layer* layer, const QVector<quint64>& keys) {
+        auto it = m_unread.find(layer->state.id);
+        if (it == m_unread.end())
+            return;
+        QVector<QPoint> tiles;
+        for (auto key : keys) {
+            if (it->remove(key))
+                tiles << TiledSurface::fromKey(key);
+        }
+        if (it->isEmpty())
+            m_unread.erase(it);
+        if (!tiles.isEmpty())
+            layer->cpu->download(&layer->surface, tiles);
+    }
+
+    /// loads what the frame has time for: the visible tiles, nearest the middle of the view first, then the rest
+    void loadSome() {
+        if (m_loading.isEmpty())
+            return;
+        FrameProfiler::Scope scope(m_profiler.data(), "load");
+        const QPointF origin = m_viewport.origin(m_dpr);
+        const QRectF visible(origin, QSizeF(m_viewSize) / m_viewport.zoom);
+        const QPointF middle = visible.center();
+        QVector<quint64> keys = m_loading.values();
+        std::sort(keys.begin(), keys.end(), [&](quint64 a, quint64 b) {
+            const QRect ra = TiledSurface::tileRect(TiledSurface::fromKey(a));
+            const QRect rb = TiledSurface::tileRect(TiledSurface::fromKey(b));
+            const bool va = visible.intersects(ra);
+            const bool vb = visible.intersects(rb);
+            if (va != vb)
+                return va;
+            return QLineF(QRectF(ra).center(), middle).length() < QLineF(QRectF(rb).center(), middle).length();
+        });
+        QElapsedTimer timer;
+        timer.start();
+        int loaded = 0;
+        while (loaded < keys.size() && timer.elapsed() < LoadBudget)
+            load({keys[loaded++]});
+        update();
+    }
+
+    void process(const DabPipeline::Op& op) {
+        switch (op.tag) {
+        case DabPipeline::Op::Begin: {
+            m_target = m_layers.active() != nullptr ? m_layers.active()->state.id : 0;
+            m_layers.setStroke(m_target, &m_strokeBuffer);
+            setBrush(op.brush);
+            m_history.begin();
+            break;
+        }
+        case DabPipeline::Op::Dabs: {
+            FrameProfiler::Scope scope(m_profiler.data(), "dabs");
+            draw(op);
+            break;
+        }
+        case DabPipeline::Op::End: {
+            FrameProfiler::Scope scope(m_profiler.data(), "merge");
+            // the stroke lands on its layer in one go, inside the open history step
+            if (auto layer = m_layers.layer(m_target)) {
+                const DirtyRegion merged = m_strokeBuffer.merge(&layer->surface);
+                // the active layer isn't cached, but the stroke may have started on another one
+                if (layer != m_layers.active() && !merged.isEmpty())
+                    m_layers.invalidate(merged);
+                m_layers.invalidateMirrors(layer, merged);
+                m_dirty.add(merged);
+                m_saver.changed(m_target, merged);
+                layer->surface.endStroke();
+                if (layer->cpu)
+                    layer->cpu->endStroke();
+            } else {
+                m_strokeBuffer.clear();
+            }
+            m_history.end();
+            break;
+        }
+        case DabPipeline::Op::Fill: {
+            auto layer = m_layers.active();
+            if (layer == nullptr)
+                break;
+            FrameProfiler::Scope scope(m_profiler.data(), "fill");
+            // a flood can reach anywhere on the layer, but no other layer
+            if (layer->cpu)
+                readIn(layer, m_unread.value(layer->state.id).values());
+            // the flood runs on the cpu; only the tiles it changed go back up, as one undo step
+            auto mirror = m_layers.mirror(layer);
+            const QPoint seed(qFloor(op.pos.x()), qFloor(op.pos.y()));
+            m_history.begin();
+            const QVector<QPoint> tiles = mirror->fill(seed, op.brush.dabColor(), m_fill);
+            mirror->upload(&layer->surface, tiles);
+            layer->surface.endStroke();
+            m_history.end();
+            for (const auto& tile : tiles)
+                m_dirty.add(TiledSurface::tileRect(tile) & QRect(QPoint(0, 0), m_documentSize));
+            m_saver.changed(layer->state.id, tiles);
+            break;
+        }
+        case DabPipeline::Op::Undo: {
+            FrameProfiler::Scope scope(m_profiler.data(), "history");
+            const DirtyRegion changed = m_history.undo();
+            restored(changed);
+            break;
+        }
+        case DabPipeline::Op::Redo: {
+            FrameProfiler::Scope scope(m_profiler.data(), "history");
+            const DirtyRegion changed = m_history.redo();
+            restored(changed);
+            break;
+        }
+        case DabPipeline::Op::Layer: {
+            // the ops after it land on the layers as the journal left them;
+            // the item takes them in at the next synchronize
+            QVector<LayerStack::State> states;
+            for (auto layer : m_layers.layers())
+                states << layer->state;
+            quint32 active = m_layers.active() != nullptr ? m_layers.active()->state.id : 0;
+            apply(op.layer, states, active);
+            m_dirty.add(m_layers.sync(states, active));
+            m_layersReplayed = true;
+            break;
+        }
+        }
+    }
+
+    /// gives GPU memory back while the process is over budget, whatever is cheapest to get back first
+    void relieve() {
+        if (GpuMemory::isOverBudget())
+            m_history.releaseGpu();
+        if (GpuMemory::isOverBudget())
+            m_layers.releaseCaches();
+        // parking takes a few frames, a few tiles at a time, and what it started finishes under budget too
+        int budget = GpuMemory::isOverBudget() ? TiledSurface::ParksPerFrame : 0;
+        const quint64 before = budget > 0 ? GpuMemory::coldBefore() : 0;
+        m_pyramid.park(before, budget);
+        m_composite.park(before, budget);
+        m_layers.park(before, budget);
+        const bool parking = m_pyramid.isParking() || m_composite.isParking() || m_layers.isParking();
+        if (parking)
+            update();
+
+        const bool over = GpuMemory::isOverBudget() && !parking;
+        if (over && !m_overBudget)
+            qWarning("Canvassy: %lld MiB over the GPU budget after giving back what it could", GpuMemory::excess() / (1024 * 1024));
+        m_overBudget = over;
     }
 
     void render() override {
         QOpenGLFunctions fns;
         fns.initializeOpenGLFunctions();
-        if (!m_initted) {
-            fns.glClearColor(0.3, 0.3, 0.3, 1.0);
-            fns.glClearDepthf(0.0);
-            fns.glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            m_initted = true;
-        }
-
-        for (auto& msg : m_messages) {
-            switch (msg.tag) {
-            case CanvassyMessage::Down: {
-                m_lastPos = msg.down.pos;
-                m_pos = msg.down.pos;
-                m_velocity = 0.0;
-                program.bind();
-                paint(m_pos, m_velocity);
-                program.release();
-                break;
-            }
-            case CanvassyMessage::Move: {
-                m_lastPos = m_pos;
-                m_pos = msg.move.pos;
-
-                auto line = QLineF(m_pos, m_lastPos);
-                m_velocity = lerp(line.length(), m_velocity, 0.9);
-                
-                program.bind();
-                if (line.length() > 1.0) {
-                    int n = line.length();
-                    for (int i = 0; i < n; i++) {
-                        auto t = qreal(i) / qreal(n);
-                        paint(line.pointAt(t), m_velocity);
-                    }
-                } else {
-                    paint(m_pos, m_velocity);
-                }
-                program.release();
-                break;
+        GpuMemory::advanceFrame();
+        FrameProfiler::CpuScope frame(m_profiler.data(), "render");
+
+        // the worker has already turned the input into dabs; the journal replays through it too
+        m_pipeline->take(m_frame);
+        for (auto received : qAsConst(m_frame.received)) {
+            m_latency->taken(received);
+        }
+        for (const auto& op : qAsConst(m_frame.ops)) {
+            process(op);
+        }
+
+        loadSome();
+
+        auto view = framebufferObject();
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "compose");
+            m_layers.compose(&m_composite, m_dirty);
+        }
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "pyramid");
+            m_pyramid.update(m_dirty);
+        }
+        // only what the surface changed under and what a resize uncovered is redrawn and published;
+        // moving the viewport or a new fbo redraws it all
+        const QRect bounds(QPoint(0, 0), m_viewSize);
+        DirtyRegion redraw = m_exposed;
+        if (m_viewDirty || m_fresh) {
+            redraw.clear();
+            redraw.add(bounds);
+        } else {
+            for (const auto& rect : m_dirty.rects()) {
+                // a view pixel of slack for the pyramid's filtering across the edge
+                const QRect shown = toView(rect).adjusted(-1, -1, 1, 1) & bounds;
+                if (!shown.isEmpty())
+                    redraw.add(shown);
             }
-            case CanvassyMessage::Up: {
-                m_lastPos = QPointF();
-                m_pos = QPointF();
-                m_velocity = 0.0;
-                fns.glClearDepthf(0.0);
-                fns.glClear(GL_DEPTH_BUFFER_BIT);
-                break;
+        }
+        if (!redraw.isEmpty()) {
+            FrameProfiler::Scope scope(m_profiler.data(), "view");
+            for (const auto& rect : redraw.rects()) {
+                // past the document's edges reads as the desk, a shade darker than the paper
+                m_pyramid.draw(view, rect, m_viewport.origin(m_dpr), m_viewport.zoom, m_layers.paper().darker(150));
             }
+        }
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "publish");
+            m_shared->publish(view, redraw);
+        }
+        m_dirty.clear();
+        m_exposed.clear();
+        m_viewDirty = false;
+        m_fresh = false;
+        m_latency->rendered();
+        m_stats->frames.fetch_add(1, std::memory_order_relaxed);
+
+        // the composite only holds all of an opened project once it has come in, a few tiles a frame
+        if (m_loading.isEmpty()) {
+            for (const auto& it : qAsConst(m_exports)) {
+                m_exporter.request(&m_composite, it.first, it.second);
             }
+            m_exports.clear();
+        }
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "export");
+            m_exporter.step();
+        }
+        if (m_exporter.isBusy())
+            update();
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "demote");
+            m_history.step();
+        }
+        if (m_history.isBusy())
+            update();
+        for (const auto& save : qAsConst(m_saves)) {
+            // a replay reopens the project with the ids its layers have now, so journaled layer changes find them
+            QVector<quint32> ids;
+            for (auto layer : m_layers.layers())
+                ids << layer->state.id;
+            // the pointer is only looked at back on the gui thread
+            m_saver.request(save.path, m_documentSize, m_layers, [save, ids](const QString& path, bool ok) {
+                QMetaObject::invokeMethod(qApp, [save, ids, path, ok] {
+                    if (!save.canvas)
+                        return;
+                    if (ok && save.checkpoint)
+                        save.canvas->checkpointJournal(path, ids, save.brush, save.position);
+                    Q_EMIT save.canvas->projectSaved(path, ok);
+                }, Qt::QueuedConnection);
+            });
+        }
+        m_saves.clear();
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "save");
+            m_saver.step();
+        }
+        if (m_saver.isBusy())
+            update();
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "relieve");
+            relieve();
         }
 
+        view->bind();
+        fns.glViewport(0, 0, view->width(), view->height());
+        m_profiler->endFrame();
     }
 
     QOpenGLFramebufferObject *createFramebufferObject(const QSize &size) override {
-        QOpenGLFramebufferObjectFormat format;
-        format.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
-        format.setSamples(4);
-        return new QOpenGLFramebufferObject(size, format);
+        // with room to grow; resizeView() asks for another once the view outgrows it
+        auto ret = new QOpenGLFramebufferObject(ViewBuffer::allocationFor(size));
+        m_viewCapacity = ret->size();
+        m_fresh = true;
+        m_viewMemory.set(m_account.data(), GpuMemory::View, ret);
+        return ret;
+    }
+
+    /// changes how much of the item's fbo is in use. a new one is only asked for when the
+    /// view doesn't fit anymore, or has settled well inside it and the spare room can go back
+    void resizeView(const QSize& size) {
+        if (size != m_viewSize) {
+            // what's already drawn stays where it is; only what the resize uncovers is drawn
+            m_exposed.add(ViewBuffer::uncovered(m_viewSize, size));
+            m_shared->resize(size);
+            m_viewSize = size;
+            m_resized = GpuMemory::frame();
+        }
+        // until the first fbo, which Qt asks for anyway
+        if (m_viewCapacity.isEmpty())
+            return;
+        const QSize settled = ViewBuffer::allocationFor(size);
+        const bool outgrown = m_viewCapacity.width() < size.width() || m_viewCapacity.height() < size.height();
+        const bool spare = GpuMemory::frame() - m_resized >= ViewBuffer::SettleFrames
+            && (m_viewCapacity.width() > settled.width() || m_viewCapacity.height() > settled.height());
+        if (outgrown || spare)
+            invalidateFramebufferObject();
     }
 
     void synchronize(QQuickFramebufferObject* item) override {
+        m_profiler->beginFrame();
+        FrameProfiler::CpuScope scope(m_profiler.data(), "synchronize");
         auto canvas = static_cast<Canvassy*>(item);
-        m_messages = std::move(canvas->messages());
-        canvas->messages().clear();
+        m_pipeline = canvas->dabPipeline();
+        // a move that found the channel full goes in once the worker has caught up
+        if (canvas->input()->flush())
+            update();
+        for (const auto& path : canvas->takeExports()) {
+            // the pointer is only looked at back on the gui thread
+            m_exports << qMakePair(path, CanvasExporter::Done([canvas = QPointer<Canvassy>(canvas)](const QString& path, bool ok) {
+                QMetaObject::invokeMethod(qApp, [canvas, path, ok] {
+                    if (canvas)
+                        Q_EMIT canvas->exported(path, ok);
+                }, Qt::QueuedConnection);
+            })));
+        }
+        const QStringList saves = canvas->takeProjectSaves();
+        if (!saves.isEmpty()) {
+            // a save can only stand in for the journal if this frame draws all the input journaled so far;
+            // mid-stroke or mid-replay the next one gets to checkpoint instead
+            m_pipeline->drain();
+            const bool settled = m_pipeline->isSettled();
+            for (const auto& path : saves)
+                m_saves << Save{path, canvas, settled, canvas->journalPosition(), qHash(canvas->brush())};
+        }
+        m_stats = canvas->rendererStats();
+        if (!m_latency) {
+            // frameSwapped is emitted on this thread, right after the swap
+            m_latency = canvas->latencyTracker();
+            m_swapped = QObject::connect(item->window(), &QQuickWindow::frameSwapped, [latency = m_latency] {
+                latency->swapped();
+            });
+            // after every item's preprocess, so it doesn't overlap our passes
+            m_sceneBegun = QObject::connect(item->window(), &QQuickWindow::beforeRenderPassRecording, [profiler = m_profiler] {
+                profiler->beginGpu("scene graph");
+            });
+            m_sceneEnded = QObject::connect(item->window(), &QQuickWindow::afterRenderPassRecording, [profiler = m_profiler] {
+                profiler->endGpu();
+            });
+        }
         m_size = item->size().toSize();
-        m_dpr = item->window()->effectiveDevicePixelRatio();
+        const float dpr = item->window()->effectiveDevicePixelRatio();
+        if (dpr != m_dpr) {
+            m_dpr = dpr;
+            m_viewDirty = true;
+        }
+        resizeView((item->size() * m_dpr).toSize());
+
+        QSize documentSize = canvas->documentSize();
+        if (documentSize.isEmpty())
+            documentSize = (item->size() * m_dpr).toSize();
+        if (documentSize != m_documentSize) {
+            m_documentSize = documentSize;
+            m_layers.setSize(documentSize);
+            m_strokeBuffer.setSize(documentSize);
+            m_composite.setSize(documentSize);
+            m_pyramid.resize();
+            m_dirty.add(QRect(QPoint(0, 0), documentSize));
+            // the desk around the document moves with its edges
+            m_viewDirty = true;
+        }
+        m_pipeline->setSurface(m_dpr, documentSize);
+        const Viewport viewport = canvas->viewport();
+        if (viewport != m_viewport) {
+            m_viewport = viewport;
+            m_viewDirty = true;
+        }
+        if (std::exchange(m_layersReplayed, false)) {
+            QVector<LayerStack::State> states;
+            for (auto layer : m_layers.layers())
+                states << layer->state;
+            canvas->adoptLayers(states, m_layers.active() != nullptr ? m_layers.active()->state.id : 0);
+        }
+        m_dirty.add(m_layers.sync(canvas->layers(), canvas->currentLayerId()));
+        QVector<quint32> opened;
+        if (auto file = canvas->takeOpenedProject(&opened))
+            open(file, opened);
+
+        const BrushPreset brush = canvas->brushPreset();
+        if (brush.name != m_nextBrush.name) {
+            m_nextBrush = brush;
+            // compile the permutation and load the tips now rather than on the stroke's first frame
+            GLResources::current()->get<CanvassyProgram>(brush.features());
+            if (brush.features() & BrushPreset::Tipped)
+                GLResources::current()->get<BrushTipAtlas>();
+        }
+        m_pipeline->setBrush(brush);
+        m_fill.tolerance = canvas->fillTolerance();
+        m_fill.gap = canvas->fillGap();
+        // after the surface, which the replayed dabs are generated for
+        m_pipeline->replay(canvas->takeJournalReplay());
+
+        const qint64 budget = qint64(canvas->historyBudget()) * 1024 * 1024;
+        if (budget != m_history.settings().budget) {
+            auto settings = m_history.settings();
+            settings.budget = budget;
+            m_history.setSettings(settings);
+        }
     }
 };
 
 struct Canvassy::Private
 {
     QPoint pos;
-    QVarLengthArray<CanvassyMessage, 10> messages;
-    CanvassyRenderer* renderer = nullptr;
+    InputChannel* input = nullptr;
+    QScopedPointer<DabPipeline> dabPipeline;
+    QScopedPointer<StrokeJournal> journal;
+    QStringList exports;
+    QString project;
+    QStringList projectSaves;
+    QSharedPointer<ProjectFile> openedProject;
+    QVector<quint32> openedLayers;
+    QVector<InputMessage> replay;
+    QTimer autosave;
+    QSharedPointer<LatencyTracker> latencyTracker = QSharedPointer<LatencyTracker>::create();
+    LatencyStats* latency = nullptr;
+    QSharedPointer<RendererStats> rendererStats = QSharedPointer<RendererStats>::create();
+    QSharedPointer<GpuMemory::Account> gpuAccount = QSharedPointer<GpuMemory::Account>::create(QStringLiteral("Canvassy"));
+    GpuMemoryStats* gpuMemory = nullptr;
+    QSharedPointer<FrameProfiler> frameProfiler = QSharedPointer<FrameProfiler>::create(QStringLiteral("Canvassy"));
+    ProfilerStats* profiler = nullptr;
+    QSharedPointer<SharedSurface> sharedSurface = QSharedPointer<SharedSurface>::create();
     Subcanvassy* subcanvassy = nullptr;
+    QVector<LayerStack::State> layers;
+    int currentLayer = 0;
+    quint32 nextLayerId = 1;
+    int historyBudget = 256;
+    QSize documentSize;
+    Viewport viewport;
+    BrushPreset brush = BrushPreset::find(BrushPreset::Paint, QString());
+    Tool tool = Paint;
+    qreal fillTolerance = 0.1;
+    int fillGap = 0;
+
+    LayerStack::State* layer(int index) {
+        if (index < 0 || index >= layers.size())
+            return nullptr;
+        return &layers[index];
+    }
+    /// so a replay puts strokes on the layers they were painted on
+    void journalLayer(LayerChange::Type type, const LayerStack::State& state, int index = 0) {
+        if (journal)
+            journal->append(InputMessage::CLayer(LayerChange{type, state.id, index, float(state.opacity), quint8(state.mode), state.visible}));
+    }
 };
 
 Canvassy::Canvassy(QQuickItem* parent) : QQuickFramebufferObject(parent), d(new Private)
 {
     setAcceptedMouseButtons(Qt::LeftButton);
+    // the renderer reallocates the fbo itself, in coarse steps
+    setTextureFollowsItemSize(false);
+    d->latency = new LatencyStats(d->latencyTracker, this);
+    d->gpuMemory = new GpuMemoryStats(d->gpuAccount, this);
+    d->profiler = new ProfilerStats(d->frameProfiler, this);
+    d->input = new InputChannel(this, Qt::LeftButton);
+    d->dabPipeline.reset(new DabPipeline(this, d->input));
+
+    LayerStack::State background;
+    background.id = d->nextLayerId++;
+    d->layers << background;
+
+    // later saves go where the last one did, if it worked
+    connect(this, &Canvassy::projectSaved, this, [this](const QString& path, bool ok) {
+        if (!ok || path == d->project)
+            return;
+        d->project = path;
+        Q_EMIT projectChanged();
+    });
+    connect(&d->autosave, &QTimer::timeout, this, [this] {
+        if (!d->project.isEmpty())
+            saveProject(d->project);
+    });
 }
 Canvassy::~Canvassy()
 {
@@ -229,23 +995,27 @@ Canvassy::~Canvassy()
 }
 QQuickFramebufferObject::Renderer* Canvassy::createRenderer() const
 {
-    d->renderer = new CanvassyRenderer(const_cast<Canvassy*>(this));
-    d->subcanvassy->attach(d->renderer);
-    return d->renderer;
+    return new CanvassyRenderer(const_cast<Canvassy*>(this));
+}
+QSGNode* Canvassy::updatePaintNode(QSGNode* node, UpdatePaintNodeData* data)
+{
+    node = QQuickFramebufferObject::updatePaintNode(node, data);
+    // the fbo has room to grow; only the corner the renderer draws into is shown
+    if (auto texture = dynamic_cast<QSGSimpleTextureNode*>(node))
+        texture->setSourceRect(QRectF(QPointF(0, 0), (size() * window()->effectiveDevicePixelRatio()).toSize()));
+    return node;
 }
 void Canvassy::mousePressEvent(QMouseEvent* event)
 {
-    d->messages << CanvassyMessage::CDown(event->pos());
-    update();
+    d->input->mousePressEvent(event);
 }
 void Canvassy::mouseMoveEvent(QMouseEvent* event)
 {
-    d->messages << CanvassyMessage::CMove(event->pos());
-    update();
+    d->input->mouseMoveEvent(event);
 }
-void Canvassy::mouseReleaseEvent(QMouseEvent*) {
-    d->messages << CanvassyMessage::CUp();
-    update();
+void Canvassy::mouseReleaseEvent(QMouseEvent* event)
+{
+    d->input->mouseReleaseEvent(event);
 }
 Subcanvassy* Canvassy::subcanvassy()
 {
@@ -257,9 +1027,467 @@ void Canvassy::setSubcanvassy(Subcanvassy* subcanvas)
         return;
 
     d->subcanvassy = subcanvas;
+    if (d->subcanvassy != nullptr)
+        d->subcanvassy->setSource(d->sharedSurface);
     Q_EMIT subcanvassyChanged();
 }
-QVarLengthArray<CanvassyMessage, 10>& Canvassy::messages() const
+InputChannel* Canvassy::input() const
+{
+    return d->input;
+}
+DabPipeline* Canvassy::dabPipeline() const
+{
+    return d->dabPipeline.data();
+}
+QSharedPointer<LatencyTracker> Canvassy::latencyTracker() const
+{
+    return d->latencyTracker;
+}
+LatencyStats* Canvassy::latency() const
+{
+    return d->latency;
+}
+QSharedPointer<RendererStats> Canvassy::rendererStats() const
+{
+    return d->rendererStats;
+}
+QSharedPointer<GpuMemory::Account> Canvassy::gpuAccount() const
+{
+    return d->gpuAccount;
+}
+GpuMemoryStats* Canvassy::gpuMemory() const
+{
+    return d->gpuMemory;
+}
+QSharedPointer<FrameProfiler> Canvassy::frameProfiler() const
+{
+    return d->frameProfiler;
+}
+ProfilerStats* Canvassy::profiler() const
+{
+    return d->profiler;
+}
+QSharedPointer<SharedSurface> Canvassy::sharedSurface() const
+{
+    return d->sharedSurface;
+}
+QString Canvassy::journal() const
+{
+    return d->journal ? d->journal->path() : QString();
+}
+void Canvassy::setJournal(const QString& journal)
+{
+    const QString path = appDataPath(journal);
+    if (path == this->journal())
+        return;
+
+    d->input->setJournal(nullptr);
+    d->replay.clear();
+    d->journal.reset(path.isEmpty() ? nullptr : new StrokeJournal(path));
+    if (d->journal && d->journal->isOpen()) {
+        d->replay = d->journal->takeReplay();
+        // the project the journal was last checkpointed with comes back first, and the replay paints on it
+        const QByteArray bytes = d->journal->base();
+        QDataStream base(bytes);
+        QString project;
+        QVector<quint32> ids;
+        quint32 nextLayerId = 0;
+        uint brush = 0;
+        base >> project >> ids >> nextLayerId >> brush;
+        if (base.status() == QDataStream::Ok && !project.isEmpty()) {
+            if (open(project, ids)) {
+                d->nextLayerId = qMax(d->nextLayerId, nextLayerId);
+                d->replay.prepend(InputMessage::CBrush(brush));
+            } else {
+                qWarning("Canvassy: couldn't reopen %s to replay the journal on", qPrintable(project));
+            }
+        }
+
+        d->input->setJournal(d->journal.data());
+        // a replay starts out with whatever brush the app starts with
+        d->journal->append(InputMessage::CBrush(qHash(d->brush.name)));
+    }
+    Q_EMIT journalChanged();
+    update();
+}
+QVector<InputMessage> Canvassy::takeJournalReplay()
+{
+    return std::move(d->replay);
+}
+quint64 Canvassy::journalPosition() const
+{
+    return d->journal ? d->journal->position() : 0;
+}
+void Canvassy::checkpointJournal(const QString& path, const QVector<quint32>& layerIds, uint brush, quint64 position)
+{
+    if (!d->journal)
+        return;
+
+    QByteArray base;
+    QDataStream stream(&base, QIODevice::WriteOnly);
+    stream << path << layerIds << d->nextLayerId << brush;
+    d->journal->checkpoint(base, position);
+}
+void Canvassy::exportImage(const QString& path)
+{
+    d->exports << path;
+    update();
+}
+QStringList Canvassy::takeExports()
+{
+    return std::exchange(d->exports, {});
+}
+QString Canvassy::project() const
+{
+    return d->project;
+}
+int Canvassy::autosave() const
+{
+    return d->autosave.interval() / 1000;
+}
+void Canvassy::setAutosave(int seconds)
+{
+    seconds = qMax(0, seconds);
+    if (seconds == autosave())
+        return;
+
+    d->autosave.setInterval(seconds * 1000);
+    if (seconds > 0)
+        d->autosave.start();
+    else
+        d->autosave.stop();
+    Q_EMIT autosaveChanged();
+}
+void Canvassy::saveProject(const QString& path)
+{
+    const QString absolute = appDataPath(path);
+    if (absolute.isEmpty())
+        return;
+
+    d->projectSaves << absolute;
+    update();
+}
+QStringList Canvassy::takeProjectSaves()
+{
+    return std::exchange(d->projectSaves, {});
+}
+bool Canvassy::openProject(const QString& path)
+{
+    const QString absolute = appDataPath(path);
+    if (!open(absolute, {}))
+        return false;
+
+    // nothing journaled before is drawn on the opened project, so a replay starts from it instead
+    d->replay.clear();
+    checkpointJournal(absolute, d->openedLayers, qHash(d->brush.name), journalPosition());
+    return true;
+}
+bool Canvassy::open(const QString& path, const QVector<quint32>& layerIds)
+{
+    auto file = ProjectFile::open(path);
+    if (!file)
+        return false;
+
+    // new ids, so the renderer makes new layers rather than keeping what's painted on the old ones,
+    // unless a replay needs the ids its layer changes were journaled with
+    const auto& index = file->index();
+    const bool reused = layerIds.size() == index.layers.size();
+    d->layers.clear();
+    d->openedLayers.clear();
+    for (int i = 0; i < index.layers.size(); i++) {
+        LayerStack::State state = index.layers[i].state;
+        state.id = reused ? layerIds[i] : d->nextLayerId++;
+        d->nextLayerId = qMax(d->nextLayerId, state.id + 1);
+        d->layers << state;
+        d->openedLayers << state.id;
+    }
+    d->openedProject = file;
+    d->currentLayer = qBound(0, index.currentLayer, d->layers.size() - 1);
+    Q_EMIT layersChanged();
+    Q_EMIT currentLayerChanged();
+    setDocumentSize(index.documentSize);
+    if (d->project != path) {
+        d->project = path;
+        Q_EMIT projectChanged();
+    }
+    update();
+    return true;
+}
+QSharedPointer<ProjectFile> Canvassy::takeOpenedProject(QVector<quint32>* layerIds)
+{
+    *layerIds = std::exchange(d->openedLayers, {});
+    return std::exchange(d->openedProject, {});
+}
+int Canvassy::layerCount() const
+{
+    return d->layers.size();
+}
+int Canvassy::currentLayer() const
+{
+    return d->currentLayer;
+}
+void Canvassy::setCurrentLayer(int index)
+{
+    index = qBound(0, index, d->layers.size() - 1);
+    if (index == d->currentLayer)
+        return;
+
+    d->currentLayer = index;
+    d->journalLayer(LayerChange::Select, d->layers[index]);
+    Q_EMIT currentLayerChanged();
+    update();
+}
+void Canvassy::addLayer()
+{
+    LayerStack::State layer;
+    layer.id = d->nextLayerId++;
+    d->layers.insert(d->currentLayer + 1, layer);
+    d->journalLayer(LayerChange::Add, layer, d->currentLayer + 1);
+    Q_EMIT layersChanged();
+    setCurrentLayer(d->currentLayer + 1);
+    update();
+}
+void Canvassy::removeLayer(int index)
+{
+    if (d->layers.size() <= 1 || d->layer(index) == nullptr)
+        return;
+
+    // a replay picks the same layer to take over as current
+    d->journalLayer(LayerChange::Remove, d->layers[index]);
+    d->layers.remove(index);
+    Q_EMIT layersChanged();
+    if (d->currentLayer >= index && d->currentLayer > 0) {
+        d->currentLayer--;
+        Q_EMIT currentLayerChanged();
+    }
+    update();
+}
+void Canvassy::moveLayer(int from, int to)
+{
+    to = qBound(0, to, d->layers.size() - 1);
+    if (d->layer(from) == nullptr || from == to)
+        return;
+
+    const quint32 current = currentLayerId();
+    d->journalLayer(LayerChange::Move, d->layers[from], to);
+    d->layers.move(from, to);
+    Q_EMIT layersChanged();
+    for (int i = 0; i < d->layers.size(); i++) {
+        if (d->layers[i].id == current)
+            setCurrentLayer(i);
+    }
+    update();
+}
+qreal Canvassy::layerOpacity(int index) const
+{
+    auto layer = d->layer(index);
+    return layer != nullptr ? layer->opacity : 0.0;
+}
+void Canvassy::setLayerOpacity(int index, qreal opacity)
+{
+    auto layer = d->layer(index);
+    if (layer == nullptr)
+        return;
+
+    layer->opacity = qBound(0.0, opacity, 1.0);
+    d->journalLayer(LayerChange::Set, *layer);
+    Q_EMIT layersChanged();
+    update();
+}
+Canvassy::BlendMode Canvassy::layerBlendMode(int index) const
+{
+    auto layer = d->layer(index);
+    return layer != nullptr ? BlendMode(layer->mode) : Normal;
+}
+void Canvassy::setLayerBlendMode(int index, BlendMode mode)
+{
+    auto layer = d->layer(index);
+    if (layer == nullptr)
+        return;
+
+    layer->mode = LayerStack::BlendMode(mode);
+    d->journalLayer(LayerChange::Set, *layer);
+    Q_EMIT layersChanged();
+    update();
+}
+bool Canvassy::isLayerVisible(int index) const
+{
+    auto layer = d->layer(index);
+    return layer != nullptr && layer->visible;
+}
+void Canvassy::setLayerVisible(int index, bool visible)
+{
+    auto layer = d->layer(index);
+    if (layer == nullptr)
+        return;
+
+    layer->visible = visible;
+    d->journalLayer(LayerChange::Set, *layer);
+    Q_EMIT layersChanged();
+    update();
+}
+QVector<LayerStack::State> Canvassy::layers() const
+{
+    return d->layers;
+}
+quint32 Canvassy::currentLayerId() const
+{
+    return d->layers[d->currentLayer].id;
+}
+void Canvassy::adoptLayers(const QVector<LayerStack::State>& layers, quint32 current)
+{
+    if (layers.isEmpty())
+        return;
+
+    d->layers = layers;
+    d->currentLayer = 0;
+    for (int i = 0; i < layers.size(); i++) {
+        if (layers[i].id == current)
+            d->currentLayer = i;
+        d->nextLayerId = qMax(d->nextLayerId, layers[i].id + 1);
+    }
+    // the gui thread is blocked in synchronize; the bindings update once it's back
+    QMetaObject::invokeMethod(this, [this] {
+        Q_EMIT layersChanged();
+        Q_EMIT currentLayerChanged();
+    }, Qt::QueuedConnection);
+}
+int Canvassy::historyBudget() const
+{
+    return d->historyBudget;
+}
+void Canvassy::setHistoryBudget(int budget)
+{
+    if (d->historyBudget == budget)
+        return;
+
+    d->historyBudget = budget;
+    Q_EMIT historyBudgetChanged();
+    update();
+}
+QString Canvassy::brush() const
+{
+    return d->brush.name;
+}
+void Canvassy::setBrush(const QString& name)
+{
+    if (d->brush.name == name)
+        return;
+
+    d->brush = BrushPreset::find(BrushPreset::Paint, name);
+    if (d->journal)
+        d->journal->append(InputMessage::CBrush(qHash(d->brush.name)));
+    Q_EMIT brushChanged();
+    update();
+}
+QStringList Canvassy::brushes() const
+{
+    return BrushPreset::names(BrushPreset::Paint);
+}
+BrushPreset Canvassy::brushPreset() const
+{
+    return d->brush;
+}
+Canvassy::Tool Canvassy::tool() const
+{
+    return d->tool;
+}
+void Canvassy::setTool(Tool tool)
+{
+    if (d->tool == tool)
+        return;
+
+    d->tool = tool;
+    // a press that's already down finishes as what it started as
+    d->input->setFillMode(tool == Fill);
+    Q_EMIT toolChanged();
+}
+qreal Canvassy::fillTolerance() const
+{
+    return d->fillTolerance;
+}
+void Canvassy::setFillTolerance(qreal tolerance)
+{
+    tolerance = qBound<qreal>(0, tolerance, 1);
+    if (qFuzzyCompare(d->fillTolerance, tolerance))
+        return;
+
+    d->fillTolerance = tolerance;
+    Q_EMIT fillChanged();
+    update();
+}
+int Canvassy::fillGap() const
+{
+    return d->fillGap;
+}
+void Canvassy::setFillGap(int gap)
+{
+    gap = qMax(0, gap);
+    if (d->fillGap == gap)
+        return;
+
+    d->fillGap = gap;
+    Q_EMIT fillChanged();
+    update();
+}
+QSize Canvassy::documentSize() const
+{
+    return d->documentSize;
+}
+void Canvassy::setDocumentSize(const QSize& size)
+{
+    if (d->documentSize == size)
+        return;
+
+    d->documentSize = size;
+    Q_EMIT documentSizeChanged();
+    update();
+}
+qreal Canvassy::zoom() const
+{
+    return d->viewport.zoom;
+}
+void Canvassy::setZoom(qreal zoom)
+{
+    Viewport viewport = d->viewport;
+    viewport.zoom = qBound(Viewport::MinimumZoom, zoom, Viewport::MaximumZoom);
+    setViewport(viewport);
+}
+QPointF Canvassy::pan() const
+{
+    return d->viewport.pan;
+}
+void Canvassy::setPan(const QPointF& pan)
+{
+    Viewport viewport = d->viewport;
+    viewport.pan = pan;
+    setViewport(viewport);
+}
+void Canvassy::zoomAt(const QPointF& pos, qreal factor)
+{
+    Viewport viewport = d->viewport;
+    viewport.zoomAt(pos, factor);
+    setViewport(viewport);
+}
+Viewport Canvassy::viewport() const
+{
+    return d->viewport;
+}
+void Canvassy::setViewport(const Viewport& viewport)
+{
+    if (d->viewport == viewport)
+        return;
+
+    d->viewport = viewport;
+    d->input->setTransform(viewport.toDocument());
+    Q_EMIT viewportChanged();
+    update();
+}
+void Canvassy::undo()
+{
+    d->input->push(InputMessage::CUndo());
+}
+void Canvassy::redo()
 {
-    return d->messages;
+    d->input->push(InputMessage::CRedo());
 }
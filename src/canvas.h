@@ -1,8 +1,23 @@
 #pragma once
 
 #include <QQuickFramebufferObject>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QVector>
+#include "layerstack.h"
 
-struct CanvassyMessage;
+struct BrushPreset;
+class DabPipeline;
+class FrameProfiler;
+class InputChannel;
+struct InputMessage;
+class LatencyStats;
+class LatencyTracker;
+class ProfilerStats;
+class ProjectFile;
+struct RendererStats;
+class SharedSurface;
+struct Viewport;
 class Subcanvassy;
 
 class Canvassy : public QQuickFramebufferObject
@@ -11,21 +26,175 @@ class Canvassy : public QQuickFramebufferObject
     QML_NAMED_ELEMENT(Canvassy)
 
     Q_PROPERTY(Subcanvassy* subcanvassy READ subcanvassy WRITE setSubcanvassy NOTIFY subcanvassyChanged REQUIRED)
+    /// input-to-photon latency of this item's strokes
+    Q_PROPERTY(LatencyStats* latency READ latency CONSTANT)
+    /// GPU memory held by this item's renderer, and by the whole process
+    Q_PROPERTY(GpuMemoryStats* gpuMemory READ gpuMemory CONSTANT)
+    /// where this item's frames go, pass by pass, on the GPU and the render thread; off until enabled
+    Q_PROPERTY(ProfilerStats* profiler READ profiler CONSTANT)
+    /// where input is journaled for crash recovery; relative paths are under the app data directory.
+    /// whatever the file already holds is replayed when the canvas is first rendered
+    Q_PROPERTY(QString journal READ journal WRITE setJournal NOTIFY journalChanged)
+    /// the project file the canvas was last saved to or opened from, which autosaves go to
+    Q_PROPERTY(QString project READ project NOTIFY projectChanged)
+    /// seconds between saves to project while there is one; 0 turns autosaving off
+    Q_PROPERTY(int autosave READ autosave WRITE setAutosave NOTIFY autosaveChanged)
+    Q_PROPERTY(int layerCount READ layerCount NOTIFY layersChanged)
+    /// the index of the layer strokes land on, counting from the bottom
+    Q_PROPERTY(int currentLayer READ currentLayer WRITE setCurrentLayer NOTIFY currentLayerChanged)
+    /// how much memory undo history may hold, in MiB
+    Q_PROPERTY(int historyBudget READ historyBudget WRITE setHistoryBudget NOTIFY historyBudgetChanged)
+    /// the name of the paint preset strokes use, one of brushes; takes effect on the next stroke
+    Q_PROPERTY(QString brush READ brush WRITE setBrush NOTIFY brushChanged)
+    Q_PROPERTY(QStringList brushes READ brushes CONSTANT)
+    /// what pressing on the canvas does; fills use the brush's colour
+    Q_PROPERTY(Tool tool READ tool WRITE setTool NOTIFY toolChanged)
+    /// how far a colour may be from the one under the seed, from 0 to 1, and still be filled
+    Q_PROPERTY(qreal fillTolerance READ fillTolerance WRITE setFillTolerance NOTIFY fillChanged)
+    /// gaps in outlines up to this many pixels wide stop a fill like the outline would
+    Q_PROPERTY(int fillGap READ fillGap WRITE setFillGap NOTIFY fillChanged)
+    /// the size of what's painted on, in pixels; empty follows the item
+    Q_PROPERTY(QSize documentSize READ documentSize WRITE setDocumentSize NOTIFY documentSizeChanged)
+    /// item pixels per document point
+    Q_PROPERTY(qreal zoom READ zoom WRITE setZoom NOTIFY viewportChanged)
+    /// the document point at the item's top left corner
+    Q_PROPERTY(QPointF pan READ pan WRITE setPan NOTIFY viewportChanged)
 
     struct Private;
     QScopedPointer<Private> d;
+    void setViewport(const Viewport& viewport);
+    /// openProject without touching the journal; layerIds, if there's one for every layer, are used instead of new ids
+    bool open(const QString& path, const QVector<quint32>& layerIds);
 
 public:
+    enum BlendMode {
+        Normal = LayerStack::Normal,
+        Multiply = LayerStack::Multiply,
+        Screen = LayerStack::Screen,
+        Overlay = LayerStack::Overlay,
+        Darken = LayerStack::Darken,
+        Lighten = LayerStack::Lighten,
+        Add = LayerStack::Add,
+    };
+    Q_ENUM(BlendMode)
+
+    enum Tool {
+        Paint,
+        Fill,
+    };
+    Q_ENUM(Tool)
+
     Canvassy(QQuickItem* parent = nullptr);
     ~Canvassy();
     Renderer* createRenderer() const override;
-    QVarLengthArray<CanvassyMessage, 10>& messages() const;
+    InputChannel* input() const;
+    /// where the renderer takes its dabs from
+    DabPipeline* dabPipeline() const;
+    QSharedPointer<LatencyTracker> latencyTracker() const;
+    LatencyStats* latency() const;
+    QSharedPointer<RendererStats> rendererStats() const;
+    QSharedPointer<GpuMemory::Account> gpuAccount() const;
+    GpuMemoryStats* gpuMemory() const;
+    QSharedPointer<FrameProfiler> frameProfiler() const;
+    ProfilerStats* profiler() const;
+    QSharedPointer<SharedSurface> sharedSurface() const;
 
     Subcanvassy* subcanvassy();
     void setSubcanvassy(Subcanvassy* subcanvas);
     Q_SIGNAL void subcanvassyChanged();
 
+    QString journal() const;
+    void setJournal(const QString& journal);
+    Q_SIGNAL void journalChanged();
+    /// the journaled messages still to be replayed; empty after the first call
+    QVector<InputMessage> takeJournalReplay();
+    /// how many messages have been journaled; 0 without a journal
+    quint64 journalPosition() const;
+    /// gui thread; drops what the project at path holds from the journal, so a replay reopens it instead.
+    /// layerIds are the ids its layers had, in file order, and brush the one strokes used at position
+    void checkpointJournal(const QString& path, const QVector<quint32>& layerIds, uint brush, quint64 position);
+
+    /// writes what's on the canvas to path without blocking painting; the format follows the suffix
+    Q_INVOKABLE void exportImage(const QString& path);
+    Q_SIGNAL void exported(const QString& path, bool ok);
+    /// export paths requested since the last call
+    QStringList takeExports();
+
+    QString project() const;
+    Q_SIGNAL void projectChanged();
+    int autosave() const;
+    void setAutosave(int seconds);
+    Q_SIGNAL void autosaveChanged();
+    /// writes the layers to path as a project without blocking painting; saving to the
+    /// same file again only writes what changed. relative paths are under the app data directory
+    Q_INVOKABLE void saveProject(const QString& path);
+    Q_SIGNAL void projectSaved(const QString& path, bool ok);
+    /// project paths saves were requested for since the last call
+    QStringList takeProjectSaves();
+    /// replaces the document with the project at path. only its index is read
+    /// up front; tiles are read as they're shown. returns false if it isn't a project
+    Q_INVOKABLE bool openProject(const QString& path);
+    /// the project opened since the last call, if any, and the ids its layers got, in file order
+    QSharedPointer<ProjectFile> takeOpenedProject(QVector<quint32>* layerIds);
+
+    int layerCount() const;
+    Q_SIGNAL void layersChanged();
+    int currentLayer() const;
+    void setCurrentLayer(int index);
+    Q_SIGNAL void currentLayerChanged();
+    /// adds an empty layer right above the current one and makes it current
+    Q_INVOKABLE void addLayer();
+    /// the last layer can't be removed
+    Q_INVOKABLE void removeLayer(int index);
+    Q_INVOKABLE void moveLayer(int from, int to);
+    Q_INVOKABLE qreal layerOpacity(int index) const;
+    Q_INVOKABLE void setLayerOpacity(int index, qreal opacity);
+    Q_INVOKABLE Canvassy::BlendMode layerBlendMode(int index) const;
+    Q_INVOKABLE void setLayerBlendMode(int index, Canvassy::BlendMode mode);
+    Q_INVOKABLE bool isLayerVisible(int index) const;
+    Q_INVOKABLE void setLayerVisible(int index, bool visible);
+    /// the layers as the renderer sees them, bottom first
+    QVector<LayerStack::State> layers() const;
+    quint32 currentLayerId() const;
+    /// render thread, in synchronize; takes in the layers as a journal replay left them
+    void adoptLayers(const QVector<LayerStack::State>& layers, quint32 current);
+
+    int historyBudget() const;
+    void setHistoryBudget(int budget);
+    Q_SIGNAL void historyBudgetChanged();
+
+    QString brush() const;
+    void setBrush(const QString& name);
+    Q_SIGNAL void brushChanged();
+    QStringList brushes() const;
+    BrushPreset brushPreset() const;
+
+    Tool tool() const;
+    void setTool(Tool tool);
+    Q_SIGNAL void toolChanged();
+    qreal fillTolerance() const;
+    void setFillTolerance(qreal tolerance);
+    int fillGap() const;
+    void setFillGap(int gap);
+    Q_SIGNAL void fillChanged();
+
+    QSize documentSize() const;
+    void setDocumentSize(const QSize& size);
+    Q_SIGNAL void documentSizeChanged();
+    qreal zoom() const;
+    void setZoom(qreal zoom);
+    QPointF pan() const;
+    void setPan(const QPointF& pan);
+    Q_SIGNAL void viewportChanged();
+    /// zooms by factor around pos, in item pixels
+    Q_INVOKABLE void zoomAt(const QPointF& pos, qreal factor);
+    Viewport viewport() const;
+
+    Q_INVOKABLE void undo();
+    Q_INVOKABLE void redo();
+
 protected:
+    QSGNode* updatePaintNode(QSGNode* node, UpdatePaintNodeData* data) override;
     void mousePressEvent(QMouseEvent* event) override;
     void mouseMoveEvent(QMouseEvent* event) override;
     void mouseReleaseEvent(QMouseEvent* event) override;
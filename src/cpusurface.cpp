@@ -0,0 +1,1142 @@
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QVarLengthArray>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include "blur.h"
+#include "brushtips.h"
+#include "cpusurface.h"
+#include "dirtyregion.h"
+#include "tiledsurface.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BRUSHY_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr int TileSize = TiledSurface::TileSize;
+constexpr int TilePixels = TileSize * TileSize;
+
+/// what a flood fill knows about a pixel
+enum FillState : quint8 {
+    /// too far from the seed's colour
+    Blocked = 0,
+    /// close enough to be filled, if the fill gets there
+    Open = 1,
+    Filled = 2,
+    /// close enough, but so near something blocked that it might be a gap in an outline
+    Closed = 3,
+};
+
+quint32 pack(const QColor& color)
+{
+    const uchar bytes[4] = {
+        uchar(color.red()), uchar(color.green()), uchar(color.blue()), uchar(color.alpha()),
+    };
+    quint32 ret;
+    std::memcpy(&ret, bytes, sizeof(ret));
+    return ret;
+}
+
+/// glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) on every channel, alpha included
+inline quint32 blend(quint32 src, quint32 dst)
+{
+    const quint32 a = src >> 24;
+    quint32 ret = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        const quint32 s = (src >> shift) & 0xff;
+        const quint32 d = (dst >> shift) & 0xff;
+        // (x + 127) / 255 without the division
+        const quint32 t = s * a + d * (255 - a) + 128;
+        ret |= ((t + (t >> 8)) >> 8) << shift;
+    }
+    return ret;
+}
+
+// a span is one row of one dab inside one tile. dx is the distance from the
+// dab's centre to the first pixel's centre, dy2 the squared vertical one.
+using SolidSpan = void (*)(quint32* pixels, quint8* stroke, int count, float dx, float dy2, float r2, quint32 color);
+using StampSpan = void (*)(quint32* pixels, quint8* stroke, const quint32* source, int count, float dx, float dy2, float r2);
+/// out[i] = sum of weights[k] * taps[k][i]
+using ConvolveSpan = void (*)(const quint32* const* taps, const float* weights, int tapCount, quint32* out, int count);
+/// out[i] = Open where every channel of pixels[i] is within tolerance of seed's, Blocked elsewhere
+using ClassifySpan = void (*)(const quint32* pixels, int count, quint32 seed, quint32 tolerance, quint8* out);
+/// blends color over the pixels whose state is Filled
+using FillSpan = void (*)(quint32* pixels, const quint8* states, int count, quint32 color);
+
+/// how much of a pixel a hard dab covers, 0 to 255, at distance d from its centre; like the shaders
+inline quint32 hardCoverage(float d, float r)
+{
+    return quint32(qBound(0.0f, r - d + 0.5f, 1.0f) * 255.0f + 0.5f);
+}
+
+/// how much of a pixel a soft dab covers, 0 to 255, at distance d from its centre; like the shaders
+inline quint32 softCoverage(float d, float r, float hardness)
+{
+    const float rim = qBound(0.0f, r - d + 0.5f, 1.0f);
+    const float t = qBound(0.0f, (d / r - hardness) / (1.0f - hardness), 1.0f);
+    return quint32(qMin(rim, 1.0f - t * t * (3.0f - 2.0f * t)) * 255.0f + 0.5f);
+}
+
+/// scales the alpha of a packed pixel by coverage / 255
+inline quint32 withCoverage(quint32 color, quint32 coverage)
+{
+    const quint32 t = (color >> 24) * coverage + 128;
+    return (color & 0xffffff) | (((t + (t >> 8)) >> 8) << 24);
+}
+
+/// the squared distance within which a hard dab of squared radius r2 covers whole pixels
+inline float innerSquared(float r2)
+{
+    const float inner = qMax(std::sqrt(r2) - 0.5f, 0.0f);
+    return inner * inner;
+}
+
+// hard dabs cover whole pixels inside innerSquared(), which is all the SIMD
+// spans look at, and fade out over the pixel either side of the edge. the
+// rim is a thin ring, so it's left to this scalar pass over the span
+template<typename Paint>
+inline void hardRim(quint8* stroke, int count, float dx, float dy2, float r2, Paint paint)
+{
+    const float r = std::sqrt(r2);
+    const float inner2 = innerSquared(r2);
+    const float outer2 = (r + 0.5f) * (r + 0.5f);
+    for (int i = 0; i < count; i++, dx += 1.0f) {
+        const float d2 = dx * dx + dy2;
+        if (d2 < inner2 || d2 >= outer2)
+            continue;
+        const quint32 coverage = hardCoverage(std::sqrt(d2), r);
+        if (coverage <= stroke[i])
+            continue;
+        paint(i, coverage);
+        stroke[i] = quint8(coverage);
+    }
+}
+
+void solidSpanScalar(quint32* pixels, quint8* stroke, int count, float dx, float dy2, float r2, quint32 color)
+{
+    const float inner2 = innerSquared(r2);
+    float x = dx;
+    for (int i = 0; i < count; i++, x += 1.0f) {
+        if (stroke[i] == 0xff || x * x + dy2 >= inner2)
+            continue;
+        pixels[i] = blend(color, pixels[i]);
+        stroke[i] = 0xff;
+    }
+    hardRim(stroke, count, dx, dy2, r2, [&](int i, quint32 coverage) {
+        pixels[i] = blend(withCoverage(color, coverage), pixels[i]);
+    });
+}
+
+void stampSpanScalar(quint32* pixels, quint8* stroke, const quint32* source, int count, float dx, float dy2, float r2)
+{
+    const float inner2 = innerSquared(r2);
+    float x = dx;
+    for (int i = 0; i < count; i++, x += 1.0f) {
+        if (stroke[i] == 0xff || x * x + dy2 >= inner2)
+            continue;
+        pixels[i] = blend(source[i], pixels[i]);
+        stroke[i] = 0xff;
+    }
+    hardRim(stroke, count, dx, dy2, r2, [&](int i, quint32 coverage) {
+        pixels[i] = blend(withCoverage(source[i], coverage), pixels[i]);
+    });
+}
+
+// soft dabs keep the most coverage the stroke has given each pixel in its
+// stroke flag, and only blend where a dab covers more, like the GL path's
+// stroke buffer. there's no SIMD version; hard brushes are the common case.
+void softSolidSpan(quint32* pixels, quint8* stroke, int count, float dx, float dy2, float r2, float hardness, quint32 color)
+{
+    const float r = std::sqrt(r2);
+    for (int i = 0; i < count; i++, dx += 1.0f) {
+        const quint32 coverage = softCoverage(std::sqrt(dx * dx + dy2), r, hardness);
+        if (coverage <= stroke[i])
+            continue;
+        pixels[i] = blend(withCoverage(color, coverage), pixels[i]);
+        stroke[i] = quint8(coverage);
+    }
+}
+
+// tipped dabs are scalar too: the turn and the trilinear lookup don't vectorise well
+void tipSpan(quint32* pixels, quint8* stroke, int count, float dx, float dy, const CpuSurface::Dab& dab, float hardness, quint32 color)
+{
+    const BrushTip& tip = BrushTip::all()[dab.tip];
+    const float r = dab.radius;
+    const float c = std::cos(dab.angle);
+    const float s = std::sin(dab.angle);
+    for (int i = 0; i < count; i++, dx += 1.0f) {
+        const float d = std::sqrt(dx * dx + dy * dy);
+        const quint32 disc = hardness < 1.0f ? softCoverage(d, r, hardness) : hardCoverage(d, r);
+        if (disc <= stroke[i])
+            continue;
+        // the same turn as the dab shader's tipCoord
+        const float u = (c * dx + s * dy) / r * 0.5f + 0.5f;
+        const float v = (c * dy - s * dx) / r * 0.5f + 0.5f;
+        const quint32 coverage = quint32(disc * tip.sample(u, v, 2.0f * r) + 0.5f);
+        if (coverage <= stroke[i])
+            continue;
+        pixels[i] = blend(withCoverage(color, coverage), pixels[i]);
+        stroke[i] = quint8(coverage);
+    }
+}
+
+void softStampSpan(quint32* pixels, quint8* stroke, const quint32* source, int count, float dx, float dy2, float r2, float hardness)
+{
+    const float r = std::sqrt(r2);
+    for (int i = 0; i < count; i++, dx += 1.0f) {
+        const quint32 coverage = softCoverage(std::sqrt(dx * dx + dy2), r, hardness);
+        if (coverage <= stroke[i])
+            continue;
+        pixels[i] = blend(withCoverage(source[i], coverage), pixels[i]);
+        stroke[i] = quint8(coverage);
+    }
+}
+
+void convolveSpanScalar(const quint32* const* taps, const float* weights, int tapCount, quint32* out, int count)
+{
+    for (int i = 0; i < count; i++) {
+        float sum[4] = {0, 0, 0, 0};
+        for (int k = 0; k < tapCount; k++) {
+            const quint32 px = taps[k][i];
+            for (int c = 0; c < 4; c++) {
+                sum[c] += weights[k] * float((px >> (c * 8)) & 0xff);
+            }
+        }
+        quint32 ret = 0;
+        for (int c = 0; c < 4; c++) {
+            ret |= quint32(qBound(0, qRound(sum[c]), 255)) << (c * 8);
+        }
+        out[i] = ret;
+    }
+}
+
+void classifySpanScalar(const quint32* pixels, int count, quint32 seed, quint32 tolerance, quint8* out)
+{
+    for (int i = 0; i < count; i++) {
+        bool near = true;
+        for (int shift = 0; shift < 32; shift += 8) {
+            const int d = int((pixels[i] >> shift) & 0xff) - int((seed >> shift) & 0xff);
+            near = near && quint32(qAbs(d)) <= tolerance;
+        }
+        out[i] = near ? Open : Blocked;
+    }
+}
+
+void fillSpanScalar(quint32* pixels, const quint8* states, int count, quint32 color)
+{
+    for (int i = 0; i < count; i++) {
+        if (states[i] == Filled)
+            pixels[i] = blend(color, pixels[i]);
+    }
+}
+
+#ifdef BRUSHY_X86_SIMD
+
+/// marks the painted lanes as fully covered
+inline void markStroke(quint8* stroke, int bits)
+{
+    while (bits != 0) {
+        stroke[__builtin_ctz(bits)] = 0xff;
+        bits &= bits - 1;
+    }
+}
+
+__attribute__((target("sse2")))
+inline __m128i freshSse2(const quint8* stroke, __m128 dx, __m128 dy2, __m128 inner2)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), dy2);
+    const __m128i inside = _mm_castps_si128(_mm_cmplt_ps(d2, inner2));
+
+    quint32 flags;
+    std::memcpy(&flags, stroke, sizeof(flags));
+    __m128i painted = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(flags)), zero), zero);
+    painted = _mm_cmpeq_epi32(painted, _mm_set1_epi32(0xff));
+    return _mm_andnot_si128(painted, inside);
+}
+
+__attribute__((target("sse2")))
+void solidSpanSse2(quint32* pixels, quint8* stroke, int count, float dx, float dy2, float r2, quint32 color)
+{
+    const __m128 dy2v = _mm_set1_ps(dy2);
+    const __m128 inner2v = _mm_set1_ps(innerSquared(r2));
+    const __m128 step = _mm_set1_ps(4.0f);
+    const __m128i colorv = _mm_set1_epi32(int(color));
+    const bool opaque = (color >> 24) == 0xff;
+    __m128 dxv = _mm_setr_ps(dx, dx + 1.0f, dx + 2.0f, dx + 3.0f);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4, dxv = _mm_add_ps(dxv, step)) {
+        const __m128i fresh = freshSse2(stroke + i, dxv, dy2v, inner2v);
+        const int bits = _mm_movemask_ps(_mm_castsi128_ps(fresh));
+        if (bits == 0)
+            continue;
+
+        if (opaque) {
+            auto at = reinterpret_cast<__m128i*>(pixels + i);
+            const __m128i dst = _mm_loadu_si128(at);
+            _mm_storeu_si128(at, _mm_or_si128(_mm_and_si128(fresh, colorv), _mm_andnot_si128(fresh, dst)));
+        } else {
+            for (int b = bits; b != 0; b &= b - 1) {
+                auto& px = pixels[i + __builtin_ctz(b)];
+                px = blend(color, px);
+            }
+        }
+        markStroke(stroke + i, bits);
+    }
+    hardRim(stroke, i, dx, dy2, r2, [&](int at, quint32 coverage) {
+        pixels[at] = blend(withCoverage(color, coverage), pixels[at]);
+    });
+    solidSpanScalar(pixels + i, stroke + i, count - i, dx + i, dy2, r2, color);
+}
+
+__attribute__((target("sse2")))
+void stampSpanSse2(quint32* pixels, quint8* stroke, const quint32* source, int count, float dx, float dy2, float r2)
+{
+    const __m128 dy2v = _mm_set1_ps(dy2);
+    const __m128 inner2v = _mm_set1_ps(innerSquared(r2));
+    const __m128 step = _mm_set1_ps(4.0f);
+    __m128 dxv = _mm_setr_ps(dx, dx + 1.0f, dx + 2.0f, dx + 3.0f);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4, dxv = _mm_add_ps(dxv, step)) {
+        const int bits = _mm_movemask_ps(_mm_castsi128_ps(freshSse2(stroke + i, dxv, dy2v, inner2v)));
+        for (int b = bits; b != 0; b &= b - 1) {
+            const int at = i + __builtin_ctz(b);
+            pixels[at] = blend(source[at], pixels[at]);
+        }
+        markStroke(stroke + i, bits);
+    }
+    hardRim(stroke, i, dx, dy2, r2, [&](int at, quint32 coverage) {
+        pixels[at] = blend(withCoverage(source[at], coverage), pixels[at]);
+    });
+    stampSpanScalar(pixels + i, stroke + i, source + i, count - i, dx + i, dy2, r2);
+}
+
+__attribute__((target("sse2")))
+void convolveSpanSse2(const quint32* const* taps, const float* weights, int tapCount, quint32* out, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < count; i++) {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < tapCount; k++) {
+            const __m128i px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(taps[k][i])), zero), zero);
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_cvtepi32_ps(px)));
+        }
+        const __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(sum), zero);
+        out[i] = quint32(_mm_cvtsi128_si32(_mm_packus_epi16(words, zero)));
+    }
+}
+
+/// all ones in the lanes whose channels are all within tolerance of seed's
+__attribute__((target("sse2")))
+inline __m128i nearSse2(__m128i pixels, __m128i seed, __m128i tolerance)
+{
+    // saturating both ways gives |pixels - seed| per channel
+    const __m128i diff = _mm_or_si128(_mm_subs_epu8(pixels, seed), _mm_subs_epu8(seed, pixels));
+    return _mm_cmpeq_epi32(_mm_subs_epu8(diff, tolerance), _mm_setzero_si128());
+}
+
+__attribute__((target("sse2")))
+void classifySpanSse2(const quint32* pixels, int count, quint32 seed, quint32 tolerance, quint8* out)
+{
+    const __m128i seedv = _mm_set1_epi32(int(seed));
+    const __m128i tolerancev = _mm_set1_epi8(char(tolerance));
+    const __m128i open = _mm_set1_epi8(Open);
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const auto at = reinterpret_cast<const __m128i*>(pixels + i);
+        const __m128i a = nearSse2(_mm_loadu_si128(at + 0), seedv, tolerancev);
+        const __m128i b = nearSse2(_mm_loadu_si128(at + 1), seedv, tolerancev);
+        const __m128i c = nearSse2(_mm_loadu_si128(at + 2), seedv, tolerancev);
+        const __m128i d = nearSse2(_mm_loadu_si128(at + 3), seedv, tolerancev);
+        // saturating packs keep all ones all ones, down to a byte per pixel
+        const __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_and_si128(bytes, open));
+    }
+    classifySpanScalar(pixels + i, count - i, seed, tolerance, out + i);
+}
+
+__attribute__((target("sse2")))
+void fillSpanSse2(quint32* pixels, const quint8* states, int count, quint32 color)
+{
+    if ((color >> 24) != 0xff) {
+        fillSpanScalar(pixels, states, count, color);
+        return;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i filled = _mm_set1_epi32(Filled);
+    const __m128i colorv = _mm_set1_epi32(int(color));
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        quint32 four;
+        std::memcpy(&four, states + i, sizeof(four));
+        const __m128i lanes = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(four)), zero), zero);
+        const __m128i mask = _mm_cmpeq_epi32(lanes, filled);
+        auto at = reinterpret_cast<__m128i*>(pixels + i);
+        const __m128i dst = _mm_loadu_si128(at);
+        _mm_storeu_si128(at, _mm_or_si128(_mm_and_si128(mask, colorv), _mm_andnot_si128(mask, dst)));
+    }
+    fillSpanScalar(pixels + i, states + i, count - i, color);
+}
+
+__attribute__((target("avx2")))
+inline __m256i freshAvx2(const quint8* stroke, __m256 dx, __m256 dy2, __m256 inner2)
+{
+    const __m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), dy2);
+    const __m256i inside = _mm256_castps_si256(_mm256_cmp_ps(d2, inner2, _CMP_LT_OQ));
+    const __m256i flags = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(stroke)));
+    return _mm256_andnot_si256(_mm256_cmpeq_epi32(flags, _mm256_set1_epi32(0xff)), inside);
+}
+
+__attribute__((target("avx2")))
+void solidSpanAvx2(quint32* pixels, quint8* stroke, int count, float dx, float dy2, float r2, quint32 color)
+{
+    const __m256 dy2v = _mm256_set1_ps(dy2);
+    const __m256 inner2v = _mm256_set1_ps(innerSquared(r2));
+    const __m256 step = _mm256_set1_ps(8.0f);
+    const __m256i colorv = _mm256_set1_epi32(int(color));
+    const bool opaque = (color >> 24) == 0xff;
+    __m256 dxv = _mm256_add_ps(_mm256_set1_ps(dx), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8, dxv = _mm256_add_ps(dxv, step)) {
+        const __m256i fresh = freshAvx2(stroke + i, dxv, dy2v, inner2v);
+        const int bits = _mm256_movemask_ps(_mm256_castsi256_ps(fresh));
+        if (bits == 0)
+            continue;
+
+        if (opaque) {
+            auto at = reinterpret_cast<__m256i*>(pixels + i);
+            _mm256_storeu_si256(at, _mm256_blendv_epi8(_mm256_loadu_si256(at), colorv, fresh));
+        } else {
+            for (int b = bits; b != 0; b &= b - 1) {
+                auto& px = pixels[i + __builtin_ctz(b)];
+                px = blend(color, px);
+            }
+        }
+        markStroke(stroke + i, bits);
+    }
+    hardRim(stroke, i, dx, dy2, r2, [&](int at, quint32 coverage) {
+        pixels[at] = blend(withCoverage(color, coverage), pixels[at]);
+    });
+    solidSpanScalar(pixels + i, stroke + i, count - i, dx + i, dy2, r2, color);
+}
+
+__attribute__((target("avx2")))
+void stampSpanAvx2(quint32* pixels, quint8* stroke, const quint32* source, int count, float dx, float dy2, float r2)
+{
+    const __m256 dy2v = _mm256_set1_ps(dy2);
+    const __m256 inner2v = _mm256_set1_ps(innerSquared(r2));
+    const __m256 step = _mm256_set1_ps(8.0f);
+    __m256 dxv = _mm256_add_ps(_mm256_set1_ps(dx), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8, dxv = _mm256_add_ps(dxv, step)) {
+        const int bits = _mm256_movemask_ps(_mm256_castsi256_ps(freshAvx2(stroke + i, dxv, dy2v, inner2v)));
+        for (int b = bits; b != 0; b &= b - 1) {
+            const int at = i + __builtin_ctz(b);
+            pixels[at] = blend(source[at], pixels[at]);
+        }
+        markStroke(stroke + i, bits);
+    }
+    hardRim(stroke, i, dx, dy2, r2, [&](int at, quint32 coverage) {
+        pixels[at] = blend(withCoverage(source[at], coverage), pixels[at]);
+    });
+    stampSpanScalar(pixels + i, stroke + i, source + i, count - i, dx + i, dy2, r2);
+}
+
+__attribute__((target("avx2")))
+void convolveSpanAvx2(const quint32* const* taps, const float* weights, int tapCount, quint32* out, int count)
+{
+    // two pixels, eight channels, per iteration
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < tapCount; k++) {
+            const __m128i px = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(taps[k] + i));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(px))));
+        }
+        const __m256i ints = _mm256_cvtps_epi32(sum);
+        const __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(words, words));
+    }
+    if (i < count) {
+        QVarLengthArray<const quint32*, 2 * BlurEngine::KernelRadius + 1> rest(tapCount);
+        for (int k = 0; k < tapCount; k++) {
+            rest[k] = taps[k] + i;
+        }
+        convolveSpanSse2(rest.constData(), weights, tapCount, out + i, count - i);
+    }
+}
+
+__attribute__((target("avx2")))
+void classifySpanAvx2(const quint32* pixels, int count, quint32 seed, quint32 tolerance, quint8* out)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i seedv = _mm256_set1_epi32(int(seed));
+    const __m256i tolerancev = _mm256_set1_epi8(char(tolerance));
+    const __m256i open = _mm256_set1_epi8(Open);
+    // the packs work within 128-bit lanes, which leaves groups of four pixels in this order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i near[4];
+        for (int k = 0; k < 4; k++) {
+            const __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i + 8 * k));
+            const __m256i diff = _mm256_or_si256(_mm256_subs_epu8(px, seedv), _mm256_subs_epu8(seedv, px));
+            near[k] = _mm256_cmpeq_epi32(_mm256_subs_epu8(diff, tolerancev), zero);
+        }
+        const __m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(near[0], near[1]), _mm256_packs_epi32(near[2], near[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_and_si256(_mm256_permutevar8x32_epi32(bytes, order), open));
+    }
+    classifySpanSse2(pixels + i, count - i, seed, tolerance, out + i);
+}
+
+__attribute__((target("avx2")))
+void fillSpanAvx2(quint32* pixels, const quint8* states, int count, quint32 color)
+{
+    if ((color >> 24) != 0xff) {
+        fillSpanScalar(pixels, states, count, color);
+        return;
+    }
+
+    const __m256i filled = _mm256_set1_epi32(Filled);
+    const __m256i colorv = _mm256_set1_epi32(int(color));
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(states + i)));
+        auto at = reinterpret_cast<__m256i*>(pixels + i);
+        _mm256_storeu_si256(at, _mm256_blendv_epi8(_mm256_loadu_si256(at), colorv, _mm256_cmpeq_epi32(lanes, filled)));
+    }
+    fillSpanSse2(pixels + i, states + i, count - i, color);
+}
+
+#endif
+
+struct Kernels {
+    SolidSpan solid = solidSpanScalar;
+    StampSpan stamp = stampSpanScalar;
+    ConvolveSpan convolve = convolveSpanScalar;
+    ClassifySpan classify = classifySpanScalar;
+    FillSpan fill = fillSpanScalar;
+};
+
+const Kernels& kernels()
+{
+    static const Kernels ret = [] {
+        Kernels it;
+#ifdef BRUSHY_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            it.solid = solidSpanAvx2;
+            it.stamp = stampSpanAvx2;
+            it.convolve = convolveSpanAvx2;
+            it.classify = classifySpanAvx2;
+            it.fill = fillSpanAvx2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            it.solid = solidSpanSse2;
+            it.stamp = stampSpanSse2;
+            it.convolve = convolveSpanSse2;
+            it.classify = classifySpanSse2;
+            it.fill = fillSpanSse2;
+        }
+#endif
+        return it;
+    }();
+    return ret;
+}
+
+/// runs fn(0) .. fn(count - 1) across the global pool and the calling thread
+template<typename Fn>
+void parallelFor(int count, const Fn& fn)
+{
+    std::atomic<int> next(0);
+    const auto work = [&] {
+        for (int i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+            fn(i);
+    };
+
+    // only idle pool threads are asked to help, so exports encoding on the
+    // pool can't hold up a frame; the calling thread does whatever's left
+    QSemaphore done;
+    int helpers = 0;
+    for (int i = 1; i < count; i++) {
+        if (!QThreadPool::globalInstance()->tryStart([&] { work(); done.release(); }))
+            break;
+        helpers++;
+    }
+    work();
+    done.acquire(helpers);
+}
+
+constexpr quint64 EightOpen = 0x0101010101010101ull;
+
+inline quint64 eight(const quint8* states)
+{
+    quint64 ret;
+    std::memcpy(&ret, states, sizeof(ret));
+    return ret;
+}
+
+/// where the run of Open pixels through x starts
+inline int openFrom(const quint8* line, int x)
+{
+    while (x >= 8 && eight(line + x - 8) == EightOpen)
+        x -= 8;
+    while (x > 0 && line[x - 1] == Open)
+        x--;
+    return x;
+}
+
+/// where the run of Open pixels through x ends, inclusive
+inline int openTo(const quint8* line, int x, int width)
+{
+    x++;
+    while (x + 8 <= width && eight(line + x) == EightOpen)
+        x += 8;
+    while (x < width && line[x] == Open)
+        x++;
+    return x - 1;
+}
+
+/// out[i] = 1 where a pixel in state lies within reach of i, 0 elsewhere
+void reachSpan(const quint8* line, quint8 state, int count, int reach, quint8* out)
+{
+    int last = -reach - 1;
+    for (int i = 0; i < count; i++) {
+        if (line[i] == state)
+            last = i;
+        out[i] = i - last <= reach;
+    }
+    int next = count + reach;
+    for (int i = count - 1; i >= 0; i--) {
+        if (line[i] == state)
+            next = i;
+        out[i] |= next - i <= reach;
+    }
+}
+
+/// turns the pixels in state into that are within reach of one in state from,
+/// in a square around them, into state to. scratch is as large as states
+void spread(quint8* states, quint8* scratch, const QSize& size, quint8 from, quint8 into, quint8 to, int reach)
+{
+    const int width = size.width();
+    const int height = size.height();
+    parallelFor(height, [&](int y) {
+        reachSpan(states + qint64(y) * width, from, width, reach, scratch + qint64(y) * width);
+    });
+    // separable: what's near horizontally, then what's near that vertically
+    parallelFor(height, [&](int y) {
+        // the flags are 0 or 1, so eight of them or together in a word
+        QVarLengthArray<quint64, 512> near((width + 7) / 8);
+        std::memset(near.data(), 0, near.size() * sizeof(quint64));
+        for (int other = qMax(0, y - reach); other <= qMin(height - 1, y + reach); other++) {
+            const quint8* row = scratch + qint64(other) * width;
+            int x = 0;
+            for (; x + 8 <= width; x += 8)
+                near[x / 8] |= eight(row + x);
+            for (; x < width; x++)
+                reinterpret_cast<quint8*>(near.data())[x] |= row[x];
+        }
+        quint8* line = states + qint64(y) * width;
+        const auto flags = reinterpret_cast<const quint8*>(near.constData());
+        for (int x = 0; x < width; x++) {
+            if (flags[x] && line[x] == into)
+                line[x] = to;
+        }
+    });
+}
+
+}
+
+CpuSurface::Backend CpuSurface::preferred()
+{
+    const QByteArray forced = qgetenv("BRUSHY_RASTER");
+    if (forced == "cpu")
+        return Cpu;
+    if (forced == "gl")
+        return Gl;
+
+    auto context = QOpenGLContext::currentContext();
+    if (context == nullptr)
+        return Gl;
+    const QByteArray renderer = reinterpret_cast<const char*>(context->functions()->glGetString(GL_RENDERER));
+    for (const char* software : {"llvmpipe", "softpipe", "SwiftShader", "Software Rasterizer"}) {
+        if (renderer.contains(software))
+            return Cpu;
+    }
+    return Gl;
+}
+
+CpuSurface::CpuSurface(const QColor& blank) : m_blank(pack(blank))
+{
+}
+
+CpuSurface::~CpuSurface()
+{
+    clear();
+}
+
+CpuSurface::Tile* CpuSurface::tile(const QPoint& tile) const
+{
+    return m_tiles.value(TiledSurface::key(tile), nullptr);
+}
+
+CpuSurface::Tile* CpuSurface::ensureTile(const QPoint& coord)
+{
+    if (auto it = tile(coord))
+        return it;
+
+    auto ret = new Tile;
+    ret->pixels.fill(m_blank, TilePixels);
+    ret->stroke.fill(0, TilePixels);
+    m_tiles.insert(TiledSurface::key(coord), ret);
+    return ret;
+}
+
+void CpuSurface::dropTile(const QPoint& coord)
+{
+    delete m_tiles.take(TiledSurface::key(coord));
+}
+
+void CpuSurface::clear()
+{
+    qDeleteAll(m_tiles);
+    m_tiles.clear();
+    m_strokeTiles.clear();
+}
+
+void CpuSurface::endStroke()
+{
+    for (auto key : qAsConst(m_strokeTiles)) {
+        if (auto it = m_tiles.value(key, nullptr))
+            it->stroke.fill(0);
+    }
+    m_strokeTiles.clear();
+}
+
+template<typename Paint>
+QVector<QPoint> CpuSurface::paint(const QVector<Dab>& dabs, const Paint& fn)
+{
+    // bin the dabs by tile, keeping stroke order within each
+    QVector<quint64> keys;
+    QHash<quint64, QVector<int>> bins;
+    const QRect surface(QPoint(0, 0), m_size);
+    for (int i = 0; i < dabs.size(); i++) {
+        const QRect bounds = DirtyRegion::dabBounds(QPointF(dabs[i].x, dabs[i].y), dabs[i].radius) & surface;
+        if (bounds.isEmpty())
+            continue;
+        const QPoint from = TiledSurface::tileAt(bounds.topLeft());
+        const QPoint to = TiledSurface::tileAt(bounds.bottomRight());
+        for (int y = from.y(); y <= to.y(); y++) {
+            for (int x = from.x(); x <= to.x(); x++) {
+                const quint64 key = TiledSurface::key(QPoint(x, y));
+                auto& bin = bins[key];
+                if (bin.isEmpty())
+                    keys << key;
+                bin << i;
+            }
+        }
+    }
+
+    // the hash isn't touched from the workers, so every tile exists up front
+    QVector<Tile*> tiles;
+    tiles.reserve(keys.size());
+    for (auto key : qAsConst(keys)) {
+        tiles << ensureTile(TiledSurface::fromKey(key));
+        m_strokeTiles << key;
+    }
+
+    parallelFor(keys.size(), [&](int index) {
+        const QPoint origin = TiledSurface::tileRect(TiledSurface::fromKey(keys[index])).topLeft();
+        Tile* tile = tiles[index];
+        for (int i : bins.value(keys[index])) {
+            const Dab& dab = dabs[i];
+            const QRect rect = (DirtyRegion::dabBounds(QPointF(dab.x, dab.y), dab.radius) & surface)
+                .translated(-origin) & QRect(0, 0, TileSize, TileSize);
+            const float r2 = dab.radius * dab.radius;
+            for (int y = rect.top(); y <= rect.bottom(); y++) {
+                // measured between pixel centres, like the fragments of the GL path
+                const float dy = origin.y() + y + 0.5f - dab.y;
+                const float dx = origin.x() + rect.left() + 0.5f - dab.x;
+                const int at = y * TileSize + rect.left();
+                fn(dab, tile->pixels.data() + at, tile->stroke.data() + at, QPoint(origin.x() + rect.left(), origin.y() + y), rect.width(), dx, dy * dy, r2);
+            }
+        }
+    });
+
+    QVector<QPoint> ret;
+    ret.reserve(keys.size());
+    for (auto key : qAsConst(keys)) {
+        ret << TiledSurface::fromKey(key);
+    }
+    return ret;
+}
+
+QVector<QPoint> CpuSurface::drawDabs(const QVector<Dab>& dabs, const QColor& color, qreal hardness)
+{
+    const quint32 packed = pack(color);
+    if (hardness < 1.0) {
+        return paint(dabs, [&](const Dab&, quint32* pixels, quint8* stroke, const QPoint&, int count, float dx, float dy2, float r2) {
+            softSolidSpan(pixels, stroke, count, dx, dy2, r2, float(hardness), packed);
+        });
+    }
+    const SolidSpan span = kernels().solid;
+    return paint(dabs, [&](const Dab&, quint32* pixels, quint8* stroke, const QPoint&, int count, float dx, float dy2, float r2) {
+        span(pixels, stroke, count, dx, dy2, r2, packed);
+    });
+}
+
+QVector<QPoint> CpuSurface::drawTips(const QVector<Dab>& dabs, const QColor& color, qreal hardness)
+{
+    const quint32 packed = pack(color);
+    return paint(dabs, [&](const Dab& dab, quint32* pixels, quint8* stroke, const QPoint& pos, int count, float dx, float, float) {
+        tipSpan(pixels, stroke, count, dx, pos.y() + 0.5f - dab.y, dab, float(hardness), packed);
+    });
+}
+
+QVector<QPoint> CpuSurface::stampDabs(const QVector<Dab>& dabs, const Image& source, qreal hardness)
+{
+    const StampSpan hard = kernels().stamp;
+    const auto span = [&](quint32* pixels, quint8* stroke, const quint32* from, int count, float dx, float dy2, float r2) {
+        if (hardness < 1.0)
+            softStampSpan(pixels, stroke, from, count, dx, dy2, r2, float(hardness));
+        else
+            hard(pixels, stroke, from, count, dx, dy2, r2);
+    };
+    return paint(dabs, [&](const Dab&, quint32* pixels, quint8* stroke, const QPoint& pos, int count, float dx, float dy2, float r2) {
+        // the caller promises source covers every dab, but a dab's bounds reach past its disc
+        const int from = qMax(pos.x(), source.rect.left());
+        const int to = qMin(pos.x() + count - 1, source.rect.right());
+        if (pos.y() < source.rect.top() || pos.y() > source.rect.bottom() || from > to)
+            return;
+        const int skip = from - pos.x();
+        span(pixels + skip, stroke + skip, source.scanLine(pos.y()) + (from - source.rect.x()), to - from + 1, dx + skip, dy2, r2);
+    });
+}
+
+QVector<QPoint> CpuSurface::fill(const QPoint& seed, const QColor& color, const Fill& settings)
+{
+    QVector<QPoint> ret;
+    if (!QRect(QPoint(0, 0), m_size).contains(seed))
+        return ret;
+
+    const int width = m_size.width();
+    const int height = m_size.height();
+    const int columns = (width + TileSize - 1) / TileSize;
+    const int rows = (height + TileSize - 1) / TileSize;
+
+    // the hash isn't touched from the workers
+    QVector<const Tile*> grid(columns * rows);
+    for (int ty = 0; ty < rows; ty++) {
+        for (int tx = 0; tx < columns; tx++) {
+            grid[ty * columns + tx] = tile(QPoint(tx, ty));
+        }
+    }
+    const QPoint seedTile = TiledSurface::tileAt(seed);
+    const Tile* seedPixels = grid[seedTile.y() * columns + seedTile.x()];
+    const quint32 target = seedPixels == nullptr ? m_blank
+        : seedPixels->pixels[(seed.y() - seedTile.y() * TileSize) * TileSize + seed.x() - seedTile.x() * TileSize];
+    const quint32 tolerance = quint32(qBound(0.0, settings.tolerance, 1.0) * 255.0 + 0.5);
+
+    // a state per pixel, a row after another
+    std::unique_ptr<quint8[]> states(new quint8[qint64(width) * height]);
+    const auto line = [&](int y) { return states.get() + qint64(y) * width; };
+
+    const ClassifySpan classify = kernels().classify;
+    quint8 blank;
+    classifySpanScalar(&m_blank, 1, target, tolerance, &blank);
+    parallelFor(height, [&](int y) {
+        const int ty = y / TileSize;
+        for (int tx = 0; tx < columns; tx++) {
+            const int x = tx * TileSize;
+            const int count = qMin(TileSize, width - x);
+            const Tile* it = grid[ty * columns + tx];
+            if (it == nullptr)
+                std::memset(line(y) + x, blank, count);
+            else
+                classify(it->pixels.constData() + (y - ty * TileSize) * TileSize, count, target, tolerance, line(y) + x);
+        }
+    });
+
+    // gaps are closed by keeping the fill away from outlines, and the fill
+    // grows back to the outlines afterwards. if the seed itself is that close
+    // to one, there's no telling a gap from the area the seed is in.
+    int gap = qMax(0, settings.gap);
+    std::unique_ptr<quint8[]> scratch;
+    if (gap > 0) {
+        scratch.reset(new quint8[qint64(width) * height]);
+        spread(states.get(), scratch.get(), m_size, Blocked, Open, Closed, gap);
+        if (line(seed.y())[seed.x()] == Closed) {
+            parallelFor(height, [&](int y) {
+                quint8* it = line(y);
+                for (int x = 0; x < width; x++) {
+                    if (it[x] == Closed)
+                        it[x] = Open;
+                }
+            });
+            gap = 0;
+        }
+    }
+
+    // a scanline fill per row of tiles, each only writing its own rows. spans
+    // that reach into a neighbouring row of tiles are handed over between
+    // rounds, until a round hands over nothing
+    struct Span {
+        int y, from, to;
+    };
+    struct Band {
+        QVector<Span> inbox;
+        QVector<Span> above;
+        QVector<Span> below;
+    };
+    QVector<Band> bands(rows);
+    bands[seedTile.y()].inbox << Span{seed.y(), seed.x(), seed.x()};
+    QVector<int> busy;
+    for (;;) {
+        busy.clear();
+        for (int i = 0; i < rows; i++) {
+            if (!bands[i].inbox.isEmpty())
+                busy << i;
+        }
+        if (busy.isEmpty())
+            break;
+
+        parallelFor(busy.size(), [&](int index) {
+            const int band = busy[index];
+            const int top = band * TileSize;
+            const int bottom = qMin(height, top + TileSize) - 1;
+            Band& it = bands[band];
+            QVector<Span> stack;
+            std::swap(stack, it.inbox);
+            while (!stack.isEmpty()) {
+                const Span span = stack.takeLast();
+                quint8* row = line(span.y);
+                for (int x = span.from; x <= span.to;) {
+                    auto found = static_cast<quint8*>(std::memchr(row + x, Open, span.to - x + 1));
+                    if (found == nullptr)
+                        break;
+                    const int from = openFrom(row, int(found - row));
+                    const int to = openTo(row, int(found - row), width);
+                    std::memset(row + from, Filled, to - from + 1);
+                    for (int y : {span.y - 1, span.y + 1}) {
+                        if (y < 0 || y >= height)
+                            continue;
+                        const Span next{y, from, to};
+                        if (y < top)
+                            it.above << next;
+                        else if (y > bottom)
+                            it.below << next;
+                        else
+                            stack << next;
+                    }
+                    // to + 1 isn't open, or the run would have gone on
+                    x = to + 2;
+                }
+            }
+        });
+
+        for (int band : qAsConst(busy)) {
+            if (band > 0)
+                bands[band - 1].inbox << bands[band].above;
+            if (band + 1 < rows)
+                bands[band + 1].inbox << bands[band].below;
+            bands[band].above.clear();
+            bands[band].below.clear();
+        }
+    }
+
+    if (gap > 0)
+        spread(states.get(), scratch.get(), m_size, Filled, Closed, Filled, gap);
+    scratch.reset();
+
+    QVector<quint8> touched(columns * rows, 0);
+    parallelFor(columns * rows, [&](int index) {
+        const QRect rect = TiledSurface::tileRect(QPoint(index % columns, index / columns)) & QRect(QPoint(0, 0), m_size);
+        for (int y = rect.top(); y <= rect.bottom(); y++) {
+            if (std::memchr(line(y) + rect.left(), Filled, rect.width()) != nullptr) {
+                touched[index] = 1;
+                return;
+            }
+        }
+    });
+
+    QVector<Tile*> tiles;
+    for (int index = 0; index < touched.size(); index++) {
+        if (!touched[index])
+            continue;
+        ret << QPoint(index % columns, index / columns);
+        tiles << ensureTile(ret.last());
+    }
+
+    const quint32 packed = pack(color);
+    const FillSpan span = kernels().fill;
+    parallelFor(tiles.size(), [&](int index) {
+        const QRect rect = TiledSurface::tileRect(ret[index]) & QRect(QPoint(0, 0), m_size);
+        for (int y = rect.top(); y <= rect.bottom(); y++) {
+            span(tiles[index]->pixels.data() + (y - rect.top()) * TileSize, line(y) + rect.left(), rect.width(), packed);
+        }
+    });
+    return ret;
+}
+
+CpuSurface::Image CpuSurface::gaussian(const Image& source, const QRect& region, int radius)
+{
+    const int taps = 2 * radius + 1;
+    const QVector<float> coefficients = BlurEngine::coefficients(radius);
+    const float* weights = coefficients.constData();
+    const ConvolveSpan convolve = kernels().convolve;
+
+    Image ret;
+    ret.rect = region & source.rect;
+    if (ret.rect.isEmpty())
+        return ret;
+
+    // edges clamp like GL_CLAMP_TO_EDGE on the source texture
+    const auto clampX = [&](int x) { return qBound(source.rect.left(), x, source.rect.right()); };
+    const auto clampY = [&](int y) { return qBound(source.rect.top(), y, source.rect.bottom()); };
+
+    // the horizontal pass covers the rows the vertical pass reads, and rounds
+    // to 8 bits in between just like the GL path's rgba8 scratch texture
+    Image horizontal;
+    horizontal.rect = QRect(ret.rect.left(), clampY(ret.rect.top() - radius), ret.rect.width(), 0);
+    horizontal.rect.setBottom(clampY(ret.rect.bottom() + radius));
+    horizontal.pixels.resize(horizontal.rect.width() * horizontal.rect.height());
+
+    parallelFor(horizontal.rect.height(), [&](int row) {
+        const int y = horizontal.rect.top() + row;
+        QVarLengthArray<quint32, 1024> padded(ret.rect.width() + 2 * radius);
+        for (int i = 0; i < padded.size(); i++) {
+            padded[i] = source.scanLine(y)[clampX(ret.rect.left() - radius + i) - source.rect.left()];
+        }
+        QVarLengthArray<const quint32*, 2 * BlurEngine::KernelRadius + 1> tapPointers(taps);
+        for (int k = 0; k < taps; k++) {
+            tapPointers[k] = padded.constData() + k;
+        }
+        convolve(tapPointers.constData(), weights, taps, horizontal.pixels.data() + row * horizontal.rect.width(), ret.rect.width());
+    });
+
+    ret.pixels.resize(ret.rect.width() * ret.rect.height());
+    parallelFor(ret.rect.height(), [&](int row) {
+        const int y = ret.rect.top() + row;
+        QVarLengthArray<const quint32*, 2 * BlurEngine::KernelRadius + 1> tapPointers(taps);
+        for (int k = 0; k < taps; k++) {
+            const int from = qBound(horizontal.rect.top(), y - radius + k, horizontal.rect.bottom());
+            tapPointers[k] = horizontal.scanLine(from);
+        }
+        convolve(tapPointers.constData(), weights, taps, ret.pixels.data() + row * ret.rect.width(), ret.rect.width());
+    });
+
+    return ret;
+}
+
+void CpuSurface::upload(TiledSurface* target, const QVector<QPoint>& tiles) const
+{
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    for (const auto& coord : tiles) {
+        auto it = tile(coord);
+        if (it == nullptr)
+            continue;
+
+        // binding fires the write hook, so history still sees the tile before it changes
+        target->bind(coord);
+        fns.glBindTexture(GL_TEXTURE_2D, target->tile(coord)->fbo->texture());
+        fns.glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TileSize, TileSize, GL_RGBA, GL_UNSIGNED_BYTE, it->pixels.constData());
+    }
+    fns.glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void CpuSurface::download(TiledSurface* source, const DirtyRegion& region)
+{
+    QSet<quint64> keys;
+    for (const auto& rect : region.rects()) {
+        for (const auto& coord : source->tilesIn(rect)) {
+            keys << TiledSurface::key(coord);
+        }
+    }
+
+    QVector<QPoint> tiles;
+    tiles.reserve(keys.size());
+    for (auto key : qAsConst(keys)) {
+        tiles << TiledSurface::fromKey(key);
+    }
+    download(source, tiles);
+}
+
+void CpuSurface::download(TiledSurface* source, const QVector<QPoint>& tiles)
+{
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    for (const auto& coord : tiles) {
+        auto from = source->tile(coord);
+        if (from == nullptr) {
+            dropTile(coord);
+            continue;
+        }
+
+        auto to = ensureTile(coord);
+        from->fbo->bind();
+        fns.glReadPixels(0, 0, TileSize, TileSize, GL_RGBA, GL_UNSIGNED_BYTE, to->pixels.data());
+    }
+    QOpenGLFramebufferObject::bindDefault();
+}
+
+CpuSurface::Image CpuSurface::resampled(const Image& source, const QRect& rect, const QPointF& origin, qreal scale)
+{
+    Image ret;
+    ret.rect = rect;
+    if (rect.isEmpty() || source.rect.isEmpty())
+        return ret;
+    ret.pixels.resize(rect.width() * rect.height());
+
+    // pixel centres map onto pixel centres
+    QVarLengthArray<int, 1024> columns(rect.width());
+    for (int i = 0; i < columns.size(); i++) {
+        const int x = int(std::floor((rect.left() + i + 0.5 - origin.x()) * scale));
+        columns[i] = qBound(source.rect.left(), x, source.rect.right()) - source.rect.left();
+    }
+    parallelFor(rect.height(), [&](int row) {
+        const int y = int(std::floor((rect.top() + row + 0.5 - origin.y()) * scale));
+        const quint32* from = source.scanLine(qBound(source.rect.top(), y, source.rect.bottom()));
+        quint32* to = ret.pixels.data() + row * rect.width();
+        for (int i = 0; i < columns.size(); i++) {
+            to[i] = from[columns[i]];
+        }
+    });
+    return ret;
+}
+
+CpuSurface::Image CpuSurface::readTexture(GLuint texture, const QRect& rect)
+{
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    Image ret;
+    ret.rect = rect;
+    ret.pixels.resize(rect.width() * rect.height());
+
+    GLuint fbo = 0;
+    fns.glGenFramebuffers(1, &fbo);
+    fns.glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    fns.glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    fns.glReadPixels(rect.x(), rect.y(), rect.width(), rect.height(), GL_RGBA, GL_UNSIGNED_BYTE, ret.pixels.data());
+    QOpenGLFramebufferObject::bindDefault();
+    fns.glDeleteFramebuffers(1, &fbo);
+    return ret;
+}
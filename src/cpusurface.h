@@ -0,0 +1,118 @@
+#pragma once
+
+#include <QColor>
+#include <QHash>
+#include <QPointF>
+#include <QRect>
+#include <QSet>
+#include <QVector>
+#include <qopengl.h>
+
+class DirtyRegion;
+class TiledSurface;
+
+/// a software twin of TiledSurface for machines whose GL is a cpu rasterizer
+///
+/// dabs are rasterized here with SSE2 or AVX2, picked at runtime, and only
+/// the finished tiles are uploaded into the TiledSurface, so the rest of the
+/// pipeline (history, export, the view) doesn't know the difference. the
+/// per-pixel stroke flags stand in for the GL path's stroke buffer and keep
+/// a stroke from piling up on itself the same way. the SIMD spans only fill
+/// the inside of hard dabs; the pixels on their antialiased rim are done one
+/// by one. tiles are rendered in parallel on the global pool. pixels are rgba8 in memory order, bottom row first, like the GL tiles.
+///
+/// it's also the copy of a layer that bucket fills read and write, whichever
+/// backend paints the layer otherwise.
+class CpuSurface
+{
+public:
+    enum Backend {
+        Gl,
+        Cpu,
+    };
+    /// BRUSHY_RASTER=gl or cpu if set; otherwise cpu when the current context is software-rendered
+    static Backend preferred();
+
+    struct Tile {
+        QVector<quint32> pixels;
+        /// the most coverage the current stroke has painted a pixel with, 0 to 255
+        QVector<quint8> stroke;
+    };
+    struct Dab {
+        float x, y;
+        float radius;
+        /// radians; only tips are turned
+        float angle = 0.0f;
+        /// a BrushTip index, for drawTips()
+        int tip = -1;
+    };
+    /// what a flood fill covers
+    struct Fill {
+        /// how far each channel may be from the seed pixel's and still be filled, 0 to 1
+        qreal tolerance = 0.0;
+        /// gaps in an outline up to twice this wide, in pixels, don't let the fill through.
+        /// the fill still reaches into them, up to this far
+        int gap = 0;
+    };
+    /// a block of pixels cut out of a larger image
+    struct Image {
+        QVector<quint32> pixels;
+        QRect rect;
+
+        const quint32* scanLine(int y) const { return pixels.constData() + (y - rect.y()) * rect.width(); }
+    };
+
+    explicit CpuSurface(const QColor& blank);
+    ~CpuSurface();
+    Q_DISABLE_COPY(CpuSurface)
+
+    QSize size() const { return m_size; }
+    void setSize(const QSize& size) { m_size = size; }
+
+    Tile* tile(const QPoint& tile) const;
+    Tile* ensureTile(const QPoint& tile);
+    void dropTile(const QPoint& tile);
+    void clear();
+    /// forgets which pixels the current stroke has painted
+    void endStroke();
+
+    /// paints dabs in a solid colour, covering what the GL dab shader covers.
+    /// hardness below 1 fades the rim like a soft brush. returns the tiles that changed.
+    QVector<QPoint> drawDabs(const QVector<Dab>& dabs, const QColor& color, qreal hardness = 1.0);
+    /// paints dabs as their bitmap tips, turned and sampled like the GL dab shader samples
+    /// BrushTipAtlas, keeping the most coverage like soft dabs. returns the tiles that changed.
+    QVector<QPoint> drawTips(const QVector<Dab>& dabs, const QColor& color, qreal hardness = 1.0);
+    /// paints dabs with the pixels of source underneath them, blended like the GL stamp shader.
+    /// source must cover every dab. returns the tiles that changed.
+    QVector<QPoint> stampDabs(const QVector<Dab>& dabs, const Image& source, qreal hardness = 1.0);
+    /// paints color over the pixels connected to seed that look like it, blended like a dab.
+    /// a scanline fill that runs a row of tiles per pool thread. returns the tiles that changed.
+    QVector<QPoint> fill(const QPoint& seed, const QColor& color, const Fill& settings);
+
+    /// the same separable gaussian as BlurEngine over region of source. source should
+    /// reach radius past region wherever the surface does; beyond that it clamps.
+    static Image gaussian(const Image& source, const QRect& region, int radius);
+    /// rect of source as seen through a view: pixel p takes the nearest source pixel
+    /// to (p - origin) * scale. beyond source it clamps.
+    static Image resampled(const Image& source, const QRect& rect, const QPointF& origin, qreal scale);
+
+    /// copies the given tiles into target, going through its write hook
+    void upload(TiledSurface* target, const QVector<QPoint>& tiles) const;
+    /// replaces every tile region touches with source's, after something else changed them on the GPU
+    void download(TiledSurface* source, const DirtyRegion& region);
+    /// the same for the given tiles
+    void download(TiledSurface* source, const QVector<QPoint>& tiles);
+
+    /// reads rect of a GL texture back into memory. synchronous, which only
+    /// costs a copy when the GL implementation renders on the cpu anyway.
+    static Image readTexture(GLuint texture, const QRect& rect);
+
+private:
+    template<typename Paint>
+    QVector<QPoint> paint(const QVector<Dab>& dabs, const Paint& fn);
+
+    QSize m_size;
+    quint32 m_blank;
+    QHash<quint64, Tile*> m_tiles;
+    QSet<quint64> m_strokeTiles;
+};
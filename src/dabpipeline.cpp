@@ -0,0 +1,346 @@
+#include <QElapsedTimer>
+#include <QHash>
+#include <QQuickItem>
+#include <QtMath>
+#include <algorithm>
+#include <cmath>
+#include "dabpipeline.h"
+#include "dirtyregion.h"
+#include "tiledsurface.h"
+
+void DabPipeline::Frame::clear()
+{
+    ops.clear();
+    dabs.clear();
+    instances.clear();
+    bins.clear();
+    received.clear();
+}
+
+void DabPipeline::Frame::append(const Frame& other)
+{
+    // the other frame's indices move up past what's already here
+    for (Op op : other.ops) {
+        op.first += dabs.size();
+        op.firstBin += bins.size();
+        ops << op;
+    }
+    for (Bin bin : other.bins) {
+        bin.first += instances.size();
+        bins << bin;
+    }
+    dabs << other.dabs;
+    instances << other.instances;
+    received << other.received;
+}
+
+DabPipeline::DabPipeline(QQuickItem* item, InputChannel* input) : m_item(item), m_input(input)
+{
+    m_input->setConsumer([this] { wake(); });
+    m_worker = std::thread([this] { run(); });
+}
+
+DabPipeline::~DabPipeline()
+{
+    m_input->setConsumer(nullptr);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_taken.notify_one();
+    m_idle.notify_all();
+    m_worker.join();
+}
+
+void DabPipeline::setSurface(qreal scale, const QSize& size)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (scale == m_scale && size == m_size)
+            return;
+        m_scale = scale;
+        m_size = size;
+        // input may have come in before there was anywhere to put it
+        m_woken = true;
+    }
+    m_wake.notify_one();
+}
+
+void DabPipeline::setBrush(const BrushPreset& brush)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_nextBrush = brush;
+}
+
+void DabPipeline::replay(const QVector<InputMessage>& messages)
+{
+    if (messages.isEmpty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_replay << messages;
+    }
+    m_wake.notify_one();
+}
+
+void DabPipeline::take(Frame& frame)
+{
+    frame.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::swap(frame, m_pending);
+    }
+    m_updateRequested.store(false, std::memory_order_release);
+    m_taken.notify_one();
+}
+
+void DabPipeline::drain()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // nothing is generated before there's a surface
+    m_idle.wait(lock, [this] {
+        return m_stop || m_scale <= 0.0 || m_held || (!m_busy && !m_woken && m_replay.isEmpty());
+    });
+}
+
+bool DabPipeline::isSettled()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // the worker only touches the stroke while it's busy
+    return m_scale > 0.0 && !m_busy && !m_woken && !m_held && m_replay.isEmpty() && !m_stroke.isActive();
+}
+
+void DabPipeline::wake()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_woken = true;
+    }
+    m_wake.notify_one();
+}
+
+void DabPipeline::run()
+{
+    QVector<InputMessage> replay;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this] { return m_stop || (m_scale > 0.0 && (m_woken || !m_replay.isEmpty())); });
+            if (m_stop)
+                return;
+            m_woken = false;
+            m_busy = true;
+            std::swap(replay, m_replay);
+            m_workScale = m_scale;
+            m_workSize = m_size;
+            m_upcoming = m_nextBrush;
+        }
+        QElapsedTimer timer;
+        timer.start();
+
+        // the journal's brush changes only hold for the strokes replayed along with them
+        const BrushPreset live = m_upcoming;
+        for (const auto& msg : qAsConst(replay)) {
+            process(msg);
+            if (m_strokeDabs.size() + m_work.dabs.size() < ReplayBatch)
+                continue;
+
+            // hold the rest back until the renderer has drawn this much
+            seal();
+            publish();
+            m_workTime.fetch_add(timer.nsecsElapsed(), std::memory_order_relaxed);
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_held = true;
+            m_idle.notify_all();
+            m_taken.wait(lock, [this] { return m_stop || m_pending.isEmpty(); });
+            m_held = false;
+            if (m_stop)
+                return;
+            timer.restart();
+        }
+        replay.clear();
+        m_upcoming = live;
+
+        m_input->beginDrain();
+        InputMessage msg;
+        while (m_input->pop(msg)) {
+            process(msg);
+        }
+        seal();
+        publish();
+        m_workTime.fetch_add(timer.nsecsElapsed(), std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_busy = false;
+        }
+        m_idle.notify_all();
+    }
+}
+
+void DabPipeline::process(const InputMessage& msg)
+{
+    switch (msg.tag) {
+    case InputMessage::Down:
+    case InputMessage::Move: {
+        m_work.received << msg.received;
+        const StrokeSample& sample = msg.tag == InputMessage::Down ? msg.down.sample : msg.move.sample;
+        if (msg.tag == InputMessage::Move && m_stroke.isActive()) {
+            m_stroke.moveTo(sample, m_strokeDabs);
+            break;
+        }
+
+        // a Down without an Up before it still ends the stroke it interrupts,
+        // and a Move without a Down starts one
+        if (m_stroke.isActive()) {
+            m_stroke.end(m_strokeDabs);
+            seal();
+            m_work.ops << Op{Op::End};
+        }
+        m_brush = m_upcoming;
+        m_stroke.setSettings(m_brush.strokeSettings());
+        // combined like boost::hash_combine
+        uint seed = qHash(sample.timestamp);
+        seed ^= qHash(sample.pos.x()) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        seed ^= qHash(sample.pos.y()) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        m_random.seed(seed);
+        m_direction = 0.0;
+        m_varied = false;
+        Op op{Op::Begin};
+        op.brush = m_brush;
+        m_work.ops << op;
+        m_stroke.begin(sample, m_strokeDabs);
+        break;
+    }
+    case InputMessage::Up: {
+        if (!m_stroke.isActive())
+            break;
+        m_stroke.end(m_strokeDabs);
+        seal();
+        m_work.ops << Op{Op::End};
+        break;
+    }
+    case InputMessage::Undo:
+    case InputMessage::Redo: {
+        if (m_stroke.isActive())
+            break;
+        m_work.ops << Op{msg.tag == InputMessage::Undo ? Op::Undo : Op::Redo};
+        break;
+    }
+    case InputMessage::Fill: {
+        m_work.received << msg.received;
+        if (m_stroke.isActive())
+            break;
+        Op op{Op::Fill};
+        op.brush = m_upcoming;
+        op.pos = msg.fill.sample.pos * m_workScale;
+        m_work.ops << op;
+        break;
+    }
+    case InputMessage::Brush: {
+        // a preset that's gone since leaves the brush as it was
+        for (const auto& preset : BrushPreset::presets(m_upcoming.kind)) {
+            if (qHash(preset.name) == msg.brush.name) {
+                m_upcoming = preset;
+                break;
+            }
+        }
+        break;
+    }
+    case InputMessage::Layer: {
+        // a stroke keeps the layer it started on, so this needn't wait for it to end
+        Op op{Op::Layer};
+        op.layer = msg.layer.change;
+        m_work.ops << op;
+        break;
+    }
+    }
+}
+
+void DabPipeline::vary(StrokeDab& dab)
+{
+    // the direction comes from the dabs as the engine placed them, before they're scattered
+    if (m_varied && dab.pos != m_lastDab)
+        m_direction = std::atan2(dab.pos.y() - m_lastDab.y(), dab.pos.x() - m_lastDab.x());
+    m_lastDab = dab.pos;
+    m_varied = true;
+
+    dab.angle = qDegreesToRadians(m_brush.angle);
+    if (m_brush.followStroke)
+        dab.angle += m_direction;
+    if (m_brush.angleJitter > 0.0)
+        dab.angle += qDegreesToRadians(m_brush.angleJitter) * (m_random.generateDouble() * 2.0 - 1.0);
+    if (m_brush.scatter > 0.0) {
+        // uniform over the disc the dab may stray into
+        const qreal towards = m_random.generateDouble() * 2.0 * M_PI;
+        const qreal distance = std::sqrt(m_random.generateDouble()) * m_brush.scatter * dab.radius;
+        dab.pos += QPointF(std::cos(towards), std::sin(towards)) * distance;
+    }
+    if (m_brush.sizeJitter > 0.0)
+        dab.radius *= 1.0 - m_brush.sizeJitter * m_random.generateDouble();
+    if (m_brush.features() & BrushPreset::Tipped)
+        dab.tip = m_brush.tips[int(m_random.bounded(uint(m_brush.tips.size())))];
+}
+
+void DabPipeline::seal()
+{
+    if (m_strokeDabs.isEmpty())
+        return;
+
+    Op op{Op::Dabs};
+    op.first = m_work.dabs.size();
+    op.count = m_strokeDabs.size();
+    op.firstBin = m_work.bins.size();
+
+    m_bins.clear();
+    for (auto dab : qAsConst(m_strokeDabs)) {
+        vary(dab);
+        const StrokeDab scaled{dab.pos * m_workScale, dab.radius * m_workScale, dab.pressure, dab.angle, dab.tip};
+        for (const auto& tile : TiledSurface::tilesIn(DirtyRegion::dabBounds(scaled.pos, scaled.radius), m_workSize)) {
+            m_bins << qMakePair(TiledSurface::key(tile), m_work.dabs.size());
+        }
+        m_work.dabs << scaled;
+    }
+    m_strokeDabs.clear();
+
+    // stable, so dabs keep their stroke order within a tile
+    std::stable_sort(m_bins.begin(), m_bins.end(), [](const QPair<quint64, int>& a, const QPair<quint64, int>& b) {
+        return a.first < b.first;
+    });
+    const QColor color = m_brush.dabColor();
+    for (int start = 0; start < m_bins.size();) {
+        const quint64 key = m_bins[start].first;
+        m_work.bins << Bin{key, m_work.instances.size(), 0};
+        int end = start;
+        for (; end < m_bins.size() && m_bins[end].first == key; end++) {
+            const StrokeDab& dab = m_work.dabs[m_bins[end].second];
+            m_work.instances << DabInstance{
+                static_cast<GLfloat>(dab.pos.x()), static_cast<GLfloat>(dab.pos.y()),
+                static_cast<GLfloat>(dab.radius),
+                static_cast<GLfloat>(color.redF()), static_cast<GLfloat>(color.greenF()),
+                static_cast<GLfloat>(color.blueF()), static_cast<GLfloat>(color.alphaF()),
+                static_cast<GLfloat>(dab.angle), static_cast<GLfloat>(qMax(dab.tip, 0)),
+            };
+        }
+        m_work.bins.last().count = end - start;
+        start = end;
+    }
+    op.binCount = m_work.bins.size() - op.firstBin;
+    m_work.ops << op;
+}
+
+void DabPipeline::publish()
+{
+    if (m_work.isEmpty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.append(m_work);
+    }
+    m_work.clear();
+
+    if (!m_updateRequested.exchange(true, std::memory_order_acq_rel)) {
+        // the item goes away only after the pipeline has stopped, and drops the call if it already has
+        QMetaObject::invokeMethod(m_item, [item = m_item] { item->update(); }, Qt::QueuedConnection);
+    }
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <QPointF>
+#include <QRandomGenerator>
+#include <QSize>
+#include <QVector>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <qopengl.h>
+#include "brush.h"
+#include "inputchannel.h"
+#include "stroke.h"
+
+class QQuickItem;
+
+/// one dab as the instanced dab shader reads it, in surface pixels.
+/// a dab's scale is its radius, which the brush dynamics have already varied
+struct DabInstance {
+    GLfloat x, y;
+    GLfloat radius;
+    GLfloat r, g, b, a;
+    /// radians
+    GLfloat angle;
+    /// the tip's layer in BrushTipAtlas
+    GLfloat tip;
+};
+
+/// turns an item's input into dabs on a worker thread
+///
+/// the worker drains the item's InputChannel as soon as input arrives, runs
+/// the stroke dynamics, varies the dabs the way the brush asks for, scales the dabs into surface pixels and packs them
+/// the way the renderers upload them, binned by the tile they land on. the
+/// render thread only swaps the finished frame out with take(), so while it
+/// draws one frame the worker is already generating the next. both frames
+/// keep their storage from one swap to the next.
+///
+/// once there's something to take, the worker asks the item for an update,
+/// at most once per take().
+class DabPipeline
+{
+public:
+    /// something the renderer has to do, in input order
+    struct Op {
+        enum Type {
+            /// a stroke starts; history opens a step
+            Begin,
+            /// dabs of the stroke in progress to draw
+            Dabs,
+            /// the stroke is finished and can land
+            End,
+            Undo,
+            Redo,
+            /// a bucket fill, which isn't a stroke and lands in a step of its own
+            Fill,
+            /// a replayed change to the layers, which later ops land on
+            Layer,
+        };
+        Type tag;
+        /// Begin: what the stroke paints with; Fill: what it fills with
+        BrushPreset brush;
+        /// Fill: the seed, in surface pixels
+        QPointF pos;
+        /// Layer: what changed
+        LayerChange layer = {};
+        /// Dabs: the frame's dabs [first, first + count) and bins [firstBin, firstBin + binCount)
+        int first = 0;
+        int count = 0;
+        int firstBin = 0;
+        int binCount = 0;
+    };
+    /// the instances [first, first + count) that touch one tile
+    struct Bin {
+        quint64 key;
+        int first;
+        int count;
+    };
+    struct Frame {
+        QVector<Op> ops;
+        /// every dab once, in stroke order
+        QVector<StrokeDab> dabs;
+        /// the dabs again, once for every tile they touch and grouped by tile, in stroke order within a tile
+        QVector<DabInstance> instances;
+        QVector<Bin> bins;
+        /// when the gui thread pushed the Down and Move messages folded into the frame
+        QVector<qint64> received;
+
+        bool isEmpty() const { return ops.isEmpty() && received.isEmpty(); }
+        /// empties the frame but keeps its storage
+        void clear();
+        void append(const Frame& other);
+    };
+
+    /// becomes the consumer of input; the item must outlive the pipeline
+    DabPipeline(QQuickItem* item, InputChannel* input);
+    ~DabPipeline();
+    Q_DISABLE_COPY(DabPipeline)
+
+    // render thread, while the gui thread is blocked in synchronize
+    /// surface pixels per item pixel and the surface's size; nothing is generated before the first call
+    void setSurface(qreal scale, const QSize& size);
+    /// takes effect on the next Down
+    void setBrush(const BrushPreset& brush);
+    /// queues journaled messages to run before any input still in the channel
+    void replay(const QVector<InputMessage>& messages);
+
+    /// render thread; swaps everything generated since the last call into frame
+    void take(Frame& frame);
+
+    /// blocks until everything pushed or queued for replay so far has been generated, or the
+    /// worker is waiting for a replay batch to be taken. for the benchmark, whose frames have to
+    /// draw the same dabs on every run
+    void drain();
+    /// whether, as of now, the worker has generated everything it was given and isn't in the middle of a
+    /// stroke, so what the renderer draws next holds all the input so far
+    bool isSettled();
+    /// nanoseconds the worker has spent generating dabs, in total
+    qint64 workTime() const { return m_workTime.load(std::memory_order_relaxed); }
+
+private:
+    /// replayed frames are handed over in batches of about this many dabs, so
+    /// a long journal doesn't have to fit in memory at once
+    static constexpr int ReplayBatch = 65536;
+
+    void wake();
+    void run();
+    void process(const InputMessage& msg);
+    /// scatters, resizes, turns and picks a tip for a dab about to be sealed
+    void vary(StrokeDab& dab);
+    /// packs the dabs generated since the last call into a Dabs op
+    void seal();
+    void publish();
+
+    QQuickItem* m_item;
+    InputChannel* m_input;
+
+    // worker only
+    StrokeEngine m_stroke;
+    BrushPreset m_brush;
+    /// m_nextBrush as of the last wake, or whatever the journal switched to while replaying
+    BrushPreset m_upcoming;
+    QVector<StrokeDab> m_strokeDabs;
+    /// seeded from each stroke's first sample, so a replayed stroke varies the same way
+    QRandomGenerator m_random;
+    /// the stroke's direction at its last dab, in radians
+    qreal m_direction = 0.0;
+    QPointF m_lastDab;
+    bool m_varied = false;
+    QVector<QPair<quint64, int>> m_bins;
+    Frame m_work;
+    qreal m_workScale = 1.0;
+    QSize m_workSize;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    /// tells a worker waiting on a full replay batch that it was taken
+    std::condition_variable m_taken;
+    /// tells drain() the worker has published what it was woken for, or is waiting on m_taken
+    std::condition_variable m_idle;
+    Frame m_pending;
+    QVector<InputMessage> m_replay;
+    BrushPreset m_nextBrush;
+    qreal m_scale = 0.0;
+    QSize m_size;
+    bool m_woken = false;
+    bool m_stop = false;
+    /// between a wakeup and publishing what it brought
+    bool m_busy = false;
+    /// waiting for a replay batch to be taken
+    bool m_held = false;
+    std::atomic<qint64> m_workTime = {0};
+    std::atomic<bool> m_updateRequested = {false};
+    std::thread m_worker;
+};
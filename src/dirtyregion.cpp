@@ -0,0 +1,70 @@
+#include <limits>
+#include "dirtyregion.h"
+
+static qint64 area(const QRect& rect)
+{
+    return qint64(rect.width()) * rect.height();
+}
+
+void DirtyRegion::add(const QRect& rect)
+{
+    if (rect.isEmpty())
+        return;
+
+    QRect merged = rect;
+    for (int i = 0; i < m_rects.size();) {
+        if (m_rects[i].contains(merged))
+            return;
+
+        if (m_rects[i].intersects(merged.adjusted(-1, -1, 1, 1))) {
+            merged |= m_rects[i];
+            m_rects.remove(i);
+            // the grown rect may now reach ones we've already passed
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+    m_rects << merged;
+
+    while (m_rects.size() > MaxRects) {
+        int bestA = 0;
+        int bestB = 1;
+        qint64 bestWaste = std::numeric_limits<qint64>::max();
+        for (int a = 0; a < m_rects.size(); a++) {
+            for (int b = a + 1; b < m_rects.size(); b++) {
+                const qint64 waste = area(m_rects[a] | m_rects[b]) - area(m_rects[a]) - area(m_rects[b]);
+                if (waste < bestWaste) {
+                    bestWaste = waste;
+                    bestA = a;
+                    bestB = b;
+                }
+            }
+        }
+        m_rects[bestA] |= m_rects[bestB];
+        m_rects.remove(bestB);
+    }
+}
+
+void DirtyRegion::add(const DirtyRegion& other)
+{
+    for (const auto& rect : other.m_rects) {
+        add(rect);
+    }
+}
+
+QRect DirtyRegion::bounds() const
+{
+    QRect ret;
+    for (const auto& rect : m_rects) {
+        ret |= rect;
+    }
+    return ret;
+}
+
+QRect DirtyRegion::dabBounds(const QPointF& pos, qreal radius)
+{
+    return QRectF(pos.x() - radius, pos.y() - radius, radius * 2, radius * 2)
+        .toAlignedRect()
+        .adjusted(-1, -1, 1, 1);
+}
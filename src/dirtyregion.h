@@ -0,0 +1,29 @@
+#pragma once
+
+#include <QRect>
+#include <QVarLengthArray>
+
+/// the parts of a surface changed during a frame, kept as a few rectangles
+///
+/// overlapping rectangles are merged as they come in, and once there are
+/// more than MaxRects the pair that wastes the least area when merged is
+/// combined, so consumers never have to walk more than a handful of scissors.
+class DirtyRegion
+{
+public:
+    static constexpr int MaxRects = 8;
+
+    void add(const QRect& rect);
+    void add(const DirtyRegion& other);
+    void clear() { m_rects.clear(); }
+
+    bool isEmpty() const { return m_rects.isEmpty(); }
+    QRect bounds() const;
+    const QVarLengthArray<QRect, MaxRects>& rects() const { return m_rects; }
+
+    /// the smallest pixel-aligned rect that covers a dab, with a pixel of slack for filtering
+    static QRect dabBounds(const QPointF& pos, qreal radius);
+
+private:
+    QVarLengthArray<QRect, MaxRects> m_rects;
+};
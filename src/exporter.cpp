@@ -0,0 +1,250 @@
+#include <QImage>
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QThreadPool>
+#include <cstring>
+#include "exporter.h"
+#include "tiledsurface.h"
+
+namespace {
+
+constexpr int TileBytes = TiledSurface::TileSize * TiledSurface::TileSize * 4;
+
+}
+
+CanvasExporter::CanvasExporter()
+{
+}
+
+CanvasExporter::~CanvasExporter()
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    for (const auto& readback : qAsConst(m_inFlight)) {
+        fns.glDeleteSync(readback.fence);
+        m_buffers << readback.buffer;
+    }
+    for (auto job : qAsConst(m_jobs)) {
+        release(job);
+        for (auto copy : qAsConst(job->copies)) {
+            deleteCopy(copy);
+        }
+        if (job->done)
+            job->done(job->path, false);
+        delete job;
+    }
+    for (auto buffer : qAsConst(m_buffers))
+        GpuMemory::untrack(buffer);
+    qDeleteAll(m_buffers);
+}
+
+QOpenGLFramebufferObject* CanvasExporter::createCopy()
+{
+    auto ret = new QOpenGLFramebufferObject(TiledSurface::TileSize, TiledSurface::TileSize);
+    GpuMemory::track(ret, m_account, GpuMemory::Export);
+    return ret;
+}
+
+void CanvasExporter::deleteCopy(QOpenGLFramebufferObject* copy)
+{
+    GpuMemory::untrack(copy);
+    delete copy;
+}
+
+void CanvasExporter::request(TiledSurface* source, const QString& path, const Done& done)
+{
+    auto job = new Job;
+    job->path = path;
+    job->done = done;
+    job->size = source->size();
+    job->blank = source->blank();
+
+    // parked tiles are already a snapshot; the rest are read straight from
+    // the surface unless something is about to change them first
+    for (const auto& tile : source->tiles()) {
+        Chunk chunk;
+        chunk.tile = tile;
+        chunk.compressed = source->parked(tile);
+        if (chunk.compressed.isEmpty())
+            job->pending.insert(TiledSurface::key(tile), job->chunks.size());
+        job->chunks << chunk;
+    }
+    if (!job->pending.isEmpty()) {
+        job->source = source;
+        source->addWatcher(job, TiledSurface::Watcher{
+            [this, job](const QPoint& tile) { preserve(job, tile); },
+            [job] { job->source = nullptr; },
+        });
+    }
+
+    m_jobs << job;
+}
+
+void CanvasExporter::preserve(Job* job, const QPoint& tile)
+{
+    const quint64 key = TiledSurface::key(tile);
+    if (!job->pending.contains(key) || job->copies.contains(key))
+        return;
+
+    // parking doesn't change a tile, so one that was parked since can be taken as it is
+    const QByteArray parked = job->source->parked(tile);
+    if (!parked.isEmpty()) {
+        job->chunks[job->pending.take(key)].compressed = parked;
+        return;
+    }
+    // blits are queued on the GPU like any other draw, so this is cheap on the cpu
+    auto copy = createCopy();
+    const QRect rect(0, 0, TiledSurface::TileSize, TiledSurface::TileSize);
+    QOpenGLFramebufferObject::blitFramebuffer(copy, rect, job->source->tile(tile)->fbo, rect, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    job->copies.insert(key, copy);
+}
+
+void CanvasExporter::release(Job* job)
+{
+    if (job->source == nullptr)
+        return;
+    job->source->removeWatcher(job);
+    job->source = nullptr;
+}
+
+void CanvasExporter::step()
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    // fences signal in submission order, so the first unsignalled one ends the scan
+    int finished = 0;
+    for (const auto& readback : qAsConst(m_inFlight)) {
+        if (fns.glClientWaitSync(readback.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            break;
+        fns.glDeleteSync(readback.fence);
+        collect(readback);
+        finished++;
+    }
+    m_inFlight.remove(0, finished);
+
+    int budget = ChunksPerFrame;
+    for (auto job : qAsConst(m_jobs)) {
+        while (budget > 0 && !job->pending.isEmpty()) {
+            const auto next = job->pending.begin();
+            const quint64 key = next.key();
+            const int index = next.value();
+            job->pending.erase(next);
+            const QPoint tile = job->chunks[index].tile;
+
+            // a copy if it was about to change, otherwise the tile itself: the read is
+            // queued ahead of whatever is drawn into it later
+            QOpenGLFramebufferObject* copy = job->copies.take(key);
+            QOpenGLFramebufferObject* from = copy;
+            if (from == nullptr) {
+                // a tile is copied before it changes or goes away, so these only guard against that not holding
+                if (job->source == nullptr)
+                    continue;
+                const QByteArray parked = job->source->parked(tile);
+                if (!parked.isEmpty()) {
+                    job->chunks[index].compressed = parked;
+                    continue;
+                }
+                auto it = job->source->tile(tile);
+                if (it == nullptr)
+                    continue;
+                from = it->fbo;
+            }
+
+            QOpenGLBuffer* buffer = nullptr;
+            if (!m_buffers.isEmpty()) {
+                buffer = m_buffers.takeLast();
+            } else {
+                buffer = new QOpenGLBuffer(QOpenGLBuffer::PixelPackBuffer);
+                buffer->setUsagePattern(QOpenGLBuffer::StreamRead);
+                buffer->create();
+                buffer->bind();
+                buffer->allocate(TileBytes);
+                buffer->release();
+                GpuMemory::track(buffer, m_account, GpuMemory::Export, TileBytes, QStringLiteral("readback buffer"));
+            }
+
+            // with a pack buffer bound, glReadPixels only queues a copy and returns
+            from->bind();
+            buffer->bind();
+            fns.glReadPixels(0, 0, TiledSurface::TileSize, TiledSurface::TileSize, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            buffer->release();
+
+            Readback readback;
+            readback.job = job;
+            readback.chunk = index;
+            readback.buffer = buffer;
+            readback.fence = fns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            m_inFlight << readback;
+            job->inFlight++;
+
+            // GL keeps the texture alive until the queued read is done with it
+            if (copy != nullptr)
+                deleteCopy(copy);
+            budget--;
+        }
+        if (job->pending.isEmpty())
+            release(job);
+    }
+    QOpenGLFramebufferObject::bindDefault();
+
+    for (int i = 0; i < m_jobs.size();) {
+        auto job = m_jobs[i];
+        if (!job->pending.isEmpty() || job->inFlight > 0) {
+            i++;
+            continue;
+        }
+        m_jobs.remove(i);
+        encode(job);
+    }
+}
+
+void CanvasExporter::collect(const Readback& readback)
+{
+    auto job = readback.job;
+    job->inFlight--;
+    Chunk& chunk = job->chunks[readback.chunk];
+
+    readback.buffer->bind();
+    auto pixels = static_cast<const char*>(readback.buffer->mapRange(0, TileBytes, QOpenGLBuffer::RangeRead));
+    if (pixels != nullptr) {
+        chunk.pixels = QByteArray(pixels, TileBytes);
+        readback.buffer->unmap();
+    } else {
+        qWarning("CanvasExporter: couldn't map a readback of tile (%d, %d)", chunk.tile.x(), chunk.tile.y());
+    }
+    readback.buffer->release();
+
+    m_buffers << readback.buffer;
+}
+
+void CanvasExporter::encode(Job* job)
+{
+    QThreadPool::globalInstance()->start([job] {
+        QImage image(job->size, QImage::Format_RGBA8888);
+        image.fill(job->blank);
+        for (const auto& chunk : qAsConst(job->chunks)) {
+            const QByteArray pixels = chunk.compressed.isEmpty() ? chunk.pixels : qUncompress(chunk.compressed);
+            if (pixels.size() != TileBytes)
+                continue;
+            // the surface is bottom-up like every GL framebuffer; the image isn't
+            const QRect rect = TiledSurface::tileRect(chunk.tile) & image.rect();
+            const QPoint origin = TiledSurface::tileRect(chunk.tile).topLeft();
+            const int stride = TiledSurface::TileSize * 4;
+            for (int y = rect.top(); y <= rect.bottom(); y++) {
+                const char* from = pixels.constData() + (y - origin.y()) * stride + (rect.x() - origin.x()) * 4;
+                uchar* to = image.scanLine(image.height() - 1 - y) + rect.x() * 4;
+                std::memcpy(to, from, rect.width() * 4);
+            }
+        }
+
+        const bool ok = image.save(job->path);
+        if (!ok)
+            qWarning("CanvasExporter: couldn't write %s", qPrintable(job->path));
+        if (job->done)
+            job->done(job->path, ok);
+        delete job;
+    });
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <QColor>
+#include <QHash>
+#include <QPoint>
+#include <QSize>
+#include <QString>
+#include <QVector>
+#include <functional>
+#include <qopengl.h>
+#include "gpumemory.h"
+
+class QOpenGLBuffer;
+class QOpenGLFramebufferObject;
+class TiledSurface;
+
+/// writes a surface out to an image file without stalling the render thread
+///
+/// a request snapshots the surface as it is, but only copies a tile on the
+/// GPU if something is about to change it before it has been read out.
+/// tiles are read back into pixel buffer objects a few a frame and mapped
+/// once their fence has signalled; parked ones are taken as they are. the
+/// image is assembled and encoded on the global thread pool.
+class CanvasExporter
+{
+public:
+    /// called from a pool thread once the file has been written, or has failed to be
+    using Done = std::function<void(const QString& path, bool ok)>;
+
+    /// how many tiles start their readback each frame
+    static constexpr int ChunksPerFrame = 4;
+
+    CanvasExporter();
+    ~CanvasExporter();
+    Q_DISABLE_COPY(CanvasExporter)
+
+    /// who the copies and readback buffers are accounted to
+    void setAccount(GpuMemory::Account* account) { m_account = account; }
+
+    /// snapshots source as it is now; only its allocated tiles are read back.
+    /// the format is picked from the path's suffix
+    void request(TiledSurface* source, const QString& path, const Done& done);
+    /// starts the next readbacks and collects finished ones; call once a frame
+    void step();
+    /// whether step() has more work to do on later frames
+    bool isBusy() const { return !m_jobs.isEmpty(); }
+
+private:
+    struct Chunk {
+        QPoint tile;
+        /// qCompress'd pixels, for tiles that were parked
+        QByteArray compressed;
+        /// pixels as read back, bottom-up like the surface
+        QByteArray pixels;
+    };
+    struct Job {
+        QString path;
+        Done done;
+        QSize size;
+        QColor blank;
+        QVector<Chunk> chunks;
+        /// watched until every chunk's readback has started
+        TiledSurface* source = nullptr;
+        /// chunks by tile key whose readback hasn't started yet
+        QHash<quint64, int> pending;
+        /// of pending tiles that were about to change
+        QHash<quint64, QOpenGLFramebufferObject*> copies;
+        int inFlight = 0;
+    };
+    struct Readback {
+        Job* job = nullptr;
+        int chunk = 0;
+        QOpenGLBuffer* buffer = nullptr;
+        GLsync fence = nullptr;
+    };
+
+    QOpenGLFramebufferObject* createCopy();
+    static void deleteCopy(QOpenGLFramebufferObject* copy);
+    /// copies a pending tile that's about to change
+    void preserve(Job* job, const QPoint& tile);
+    /// stops watching the source once nothing is left to read from it
+    static void release(Job* job);
+    void collect(const Readback& readback);
+    void encode(Job* job);
+
+    GpuMemory::Account* m_account = nullptr;
+    /// oldest first
+    QVector<Job*> m_jobs;
+    QVector<Readback> m_inFlight;
+    QVector<QOpenGLBuffer*> m_buffers;
+};
@@ -0,0 +1,70 @@
+#include <QHash>
+#include <QMutex>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include "glresources.h"
+#include "gpumemory.h"
+
+namespace {
+
+// every window's render thread has its own context, so lookups can race
+QMutex registryLock;
+QHash<QOpenGLContext*, GLResources*> registry;
+
+}
+
+GLResources* GLResources::current()
+{
+    auto context = QOpenGLContext::currentContext();
+    Q_ASSERT(context != nullptr);
+
+    QMutexLocker locker(&registryLock);
+    if (auto it = registry.value(context, nullptr))
+        return it;
+
+    auto ret = new GLResources;
+    registry.insert(context, ret);
+
+    // emitted with the context current, so the resources can still be freed
+    QObject::connect(context, &QOpenGLContext::aboutToBeDestroyed, [context] {
+        GLResources* it = nullptr;
+        {
+            QMutexLocker locker(&registryLock);
+            it = registry.take(context);
+        }
+        delete it;
+    });
+    return ret;
+}
+
+GLResources::~GLResources()
+{
+    m_resources.clear();
+    m_variants.clear();
+    for (auto it : qAsConst(m_scratch))
+        GpuMemory::untrack(it);
+    qDeleteAll(m_scratch);
+}
+
+QOpenGLFramebufferObject* GLResources::scratch(int index, const QSize& size)
+{
+    if (m_scratch.size() <= index)
+        m_scratch.resize(index + 1);
+
+    auto& it = m_scratch[index];
+    if (it != nullptr && it->width() >= size.width() && it->height() >= size.height())
+        return it;
+
+    // grow in coarse steps so a stroke doesn't reallocate every frame
+    const auto round = [](int value) { return (value + 63) & ~63; };
+    QSize allocation(round(size.width()), round(size.height()));
+    if (it != nullptr) {
+        allocation = allocation.expandedTo(it->size());
+        GpuMemory::untrack(it);
+        delete it;
+    }
+    it = new QOpenGLFramebufferObject(allocation);
+    // shared by every renderer on the context, so nobody's in particular
+    GpuMemory::track(it, nullptr, GpuMemory::Scratch);
+    return it;
+}
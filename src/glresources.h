@@ -0,0 +1,61 @@
+#pragma once
+
+#include <QSize>
+#include <QVector>
+#include <map>
+#include <memory>
+#include <typeindex>
+#include <unordered_map>
+
+class QOpenGLContext;
+class QOpenGLFramebufferObject;
+
+/// GL objects that every renderer on a context can share
+///
+/// programs, their locations and static buffers are built once per context
+/// and handed to every renderer that asks for them, so opening another
+/// canvas costs no shader compiles. the registry is created the first time
+/// a context asks for it and freed, with the context current, right before
+/// the context goes away. it is only ever touched from the context's thread.
+class GLResources
+{
+public:
+    /// anything kept in the registry; constructed and destroyed with the context current
+    struct Resource {
+        virtual ~Resource() = default;
+    };
+
+    /// the registry of the current context
+    static GLResources* current();
+
+    /// the context's instance of T, constructing it on first use
+    template<typename T>
+    T* get() {
+        auto& it = m_resources[std::type_index(typeid(T))];
+        if (!it)
+            it.reset(new T);
+        return static_cast<T*>(it.get());
+    }
+    /// the context's instance of T built for key, like a shader permutation;
+    /// constructed as T(key) on first use
+    template<typename T>
+    T* get(quint32 key) {
+        auto& it = m_variants[std::make_pair(std::type_index(typeid(T)), key)];
+        if (!it)
+            it.reset(new T(key));
+        return static_cast<T*>(it.get());
+    }
+
+    /// a scratch framebuffer at least size large; the same index hands out the same
+    /// framebuffer to every caller, so its contents only last until someone else draws
+    QOpenGLFramebufferObject* scratch(int index, const QSize& size);
+
+private:
+    GLResources() = default;
+    ~GLResources();
+    Q_DISABLE_COPY(GLResources)
+
+    std::unordered_map<std::type_index, std::unique_ptr<Resource>> m_resources;
+    std::map<std::pair<std::type_index, quint32>, std::unique_ptr<Resource>> m_variants;
+    QVector<QOpenGLFramebufferObject*> m_scratch;
+};
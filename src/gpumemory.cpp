@@ -0,0 +1,313 @@
+#include <QHash>
+#include <QMutex>
+#include <QOpenGLFramebufferObject>
+#include <QStringList>
+#include <QTimer>
+#include <QVector>
+#include <algorithm>
+#include "gpumemory.h"
+
+namespace {
+
+struct Record {
+    GpuMemory::Account* account;
+    GpuMemory::Category category;
+    qint64 bytes;
+    QString format;
+};
+
+QMutex registryLock;
+QHash<const void*, Record> registry;
+std::array<std::atomic<qint64>, GpuMemory::CategoryCount> totals = {};
+std::atomic<quint64> frames = {0};
+
+qint64 initialBudget()
+{
+    bool ok = false;
+    const qint64 mib = qEnvironmentVariableIntValue("BRUSHY_GPU_BUDGET", &ok);
+    return ok ? mib * 1024 * 1024 : 0;
+}
+
+std::atomic<qint64> budgetBytes = {initialBudget()};
+
+int bytesPerPixel(GLenum format)
+{
+    switch (format) {
+    case GL_RGBA16F:
+        return 8;
+    case GL_RGBA32F:
+        return 16;
+    case GL_R8:
+        return 1;
+    default:
+        return 4;
+    }
+}
+
+QString formatName(GLenum format)
+{
+    switch (format) {
+    case GL_RGBA8:
+        return QStringLiteral("RGBA8");
+    case GL_RGBA16F:
+        return QStringLiteral("RGBA16F");
+    case GL_RGBA32F:
+        return QStringLiteral("RGBA32F");
+    case GL_R8:
+        return QStringLiteral("R8");
+    default:
+        return QStringLiteral("0x%1").arg(format, 0, 16);
+    }
+}
+
+/// bytes held by fbo's attachments, and what they are
+qint64 describe(const QOpenGLFramebufferObject* fbo, QString& name)
+{
+    const auto format = fbo->format();
+    const qint64 pixels = qint64(fbo->width()) * fbo->height() * qMax(1, format.samples());
+    qint64 bytes = pixels * bytesPerPixel(format.internalTextureFormat());
+    name = QStringLiteral("%1x%2 %3").arg(fbo->width()).arg(fbo->height()).arg(formatName(format.internalTextureFormat()));
+    if (format.samples() > 0)
+        name += QStringLiteral(" %1x MSAA").arg(format.samples());
+    if (format.attachment() != QOpenGLFramebufferObject::NoAttachment) {
+        bytes += pixels * 4;
+        name += QStringLiteral(" + depth/stencil");
+    }
+    return bytes;
+}
+
+QString mib(qint64 bytes)
+{
+    return QString::number(bytes / (1024.0 * 1024.0), 'f', 1) + QStringLiteral(" MiB");
+}
+
+}
+
+void GpuMemory::count(Account* account, Category category, qint64 bytes)
+{
+    totals[category].fetch_add(bytes, std::memory_order_relaxed);
+    if (account != nullptr)
+        account->m_bytes[category].fetch_add(bytes, std::memory_order_relaxed);
+}
+
+qint64 GpuMemory::Account::bytes() const
+{
+    qint64 ret = 0;
+    for (const auto& it : m_bytes)
+        ret += it.load(std::memory_order_relaxed);
+    return ret;
+}
+
+void GpuMemory::Allocation::set(Account* account, Category category, const QOpenGLFramebufferObject* fbo)
+{
+    if (fbo == nullptr) {
+        reset();
+        return;
+    }
+    // keyed by the member, not the fbo, so the entry follows whatever the member holds
+    QString format;
+    const qint64 bytes = describe(fbo, format);
+    track(this, account, category, bytes, format);
+}
+
+void GpuMemory::track(const void* object, Account* account, Category category, qint64 bytes, const QString& format)
+{
+    QMutexLocker locker(&registryLock);
+    auto it = registry.find(object);
+    if (it != registry.end()) {
+        count(it->account, it->category, -it->bytes);
+        *it = Record{account, category, bytes, format};
+    } else {
+        it = registry.insert(object, Record{account, category, bytes, format});
+    }
+    count(it->account, it->category, it->bytes);
+}
+
+void GpuMemory::track(const QOpenGLFramebufferObject* fbo, Account* account, Category category)
+{
+    QString format;
+    const qint64 bytes = describe(fbo, format);
+    track(fbo, account, category, bytes, format);
+}
+
+void GpuMemory::untrack(const void* object)
+{
+    QMutexLocker locker(&registryLock);
+    auto it = registry.find(object);
+    if (it == registry.end())
+        return;
+    count(it->account, it->category, -it->bytes);
+    registry.erase(it);
+}
+
+qint64 GpuMemory::total()
+{
+    qint64 ret = 0;
+    for (const auto& it : totals)
+        ret += it.load(std::memory_order_relaxed);
+    return ret;
+}
+
+qint64 GpuMemory::total(Category category)
+{
+    return totals[category].load(std::memory_order_relaxed);
+}
+
+const char* GpuMemory::name(Category category)
+{
+    switch (category) {
+    case Layers:
+        return "layers";
+    case Caches:
+        return "caches";
+    case Stroke:
+        return "stroke";
+    case History:
+        return "history";
+    case View:
+        return "view";
+    case Scratch:
+        return "scratch";
+    case Buffers:
+        return "buffers";
+    case Export:
+        return "export";
+    case Textures:
+        return "textures";
+    case CategoryCount:
+        break;
+    }
+    return "?";
+}
+
+qint64 GpuMemory::budget()
+{
+    return budgetBytes.load(std::memory_order_relaxed);
+}
+
+void GpuMemory::setBudget(qint64 bytes)
+{
+    budgetBytes.store(qMax<qint64>(0, bytes), std::memory_order_relaxed);
+}
+
+bool GpuMemory::isOverBudget()
+{
+    return excess() > 0;
+}
+
+qint64 GpuMemory::excess()
+{
+    const qint64 limit = budget();
+    return limit > 0 ? total() - limit : 0;
+}
+
+quint64 GpuMemory::frame()
+{
+    return frames.load(std::memory_order_relaxed);
+}
+
+void GpuMemory::advanceFrame()
+{
+    frames.fetch_add(1, std::memory_order_relaxed);
+}
+
+void GpuMemory::log()
+{
+    struct Line {
+        QString owner;
+        Record record;
+    };
+    QVector<Line> lines;
+    QHash<QString, std::array<qint64, CategoryCount>> owners;
+    {
+        QMutexLocker locker(&registryLock);
+        lines.reserve(registry.size());
+        for (const auto& record : qAsConst(registry)) {
+            const QString owner = record.account != nullptr ? record.account->name() : QStringLiteral("process");
+            lines << Line{owner, record};
+            auto& sums = owners[owner];
+            sums[record.category] += record.bytes;
+        }
+    }
+
+    qDebug("GpuMemory: %s in %d allocations, budget %s", qPrintable(mib(total())), lines.size(),
+           budget() > 0 ? qPrintable(mib(budget())) : "unlimited");
+    for (auto it = owners.cbegin(); it != owners.cend(); it++) {
+        QStringList parts;
+        for (int i = 0; i < CategoryCount; i++) {
+            if (it.value()[i] > 0)
+                parts << QStringLiteral("%1 %2").arg(QLatin1String(name(Category(i))), mib(it.value()[i]));
+        }
+        qDebug("  %s: %s", qPrintable(it.key()), qPrintable(parts.join(QStringLiteral(", "))));
+    }
+
+    // the largest few say more than thousands of identical tiles would
+    std::sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) { return a.record.bytes > b.record.bytes; });
+    for (int i = 0; i < qMin(16, lines.size()); i++) {
+        const auto& line = lines[i];
+        qDebug("  %10s  %-8s %-10s %s", qPrintable(mib(line.record.bytes)), name(line.record.category),
+               qPrintable(line.owner), qPrintable(line.record.format));
+    }
+}
+
+GpuMemoryStats::GpuMemoryStats(const QSharedPointer<GpuMemory::Account>& account, QObject* parent) : QObject(parent), m_account(account), m_timer(new QTimer(this))
+{
+    m_timer->setInterval(500);
+    connect(m_timer, &QTimer::timeout, this, &GpuMemoryStats::changed);
+    m_timer->start();
+}
+
+GpuMemoryStats::~GpuMemoryStats()
+{
+}
+
+static qreal toMiB(qint64 bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+qreal GpuMemoryStats::total() const
+{
+    return toMiB(m_account->bytes());
+}
+
+QVariantMap GpuMemoryStats::categories() const
+{
+    QVariantMap ret;
+    for (int i = 0; i < GpuMemory::CategoryCount; i++) {
+        ret.insert(QLatin1String(GpuMemory::name(GpuMemory::Category(i))), toMiB(m_account->bytes(GpuMemory::Category(i))));
+    }
+    return ret;
+}
+
+qreal GpuMemoryStats::processTotal() const
+{
+    return toMiB(GpuMemory::total());
+}
+
+QVariantMap GpuMemoryStats::processCategories() const
+{
+    QVariantMap ret;
+    for (int i = 0; i < GpuMemory::CategoryCount; i++) {
+        ret.insert(QLatin1String(GpuMemory::name(GpuMemory::Category(i))), toMiB(GpuMemory::total(GpuMemory::Category(i))));
+    }
+    return ret;
+}
+
+int GpuMemoryStats::budget() const
+{
+    return int(GpuMemory::budget() / (1024 * 1024));
+}
+
+void GpuMemoryStats::setBudget(int budget)
+{
+    if (budget == this->budget())
+        return;
+    GpuMemory::setBudget(qint64(budget) * 1024 * 1024);
+    Q_EMIT changed();
+}
+
+void GpuMemoryStats::log() const
+{
+    GpuMemory::log();
+}
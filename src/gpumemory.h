@@ -0,0 +1,150 @@
+#pragma once
+
+#include <QObject>
+#include <QSharedPointer>
+#include <QString>
+#include <QVariantMap>
+#include <array>
+#include <atomic>
+#include <QtQml/qqml.h>
+
+class QOpenGLFramebufferObject;
+class QTimer;
+
+/// where the GPU memory of the canvas items goes
+///
+/// every framebuffer, texture and buffer the renderers create is tracked
+/// here with its size, format, owner and category, keyed by the object that
+/// holds it. owners are accounts, one per item; anything shared by a context
+/// is accounted to the process. the totals are atomics any thread may read.
+///
+/// there's also a process-wide budget. the render threads check it once a
+/// frame and, when it's exceeded, give back what they can: undo snapshots
+/// and cold tiles are read back and compressed into system memory, and
+/// caches that can be rebuilt are dropped. that happens well before the
+/// driver runs out, since several apps may share the GPU.
+class GpuMemory
+{
+public:
+    /// how many frames a tile goes unused before it counts as cold
+    static constexpr quint64 ColdFrames = 120;
+
+    enum Category {
+        /// what's painted: layer tiles and the smudge overlay
+        Layers,
+        /// what can be rebuilt from the layers: flattened layers, the composite, the view pyramid
+        Caches,
+        /// strokes in progress
+        Stroke,
+        /// undo snapshots kept on the GPU
+        History,
+        /// the items' framebuffers and what's shared between them
+        View,
+        /// scratch targets shared by everything on a context
+        Scratch,
+        /// vertex, index and instance buffers
+        Buffers,
+        /// copies and readbacks of exports in flight
+        Export,
+        /// textures loaded from the app's data, like the brush tips
+        Textures,
+        CategoryCount,
+    };
+
+    /// one owner's share; items hold theirs in a QSharedPointer, like RendererStats
+    class Account
+    {
+    public:
+        explicit Account(const QString& name) : m_name(name) { }
+        Q_DISABLE_COPY(Account)
+
+        QString name() const { return m_name; }
+        qint64 bytes() const;
+        qint64 bytes(Category category) const { return m_bytes[category].load(std::memory_order_relaxed); }
+
+    private:
+        friend class GpuMemory;
+        QString m_name;
+        std::array<std::atomic<qint64>, CategoryCount> m_bytes = {};
+    };
+
+    /// the tracked entry of a GL object that lives as a member, untracked when it goes away
+    class Allocation
+    {
+    public:
+        Allocation() = default;
+        ~Allocation() { reset(); }
+        Q_DISABLE_COPY(Allocation)
+
+        void set(Account* account, Category category, qint64 bytes, const QString& format) { track(this, account, category, bytes, format); }
+        void set(Account* account, Category category, const QOpenGLFramebufferObject* fbo);
+        void reset() { untrack(this); }
+    };
+
+    /// tracks object, or updates it if it's tracked already; a null account is the process's
+    static void track(const void* object, Account* account, Category category, qint64 bytes, const QString& format);
+    /// the same for a framebuffer, sized from its attachments
+    static void track(const QOpenGLFramebufferObject* fbo, Account* account, Category category);
+    /// does nothing for objects that aren't tracked
+    static void untrack(const void* object);
+
+    static qint64 total();
+    static qint64 total(Category category);
+    static const char* name(Category category);
+
+    /// bytes the process may hold before renderers give memory back; 0 is no limit.
+    /// starts out as BRUSHY_GPU_BUDGET, in MiB, if that's set
+    static qint64 budget();
+    static void setBudget(qint64 bytes);
+    static bool isOverBudget();
+    /// how far total() has to come down to get back under the budget
+    static qint64 excess();
+
+    /// counts frames for telling cold tiles from hot ones; renderers advance it once a frame
+    static quint64 frame();
+    static void advanceFrame();
+    /// tiles last used before this frame are cold enough to park
+    static quint64 coldBefore() { return frame() > ColdFrames ? frame() - ColdFrames : 0; }
+
+    /// writes the totals per account and category and the largest allocations to the debug log
+    static void log();
+
+private:
+    /// adds bytes to the process's totals and the account's
+    static void count(Account* account, Category category, qint64 bytes);
+};
+
+/// an item's GPU memory and the process's, for QML; sizes are in MiB
+class GpuMemoryStats : public QObject
+{
+    Q_OBJECT
+    QML_ANONYMOUS
+
+    /// what this item holds
+    Q_PROPERTY(qreal total READ total NOTIFY changed)
+    /// name of each category -> what this item holds in it
+    Q_PROPERTY(QVariantMap categories READ categories NOTIFY changed)
+    /// what the whole process holds
+    Q_PROPERTY(qreal processTotal READ processTotal NOTIFY changed)
+    Q_PROPERTY(QVariantMap processCategories READ processCategories NOTIFY changed)
+    /// shared by every item; 0 is no limit
+    Q_PROPERTY(int budget READ budget WRITE setBudget NOTIFY changed)
+
+public:
+    GpuMemoryStats(const QSharedPointer<GpuMemory::Account>& account, QObject* parent = nullptr);
+    ~GpuMemoryStats();
+
+    qreal total() const;
+    QVariantMap categories() const;
+    qreal processTotal() const;
+    QVariantMap processCategories() const;
+    int budget() const;
+    void setBudget(int budget);
+    Q_SIGNAL void changed();
+
+    Q_INVOKABLE void log() const;
+
+private:
+    QSharedPointer<GpuMemory::Account> m_account;
+    QTimer* m_timer;
+};
@@ -0,0 +1,362 @@
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QThreadPool>
+#include "history.h"
+#include "tiledsurface.h"
+
+namespace {
+
+constexpr int TileBytes = TiledSurface::TileSize * TiledSurface::TileSize * 4;
+
+}
+
+History::History(TiledSurface* surface)
+{
+    if (surface != nullptr)
+        attach(surface);
+}
+
+History::~History()
+{
+    for (auto surface : qAsConst(m_surfaces))
+        surface->setWriteHook(nullptr);
+    if (m_open != nullptr)
+        free(m_open);
+    for (auto step : qAsConst(m_undo))
+        free(step);
+    for (auto step : qAsConst(m_redo))
+        free(step);
+
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+    for (const auto& readback : qAsConst(m_inFlight)) {
+        fns.glDeleteSync(readback.fence);
+        m_buffers << readback.buffer;
+    }
+    for (auto buffer : qAsConst(m_buffers))
+        GpuMemory::untrack(buffer);
+    qDeleteAll(m_buffers);
+}
+
+void History::setSettings(const Settings& settings)
+{
+    m_settings = settings;
+    enforce();
+}
+
+void History::attach(TiledSurface* surface)
+{
+    m_surfaces << surface;
+    surface->setWriteHook([this, surface](const QPoint& tile) {
+        if (m_open != nullptr)
+            touch(surface, tile);
+    });
+}
+
+void History::detach(TiledSurface* surface)
+{
+    if (!m_surfaces.removeOne(surface))
+        return;
+    surface->setWriteHook(nullptr);
+
+    const auto forget = [surface](Step* step) {
+        for (int i = step->entries.size() - 1; i >= 0; i--) {
+            if (step->entries[i].surface != surface)
+                continue;
+            discard(step->entries[i].snapshot.gpu);
+            step->entries.remove(i);
+        }
+    };
+    const auto prune = [this, &forget](QVector<Step*>& steps) {
+        for (int i = steps.size() - 1; i >= 0; i--) {
+            forget(steps[i]);
+            if (steps[i]->entries.isEmpty())
+                free(steps.takeAt(i));
+        }
+    };
+    if (m_open != nullptr) {
+        forget(m_open);
+        for (auto it = m_openTiles.begin(); it != m_openTiles.end();) {
+            if (it->first == surface)
+                it = m_openTiles.erase(it);
+            else
+                it++;
+        }
+    }
+    prune(m_undo);
+    prune(m_redo);
+}
+
+void History::begin()
+{
+    if (m_open != nullptr)
+        end();
+
+    m_open = new Step;
+}
+
+void History::touch(TiledSurface* surface, const QPoint& tile)
+{
+    if (m_open == nullptr)
+        return;
+
+    const auto key = qMakePair(surface, TiledSurface::key(tile));
+    if (m_openTiles.contains(key))
+        return;
+
+    m_openTiles << key;
+    m_open->entries << Entry{surface, tile, capture(surface, tile)};
+}
+
+void History::end()
+{
+    if (m_open == nullptr)
+        return;
+
+    auto step = m_open;
+    m_open = nullptr;
+    m_openTiles.clear();
+
+    if (step->entries.isEmpty()) {
+        free(step);
+        return;
+    }
+
+    for (auto redo : qAsConst(m_redo))
+        free(redo);
+    m_redo.clear();
+
+    m_undo << step;
+    enforce();
+}
+
+DirtyRegion History::undo()
+{
+    if (m_undo.isEmpty())
+        return DirtyRegion();
+
+    auto step = m_undo.takeLast();
+    const auto ret = swap(step);
+    m_redo << step;
+    enforce();
+    return ret;
+}
+
+DirtyRegion History::redo()
+{
+    if (m_redo.isEmpty())
+        return DirtyRegion();
+
+    auto step = m_redo.takeLast();
+    const auto ret = swap(step);
+    m_undo << step;
+    enforce();
+    return ret;
+}
+
+qint64 History::bytes() const
+{
+    qint64 ret = 0;
+    for (auto step : m_undo)
+        ret += bytes(step);
+    for (auto step : m_redo)
+        ret += bytes(step);
+    return ret;
+}
+
+void History::releaseGpu()
+{
+    for (auto step : qAsConst(m_undo))
+        demote(step);
+    for (auto step : qAsConst(m_redo))
+        demote(step);
+}
+
+History::Snapshot History::capture(TiledSurface* surface, const QPoint& coord)
+{
+    Snapshot ret;
+    auto tile = surface->tile(coord);
+    if (tile == nullptr)
+        return ret;
+
+    ret.gpu = new QOpenGLFramebufferObject(TiledSurface::TileSize, TiledSurface::TileSize);
+    GpuMemory::track(ret.gpu, m_account, GpuMemory::History);
+    const QRect rect(0, 0, TiledSurface::TileSize, TiledSurface::TileSize);
+    QOpenGLFramebufferObject::blitFramebuffer(ret.gpu, rect, tile->fbo, rect, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    return ret;
+}
+
+void History::restore(TiledSurface* surface, const QPoint& coord, const Snapshot& snapshot)
+{
+    if (snapshot.isBlank()) {
+        surface->dropTile(coord);
+        return;
+    }
+
+    auto tile = surface->ensureTile(coord);
+    if (snapshot.gpu != nullptr) {
+        const QRect rect(0, 0, TiledSurface::TileSize, TiledSurface::TileSize);
+        QOpenGLFramebufferObject::blitFramebuffer(tile->fbo, rect, snapshot.gpu, rect, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        return;
+    }
+
+    const QByteArray pixels = qUncompress(snapshot.cpu);
+    if (pixels.size() != TileBytes)
+        return;
+
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+    fns.glBindTexture(GL_TEXTURE_2D, tile->fbo->texture());
+    fns.glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TiledSurface::TileSize, TiledSurface::TileSize, GL_RGBA, GL_UNSIGNED_BYTE, pixels.constData());
+    fns.glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+DirtyRegion History::swap(Step* step)
+{
+    DirtyRegion ret;
+    for (auto& entry : step->entries) {
+        // capture before restoring, so the step flips between undo and redo
+        Snapshot current = capture(entry.surface, entry.tile);
+        restore(entry.surface, entry.tile, entry.snapshot);
+        discard(entry.snapshot.gpu);
+        entry.snapshot = current;
+        ret.add(TiledSurface::tileRect(entry.tile));
+    }
+    return ret;
+}
+
+void History::demote(Step* step)
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    for (auto& entry : step->entries) {
+        auto gpu = entry.snapshot.gpu;
+        if (gpu == nullptr || entry.snapshot.demotion)
+            continue;
+
+        QOpenGLBuffer* buffer = nullptr;
+        if (!m_buffers.isEmpty()) {
+            buffer = m_buffers.takeLast();
+        } else {
+            buffer = new QOpenGLBuffer(QOpenGLBuffer::PixelPackBuffer);
+            buffer->setUsagePattern(QOpenGLBuffer::StreamRead);
+            buffer->create();
+            buffer->bind();
+            buffer->allocate(TileBytes);
+            buffer->release();
+            GpuMemory::track(buffer, m_account, GpuMemory::History, TileBytes, QStringLiteral("history readback buffer"));
+        }
+
+        // with a pack buffer bound, glReadPixels only queues a copy and returns
+        gpu->bind();
+        buffer->bind();
+        fns.glReadPixels(0, 0, TiledSurface::TileSize, TiledSurface::TileSize, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        buffer->release();
+        gpu->release();
+
+        entry.snapshot.demotion = QSharedPointer<Demotion>::create();
+        m_inFlight << Readback{entry.snapshot.demotion, buffer, fns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)};
+        m_demoting++;
+    }
+}
+
+void History::step()
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    // fences signal in submission order, so the first unsignalled one ends the scan
+    int finished = 0;
+    for (const auto& readback : qAsConst(m_inFlight)) {
+        if (fns.glClientWaitSync(readback.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            break;
+        fns.glDeleteSync(readback.fence);
+        finished++;
+
+        readback.buffer->bind();
+        auto mapped = static_cast<const char*>(readback.buffer->mapRange(0, TileBytes, QOpenGLBuffer::RangeRead));
+        if (mapped != nullptr) {
+            QByteArray pixels(mapped, TileBytes);
+            readback.buffer->unmap();
+            QThreadPool::globalInstance()->start([demotion = readback.demotion, pixels] {
+                demotion->compressed = qCompress(pixels, 1);
+                demotion->done.store(true, std::memory_order_release);
+            });
+        } else {
+            // the snapshot stays on the GPU, and isn't tried again
+            qWarning("History: couldn't map a snapshot's readback");
+            readback.demotion->failed = true;
+            readback.demotion->done.store(true, std::memory_order_release);
+        }
+        readback.buffer->release();
+        m_buffers << readback.buffer;
+    }
+    m_inFlight.remove(0, finished);
+
+    if (m_demoting == 0)
+        return;
+    // counted again, since snapshots that were swapped or freed took their demotions with them
+    m_demoting = 0;
+    const auto takeIn = [this](Step* step) {
+        for (auto& entry : step->entries) {
+            auto& snapshot = entry.snapshot;
+            if (!snapshot.demotion)
+                continue;
+            if (!snapshot.demotion->done.load(std::memory_order_acquire)) {
+                m_demoting++;
+                continue;
+            }
+            if (snapshot.demotion->failed)
+                continue;
+            snapshot.cpu = snapshot.demotion->compressed;
+            snapshot.demotion.reset();
+            discard(snapshot.gpu);
+            snapshot.gpu = nullptr;
+        }
+    };
+    for (auto step : qAsConst(m_undo))
+        takeIn(step);
+    for (auto step : qAsConst(m_redo))
+        takeIn(step);
+}
+
+void History::discard(QOpenGLFramebufferObject* gpu)
+{
+    GpuMemory::untrack(gpu);
+    delete gpu;
+}
+
+void History::free(Step* step)
+{
+    for (auto& entry : step->entries)
+        discard(entry.snapshot.gpu);
+    delete step;
+}
+
+qint64 History::bytes(const Step* step) const
+{
+    qint64 ret = 0;
+    for (const auto& entry : step->entries) {
+        if (entry.snapshot.gpu != nullptr)
+            ret += TileBytes;
+        ret += entry.snapshot.cpu.size();
+    }
+    return ret;
+}
+
+void History::enforce()
+{
+    for (int i = 0; i < m_undo.size() - m_settings.gpuSteps; i++)
+        demote(m_undo[i]);
+    for (int i = 0; i < m_redo.size() - m_settings.gpuSteps; i++)
+        demote(m_redo[i]);
+
+    // the oldest undo steps go first, then the furthest redo steps
+    while (bytes() > m_settings.budget && !m_undo.isEmpty())
+        free(m_undo.takeFirst());
+    while (bytes() > m_settings.budget && !m_redo.isEmpty())
+        free(m_redo.takeFirst());
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <QByteArray>
+#include <QPair>
+#include <QPoint>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVector>
+#include <atomic>
+#include <qopengl.h>
+#include "dirtyregion.h"
+#include "gpumemory.h"
+
+class QOpenGLBuffer;
+class QOpenGLFramebufferObject;
+class TiledSurface;
+
+/// undo/redo for TiledSurfaces that only keeps the tiles each step changed
+///
+/// while a step is open, every tile is copied right before its first write.
+/// undoing swaps those copies with the tiles' current contents, so the same
+/// step then serves as its own redo. the most recent steps keep their copies
+/// on the GPU; older ones are read back through pixel buffer objects and
+/// compressed on the global thread pool, and keep their GPU copies until
+/// that's done. once the whole history is over budget the oldest steps are
+/// dropped. one history can watch several surfaces, so steps on different
+/// layers undo in order.
+class History
+{
+public:
+    struct Settings {
+        /// upper bound on the memory held by snapshots, in bytes
+        qint64 budget = 256 * 1024 * 1024;
+        /// how many steps on either side of the present keep GPU copies
+        int gpuSteps = 4;
+    };
+
+    /// watches surface, if given
+    explicit History(TiledSurface* surface = nullptr);
+    ~History();
+    Q_DISABLE_COPY(History)
+
+    const Settings& settings() const { return m_settings; }
+    void setSettings(const Settings& settings);
+
+    /// who the GPU snapshots are accounted to
+    void setAccount(GpuMemory::Account* account) { m_account = account; }
+
+    /// records writes to surface from now on
+    void attach(TiledSurface* surface);
+    /// stops watching surface and forgets everything recorded on it
+    void detach(TiledSurface* surface);
+
+    /// opens a step; writes to the surfaces are recorded until end()
+    void begin();
+    /// snapshots a tile into the open step, if it isn't in there already
+    void touch(TiledSurface* surface, const QPoint& tile);
+    /// closes the open step; steps that touched nothing are discarded
+    void end();
+    bool isRecording() const { return m_open != nullptr; }
+
+    bool canUndo() const { return !m_undo.isEmpty(); }
+    bool canRedo() const { return !m_redo.isEmpty(); }
+    /// both return the area that changed, on whichever surfaces it was
+    DirtyRegion undo();
+    DirtyRegion redo();
+
+    qint64 bytes() const;
+    /// starts reading every GPU snapshot back into system memory, whatever the settings say
+    void releaseGpu();
+    /// collects finished readbacks and swaps compressed snapshots in for their GPU copies; call once a frame
+    void step();
+    /// whether step() has more work to do on later frames
+    bool isBusy() const { return m_demoting > 0 || !m_inFlight.isEmpty(); }
+
+private:
+    /// a GPU snapshot on its way into system memory
+    struct Demotion {
+        /// qCompress'd rgba8 pixels, once done is set
+        QByteArray compressed;
+        /// set along with done when the readback couldn't be mapped; the snapshot stays on the GPU
+        bool failed = false;
+        std::atomic<bool> done = {false};
+    };
+    struct Snapshot {
+        QOpenGLFramebufferObject* gpu = nullptr;
+        /// qCompress'd rgba8 pixels
+        QByteArray cpu;
+        /// while gpu is being read back; dropped along with the snapshot if it's swapped or freed first
+        QSharedPointer<Demotion> demotion;
+
+        bool isBlank() const { return gpu == nullptr && cpu.isEmpty(); }
+    };
+    struct Readback {
+        QSharedPointer<Demotion> demotion;
+        QOpenGLBuffer* buffer = nullptr;
+        GLsync fence = nullptr;
+    };
+    struct Entry {
+        TiledSurface* surface;
+        QPoint tile;
+        Snapshot snapshot;
+    };
+    struct Step {
+        QVector<Entry> entries;
+    };
+
+    Snapshot capture(TiledSurface* surface, const QPoint& tile);
+    void restore(TiledSurface* surface, const QPoint& tile, const Snapshot& snapshot);
+    DirtyRegion swap(Step* step);
+    void demote(Step* step);
+    static void discard(QOpenGLFramebufferObject* gpu);
+    void free(Step* step);
+    qint64 bytes(const Step* step) const;
+    void enforce();
+
+    QVector<TiledSurface*> m_surfaces;
+    Settings m_settings;
+    GpuMemory::Account* m_account = nullptr;
+    Step* m_open = nullptr;
+    QSet<QPair<TiledSurface*, quint64>> m_openTiles;
+    /// oldest first
+    QVector<Step*> m_undo;
+    /// the most recently undone step is at the back
+    QVector<Step*> m_redo;
+
+    /// oldest first
+    QVector<Readback> m_inFlight;
+    QVector<QOpenGLBuffer*> m_buffers;
+    /// snapshots whose demotion has started and hasn't been taken in yet
+    int m_demoting = 0;
+};
@@ -0,0 +1,183 @@
+#include <QMouseEvent>
+#include <QQuickItem>
+#include <QQuickWindow>
+#include <QTabletEvent>
+#include "inputchannel.h"
+#include "journal.h"
+#include "latency.h"
+
+InputChannel::InputChannel(QQuickItem* item, Qt::MouseButtons buttons) : QObject(item), m_item(item), m_buttons(buttons)
+{
+    connect(m_item, &QQuickItem::windowChanged, this, &InputChannel::setWindow);
+    setWindow(m_item->window());
+}
+
+InputChannel::~InputChannel()
+{
+    setWindow(nullptr);
+}
+
+bool InputChannel::push(const InputMessage& message)
+{
+    InputMessage stamped = message;
+    stamped.received = LatencyTracker::now();
+    // published slots may already be being read, so a move coalesces while it's still ours
+    if (message.tag == InputMessage::Move) {
+        if (m_moveWaiting)
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        m_move = stamped;
+        m_moveWaiting = true;
+        // otherwise the item's next frame tries again
+        if (!flushMove(Capacity - Headroom))
+            m_item->update();
+        return true;
+    }
+
+    // the waiting move goes first, into the headroom if it has to
+    if (!flushMove(Capacity) || !publish(stamped, Capacity)) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool InputChannel::flushMove(int limit)
+{
+    if (!m_moveWaiting)
+        return true;
+    if (!publish(m_move, limit))
+        return false;
+    m_moveWaiting = false;
+    return true;
+}
+
+bool InputChannel::publish(const InputMessage& message, int limit)
+{
+    const quint32 head = m_head.load(std::memory_order_relaxed);
+    const quint32 tail = m_tail.load(std::memory_order_acquire);
+    if (head - tail >= quint32(limit))
+        return false;
+
+    m_ring[head % Capacity] = message;
+    m_head.store(head + 1, std::memory_order_release);
+
+    if (m_journal != nullptr)
+        m_journal->append(message);
+
+    if (!m_scheduled.exchange(true, std::memory_order_acq_rel)) {
+        if (m_wake)
+            m_wake();
+        else
+            m_item->update();
+    }
+    return true;
+}
+
+bool InputChannel::pop(InputMessage& message)
+{
+    const quint32 tail = m_tail.load(std::memory_order_relaxed);
+    const quint32 head = m_head.load(std::memory_order_acquire);
+    if (tail == head)
+        return false;
+
+    message = m_ring[tail % Capacity];
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+void InputChannel::beginDrain()
+{
+    m_scheduled.store(false, std::memory_order_release);
+}
+
+StrokeSample InputChannel::mouseSample(QMouseEvent* event) const
+{
+    return StrokeSample{m_transform.map(event->localPos()), qint64(event->timestamp()), 1.0, QPointF()};
+}
+
+void InputChannel::mousePressEvent(QMouseEvent* event)
+{
+    if (m_fillMode) {
+        m_filling = true;
+        push(InputMessage::CFill(mouseSample(event)));
+        return;
+    }
+    push(InputMessage::CDown(mouseSample(event)));
+}
+
+void InputChannel::mouseMoveEvent(QMouseEvent* event)
+{
+    if (m_filling)
+        return;
+    push(InputMessage::CMove(mouseSample(event)));
+}
+
+void InputChannel::mouseReleaseEvent(QMouseEvent*)
+{
+    if (m_filling) {
+        m_filling = false;
+        return;
+    }
+    push(InputMessage::CUp());
+}
+
+bool InputChannel::eventFilter(QObject* watched, QEvent* event)
+{
+    if (watched != m_window)
+        return false;
+
+    switch (event->type()) {
+    case QEvent::TabletPress:
+    case QEvent::TabletMove:
+    case QEvent::TabletRelease:
+        break;
+    default:
+        return false;
+    }
+
+    auto tablet = static_cast<QTabletEvent*>(event);
+    const QPointF pos = m_item->mapFromScene(tablet->posF());
+    const StrokeSample sample{m_transform.map(pos), qint64(tablet->timestamp()), tablet->pressure(), QPointF(tablet->xTilt(), tablet->yTilt())};
+
+    switch (event->type()) {
+    case QEvent::TabletPress:
+        if (!(tablet->button() & m_buttons) || !m_item->isVisible() || !m_item->contains(pos))
+            return false;
+        m_tabletActive = true;
+        m_filling = m_fillMode;
+        push(m_filling ? InputMessage::CFill(sample) : InputMessage::CDown(sample));
+        break;
+    case QEvent::TabletMove:
+        if (!m_tabletActive)
+            return false;
+        if (!m_filling)
+            push(InputMessage::CMove(sample));
+        break;
+    case QEvent::TabletRelease:
+        if (!m_tabletActive)
+            return false;
+        m_tabletActive = false;
+        if (!m_filling)
+            push(InputMessage::CUp());
+        m_filling = false;
+        break;
+    default:
+        break;
+    }
+
+    // accepting it keeps Qt from synthesizing a mouse event for the same input
+    tablet->accept();
+    return true;
+}
+
+void InputChannel::setWindow(QQuickWindow* window)
+{
+    if (m_window == window)
+        return;
+
+    if (m_window != nullptr)
+        m_window->removeEventFilter(this);
+    m_window = window;
+    if (m_window != nullptr)
+        m_window->installEventFilter(this);
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <QObject>
+#include <QPointer>
+#include <QTransform>
+#include <array>
+#include <atomic>
+#include <functional>
+#include "stroke.h"
+
+class QMouseEvent;
+class QQuickItem;
+class QQuickWindow;
+class StrokeJournal;
+
+/// a change an item made to its layers, as the journal keeps it
+struct LayerChange {
+    enum Type {
+        Select,
+        Add,
+        Remove,
+        Move,
+        /// opacity, mode or visibility
+        Set,
+    };
+    Type type;
+    quint32 id;
+    /// Add and Move: where the layer ends up, counting from the bottom
+    int index;
+    /// Set: the layer's state from then on
+    float opacity;
+    quint8 mode;
+    bool visible;
+};
+
+struct InputMessage {
+    enum Type {
+        Down,
+        Move,
+        Up,
+        Undo,
+        Redo,
+        /// a bucket fill at a point
+        Fill,
+        /// the preset later strokes and fills use; only ever journaled and replayed,
+        /// since live changes go to the pipeline directly
+        Brush,
+        /// a change to the item's layers; only ever journaled and replayed
+        Layer,
+    };
+    Type tag;
+    /// when the gui thread pushed this, on LatencyTracker's clock
+    qint64 received = 0;
+    union {
+        struct {
+            StrokeSample sample;
+        } down;
+        struct {
+            StrokeSample sample;
+        } move;
+        struct {
+        } up;
+        struct {
+            StrokeSample sample;
+        } fill;
+        struct {
+            /// qHash of the preset's name, which survives presets being added or reordered
+            uint name;
+        } brush;
+        struct {
+            LayerChange change;
+        } layer;
+    };
+    InputMessage() { }
+    static InputMessage CDown(const StrokeSample& sample) {
+        InputMessage ret; { ret.tag = Down; ret.down = {sample}; }; return ret;
+    }
+    static InputMessage CMove(const StrokeSample& sample) {
+        InputMessage ret; { ret.tag = Move; ret.move = {sample}; }; return ret;
+    }
+    static InputMessage CUp() {
+        InputMessage ret; { ret.tag = Up; ret.up = {}; }; return ret;
+    }
+    static InputMessage CUndo() {
+        InputMessage ret; { ret.tag = Undo; }; return ret;
+    }
+    static InputMessage CRedo() {
+        InputMessage ret; { ret.tag = Redo; }; return ret;
+    }
+    static InputMessage CFill(const StrokeSample& sample) {
+        InputMessage ret; { ret.tag = Fill; ret.fill = {sample}; }; return ret;
+    }
+    static InputMessage CBrush(uint name) {
+        InputMessage ret; { ret.tag = Brush; ret.brush = {name}; }; return ret;
+    }
+    static InputMessage CLayer(const LayerChange& change) {
+        InputMessage ret; { ret.tag = Layer; ret.layer = {change}; }; return ret;
+    }
+};
+
+/// carries input from an item on the gui thread to whatever consumes it
+///
+/// a preallocated single-producer single-consumer ring: the gui thread
+/// pushes, the consumer pops, and neither allocates or locks. the consumer
+/// (the item's update(), unless one is set) is only woken when it has caught
+/// up with everything pushed before, so a 1000 Hz tablet doesn't turn into
+/// 1000 wakeups.
+///
+/// moves may only fill the ring up to Headroom slots short of Capacity. past
+/// that the newest one waits on the gui thread, replacing the one that waited
+/// before it, until there's room again at the item's next synchronize or
+/// another message has to go after it; so a consumer that falls behind costs a
+/// stroke detail, never its ends.
+///
+/// it also picks up tablet events from the item's window, which Qt Quick would
+/// otherwise turn into mouse events without pressure or tilt.
+class InputChannel : public QObject
+{
+    Q_OBJECT
+
+public:
+    static constexpr int Capacity = 1024;
+    /// slots only messages that can't be coalesced, like Down and Up, may use
+    static constexpr int Headroom = 64;
+
+    InputChannel(QQuickItem* item, Qt::MouseButtons buttons);
+    ~InputChannel();
+
+    /// gui thread; returns false and drops the message if the renderer is
+    /// more than Capacity messages behind. moves are always taken, but may be coalesced
+    bool push(const InputMessage& message);
+    /// consumer thread
+    bool pop(InputMessage& message);
+    /// consumer thread; call before draining so pushes racing with the drain
+    /// still wake the consumer again
+    void beginDrain();
+
+    /// gui thread, or the render thread with it blocked in synchronize; publishes the move waiting
+    /// for room if there's room now, and returns whether one is still waiting
+    bool flush() { return !flushMove(Capacity - Headroom); }
+
+    /// messages dropped, and moves coalesced away
+    quint64 dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    /// gui thread; everything pushed from now on is also appended to journal
+    void setJournal(StrokeJournal* journal) { m_journal = journal; }
+    /// gui thread; maps item positions to the positions samples carry
+    void setTransform(const QTransform& transform) { m_transform = transform; }
+    /// gui thread; called from push() in place of updating the item, or nullptr to go back to that
+    void setConsumer(const std::function<void()>& wake) { m_wake = wake; }
+    /// gui thread; presses push a Fill instead of starting a stroke, and the rest of
+    /// the press is swallowed. a stroke already in progress still ends normally
+    void setFillMode(bool fill) { m_fillMode = fill; }
+
+    void mousePressEvent(QMouseEvent* event);
+    void mouseMoveEvent(QMouseEvent* event);
+    void mouseReleaseEvent(QMouseEvent* event);
+
+protected:
+    bool eventFilter(QObject* watched, QEvent* event) override;
+
+private:
+    void setWindow(QQuickWindow* window);
+    StrokeSample mouseSample(QMouseEvent* event) const;
+    /// puts message in the ring if fewer than limit slots are taken
+    bool publish(const InputMessage& message, int limit);
+    /// publishes the move waiting for room, if any
+    bool flushMove(int limit);
+
+    QQuickItem* m_item;
+    Qt::MouseButtons m_buttons;
+    QPointer<QQuickWindow> m_window;
+    bool m_tabletActive = false;
+    bool m_fillMode = false;
+    /// a press turned into a Fill, whose moves and release go nowhere
+    bool m_filling = false;
+    StrokeJournal* m_journal = nullptr;
+    QTransform m_transform;
+    std::function<void()> m_wake;
+    /// the newest move that didn't fit, if m_moveWaiting
+    InputMessage m_move;
+    bool m_moveWaiting = false;
+
+    std::array<InputMessage, Capacity> m_ring;
+    std::atomic<quint32> m_head = {0};
+    std::atomic<quint32> m_tail = {0};
+    std::atomic<bool> m_scheduled = {false};
+    std::atomic<quint64> m_dropped = {0};
+};
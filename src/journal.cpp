@@ -0,0 +1,281 @@
+#include <QDir>
+#include <QFileInfo>
+#include <cstring>
+#include <utility>
+#include "journal.h"
+
+namespace {
+
+constexpr char Magic[4] = {'B', 'R', 'J', '1'};
+constexpr quint32 Version = 2;
+/// the file grows by this much whenever it runs out of room
+constexpr qint64 Growth = 4 * 1024 * 1024;
+/// past this the journal drops appends until the next checkpoint; about half an hour of a 1000 Hz tablet
+constexpr qint64 Limit = 64 * 1024 * 1024;
+/// how long the writer lets a batch build up
+constexpr auto BatchInterval = std::chrono::milliseconds(50);
+
+}
+
+StrokeJournal::StrokeJournal(const QString& path) : m_file(path)
+{
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    if (!m_file.open(QIODevice::ReadWrite))
+        return;
+
+    const bool fresh = m_file.size() < qint64(sizeof(Header));
+    if (!reserve(fresh ? Growth : m_file.size()))
+        return;
+
+    if (fresh || std::memcmp(header()->magic, Magic, sizeof(Magic)) != 0 || header()->version != Version) {
+        std::memcpy(header()->magic, Magic, sizeof(Magic));
+        header()->version = Version;
+        header()->used = 0;
+        header()->base = 0;
+    }
+    if (recordsAt(header()->base) > m_mapped) {
+        header()->used = 0;
+        header()->base = 0;
+    }
+
+    // whatever survived the last session
+    m_base = QByteArray(reinterpret_cast<const char*>(m_map + sizeof(Header)), int(header()->base));
+    const qint64 at = recordsAt(header()->base);
+    const quint64 used = qMin<quint64>(header()->used, quint64(m_mapped - at));
+    const int count = int(used / sizeof(Record));
+    header()->used = quint64(count) * sizeof(Record);
+    m_position = quint64(count);
+    auto records = reinterpret_cast<const Record*>(m_map + at);
+    m_replay.reserve(count);
+    for (int i = 0; i < count; i++) {
+        const auto& record = records[i];
+        const auto& fields = record.sample;
+        const StrokeSample sample{QPointF(fields.x, fields.y), record.timestamp, fields.pressure, QPointF(fields.tiltX, fields.tiltY)};
+        switch (InputMessage::Type(record.type)) {
+        case InputMessage::Down:
+            m_replay << InputMessage::CDown(sample);
+            break;
+        case InputMessage::Move:
+            m_replay << InputMessage::CMove(sample);
+            break;
+        case InputMessage::Up:
+            m_replay << InputMessage::CUp();
+            break;
+        case InputMessage::Undo:
+            m_replay << InputMessage::CUndo();
+            break;
+        case InputMessage::Redo:
+            m_replay << InputMessage::CRedo();
+            break;
+        case InputMessage::Fill:
+            m_replay << InputMessage::CFill(sample);
+            break;
+        case InputMessage::Brush:
+            m_replay << InputMessage::CBrush(record.brush);
+            break;
+        case InputMessage::Layer: {
+            const auto& fields = record.layer;
+            const LayerChange change{LayerChange::Type(fields.type), fields.id, fields.index, fields.opacity, fields.mode, fields.visible != 0};
+            m_replay << InputMessage::CLayer(change);
+            break;
+        }
+        }
+    }
+
+    m_open = true;
+    m_writer = std::thread([this] { run(); });
+}
+
+StrokeJournal::~StrokeJournal()
+{
+    if (m_writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        m_writer.join();
+    }
+
+    if (m_map != nullptr) {
+        const qint64 size = recordsAt(header()->base) + qint64(header()->used);
+        m_file.unmap(m_map);
+        m_map = nullptr;
+        m_file.resize(size);
+    }
+}
+
+void StrokeJournal::append(const InputMessage& message)
+{
+    if (!isOpen())
+        return;
+
+    Record record = {};
+    record.type = quint8(message.tag);
+    switch (message.tag) {
+    case InputMessage::Down:
+    case InputMessage::Move:
+    case InputMessage::Fill: {
+        const auto& sample = message.tag == InputMessage::Down ? message.down.sample
+            : message.tag == InputMessage::Move ? message.move.sample : message.fill.sample;
+        record.sample.x = float(sample.pos.x());
+        record.sample.y = float(sample.pos.y());
+        record.sample.pressure = float(sample.pressure);
+        record.sample.tiltX = float(sample.tilt.x());
+        record.sample.tiltY = float(sample.tilt.y());
+        record.timestamp = sample.timestamp;
+        break;
+    }
+    case InputMessage::Brush:
+        record.brush = message.brush.name;
+        break;
+    case InputMessage::Layer: {
+        const auto& change = message.layer.change;
+        record.layer.id = change.id;
+        record.layer.index = change.index;
+        record.layer.opacity = change.opacity;
+        record.layer.type = quint8(change.type);
+        record.layer.mode = change.mode;
+        record.layer.visible = change.visible ? 1 : 0;
+        break;
+    }
+    default:
+        break;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending << record;
+    m_position++;
+}
+
+quint64 StrokeJournal::position() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_position;
+}
+
+void StrokeJournal::checkpoint(const QByteArray& base, quint64 position)
+{
+    if (!isOpen())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // saves can finish out of order; an older checkpoint has nothing left to drop
+        if (m_checkpoint.pending && position < m_checkpoint.position)
+            return;
+        m_checkpoint.base = base;
+        m_checkpoint.position = qMin(position, m_position);
+        m_checkpoint.pending = true;
+    }
+    m_wake.notify_one();
+}
+
+QVector<InputMessage> StrokeJournal::takeReplay()
+{
+    return std::move(m_replay);
+}
+
+bool StrokeJournal::reserve(qint64 bytes)
+{
+    if (m_map != nullptr && bytes <= m_mapped)
+        return true;
+
+    if (m_map != nullptr) {
+        m_file.unmap(m_map);
+        m_map = nullptr;
+    }
+    if (m_file.size() < bytes && !m_file.resize(bytes))
+        return false;
+
+    m_map = m_file.map(0, bytes);
+    m_mapped = m_map != nullptr ? bytes : 0;
+    return m_map != nullptr;
+}
+
+void StrokeJournal::run()
+{
+    QVector<Record> batch;
+    for (;;) {
+        bool stop;
+        QByteArray checkpointBase;
+        quint64 checkpointPosition = 0;
+        bool checkpointing;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait_for(lock, BatchInterval, [this] { return m_stop || m_checkpoint.pending; });
+            std::swap(batch, m_pending);
+            checkpointing = std::exchange(m_checkpoint.pending, false);
+            checkpointBase = std::move(m_checkpoint.base);
+            checkpointPosition = m_checkpoint.position;
+            stop = m_stop;
+        }
+
+        // the batch holds everything appended before the checkpoint that isn't in the file yet
+        write(batch);
+        batch.clear();
+        if (checkpointing)
+            compact(checkpointBase, checkpointPosition);
+        if (stop)
+            return;
+    }
+}
+
+void StrokeJournal::write(const QVector<Record>& records)
+{
+    if (records.isEmpty() || m_map == nullptr)
+        return;
+
+    const qint64 bytes = qint64(records.size()) * sizeof(Record);
+    const qint64 at = recordsAt(header()->base) + qint64(header()->used);
+    const qint64 end = at + bytes;
+    if (end > Limit) {
+        if (!m_full)
+            qWarning("StrokeJournal: %s is full, input isn't journaled until the next checkpoint", qPrintable(path()));
+        m_full = true;
+        return;
+    }
+    if (end > m_mapped && !reserve((end / Growth + 1) * Growth))
+        return;
+
+    std::memcpy(m_map + at, records.constData(), bytes);
+    // records first, then the length that makes them visible to a replay
+    std::atomic_thread_fence(std::memory_order_release);
+    header()->used += bytes;
+}
+
+void StrokeJournal::compact(const QByteArray& base, quint64 position)
+{
+    if (m_map == nullptr || position < m_start)
+        return;
+
+    const quint64 count = header()->used / sizeof(Record);
+    const quint64 drop = qMin<quint64>(position - m_start, count);
+    const qint64 kept = qint64(count - drop) * qint64(sizeof(Record));
+    const qint64 from = recordsAt(header()->base) + qint64(drop * sizeof(Record));
+    const qint64 to = recordsAt(base.size());
+    if (!reserve(to + kept))
+        return;
+
+    // a crash halfway through replays nothing rather than garbage
+    header()->used = 0;
+    header()->base = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memmove(m_map + to, m_map + from, size_t(kept));
+    std::memcpy(m_map + sizeof(Header), base.constData(), size_t(base.size()));
+    header()->base = quint32(base.size());
+    std::atomic_thread_fence(std::memory_order_release);
+    header()->used = quint64(kept);
+    m_start = position;
+    m_full = false;
+
+    // give back what the dropped records took
+    const qint64 size = ((to + kept) / Growth + 1) * Growth;
+    if (m_mapped > size) {
+        m_file.unmap(m_map);
+        m_map = nullptr;
+        m_mapped = 0;
+        m_file.resize(size);
+        reserve(size);
+    }
+}
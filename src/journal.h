@@ -0,0 +1,110 @@
+#pragma once
+
+#include <QFile>
+#include <QVector>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "inputchannel.h"
+
+/// an append-only, memory-mapped log of an item's input messages
+///
+/// the gui thread only copies messages into a pending batch; a writer thread
+/// moves batches into the mapped file every few dozen milliseconds, growing it
+/// in large steps. since the bytes live in the page cache as soon as they're
+/// copied, a crash of the app loses at most the batch in flight. whatever was
+/// in the file when it was opened can be taken for replay.
+///
+/// a checkpoint drops the records some saved state already holds, leaving an
+/// opaque base that says how to get that state back, and shrinks the file.
+class StrokeJournal
+{
+public:
+    explicit StrokeJournal(const QString& path);
+    ~StrokeJournal();
+    Q_DISABLE_COPY(StrokeJournal)
+
+    bool isOpen() const { return m_open; }
+    QString path() const { return m_file.fileName(); }
+
+    /// gui thread; never touches the disk
+    void append(const InputMessage& message);
+    /// the messages the file held when it was opened; empty after the first call
+    QVector<InputMessage> takeReplay();
+    /// the base the file held when it was opened, to be restored before the replay
+    QByteArray base() const { return m_base; }
+
+    /// gui thread, or with it blocked; how many messages have been appended,
+    /// counting the ones the file held when it was opened
+    quint64 position() const;
+    /// gui thread, or with it blocked; drops the messages before position,
+    /// which base now stands in for. the writer applies it with its next batch
+    void checkpoint(const QByteArray& base, quint64 position);
+
+private:
+    struct Header {
+        char magic[4];
+        quint32 version;
+        /// bytes of records after the base
+        quint64 used;
+        /// bytes of base right after the header; the records start at the next whole record
+        quint32 base;
+        quint32 reserved;
+    };
+    /// fixed size and native endian; the journal isn't meant to travel between machines
+    struct Record {
+        quint8 type;
+        quint8 reserved[3];
+        union {
+            /// Down, Move and Fill
+            struct {
+                float x, y;
+                float pressure;
+                float tiltX, tiltY;
+            } sample;
+            /// Brush: the preset's name hash
+            quint32 brush;
+            struct {
+                quint32 id;
+                qint32 index;
+                float opacity;
+                quint8 type;
+                quint8 mode;
+                quint8 visible;
+            } layer;
+        };
+        qint64 timestamp;
+    };
+    static_assert(sizeof(Header) == 24, "journal header layout changed");
+    static_assert(sizeof(Record) == 32, "journal record layout changed");
+
+    bool reserve(qint64 bytes);
+    void run();
+    void write(const QVector<Record>& records);
+    void compact(const QByteArray& base, quint64 position);
+    Header* header() const { return reinterpret_cast<Header*>(m_map); }
+    static qint64 recordsAt(qint64 base) { return qint64(sizeof(Header)) + (base + qint64(sizeof(Record)) - 1) / qint64(sizeof(Record)) * qint64(sizeof(Record)); }
+
+    QFile m_file;
+    bool m_open = false;
+    uchar* m_map = nullptr;
+    qint64 m_mapped = 0;
+    QVector<InputMessage> m_replay;
+    QByteArray m_base;
+    /// writer thread; the position of the file's first record
+    quint64 m_start = 0;
+    /// writer thread; whether appends are being dropped for the file being full
+    bool m_full = false;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    QVector<Record> m_pending;
+    quint64 m_position = 0;
+    struct {
+        QByteArray base;
+        quint64 position = 0;
+        bool pending = false;
+    } m_checkpoint;
+    bool m_stop = false;
+    std::thread m_writer;
+};
@@ -0,0 +1,199 @@
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QTimer>
+#include <algorithm>
+#include <chrono>
+#include "latency.h"
+
+qint64 LatencyTracker::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LatencyTracker::taken(qint64 received)
+{
+    if (received == 0)
+        return;
+
+    m_pending << Record{received, now(), 0, 0};
+}
+
+void LatencyTracker::rendered()
+{
+    const qint64 time = now();
+    for (auto& record : m_pending) {
+        record.rendered = time;
+        m_awaitingSwap << record;
+    }
+    m_pending.clear();
+}
+
+void LatencyTracker::swapped()
+{
+    if (m_awaitingSwap.isEmpty())
+        return;
+
+    const qint64 time = now();
+
+    QMutexLocker locker(&m_mutex);
+    if (m_records.size() < Capacity)
+        m_records.reserve(Capacity);
+    for (auto record : qAsConst(m_awaitingSwap)) {
+        record.swapped = time;
+        if (m_records.size() < Capacity) {
+            m_records << record;
+        } else {
+            m_records[m_next] = record;
+        }
+        m_next = (m_next + 1) % Capacity;
+    }
+    m_awaitingSwap.clear();
+}
+
+static qint64 duration(const LatencyTracker::Record& record, LatencyTracker::Stage stage)
+{
+    switch (stage) {
+    case LatencyTracker::Queue:
+        return record.taken - record.received;
+    case LatencyTracker::Render:
+        return record.rendered - record.taken;
+    case LatencyTracker::Present:
+        return record.swapped - record.rendered;
+    case LatencyTracker::Total:
+    case LatencyTracker::StageCount:
+        break;
+    }
+    return record.swapped - record.received;
+}
+
+LatencyTracker::Percentiles LatencyTracker::percentiles(Stage stage) const
+{
+    QVector<qint64> durations;
+    {
+        QMutexLocker locker(&m_mutex);
+        durations.reserve(m_records.size());
+        for (const auto& record : m_records) {
+            durations << duration(record, stage);
+        }
+    }
+
+    Percentiles ret;
+    if (durations.isEmpty())
+        return ret;
+
+    const auto at = [&durations](qreal fraction) {
+        const int index = qMin(durations.size() - 1, int(fraction * durations.size()));
+        std::nth_element(durations.begin(), durations.begin() + index, durations.end());
+        return durations[index] / 1e6;
+    };
+    ret.p50 = at(0.50);
+    ret.p95 = at(0.95);
+    ret.p99 = at(0.99);
+    return ret;
+}
+
+int LatencyTracker::count() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_records.size();
+}
+
+bool LatencyTracker::dump(const QString& path) const
+{
+    QVector<Record> records;
+    {
+        QMutexLocker locker(&m_mutex);
+        // oldest first
+        records = m_records.mid(m_records.size() < Capacity ? 0 : m_next);
+        records << m_records.mid(0, m_records.size() < Capacity ? 0 : m_next);
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    if (path.endsWith(QLatin1String(".json"))) {
+        QJsonArray array;
+        for (const auto& record : qAsConst(records)) {
+            array << QJsonObject{
+                {QStringLiteral("received"), double(record.received)},
+                {QStringLiteral("taken"), double(record.taken)},
+                {QStringLiteral("rendered"), double(record.rendered)},
+                {QStringLiteral("swapped"), double(record.swapped)},
+            };
+        }
+        file.write(QJsonDocument(array).toJson(QJsonDocument::Compact));
+        return true;
+    }
+
+    QTextStream stream(&file);
+    stream << "received,taken,rendered,swapped\n";
+    for (const auto& record : qAsConst(records)) {
+        stream << record.received << ',' << record.taken << ',' << record.rendered << ',' << record.swapped << '\n';
+    }
+    return true;
+}
+
+LatencyStats::LatencyStats(const QSharedPointer<LatencyTracker>& tracker, QObject* parent) : QObject(parent), m_tracker(tracker), m_timer(new QTimer(this))
+{
+    if (parent != nullptr)
+        m_owner = QString::fromLatin1(parent->metaObject()->className());
+
+    m_timer->setInterval(500);
+    connect(m_timer, &QTimer::timeout, this, &LatencyStats::changed);
+    m_timer->start();
+}
+
+LatencyStats::~LatencyStats()
+{
+    // e.g. BRUSHY_LATENCY_DUMP=/tmp/%1.csv, where %1 becomes the item's type
+    QString path = qEnvironmentVariable("BRUSHY_LATENCY_DUMP");
+    if (path.isEmpty())
+        return;
+    if (path.contains(QLatin1String("%1")))
+        path = path.arg(m_owner);
+    m_tracker->dump(path);
+}
+
+QVariantMap LatencyStats::stage(LatencyTracker::Stage stage) const
+{
+    const auto it = m_tracker->percentiles(stage);
+    return QVariantMap{
+        {QStringLiteral("p50"), it.p50},
+        {QStringLiteral("p95"), it.p95},
+        {QStringLiteral("p99"), it.p99},
+    };
+}
+
+QVariantMap LatencyStats::queue() const
+{
+    return stage(LatencyTracker::Queue);
+}
+
+QVariantMap LatencyStats::render() const
+{
+    return stage(LatencyTracker::Render);
+}
+
+QVariantMap LatencyStats::present() const
+{
+    return stage(LatencyTracker::Present);
+}
+
+QVariantMap LatencyStats::total() const
+{
+    return stage(LatencyTracker::Total);
+}
+
+int LatencyStats::samples() const
+{
+    return m_tracker->count();
+}
+
+bool LatencyStats::dump(const QString& path) const
+{
+    return m_tracker->dump(path);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <QMutex>
+#include <QObject>
+#include <QSharedPointer>
+#include <QVariantMap>
+#include <QVector>
+#include <QtQml/qqml.h>
+
+class QTimer;
+
+/// follows input messages from the event handler to the swapped frame
+///
+/// the gui thread stamps each message when it's pushed; the render thread
+/// reports when it took the messages, when their dabs were drawn and when the
+/// frame holding them was swapped. finished records go into a ring that the
+/// gui thread reads percentiles from.
+class LatencyTracker
+{
+public:
+    enum Stage {
+        /// pushed by the gui thread -> taken by the renderer
+        Queue,
+        /// taken -> dabs drawn
+        Render,
+        /// drawn -> frame swapped
+        Present,
+        /// pushed -> frame swapped
+        Total,
+        StageCount,
+    };
+
+    struct Record {
+        qint64 received;
+        qint64 taken;
+        qint64 rendered;
+        qint64 swapped;
+    };
+
+    struct Percentiles {
+        qreal p50 = 0.0;
+        qreal p95 = 0.0;
+        qreal p99 = 0.0;
+    };
+
+    static constexpr int Capacity = 4096;
+
+    /// nanoseconds on a monotonic clock shared by every thread
+    static qint64 now();
+
+    // render thread
+    void taken(qint64 received);
+    void rendered();
+    void swapped();
+
+    // any thread
+    /// in milliseconds, over the last Capacity records
+    Percentiles percentiles(Stage stage) const;
+    int count() const;
+    /// writes every record in the ring; json if the path ends in .json, csv otherwise
+    bool dump(const QString& path) const;
+
+private:
+    QVector<Record> m_pending;
+    QVector<Record> m_awaitingSwap;
+
+    mutable QMutex m_mutex;
+    QVector<Record> m_records;
+    int m_next = 0;
+};
+
+/// an item's latency percentiles, for QML
+class LatencyStats : public QObject
+{
+    Q_OBJECT
+    QML_ANONYMOUS
+
+    /// each of these is a map with p50, p95 and p99 in milliseconds
+    Q_PROPERTY(QVariantMap queue READ queue NOTIFY changed)
+    Q_PROPERTY(QVariantMap render READ render NOTIFY changed)
+    Q_PROPERTY(QVariantMap present READ present NOTIFY changed)
+    Q_PROPERTY(QVariantMap total READ total NOTIFY changed)
+    Q_PROPERTY(int samples READ samples NOTIFY changed)
+
+public:
+    LatencyStats(const QSharedPointer<LatencyTracker>& tracker, QObject* parent = nullptr);
+    ~LatencyStats();
+
+    QVariantMap queue() const;
+    QVariantMap render() const;
+    QVariantMap present() const;
+    QVariantMap total() const;
+    int samples() const;
+    Q_SIGNAL void changed();
+
+    Q_INVOKABLE bool dump(const QString& path) const;
+
+private:
+    QVariantMap stage(LatencyTracker::Stage stage) const;
+
+    QSharedPointer<LatencyTracker> m_tracker;
+    QTimer* m_timer;
+    QString m_owner;
+};
@@ -0,0 +1,444 @@
+#include <QOpenGLBuffer>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QOpenGLShaderProgram>
+#include "glresources.h"
+#include "gpumemory.h"
+#include "history.h"
+#include "layerstack.h"
+#include "strokebuffer.h"
+
+namespace {
+
+// BlurEngine's passes use the first few
+constexpr int ScratchA = 16;
+constexpr int ScratchB = 17;
+/// a layer tile with the stroke in progress merged in
+constexpr int ScratchStroke = 18;
+
+const char* vsrc =
+    R"(
+    #version 330
+    in highp vec2 vertex;
+    out highp vec2 TextureCoordinates;
+    void main()
+    {
+        gl_Position = vec4(vertex * 2.0 - 1.0, 0.0, 1.0);
+        TextureCoordinates = vertex;
+    }
+    )";
+
+// the separable blend modes of the compositing spec, on straight alpha
+const char* fsrc =
+    R"(
+    #version 330
+    uniform sampler2D backdrop;
+    uniform sampler2D layer;
+    uniform mediump float opacity;
+    uniform int mode;
+    in highp vec2 TextureCoordinates;
+
+    vec3 blend(vec3 b, vec3 s) {
+        if (mode == 1) return b * s;
+        if (mode == 2) return b + s - b * s;
+        if (mode == 3) return mix(2.0 * b * s, 1.0 - 2.0 * (1.0 - b) * (1.0 - s), step(0.5, b));
+        if (mode == 4) return min(b, s);
+        if (mode == 5) return max(b, s);
+        if (mode == 6) return min(b + s, vec3(1.0));
+        return s;
+    }
+
+    void main() {
+        vec4 b = texture(backdrop, TextureCoordinates);
+        vec4 s = texture(layer, TextureCoordinates);
+        float as = s.a * opacity;
+        vec3 mixed = mix(s.rgb, blend(b.rgb, s.rgb), b.a);
+        float ao = as + b.a * (1.0 - as);
+        vec3 co = as * mixed + b.a * b.rgb * (1.0 - as);
+        gl_FragColor = ao > 0.0 ? vec4(co / ao, ao) : vec4(0.0);
+    }
+    )";
+
+struct CompositeProgram : GLResources::Resource
+{
+    QOpenGLShaderProgram program;
+    int vertexLocation;
+    int backdropLocation;
+    int layerLocation;
+    int opacityLocation;
+    int modeLocation;
+    QOpenGLBuffer quad = QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    GpuMemory::Allocation memory;
+
+    CompositeProgram() {
+        program.addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vsrc);
+        program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fsrc);
+        program.link();
+
+        vertexLocation = program.attributeLocation("vertex");
+        backdropLocation = program.uniformLocation("backdrop");
+        layerLocation = program.uniformLocation("layer");
+        opacityLocation = program.uniformLocation("opacity");
+        modeLocation = program.uniformLocation("mode");
+
+        const GLfloat strip[] = {
+            0.0f, 0.0f,
+            1.0f, 0.0f,
+            0.0f, 1.0f,
+            1.0f, 1.0f,
+        };
+        quad.create();
+        quad.bind();
+        quad.allocate(strip, sizeof(strip));
+        quad.release();
+        memory.set(nullptr, GpuMemory::Buffers, sizeof(strip), QStringLiteral("composite quad"));
+    }
+};
+
+const QRect TileBounds(0, 0, TiledSurface::TileSize, TiledSurface::TileSize);
+
+void fill(QOpenGLFramebufferObject* target, const QColor& color)
+{
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+    target->bind();
+    fns.glViewport(0, 0, TiledSurface::TileSize, TiledSurface::TileSize);
+    fns.glClearColor(color.redF(), color.greenF(), color.blueF(), color.alphaF());
+    fns.glClear(GL_COLOR_BUFFER_BIT);
+}
+
+}
+
+LayerStack::LayerStack(History* history, const QColor& paper) : m_history(history), m_paper(paper)
+{
+}
+
+LayerStack::~LayerStack()
+{
+    for (auto layer : qAsConst(m_layers)) {
+        m_history->detach(&layer->surface);
+        delete layer;
+    }
+}
+
+void LayerStack::setSize(const QSize& size)
+{
+    m_size = size;
+    for (auto layer : qAsConst(m_layers)) {
+        layer->surface.setSize(size);
+        if (layer->cpu)
+            layer->cpu->setSize(size);
+        if (layer->mirror)
+            layer->mirror->setSize(size);
+    }
+    m_below.setSize(size);
+    m_above.setSize(size);
+    invalidate(DirtyRegion());
+}
+
+void LayerStack::setAccount(GpuMemory::Account* account)
+{
+    m_account = account;
+    for (auto layer : qAsConst(m_layers))
+        layer->surface.setAccount(account, GpuMemory::Layers);
+    m_below.setAccount(account, GpuMemory::Caches);
+    m_above.setAccount(account, GpuMemory::Caches);
+}
+
+DirtyRegion LayerStack::sync(const QVector<State>& states, quint32 active)
+{
+    bool changed = states.size() != m_layers.size();
+    for (int i = 0; !changed && i < states.size(); i++) {
+        changed = states[i] != m_layers[i]->state;
+    }
+    if (!changed && active == m_active)
+        return DirtyRegion();
+
+    QVector<Layer*> layers;
+    layers.reserve(states.size());
+    for (const auto& state : states) {
+        auto it = layer(state.id);
+        if (it == nullptr) {
+            it = new Layer;
+            it->surface.setSize(m_size);
+            it->surface.setAccount(m_account, GpuMemory::Layers);
+            if (m_backend == CpuSurface::Cpu) {
+                it->cpu.reset(new CpuSurface(Qt::transparent));
+                it->cpu->setSize(m_size);
+            }
+            m_history->attach(&it->surface);
+        }
+        it->state = state;
+        layers << it;
+    }
+    for (auto it : qAsConst(m_layers)) {
+        if (layers.contains(it))
+            continue;
+        // deleting a layer isn't undoable, so neither is anything painted on it
+        m_history->detach(&it->surface);
+        delete it;
+    }
+    m_layers = layers;
+    m_active = active;
+
+    // which cache a change lands in depends on the active layer, so start both over
+    invalidate(DirtyRegion());
+
+    DirtyRegion ret;
+    if (changed)
+        ret.add(QRect(QPoint(0, 0), m_size));
+    return ret;
+}
+
+LayerStack::Layer* LayerStack::layer(quint32 id) const
+{
+    for (auto it : m_layers) {
+        if (it->state.id == id)
+            return it;
+    }
+    return nullptr;
+}
+
+void LayerStack::invalidate(const DirtyRegion& region)
+{
+    if (region.isEmpty()) {
+        m_belowValid.clear();
+        m_aboveValid.clear();
+        return;
+    }
+    for (const auto& rect : region.rects()) {
+        for (const auto& tile : m_below.tilesIn(rect)) {
+            m_belowValid.remove(TiledSurface::key(tile));
+            m_aboveValid.remove(TiledSurface::key(tile));
+        }
+    }
+}
+
+int LayerStack::activeIndex() const
+{
+    for (int i = 0; i < m_layers.size(); i++) {
+        if (m_layers[i]->state.id == m_active)
+            return i;
+    }
+    // with nothing active, everything counts as below
+    return m_layers.size();
+}
+
+bool LayerStack::aboveFlattens() const
+{
+    for (int i = activeIndex() + 1; i < m_layers.size(); i++) {
+        if (m_layers[i]->state.visible && m_layers[i]->state.mode != Normal)
+            return false;
+    }
+    return true;
+}
+
+QOpenGLFramebufferObject* LayerStack::blend(QOpenGLFramebufferObject* backdrop, GLuint layer, qreal opacity, BlendMode mode)
+{
+    auto resources = GLResources::current();
+    auto target = resources->scratch(ScratchA, TileBounds.size());
+    if (target == backdrop)
+        target = resources->scratch(ScratchB, TileBounds.size());
+
+    auto gl = resources->get<CompositeProgram>();
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    target->bind();
+    fns.glViewport(0, 0, TiledSurface::TileSize, TiledSurface::TileSize);
+    fns.glDisable(GL_BLEND);
+    fns.glDisable(GL_DEPTH_TEST);
+
+    fns.glActiveTexture(GL_TEXTURE1);
+    fns.glBindTexture(GL_TEXTURE_2D, layer);
+    fns.glActiveTexture(GL_TEXTURE0);
+    fns.glBindTexture(GL_TEXTURE_2D, backdrop->texture());
+
+    gl->program.bind();
+    gl->program.setUniformValue(gl->backdropLocation, 0);
+    gl->program.setUniformValue(gl->layerLocation, 1);
+    gl->program.setUniformValue(gl->opacityLocation, GLfloat(opacity));
+    gl->program.setUniformValue(gl->modeLocation, int(mode));
+    gl->quad.bind();
+    gl->program.enableAttributeArray(gl->vertexLocation);
+    gl->program.setAttributeBuffer(gl->vertexLocation, GL_FLOAT, 0, 2);
+    gl->quad.release();
+    fns.glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    gl->program.disableAttributeArray(gl->vertexLocation);
+    gl->program.release();
+
+    return target;
+}
+
+QOpenGLFramebufferObject* LayerStack::blend(QOpenGLFramebufferObject* backdrop, const Layer* layer, const QPoint& tile)
+{
+    auto it = layer->surface.tile(tile);
+    if (layer->state.id != m_strokeLayer || m_stroke == nullptr || !m_stroke->hasTile(tile))
+        return blend(backdrop, it->fbo->texture(), layer->state.opacity, layer->state.mode);
+
+    // the stroke lands on the layer before the layer is blended, just like it will once merged
+    auto merged = GLResources::current()->scratch(ScratchStroke, TileBounds.size());
+    if (it != nullptr)
+        QOpenGLFramebufferObject::blitFramebuffer(merged, TileBounds, it->fbo, TileBounds, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    else
+        fill(merged, layer->surface.blank());
+    QMatrix4x4 projection;
+    const QRect rect = TiledSurface::tileRect(tile);
+    projection.ortho(rect.x(), rect.x() + TiledSurface::TileSize, rect.y(), rect.y() + TiledSurface::TileSize, -1, 1);
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+    merged->bind();
+    fns.glViewport(0, 0, TiledSurface::TileSize, TiledSurface::TileSize);
+    m_stroke->drawTile(tile, projection);
+    return blend(backdrop, merged->texture(), layer->state.opacity, layer->state.mode);
+}
+
+bool LayerStack::hasContent(const Layer* layer, const QPoint& tile) const
+{
+    if (layer->surface.tile(tile) != nullptr)
+        return true;
+    return layer->state.id == m_strokeLayer && m_stroke != nullptr && m_stroke->hasTile(tile);
+}
+
+CpuSurface* LayerStack::mirror(Layer* layer)
+{
+    // painting on the cpu keeps a copy up to date anyway
+    if (layer->cpu)
+        return layer->cpu.data();
+
+    if (!layer->mirror) {
+        layer->mirror.reset(new CpuSurface(Qt::transparent));
+        layer->mirror->setSize(m_size);
+        layer->stale.clear();
+        for (const auto& tile : layer->surface.tiles())
+            layer->stale << TiledSurface::key(tile);
+    }
+    if (!layer->stale.isEmpty()) {
+        QVector<QPoint> tiles;
+        tiles.reserve(layer->stale.size());
+        for (auto key : qAsConst(layer->stale))
+            tiles << TiledSurface::fromKey(key);
+        layer->mirror->download(&layer->surface, tiles);
+        layer->stale.clear();
+    }
+    return layer->mirror.data();
+}
+
+void LayerStack::invalidateMirrors(const Layer* layer, const DirtyRegion& region)
+{
+    for (auto it : qAsConst(m_layers)) {
+        if (!it->mirror || (layer != nullptr && it != layer))
+            continue;
+        for (const auto& rect : region.rects()) {
+            for (const auto& tile : it->surface.tilesIn(rect))
+                it->stale << TiledSurface::key(tile);
+        }
+    }
+}
+
+void LayerStack::releaseCaches()
+{
+    m_below.clear();
+    m_above.clear();
+    invalidate(DirtyRegion());
+}
+
+qint64 LayerStack::park(quint64 before, int& budget)
+{
+    qint64 ret = 0;
+    for (auto layer : qAsConst(m_layers))
+        ret += layer->surface.park(before, budget);
+    return ret;
+}
+
+bool LayerStack::isParking() const
+{
+    for (auto layer : m_layers) {
+        if (layer->surface.isParking())
+            return true;
+    }
+    return false;
+}
+
+void LayerStack::flatten(TiledSurface* cache, const QPoint& tile, int from, int to, const QColor& base)
+{
+    QOpenGLFramebufferObject* backdrop = nullptr;
+    for (int i = from; i < to; i++) {
+        const Layer* layer = m_layers[i];
+        if (!layer->state.visible || !hasContent(layer, tile))
+            continue;
+        if (backdrop == nullptr) {
+            backdrop = GLResources::current()->scratch(ScratchA, TileBounds.size());
+            fill(backdrop, base);
+        }
+        backdrop = blend(backdrop, layer, tile);
+    }
+
+    // no tile stands for the base colour, which the composite starts from anyway
+    if (backdrop == nullptr) {
+        cache->dropTile(tile);
+        return;
+    }
+    QOpenGLFramebufferObject::blitFramebuffer(cache->ensureTile(tile)->fbo, TileBounds, backdrop, TileBounds, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+void LayerStack::compose(TiledSurface* target, const DirtyRegion& region)
+{
+    const int active = activeIndex();
+    const bool flattens = aboveFlattens();
+    auto resources = GLResources::current();
+
+    QSet<quint64> tiles;
+    for (const auto& rect : region.rects()) {
+        for (const auto& tile : m_below.tilesIn(rect)) {
+            tiles << TiledSurface::key(tile);
+        }
+    }
+
+    for (auto key : qAsConst(tiles)) {
+        const QPoint tile = TiledSurface::fromKey(key);
+        if (!m_belowValid.contains(key)) {
+            flatten(&m_below, tile, 0, active, m_paper);
+            m_belowValid << key;
+        }
+        if (flattens && !m_aboveValid.contains(key)) {
+            flatten(&m_above, tile, active + 1, m_layers.size(), Qt::transparent);
+            m_aboveValid << key;
+        }
+
+        // paper is what the target's blank tiles read as anyway
+        bool blank = m_below.tile(tile) == nullptr;
+        for (int i = active; blank && i < m_layers.size(); i++) {
+            blank = !m_layers[i]->state.visible || !hasContent(m_layers[i], tile);
+        }
+        if (blank) {
+            target->dropTile(tile);
+            continue;
+        }
+
+        QOpenGLFramebufferObject* backdrop = resources->scratch(ScratchA, TileBounds.size());
+        if (auto below = m_below.tile(tile))
+            QOpenGLFramebufferObject::blitFramebuffer(backdrop, TileBounds, below->fbo, TileBounds, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        else
+            fill(backdrop, m_paper);
+
+        if (active < m_layers.size()) {
+            const Layer* layer = m_layers[active];
+            if (layer->state.visible && hasContent(layer, tile))
+                backdrop = blend(backdrop, layer, tile);
+        }
+
+        if (flattens) {
+            if (auto above = m_above.tile(tile))
+                backdrop = blend(backdrop, above->fbo->texture(), 1.0, Normal);
+        } else {
+            for (int i = active + 1; i < m_layers.size(); i++) {
+                const Layer* layer = m_layers[i];
+                if (layer->state.visible && hasContent(layer, tile))
+                    backdrop = blend(backdrop, layer, tile);
+            }
+        }
+
+        QOpenGLFramebufferObject::blitFramebuffer(target->ensureTile(tile)->fbo, TileBounds, backdrop, TileBounds, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <QColor>
+#include <QScopedPointer>
+#include <QSet>
+#include <QVector>
+#include <qopengl.h>
+#include "cpusurface.h"
+#include "dirtyregion.h"
+#include "tiledsurface.h"
+
+class History;
+class StrokeBuffer;
+class QOpenGLFramebufferObject;
+
+/// a stack of TiledSurface layers over an opaque paper colour
+///
+/// the composite is built from two caches: everything below the active
+/// layer flattened onto the paper, and everything above it flattened onto
+/// transparency. painting on the active layer only re-blends its dirty
+/// tiles between the two, however many layers there are. both caches are
+/// filled a tile at a time as the composite needs them. flattening the
+/// layers above is only exact when they all blend normally, so any other
+/// mode above the active layer makes those layers blend one by one instead.
+class LayerStack
+{
+public:
+    enum BlendMode {
+        Normal,
+        Multiply,
+        Screen,
+        Overlay,
+        Darken,
+        Lighten,
+        Add,
+    };
+
+    /// what the item knows about a layer; the renderer's layers are matched to it by id
+    struct State {
+        quint32 id = 0;
+        qreal opacity = 1.0;
+        BlendMode mode = Normal;
+        bool visible = true;
+
+        bool operator==(const State& other) const {
+            return id == other.id && opacity == other.opacity && mode == other.mode && visible == other.visible;
+        }
+        bool operator!=(const State& other) const { return !(*this == other); }
+    };
+
+    struct Layer {
+        State state;
+        TiledSurface surface = TiledSurface(Qt::transparent);
+        /// only when painting on the cpu
+        QScopedPointer<CpuSurface> cpu;
+        /// what fills work on when painting on the GPU, from the first fill on
+        QScopedPointer<CpuSurface> mirror;
+        /// tiles of the surface the mirror hasn't caught up with
+        QSet<quint64> stale;
+    };
+
+    LayerStack(History* history, const QColor& paper);
+    ~LayerStack();
+    Q_DISABLE_COPY(LayerStack)
+
+    /// whether layers made from now on get a CpuSurface
+    void setBackend(CpuSurface::Backend backend) { m_backend = backend; }
+    void setSize(const QSize& size);
+    QColor paper() const { return m_paper; }
+    /// who the layers and caches are accounted to
+    void setAccount(GpuMemory::Account* account);
+
+    /// brings the layers in line with states, bottom first, and returns what that changed on the composite
+    DirtyRegion sync(const QVector<State>& states, quint32 active);
+    Layer* layer(quint32 id) const;
+    Layer* active() const { return layer(m_active); }
+    const QVector<Layer*>& layers() const { return m_layers; }
+
+    /// shows stroke over the layer with the given id until it's merged into it
+    void setStroke(quint32 layer, const StrokeBuffer* stroke) { m_strokeLayer = layer; m_stroke = stroke; }
+
+    /// for changes to layers other than the active one, like undo
+    void invalidate(const DirtyRegion& region);
+    /// a CPU copy of layer for fills, brought up to date with its surface; fills
+    /// change both. only the tiles that changed since the last fill are read back
+    CpuSurface* mirror(Layer* layer);
+    /// for changes to layer's surface that didn't go through its mirror, or to every layer's if it's null
+    void invalidateMirrors(const Layer* layer, const DirtyRegion& region);
+    /// composites region into target, which must be as large as the surfaces and
+    /// read as the paper where blank; tiles with nothing on them are dropped from it
+    void compose(TiledSurface* target, const DirtyRegion& region);
+
+    /// frees both caches; compose() rebuilds what it needs
+    void releaseCaches();
+    /// TiledSurface::park() over the layer tiles, sharing budget
+    qint64 park(quint64 before, int& budget);
+    bool isParking() const;
+
+private:
+    int activeIndex() const;
+    bool aboveFlattens() const;
+    /// rebuilds one tile of a cache from the layers in [from, to)
+    void flatten(TiledSurface* cache, const QPoint& tile, int from, int to, const QColor& base);
+    /// blends a layer's texture onto the backdrop in one scratch tile, into the other; returns the new backdrop
+    QOpenGLFramebufferObject* blend(QOpenGLFramebufferObject* backdrop, GLuint layer, qreal opacity, BlendMode mode);
+    QOpenGLFramebufferObject* blend(QOpenGLFramebufferObject* backdrop, const Layer* layer, const QPoint& tile);
+    /// whether the layer has anything in the tile, counting an unmerged stroke
+    bool hasContent(const Layer* layer, const QPoint& tile) const;
+
+    History* m_history;
+    QColor m_paper;
+    GpuMemory::Account* m_account = nullptr;
+    QSize m_size;
+    CpuSurface::Backend m_backend = CpuSurface::Gl;
+    QVector<Layer*> m_layers;
+    quint32 m_active = 0;
+    quint32 m_strokeLayer = 0;
+    const StrokeBuffer* m_stroke = nullptr;
+
+    TiledSurface m_below = TiledSurface(Qt::transparent);
+    TiledSurface m_above = TiledSurface(Qt::transparent);
+    QSet<quint64> m_belowValid;
+    QSet<quint64> m_aboveValid;
+};
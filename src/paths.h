@@ -0,0 +1,13 @@
+#pragma once
+
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QString>
+
+/// where a file an item is given a relative path for goes: under the app data directory
+inline QString appDataPath(const QString& path)
+{
+    if (path.isEmpty() || !QFileInfo(path).isRelative())
+        return path;
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + QLatin1Char('/') + path;
+}
@@ -0,0 +1,272 @@
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QOpenGLTimerQuery>
+#include <QSet>
+#include <QTimer>
+#include <algorithm>
+#include "latency.h"
+#include "profiler.h"
+
+FrameProfiler::FrameProfiler(const QString& owner) : m_owner(owner), m_enabled(!qEnvironmentVariableIsEmpty("BRUSHY_TRACE"))
+{
+}
+
+FrameProfiler::~FrameProfiler()
+{
+    // the renderer releases the queries while its context is still current
+    Q_ASSERT(m_queries.isEmpty() && m_pending.isEmpty() && m_open.query == nullptr);
+}
+
+void FrameProfiler::beginFrame()
+{
+    collect();
+    m_active = isEnabled();
+}
+
+void FrameProfiler::endFrame()
+{
+    collect();
+    m_frame++;
+}
+
+void FrameProfiler::beginGpu(const char* name)
+{
+    if (m_gpuDepth++ > 0 || !m_active || !m_gpuTiming || m_pending.size() >= MaxPending)
+        return;
+
+    QOpenGLTimerQuery* query = nullptr;
+    if (!m_queries.isEmpty()) {
+        query = m_queries.takeLast();
+    } else {
+        query = new QOpenGLTimerQuery;
+        if (!query->create()) {
+            delete query;
+            m_gpuTiming = false;
+            qWarning("FrameProfiler: the context has no timer queries, so %s only times the CPU", qPrintable(m_owner));
+            return;
+        }
+    }
+
+    m_open.event = Event{name, Gpu, m_frame, LatencyTracker::now(), 0};
+    m_open.query = query;
+    query->begin();
+}
+
+void FrameProfiler::endGpu()
+{
+    if (m_gpuDepth == 0 || --m_gpuDepth > 0 || m_open.query == nullptr)
+        return;
+
+    m_open.query->end();
+    m_pending << m_open;
+    m_open = Pending();
+}
+
+void FrameProfiler::collect()
+{
+    // elapsed queries finish in the order they were issued, so the first one that isn't in ends the scan
+    int done = 0;
+    for (const auto& pending : qAsConst(m_pending)) {
+        if (!pending.query->isResultAvailable())
+            break;
+        Event event = pending.event;
+        event.duration = qint64(pending.query->waitForResult());
+        record(event);
+        m_queries << pending.query;
+        done++;
+    }
+    m_pending.remove(0, done);
+}
+
+void FrameProfiler::release()
+{
+    if (m_open.query != nullptr) {
+        m_open.query->end();
+        m_queries << m_open.query;
+        m_open = Pending();
+    }
+    for (const auto& pending : qAsConst(m_pending))
+        m_queries << pending.query;
+    m_pending.clear();
+    qDeleteAll(m_queries);
+    m_queries.clear();
+    m_gpuDepth = 0;
+    m_gpuTiming = true;
+}
+
+void FrameProfiler::record(const Event& event)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_events.size() < Capacity) {
+        m_events << event;
+    } else {
+        m_events[m_next] = event;
+    }
+    m_next = (m_next + 1) % Capacity;
+}
+
+QVector<FrameProfiler::Pass> FrameProfiler::passes() const
+{
+    QVector<Event> events;
+    {
+        QMutexLocker locker(&m_mutex);
+        events = m_events;
+    }
+
+    // a pass may run several times a frame, like dabs once per op, so it's summed per frame first
+    struct Sums {
+        Kind kind;
+        QHash<quint64, qint64> frames;
+    };
+    QHash<QString, Sums> sums;
+    for (const auto& event : qAsConst(events)) {
+        auto& it = sums[QString::fromLatin1(event.name) + QLatin1Char(event.kind == Gpu ? 'g' : 'c')];
+        it.kind = event.kind;
+        it.frames[event.frame] += event.duration;
+    }
+
+    QVector<Pass> ret;
+    ret.reserve(sums.size());
+    for (auto it = sums.cbegin(); it != sums.cend(); it++) {
+        qint64 total = 0;
+        qint64 max = 0;
+        for (auto duration : it->frames) {
+            total += duration;
+            max = qMax(max, duration);
+        }
+        const int frames = it->frames.size();
+        ret << Pass{it.key().chopped(1), it->kind, total / 1e6 / frames, max / 1e6, frames};
+    }
+    std::sort(ret.begin(), ret.end(), [](const Pass& a, const Pass& b) {
+        if (a.kind != b.kind)
+            return a.kind == Gpu;
+        return a.average > b.average;
+    });
+    return ret;
+}
+
+int FrameProfiler::frames() const
+{
+    QSet<quint64> frames;
+    QMutexLocker locker(&m_mutex);
+    for (const auto& event : m_events)
+        frames << event.frame;
+    return frames.size();
+}
+
+bool FrameProfiler::dumpTrace(const QString& path) const
+{
+    QVector<Event> events;
+    {
+        QMutexLocker locker(&m_mutex);
+        // oldest first
+        events = m_events.mid(m_events.size() < Capacity ? 0 : m_next);
+        events << m_events.mid(0, m_events.size() < Capacity ? 0 : m_next);
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    // the render thread and the GPU get a track each; timestamps are in microseconds
+    const auto metadata = [](const QString& name, int tid, const QString& value) {
+        return QJsonObject{
+            {QStringLiteral("name"), name},
+            {QStringLiteral("ph"), QStringLiteral("M")},
+            {QStringLiteral("pid"), 1},
+            {QStringLiteral("tid"), tid},
+            {QStringLiteral("args"), QJsonObject{{QStringLiteral("name"), value}}},
+        };
+    };
+    QJsonArray array;
+    array << metadata(QStringLiteral("process_name"), 0, m_owner)
+          << metadata(QStringLiteral("thread_name"), 1, QStringLiteral("render thread"))
+          << metadata(QStringLiteral("thread_name"), 2, QStringLiteral("GPU"));
+    for (const auto& event : qAsConst(events)) {
+        array << QJsonObject{
+            {QStringLiteral("name"), QString::fromLatin1(event.name)},
+            {QStringLiteral("cat"), event.kind == Gpu ? QStringLiteral("gpu") : QStringLiteral("cpu")},
+            {QStringLiteral("ph"), QStringLiteral("X")},
+            {QStringLiteral("ts"), event.start / 1e3},
+            {QStringLiteral("dur"), event.duration / 1e3},
+            {QStringLiteral("pid"), 1},
+            {QStringLiteral("tid"), event.kind == Gpu ? 2 : 1},
+            {QStringLiteral("args"), QJsonObject{{QStringLiteral("frame"), double(event.frame)}}},
+        };
+    }
+    file.write(QJsonDocument(QJsonObject{{QStringLiteral("traceEvents"), array}}).toJson(QJsonDocument::Compact));
+    return true;
+}
+
+FrameProfiler::CpuScope::CpuScope(FrameProfiler* profiler, const char* name) : m_profiler(profiler), m_name(name)
+{
+    if (m_profiler != nullptr && m_profiler->m_active)
+        m_start = LatencyTracker::now();
+}
+
+FrameProfiler::CpuScope::~CpuScope()
+{
+    if (m_start != 0)
+        m_profiler->record(Event{m_name, Cpu, m_profiler->m_frame, m_start, LatencyTracker::now() - m_start});
+}
+
+ProfilerStats::ProfilerStats(const QSharedPointer<FrameProfiler>& profiler, QObject* parent) : QObject(parent), m_profiler(profiler), m_timer(new QTimer(this))
+{
+    if (parent != nullptr)
+        m_owner = QString::fromLatin1(parent->metaObject()->className());
+
+    m_timer->setInterval(500);
+    connect(m_timer, &QTimer::timeout, this, &ProfilerStats::changed);
+    m_timer->start();
+}
+
+ProfilerStats::~ProfilerStats()
+{
+    // e.g. BRUSHY_TRACE=/tmp/%1.json, where %1 becomes the item's type
+    QString path = qEnvironmentVariable("BRUSHY_TRACE");
+    if (path.isEmpty())
+        return;
+    if (path.contains(QLatin1String("%1")))
+        path = path.arg(m_owner);
+    m_profiler->dumpTrace(path);
+}
+
+bool ProfilerStats::enabled() const
+{
+    return m_profiler->isEnabled();
+}
+
+void ProfilerStats::setEnabled(bool enabled)
+{
+    if (enabled == this->enabled())
+        return;
+    m_profiler->setEnabled(enabled);
+    Q_EMIT enabledChanged();
+}
+
+QVariantList ProfilerStats::passes() const
+{
+    QVariantList ret;
+    for (const auto& pass : m_profiler->passes()) {
+        ret << QVariantMap{
+            {QStringLiteral("name"), pass.name},
+            {QStringLiteral("gpu"), pass.kind == FrameProfiler::Gpu},
+            {QStringLiteral("average"), pass.average},
+            {QStringLiteral("max"), pass.max},
+        };
+    }
+    return ret;
+}
+
+int ProfilerStats::frames() const
+{
+    return m_profiler->frames();
+}
+
+bool ProfilerStats::dumpTrace(const QString& path) const
+{
+    return m_profiler->dumpTrace(path);
+}
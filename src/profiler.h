@@ -0,0 +1,182 @@
+#pragma once
+
+#include <QMutex>
+#include <QObject>
+#include <QSharedPointer>
+#include <QString>
+#include <QVariantList>
+#include <QVector>
+#include <atomic>
+#include <QtQml/qqml.h>
+
+class QOpenGLTimerQuery;
+class QTimer;
+
+/// where a renderer's frames go, pass by pass, on the GPU and the render thread
+///
+/// GPU passes are bracketed with GL_TIME_ELAPSED queries from a pool. their
+/// results are only read once GL says they're in, usually a frame or two
+/// later, so timing never stalls the pipeline. CPU scopes use the clock of
+/// LatencyTracker. finished events go into a ring that the gui thread reads
+/// per-pass averages from or writes out as a Chrome trace. it does nothing
+/// until it's enabled, and then costs a few queries a frame.
+class FrameProfiler
+{
+public:
+    enum Kind {
+        Cpu,
+        Gpu,
+    };
+
+    struct Event {
+        /// a string literal
+        const char* name = nullptr;
+        Kind kind = Cpu;
+        quint64 frame = 0;
+        /// nanoseconds on LatencyTracker's clock; GPU passes start when they were issued
+        qint64 start = 0;
+        qint64 duration = 0;
+    };
+
+    struct Pass {
+        QString name;
+        Kind kind;
+        /// milliseconds per frame it ran in, over the ring
+        qreal average;
+        qreal max;
+        /// how many of the ring's frames it ran in
+        int frames;
+    };
+
+    static constexpr int Capacity = 8192;
+    /// GPU passes waiting for their results; past this, new ones aren't timed
+    static constexpr int MaxPending = 64;
+
+    explicit FrameProfiler(const QString& owner);
+    ~FrameProfiler();
+    Q_DISABLE_COPY(FrameProfiler)
+
+    // any thread
+    bool isEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+    /// takes effect at the next frame
+    void setEnabled(bool enabled) { m_enabled.store(enabled, std::memory_order_relaxed); }
+    /// slowest first, the GPU's before the CPU's
+    QVector<Pass> passes() const;
+    /// how many frames the ring covers
+    int frames() const;
+    /// writes the ring as Chrome trace event json, for chrome://tracing or Perfetto
+    bool dumpTrace(const QString& path) const;
+
+    // render thread
+    /// takes the GPU results that are in and decides whether this frame is profiled
+    void beginFrame();
+    void endFrame();
+    /// GL times one elapsed query at a time, so a pass begun inside another counts towards that one
+    void beginGpu(const char* name);
+    void endGpu();
+    /// frees the queries; the context they were made on has to be current
+    void release();
+
+    /// times the block it lives in on the render thread; scopes nest
+    class CpuScope
+    {
+    public:
+        CpuScope(FrameProfiler* profiler, const char* name);
+        ~CpuScope();
+        Q_DISABLE_COPY(CpuScope)
+
+    private:
+        FrameProfiler* m_profiler;
+        const char* m_name;
+        qint64 m_start = 0;
+    };
+
+    /// times the block it lives in as a GPU pass; the profiler may be null
+    class GpuScope
+    {
+    public:
+        GpuScope(FrameProfiler* profiler, const char* name) : m_profiler(profiler) {
+            if (m_profiler != nullptr)
+                m_profiler->beginGpu(name);
+        }
+        ~GpuScope() {
+            if (m_profiler != nullptr)
+                m_profiler->endGpu();
+        }
+        Q_DISABLE_COPY(GpuScope)
+
+    private:
+        FrameProfiler* m_profiler;
+    };
+
+    /// both: what the block costs to issue and what it costs the GPU to run
+    class Scope
+    {
+    public:
+        Scope(FrameProfiler* profiler, const char* name) : m_cpu(profiler, name), m_gpu(profiler, name) { }
+        Q_DISABLE_COPY(Scope)
+
+    private:
+        CpuScope m_cpu;
+        GpuScope m_gpu;
+    };
+
+private:
+    struct Pending {
+        Event event;
+        QOpenGLTimerQuery* query = nullptr;
+    };
+
+    void collect();
+    void record(const Event& event);
+
+    QString m_owner;
+    std::atomic<bool> m_enabled = {false};
+
+    // render thread
+    bool m_active = false;
+    /// false once the context turned out not to have timer queries
+    bool m_gpuTiming = true;
+    quint64 m_frame = 0;
+    int m_gpuDepth = 0;
+    /// the outermost GPU pass, while it's open
+    Pending m_open;
+    /// ended passes, oldest first, whose results aren't in yet
+    QVector<Pending> m_pending;
+    QVector<QOpenGLTimerQuery*> m_queries;
+
+    mutable QMutex m_mutex;
+    QVector<Event> m_events;
+    int m_next = 0;
+};
+
+/// an item's per-pass frame times, for QML
+class ProfilerStats : public QObject
+{
+    Q_OBJECT
+    QML_ANONYMOUS
+
+    /// starts out on if BRUSHY_TRACE is set
+    Q_PROPERTY(bool enabled READ enabled WRITE setEnabled NOTIFY enabledChanged)
+    /// a map per pass with name, gpu (a bool), average and max (milliseconds per frame), slowest first
+    Q_PROPERTY(QVariantList passes READ passes NOTIFY changed)
+    Q_PROPERTY(int frames READ frames NOTIFY changed)
+
+public:
+    ProfilerStats(const QSharedPointer<FrameProfiler>& profiler, QObject* parent = nullptr);
+    ~ProfilerStats();
+
+    bool enabled() const;
+    void setEnabled(bool enabled);
+    Q_SIGNAL void enabledChanged();
+    QVariantList passes() const;
+    int frames() const;
+    Q_SIGNAL void changed();
+
+    Q_INVOKABLE bool dumpTrace(const QString& path) const;
+
+private:
+    QSharedPointer<FrameProfiler> m_profiler;
+    QTimer* m_timer;
+    QString m_owner;
+};
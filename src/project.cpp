@@ -0,0 +1,564 @@
+#include <QDataStream>
+#include <QFileInfo>
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QSaveFile>
+#include <QThreadPool>
+#include <cstring>
+#include "project.h"
+#include "tiledsurface.h"
+
+namespace {
+
+constexpr int TileBytes = TiledSurface::TileSize * TiledSurface::TileSize * 4;
+constexpr char Magic[8] = {'B', 'R', 'U', 'S', 'H', 'Y', 'P', 'R'};
+
+void prepare(QDataStream& stream)
+{
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream.setByteOrder(QDataStream::LittleEndian);
+}
+
+}
+
+ProjectFile::~ProjectFile()
+{
+    if (m_map != nullptr)
+        m_file.unmap(const_cast<uchar*>(m_map));
+}
+
+QSharedPointer<ProjectFile> ProjectFile::open(const QString& path)
+{
+    QSharedPointer<ProjectFile> ret(new ProjectFile);
+    ret->m_file.setFileName(path);
+    if (!ret->m_file.open(QIODevice::ReadOnly)) {
+        qWarning("ProjectFile: couldn't open %s", qPrintable(path));
+        return {};
+    }
+    ret->m_size = ret->m_file.size();
+    if (ret->m_size >= HeaderSize)
+        ret->m_map = ret->m_file.map(0, ret->m_size);
+    if (ret->m_map == nullptr) {
+        qWarning("ProjectFile: couldn't map %s", qPrintable(path));
+        return {};
+    }
+
+    QDataStream header(QByteArray::fromRawData(reinterpret_cast<const char*>(ret->m_map), HeaderSize));
+    prepare(header);
+    char magic[sizeof(Magic)];
+    quint32 version = 0;
+    quint32 indexSize = 0;
+    quint64 indexOffset = 0;
+    header.readRawData(magic, sizeof(magic));
+    header >> version >> indexSize >> indexOffset;
+    if (std::memcmp(magic, Magic, sizeof(Magic)) != 0 || version != Version) {
+        qWarning("ProjectFile: %s isn't a project this version can read", qPrintable(path));
+        return {};
+    }
+    if (indexOffset < quint64(HeaderSize) || indexOffset + indexSize > quint64(ret->m_size)
+        || !decode(ret->chunk(Chunk{indexOffset, indexSize}), &ret->m_index)) {
+        qWarning("ProjectFile: %s has a broken index", qPrintable(path));
+        return {};
+    }
+
+    // a chunk past the end would only fault once its tile is shown
+    for (const auto& layer : qAsConst(ret->m_index.layers)) {
+        for (const auto& chunk : layer.tiles) {
+            if (chunk.offset < quint64(HeaderSize) || chunk.offset + chunk.size > indexOffset) {
+                qWarning("ProjectFile: %s has tiles outside of it", qPrintable(path));
+                return {};
+            }
+        }
+    }
+    return ret;
+}
+
+QByteArray ProjectFile::chunk(const Chunk& chunk) const
+{
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(m_map + chunk.offset), int(chunk.size));
+}
+
+QByteArray ProjectFile::header(quint64 indexOffset, quint32 indexSize)
+{
+    QByteArray ret;
+    QDataStream stream(&ret, QIODevice::WriteOnly);
+    prepare(stream);
+    stream.writeRawData(Magic, sizeof(Magic));
+    stream << Version << indexSize << indexOffset;
+    ret.append(HeaderSize - ret.size(), '\0');
+    return ret;
+}
+
+QByteArray ProjectFile::encode(const Index& index)
+{
+    QByteArray ret;
+    QDataStream stream(&ret, QIODevice::WriteOnly);
+    prepare(stream);
+    stream << qint32(index.documentSize.width()) << qint32(index.documentSize.height())
+           << qint32(index.currentLayer) << quint32(index.layers.size());
+    for (const auto& layer : index.layers) {
+        stream << double(layer.state.opacity) << qint32(layer.state.mode) << layer.state.visible
+               << quint32(layer.tiles.size());
+        for (auto it = layer.tiles.cbegin(); it != layer.tiles.cend(); it++) {
+            const QPoint tile = TiledSurface::fromKey(it.key());
+            stream << qint32(tile.x()) << qint32(tile.y()) << quint64(it->offset) << quint32(it->size);
+        }
+    }
+    return ret;
+}
+
+bool ProjectFile::decode(const QByteArray& bytes, Index* index)
+{
+    QDataStream stream(bytes);
+    prepare(stream);
+    qint32 width = 0;
+    qint32 height = 0;
+    qint32 current = 0;
+    quint32 layers = 0;
+    stream >> width >> height >> current >> layers;
+    index->documentSize = QSize(width, height);
+    index->currentLayer = current;
+    index->layers.clear();
+    // a broken count shouldn't reserve gigabytes before the stream runs dry
+    for (quint32 i = 0; i < layers && stream.status() == QDataStream::Ok; i++) {
+        Layer layer;
+        double opacity = 1.0;
+        qint32 mode = 0;
+        quint32 tiles = 0;
+        stream >> opacity >> mode >> layer.state.visible >> tiles;
+        layer.state.opacity = qBound(0.0, opacity, 1.0);
+        layer.state.mode = LayerStack::BlendMode(qBound(int(LayerStack::Normal), int(mode), int(LayerStack::Add)));
+        for (quint32 j = 0; j < tiles && stream.status() == QDataStream::Ok; j++) {
+            qint32 x = 0;
+            qint32 y = 0;
+            Chunk chunk;
+            stream >> x >> y >> chunk.offset >> chunk.size;
+            layer.tiles.insert(TiledSurface::key(QPoint(x, y)), chunk);
+        }
+        index->layers << layer;
+    }
+    return stream.status() == QDataStream::Ok && stream.atEnd() && !index->documentSize.isEmpty()
+        && !index->layers.isEmpty();
+}
+
+ProjectSaver::~ProjectSaver()
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    for (const auto& readback : qAsConst(m_inFlight)) {
+        fns.glDeleteSync(readback.fence);
+        m_buffers << readback.buffer;
+    }
+    // a job that's being written finishes on its own; one that isn't yet never will
+    if (m_job && !m_job->writing) {
+        for (int i = 0; i < m_job->layers.size(); i++)
+            release(m_job.data(), i);
+        for (const auto& layer : qAsConst(m_job->layers)) {
+            for (const auto& tile : layer.tiles) {
+                if (tile.copy == nullptr)
+                    continue;
+                GpuMemory::untrack(tile.copy);
+                delete tile.copy;
+            }
+        }
+        if (m_job->done)
+            m_job->done(m_job->path, false);
+    }
+    for (const auto& request : qAsConst(m_requests)) {
+        if (request.done)
+            request.done(request.path, false);
+    }
+    for (auto buffer : qAsConst(m_buffers))
+        GpuMemory::untrack(buffer);
+    qDeleteAll(m_buffers);
+}
+
+void ProjectSaver::changed(quint32 layer, const DirtyRegion& region)
+{
+    QVector<QPoint> tiles;
+    for (const auto& rect : region.rects()) {
+        const QPoint from = TiledSurface::tileAt(rect.topLeft());
+        const QPoint to = TiledSurface::tileAt(rect.bottomRight());
+        for (int y = from.y(); y <= to.y(); y++) {
+            for (int x = from.x(); x <= to.x(); x++)
+                tiles << QPoint(x, y);
+        }
+    }
+    changed(layer, tiles);
+}
+
+void ProjectSaver::changed(quint32 layer, const QVector<QPoint>& tiles)
+{
+    if (layer != 0) {
+        auto& it = m_changed[layer];
+        for (const auto& tile : tiles)
+            it << TiledSurface::key(tile);
+        return;
+    }
+    for (auto it = m_chunks.cbegin(); it != m_chunks.cend(); it++)
+        changed(it.key(), tiles);
+}
+
+void ProjectSaver::opened(const QSharedPointer<ProjectFile>& file, const QVector<quint32>& ids)
+{
+    const auto& index = file->index();
+    m_path = file->path();
+    m_size = file->size();
+    m_chunks.clear();
+    m_changed.clear();
+    m_states.clear();
+    for (int i = 0; i < ids.size() && i < index.layers.size(); i++) {
+        m_chunks.insert(ids[i], index.layers[i].tiles);
+        LayerStack::State state = index.layers[i].state;
+        state.id = ids[i];
+        m_states << state;
+    }
+    m_documentSize = index.documentSize;
+    m_active = ids.value(index.currentLayer);
+    m_files << file;
+}
+
+void ProjectSaver::request(const QString& path, const QSize& documentSize, const LayerStack& layers, const Done& done)
+{
+    // one save that hasn't started yet covers another to the same file
+    if (!m_requests.isEmpty() && m_requests.last().path == path) {
+        auto& last = m_requests.last();
+        last.documentSize = documentSize;
+        const Done first = last.done;
+        last.done = [first, done](const QString& path, bool ok) {
+            if (first)
+                first(path, ok);
+            if (done)
+                done(path, ok);
+        };
+        return;
+    }
+    m_requests << Request{path, done, documentSize, &layers};
+}
+
+void ProjectSaver::start(const Request& request)
+{
+    const auto& layers = request.layers->layers();
+    const quint32 active = request.layers->active() != nullptr ? request.layers->active()->state.id : 0;
+    QVector<LayerStack::State> states;
+    for (auto layer : layers)
+        states << layer->state;
+
+    bool changed = request.path != m_path || states != m_states || request.documentSize != m_documentSize || active != m_active;
+    for (auto layer : layers)
+        changed = changed || !m_changed.value(layer->state.id).isEmpty();
+    if (!changed) {
+        // the file already holds all of it
+        if (request.done)
+            QThreadPool::globalInstance()->start([request] { request.done(request.path, true); });
+        return;
+    }
+
+    auto job = QSharedPointer<Job>::create();
+    job->path = request.path;
+    job->done = request.done;
+    job->documentSize = request.documentSize;
+    job->source = m_path;
+    job->files = m_files;
+    for (int i = 0; i < layers.size(); i++) {
+        if (layers[i]->state.id == active)
+            job->currentLayer = i;
+    }
+
+    // chunks that stay where they are in the file cost nothing; the rest is garbage once they're replaced
+    qint64 kept = 0;
+    for (auto layer : layers) {
+        const quint32 id = layer->state.id;
+        const auto& chunks = m_chunks.value(id);
+        const auto& changedTiles = m_changed.value(id);
+        job->changed.insert(id, changedTiles);
+
+        Layer saved{id, layer->state, {}};
+        for (const auto& tile : layer->surface.tiles()) {
+            const quint64 key = TiledSurface::key(tile);
+            Tile it;
+            it.tile = tile;
+            if (!changedTiles.contains(key) && chunks.contains(key)) {
+                it.saved = chunks.value(key);
+                kept += it.saved.size;
+            } else if (layer->surface.parked(tile).isEmpty()) {
+                // read back later, straight from the surface unless it's about to change first
+                saved.pending.insert(key, saved.tiles.size());
+            } else {
+                // parked tiles are already in the file's format
+                it.compressed = layer->surface.parked(tile);
+            }
+            saved.tiles << it;
+        }
+        if (!saved.pending.isEmpty())
+            saved.surface = &layer->surface;
+        job->layers << saved;
+    }
+    for (int i = 0; i < job->layers.size(); i++) {
+        if (job->layers[i].surface == nullptr)
+            continue;
+        // a layer deleted mid-save still gets its tiles copied on the way out
+        job->layers[i].surface->addWatcher(job.data(), TiledSurface::Watcher{
+            [this, job = job.data(), i](const QPoint& tile) { preserve(job, i, tile); },
+            [job = job.data(), i] { job->layers[i].surface = nullptr; },
+        });
+    }
+    // the job has what's changed on every layer there still is
+    m_changed.clear();
+
+    const qint64 waste = m_size - ProjectFile::HeaderSize - kept;
+    job->append = request.path == m_path && QFileInfo::exists(m_path) && !(waste > MinimumWaste && waste > kept);
+
+    // what the job will have written, so later requests compare against it
+    m_states = states;
+    m_documentSize = request.documentSize;
+    m_active = active;
+    m_job = job;
+}
+
+void ProjectSaver::step()
+{
+    if (!m_job && !m_requests.isEmpty())
+        start(m_requests.takeFirst());
+    if (!m_job)
+        return;
+
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    // fences signal in submission order, so the first unsignalled one ends the scan
+    int finished = 0;
+    for (const auto& readback : qAsConst(m_inFlight)) {
+        if (fns.glClientWaitSync(readback.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            break;
+        fns.glDeleteSync(readback.fence);
+        collect(readback);
+        finished++;
+    }
+    m_inFlight.remove(0, finished);
+
+    int budget = ChunksPerFrame;
+    bool pending = false;
+    for (int i = 0; i < m_job->layers.size(); i++) {
+        Layer& layer = m_job->layers[i];
+        while (budget > 0 && !layer.pending.isEmpty()) {
+            const auto next = layer.pending.begin();
+            const int index = next.value();
+            layer.pending.erase(next);
+            Tile& tile = layer.tiles[index];
+
+            // a copy if it was about to change, otherwise the tile itself: the read is
+            // queued ahead of whatever is drawn into it later
+            QOpenGLFramebufferObject* from = tile.copy;
+            if (from == nullptr) {
+                // a tile is copied before it changes or goes away, so these only guard against that not holding
+                if (layer.surface == nullptr)
+                    continue;
+                const QByteArray parked = layer.surface->parked(tile.tile);
+                if (!parked.isEmpty()) {
+                    tile.compressed = parked;
+                    continue;
+                }
+                auto it = layer.surface->tile(tile.tile);
+                if (it == nullptr)
+                    continue;
+                from = it->fbo;
+            }
+
+            QOpenGLBuffer* buffer = nullptr;
+            if (!m_buffers.isEmpty()) {
+                buffer = m_buffers.takeLast();
+            } else {
+                buffer = new QOpenGLBuffer(QOpenGLBuffer::PixelPackBuffer);
+                buffer->setUsagePattern(QOpenGLBuffer::StreamRead);
+                buffer->create();
+                buffer->bind();
+                buffer->allocate(TileBytes);
+                buffer->release();
+                GpuMemory::track(buffer, m_account, GpuMemory::Export, TileBytes, QStringLiteral("readback buffer"));
+            }
+
+            // with a pack buffer bound, glReadPixels only queues a copy and returns
+            from->bind();
+            buffer->bind();
+            fns.glReadPixels(0, 0, TiledSurface::TileSize, TiledSurface::TileSize, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            buffer->release();
+            m_inFlight << Readback{i, index, buffer, fns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)};
+            m_job->inFlight++;
+
+            // GL keeps the texture alive until the queued read is done with it
+            if (tile.copy != nullptr) {
+                GpuMemory::untrack(tile.copy);
+                delete tile.copy;
+                tile.copy = nullptr;
+            }
+            budget--;
+        }
+        if (layer.pending.isEmpty())
+            release(m_job.data(), i);
+        else
+            pending = true;
+    }
+    QOpenGLFramebufferObject::bindDefault();
+
+    if (!pending && m_job->inFlight == 0 && !m_job->writing) {
+        m_job->writing = true;
+        QThreadPool::globalInstance()->start([job = m_job] { write(job.data()); });
+    }
+    if (m_job->written.load(std::memory_order_acquire)) {
+        finish(m_job.data());
+        m_job.reset();
+    }
+}
+
+void ProjectSaver::preserve(Job* job, int layer, const QPoint& tile)
+{
+    Layer& it = job->layers[layer];
+    const auto index = it.pending.constFind(TiledSurface::key(tile));
+    if (index == it.pending.cend() || it.tiles[index.value()].copy != nullptr)
+        return;
+    Tile& saved = it.tiles[index.value()];
+
+    // parking doesn't change a tile, so one that was parked since can be taken as it is
+    const QByteArray parked = it.surface->parked(tile);
+    if (!parked.isEmpty()) {
+        saved.compressed = parked;
+        it.pending.remove(TiledSurface::key(tile));
+        return;
+    }
+    // blits are queued on the GPU like any other draw, so this is cheap on the cpu
+    saved.copy = new QOpenGLFramebufferObject(TiledSurface::TileSize, TiledSurface::TileSize);
+    GpuMemory::track(saved.copy, m_account, GpuMemory::Export);
+    const QRect rect(0, 0, TiledSurface::TileSize, TiledSurface::TileSize);
+    QOpenGLFramebufferObject::blitFramebuffer(saved.copy, rect, it.surface->tile(tile)->fbo, rect, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+void ProjectSaver::release(Job* job, int layer)
+{
+    Layer& it = job->layers[layer];
+    if (it.surface == nullptr)
+        return;
+    it.surface->removeWatcher(job);
+    it.surface = nullptr;
+}
+
+void ProjectSaver::collect(const Readback& readback)
+{
+    m_job->inFlight--;
+    Tile& tile = m_job->layers[readback.layer].tiles[readback.tile];
+
+    readback.buffer->bind();
+    auto pixels = static_cast<const char*>(readback.buffer->mapRange(0, TileBytes, QOpenGLBuffer::RangeRead));
+    if (pixels != nullptr) {
+        tile.pixels = QByteArray(pixels, TileBytes);
+        readback.buffer->unmap();
+    } else {
+        qWarning("ProjectSaver: couldn't map a readback of tile (%d, %d)", tile.tile.x(), tile.tile.y());
+    }
+    readback.buffer->release();
+
+    m_buffers << readback.buffer;
+}
+
+void ProjectSaver::finish(Job* job)
+{
+    if (!job->ok) {
+        // whatever the job took is still to be saved, and the next save can't trust the file
+        for (auto it = job->changed.cbegin(); it != job->changed.cend(); it++)
+            m_changed[it.key()] += it.value();
+        m_states.clear();
+        return;
+    }
+    m_path = job->path;
+    m_size = job->size;
+    m_chunks = job->chunks;
+}
+
+void ProjectSaver::write(Job* job)
+{
+    const auto fail = [job](const char* what) {
+        qWarning("ProjectSaver: couldn't %s %s", what, qPrintable(job->path));
+        if (job->done)
+            job->done(job->path, false);
+        job->written.store(true, std::memory_order_release);
+    };
+
+    // a tile whose readback failed is left out rather than saved blank
+    for (auto& layer : job->layers) {
+        for (auto& tile : layer.tiles) {
+            if (tile.pixels.isEmpty())
+                continue;
+            tile.compressed = qCompress(tile.pixels, 1);
+            tile.pixels.clear();
+        }
+    }
+
+    // appending leaves the old index standing until the header points at the new one;
+    // rewriting goes through a temporary file that replaces the old one once it's complete
+    QFile appended(job->path);
+    QSaveFile rewritten(job->path);
+    QFileDevice* out = job->append ? static_cast<QFileDevice*>(&appended) : &rewritten;
+    if (!out->open(job->append ? QIODevice::ReadWrite : QIODevice::WriteOnly))
+        return fail("open");
+    QFile source(job->source);
+    if (!job->append && !job->source.isEmpty() && !source.open(QIODevice::ReadOnly))
+        return fail("read the last save of");
+
+    qint64 at = job->append ? out->size() : ProjectFile::HeaderSize;
+    if (!job->append && out->write(QByteArray(ProjectFile::HeaderSize, '\0')) != ProjectFile::HeaderSize)
+        return fail("write");
+
+    ProjectFile::Index index;
+    index.documentSize = job->documentSize;
+    index.currentLayer = job->currentLayer;
+    out->seek(at);
+    for (const auto& layer : qAsConst(job->layers)) {
+        ProjectFile::Layer entry;
+        entry.state = layer.state;
+        for (const auto& tile : layer.tiles) {
+            const quint64 key = TiledSurface::key(tile.tile);
+            QByteArray bytes = tile.compressed;
+            if (bytes.isEmpty() && tile.saved.size == 0)
+                continue;
+            if (bytes.isEmpty()) {
+                if (job->append) {
+                    entry.tiles.insert(key, tile.saved);
+                    continue;
+                }
+                source.seek(qint64(tile.saved.offset));
+                bytes = source.read(tile.saved.size);
+                if (bytes.size() != int(tile.saved.size))
+                    return fail("copy the tiles of");
+            }
+            if (out->write(bytes) != bytes.size())
+                return fail("write");
+            entry.tiles.insert(key, ProjectFile::Chunk{quint64(at), quint32(bytes.size())});
+            at += bytes.size();
+        }
+        job->chunks.insert(layer.id, entry.tiles);
+        index.layers << entry;
+    }
+
+    const QByteArray encoded = ProjectFile::encode(index);
+    if (out->write(encoded) != encoded.size() || !out->flush())
+        return fail("write");
+    // the header goes last, so until then the file still reads as the last save
+    out->seek(0);
+    if (out->write(ProjectFile::header(quint64(at), quint32(encoded.size()))) != ProjectFile::HeaderSize)
+        return fail("write");
+    if (job->append) {
+        appended.close();
+        if (appended.error() != QFileDevice::NoError)
+            return fail("write");
+    } else if (!rewritten.commit()) {
+        return fail("replace");
+    }
+
+    job->size = at + encoded.size();
+    job->ok = true;
+    if (job->done)
+        job->done(job->path, true);
+    job->written.store(true, std::memory_order_release);
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <QFile>
+#include <QHash>
+#include <QPoint>
+#include <QSet>
+#include <QSharedPointer>
+#include <QSize>
+#include <QString>
+#include <QVector>
+#include <atomic>
+#include <functional>
+#include <qopengl.h>
+#include "dirtyregion.h"
+#include "gpumemory.h"
+#include "layerstack.h"
+
+class QOpenGLBuffer;
+class QOpenGLFramebufferObject;
+class TiledSurface;
+
+/// a canvas's layers on disk, read through a memory mapping
+///
+/// a project file is a fixed header followed by chunks: every tile of every
+/// layer compressed on its own, the way TiledSurface parks tiles, and an
+/// index of where they are. saves only append the tiles that changed and a
+/// new index, then point the header at it, so a save that doesn't finish
+/// leaves the last one intact. the file is rewritten from scratch once most
+/// of it is chunks nothing points to anymore. everything is little endian.
+///
+/// opening only reads the index; the tiles stay in the mapping until
+/// someone asks for them.
+class ProjectFile
+{
+public:
+    static constexpr quint32 Version = 1;
+    static constexpr int HeaderSize = 32;
+
+    /// where a tile's compressed pixels are in the file
+    struct Chunk {
+        quint64 offset = 0;
+        quint32 size = 0;
+    };
+    struct Layer {
+        LayerStack::State state;
+        /// by TiledSurface::key
+        QHash<quint64, Chunk> tiles;
+    };
+    struct Index {
+        QSize documentSize;
+        /// the index of the layer strokes land on, counting from the bottom
+        int currentLayer = 0;
+        /// bottom first; the states' ids are meaningless outside the session that saved them
+        QVector<Layer> layers;
+    };
+
+    ~ProjectFile();
+    Q_DISABLE_COPY(ProjectFile)
+
+    /// maps the file at path and reads its index; null if it can't be read or isn't a project
+    static QSharedPointer<ProjectFile> open(const QString& path);
+
+    QString path() const { return m_file.fileName(); }
+    qint64 size() const { return m_size; }
+    const Index& index() const { return m_index; }
+    /// a chunk's bytes, straight from the mapping without a copy, so they're only good while this lives
+    QByteArray chunk(const Chunk& chunk) const;
+
+    /// the index as it's stored; the layers' ids aren't
+    static QByteArray encode(const Index& index);
+    static bool decode(const QByteArray& bytes, Index* index);
+    static QByteArray header(quint64 indexOffset, quint32 indexSize);
+
+private:
+    ProjectFile() = default;
+
+    QFile m_file;
+    const uchar* m_map = nullptr;
+    qint64 m_size = 0;
+    Index m_index;
+};
+
+/// saves a canvas's layers as a ProjectFile without stalling the render thread
+///
+/// it remembers where each layer's tiles went in the file it wrote or was
+/// opened from last, and which tiles have changed since. a save of the same
+/// file only snapshots the tiles that changed: parked ones as they are, the
+/// others by reading them back a few a frame like CanvasExporter does,
+/// copying one on the GPU only if something is about to change it first.
+/// compressing and writing happen on the global thread pool. saves run one at a time; a request made while one is running
+/// starts once it's done, along with any more to the same file.
+class ProjectSaver
+{
+public:
+    /// called from a pool thread once the file has been written, or has failed to be
+    using Done = std::function<void(const QString& path, bool ok)>;
+
+    /// how many tiles start their readback each frame
+    static constexpr int ChunksPerFrame = 8;
+    /// a save rewrites the file instead of appending to it once that would leave
+    /// more than this many bytes nothing points to, and more of them than bytes something does
+    static constexpr qint64 MinimumWaste = 16 * 1024 * 1024;
+
+    ProjectSaver() = default;
+    ~ProjectSaver();
+    Q_DISABLE_COPY(ProjectSaver)
+
+    /// who the copies and readback buffers are accounted to
+    void setAccount(GpuMemory::Account* account) { m_account = account; }
+
+    /// region of a layer changed; a null id means every layer's did
+    void changed(quint32 layer, const DirtyRegion& region);
+    void changed(quint32 layer, const QVector<QPoint>& tiles);
+    /// the layers were just opened from file, given their ids in file order; nothing has changed since
+    void opened(const QSharedPointer<ProjectFile>& file, const QVector<quint32>& ids);
+
+    /// saves layers, bottom first, to path as they are now
+    void request(const QString& path, const QSize& documentSize, const LayerStack& layers, const Done& done);
+    /// starts the next readbacks, collects finished ones and takes finished saves in; call once a frame
+    void step();
+    /// whether step() has more work to do on later frames
+    bool isBusy() const { return m_job || !m_requests.isEmpty(); }
+
+private:
+    struct Tile {
+        QPoint tile;
+        /// where it already is in the file that was saved last, if it hasn't changed since
+        ProjectFile::Chunk saved;
+        /// compressed pixels, as TiledSurface parks them
+        QByteArray compressed;
+        /// raw pixels, until they're compressed on the pool
+        QByteArray pixels;
+        /// if it was about to change before its readback started
+        QOpenGLFramebufferObject* copy = nullptr;
+    };
+    struct Layer {
+        quint32 id;
+        LayerStack::State state;
+        QVector<Tile> tiles;
+        /// watched until every tile's readback has started
+        TiledSurface* surface = nullptr;
+        /// tiles by key whose readback hasn't started yet
+        QHash<quint64, int> pending;
+    };
+    struct Job {
+        QString path;
+        Done done;
+        QSize documentSize;
+        int currentLayer = 0;
+        QVector<Layer> layers;
+        /// the file the saved chunks are in
+        QString source;
+        /// whether the chunks go on the end of source rather than into a file of their own
+        bool append = false;
+        /// what was taken out of m_changed, for putting back if the save fails
+        QHash<quint32, QSet<quint64>> changed;
+        /// files parked tiles may point into, kept open until the job is done with them
+        QVector<QSharedPointer<ProjectFile>> files;
+        int inFlight = 0;
+        /// handed to the pool
+        bool writing = false;
+
+        // written on the pool, read once written is set
+        bool ok = false;
+        qint64 size = 0;
+        QHash<quint32, QHash<quint64, ProjectFile::Chunk>> chunks;
+        std::atomic<bool> written = {false};
+    };
+    struct Readback {
+        int layer;
+        int tile;
+        QOpenGLBuffer* buffer = nullptr;
+        GLsync fence = nullptr;
+    };
+    struct Request {
+        QString path;
+        Done done;
+        QSize documentSize;
+        /// the stack is only looked at once the request starts
+        const LayerStack* layers;
+    };
+
+    void start(const Request& request);
+    /// copies a pending tile of a layer that's about to change
+    void preserve(Job* job, int layer, const QPoint& tile);
+    /// stops watching a layer once nothing is left to read from it
+    static void release(Job* job, int layer);
+    void collect(const Readback& readback);
+    void finish(Job* job);
+    static void write(Job* job);
+
+    GpuMemory::Account* m_account = nullptr;
+    /// the file the chunks below are in, and how large it is
+    QString m_path;
+    qint64 m_size = 0;
+    QHash<quint32, QHash<quint64, ProjectFile::Chunk>> m_chunks;
+    /// tiles by layer that changed since the last save; a layer without chunks hasn't been saved at all
+    QHash<quint32, QSet<quint64>> m_changed;
+    /// what the last save wrote besides tiles, so saving without changes writes nothing
+    QVector<LayerStack::State> m_states;
+    QSize m_documentSize;
+    quint32 m_active = 0;
+
+    /// every file opened so far, which parked tiles may still point into
+    QVector<QSharedPointer<ProjectFile>> m_files;
+
+    QVector<Request> m_requests;
+    /// shared with the pool while it's written
+    QSharedPointer<Job> m_job;
+    QVector<Readback> m_inFlight;
+    QVector<QOpenGLBuffer*> m_buffers;
+};
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <QtGlobal>
+#include <atomic>
+
+/// counters a renderer bumps on the render thread and anyone may read
+struct RendererStats {
+    /// dabs drawn since the renderer was created
+    std::atomic<quint64> dabs = {0};
+    /// frames rendered since the renderer was created
+    std::atomic<quint64> frames = {0};
+};
@@ -0,0 +1,69 @@
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include "dirtyregion.h"
+#include "sharedsurface.h"
+
+SharedSurface::SharedSurface()
+{
+}
+
+SharedSurface::~SharedSurface()
+{
+    // the renderer owning the producing context releases us; by the time the
+    // last reference goes away there may be no context to free anything with
+    Q_ASSERT(m_buffer.fbo() == nullptr);
+}
+
+void SharedSurface::publish(QOpenGLFramebufferObject* source, const DirtyRegion& region)
+{
+    if (m_buffer.fbo() == nullptr || region.isEmpty())
+        return;
+
+    m_buffer.step();
+    for (const auto& rect : region.rects()) {
+        const QRect clipped = rect & QRect(QPoint(0, 0), m_buffer.size());
+        if (clipped.isEmpty())
+            continue;
+        QOpenGLFramebufferObject::blitFramebuffer(m_buffer.fbo(), clipped, source, clipped, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+    if (m_fence != nullptr)
+        fns.glDeleteSync(m_fence);
+    m_fence = fns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    m_version.fetch_add(1, std::memory_order_release);
+}
+
+SharedSurface::Handle SharedSurface::acquire()
+{
+    Handle ret;
+    if (m_buffer.fbo() == nullptr)
+        return ret;
+
+    if (m_fence != nullptr) {
+        // a server-side wait: the consumer's commands queue up behind the
+        // copy without blocking the cpu
+        QOpenGLExtraFunctions fns;
+        fns.initializeOpenGLFunctions();
+        fns.glWaitSync(m_fence, 0, GL_TIMEOUT_IGNORED);
+    }
+
+    ret.texture = m_buffer.fbo()->texture();
+    ret.size = m_buffer.size();
+    ret.textureSize = m_buffer.fbo()->size();
+    ret.version = version();
+    return ret;
+}
+
+void SharedSurface::release()
+{
+    if (m_fence != nullptr) {
+        QOpenGLExtraFunctions fns;
+        fns.initializeOpenGLFunctions();
+        fns.glDeleteSync(m_fence);
+        m_fence = nullptr;
+    }
+    m_buffer.release();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <QSize>
+#include <atomic>
+#include <qopengl.h>
+#include "gpumemory.h"
+#include "viewbuffer.h"
+
+class QOpenGLFramebufferObject;
+class DirtyRegion;
+
+/// a single-sample texture that one renderer publishes and others sample
+///
+/// the producer copies its dirty region in once per frame and fences it;
+/// consumers acquire a versioned handle whose contents are guaranteed to be
+/// a complete frame. the object itself is created on the gui thread, but all
+/// of its GL work happens on the render thread. the texture is a ViewBuffer,
+/// so it's usually larger than the view it holds.
+class SharedSurface
+{
+public:
+    struct Handle {
+        GLuint texture = 0;
+        /// the part of the texture that holds the view
+        QSize size;
+        /// the allocated size of the texture
+        QSize textureSize;
+        quint64 version = 0;
+
+        bool isValid() const { return texture != 0; }
+    };
+
+    SharedSurface();
+    ~SharedSurface();
+    Q_DISABLE_COPY(SharedSurface)
+
+    /// who the shared texture is accounted to; the producer
+    void setAccount(GpuMemory::Account* account) { m_buffer.setAccount(account); }
+    /// keeps what's still in view; what the resize uncovers is undefined until a publish covers it
+    void resize(const QSize& size) { m_buffer.resize(size); }
+    /// copies region of source into the shared texture and fences the copy.
+    /// does nothing when the region is empty, so unchanged frames cost nothing.
+    void publish(QOpenGLFramebufferObject* source, const DirtyRegion& region);
+    /// makes the GL command stream wait for the latest publish and returns it
+    Handle acquire();
+    /// frees the GL resources; must be called with the producer's context current
+    void release();
+
+    quint64 version() const { return m_version.load(std::memory_order_acquire); }
+
+private:
+    ViewBuffer m_buffer = ViewBuffer(GpuMemory::View);
+    GLsync m_fence = nullptr;
+    std::atomic<quint64> m_version = {0};
+};
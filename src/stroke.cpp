@@ -0,0 +1,132 @@
+#include <QLineF>
+#include <QtMath>
+#include "stroke.h"
+
+inline qreal lerp(qreal a, qreal b, qreal f)
+{
+    return a * (1.0 - f) + (b * f);
+}
+
+/// how long it takes the velocity estimate to settle, in milliseconds
+constexpr qreal VelocitySmoothing = 40.0;
+
+StrokeEngine::StrokeEngine(const Settings& settings) : m_settings(settings)
+{
+}
+
+qreal StrokeEngine::radius() const
+{
+    return radius(m_last.pressure);
+}
+
+qreal StrokeEngine::radius(qreal pressure) const
+{
+    const qreal base = m_settings.baseRadius + m_velocity * m_settings.velocityRadius;
+    return base * lerp(1.0, pressure, m_settings.pressureRadius);
+}
+
+qreal StrokeEngine::spacing() const
+{
+    return qMax(m_settings.minimumSpacing, 2.0 * radius() * m_settings.spacing);
+}
+
+void StrokeEngine::begin(const StrokeSample& sample, QVector<StrokeDab>& out)
+{
+    m_active = true;
+    m_last = sample;
+    m_curveEnd = sample.pos;
+    m_curvePressure = sample.pressure;
+    m_velocity = 0.0;
+    m_carry = 0.0;
+    out << StrokeDab{sample.pos, radius(sample.pressure), sample.pressure};
+}
+
+void StrokeEngine::moveTo(const StrokeSample& sample, QVector<StrokeDab>& out)
+{
+    if (!m_active) {
+        begin(sample, out);
+        return;
+    }
+
+    const StrokeSample last = m_last;
+    m_last = sample;
+
+    // velocity comes from the event timestamps, so it doesn't depend on how
+    // often the device reports; events stamped in the same millisecond just
+    // add distance. brushes without velocity dynamics skip it.
+    const qreal dt = sample.timestamp - last.timestamp;
+    if (dt > 0 && m_settings.velocityRadius != 0.0) {
+        const qreal instant = QLineF(last.pos, sample.pos).length() / dt * 1000.0;
+        const qreal f = qExp(-dt / VelocitySmoothing);
+        m_velocity = lerp(instant, m_velocity, f);
+    }
+
+    switch (m_settings.interpolation) {
+    case Linear: {
+        walk(last.pos, sample.pos, last.pressure, sample.pressure, out);
+        break;
+    }
+    case Curve: {
+        // curve from the end of the previous one to the midpoint of this
+        // segment, pulled towards the previous input position
+        const QPointF start = m_curveEnd;
+        const QPointF control = last.pos;
+        const QPointF end = (last.pos + sample.pos) / 2.0;
+        const qreal endPressure = (last.pressure + sample.pressure) / 2.0;
+        const qreal chord = QLineF(start, control).length() + QLineF(control, end).length();
+        const int n = qMax(1, qCeil(chord / 4.0));
+
+        QPointF prev = start;
+        qreal prevPressure = m_curvePressure;
+        for (int i = 1; i <= n; i++) {
+            const qreal t = qreal(i) / qreal(n);
+            const qreal u = 1.0 - t;
+            const QPointF next = u * u * start + 2.0 * u * t * control + t * t * end;
+            const qreal nextPressure = lerp(m_curvePressure, endPressure, t);
+            walk(prev, next, prevPressure, nextPressure, out);
+            prev = next;
+            prevPressure = nextPressure;
+        }
+        m_curveEnd = end;
+        m_curvePressure = endPressure;
+        break;
+    }
+    }
+}
+
+void StrokeEngine::end(QVector<StrokeDab>& out)
+{
+    if (!m_active)
+        return;
+
+    if (m_settings.interpolation == Curve) {
+        walk(m_curveEnd, m_last.pos, m_curvePressure, m_last.pressure, out);
+    }
+
+    m_active = false;
+    m_last = StrokeSample{QPointF(), 0, 1.0, QPointF()};
+    m_curveEnd = QPointF();
+    m_curvePressure = 1.0;
+    m_velocity = 0.0;
+    m_carry = 0.0;
+}
+
+void StrokeEngine::walk(const QPointF& from, const QPointF& to, qreal fromPressure, qreal toPressure, QVector<StrokeDab>& out)
+{
+    const QLineF line(from, to);
+    const qreal length = line.length();
+    if (length <= 0.0)
+        return;
+
+    // the step changes with pressure and velocity from event to event, so the distance
+    // carried over can be longer than this one; then the first dab goes right at from
+    const qreal step = spacing();
+    qreal d = qMax(0.0, step - m_carry);
+    while (d <= length) {
+        const qreal t = d / length;
+        const qreal pressure = lerp(fromPressure, toPressure, t);
+        out << StrokeDab{line.pointAt(t), radius(pressure), pressure};
+        d += step;
+    }
+    m_carry = length - (d - step);
+}
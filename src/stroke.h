@@ -0,0 +1,88 @@
+#pragma once
+
+#include <QPointF>
+#include <QVector>
+
+/// one input position of a stroke, in item coordinates
+struct StrokeSample {
+    QPointF pos;
+    /// milliseconds, from the input event
+    qint64 timestamp = 0;
+    /// 0..1; mice always report 1
+    qreal pressure = 1.0;
+    /// degrees from the perpendicular, as QTabletEvent reports it
+    QPointF tilt;
+};
+
+/// a single stamp of the brush along a stroke, in item coordinates
+struct StrokeDab {
+    QPointF pos;
+    qreal radius;
+    qreal pressure;
+    /// how far the tip is turned, in radians; the brush dynamics set it, not the engine
+    qreal angle = 0.0;
+    /// a BrushTip index, or -1 for a plain disc
+    int tip = -1;
+};
+
+/// turns the input positions of a stroke into evenly spaced dabs
+///
+/// this knows nothing about rendering: feed it the positions from
+/// Down/Move/Up and it appends the dabs to draw to the vector you give it.
+/// the distance left over after the last dab is carried into the next event,
+/// so spacing stays even no matter how the input is chunked.
+class StrokeEngine
+{
+public:
+    enum Interpolation {
+        /// straight lines between input positions
+        Linear,
+        /// quadratic curves through the midpoints of input positions;
+        /// lags half a segment behind the input until end()
+        Curve,
+    };
+
+    struct Settings {
+        /// radius = (baseRadius + velocity * velocityRadius) * lerp(1, pressure, pressureRadius),
+        /// with velocity in pixels per second
+        qreal baseRadius = 5.0;
+        qreal velocityRadius = 0.0;
+        qreal pressureRadius = 0.0;
+        /// distance between dabs as a fraction of the brush diameter
+        qreal spacing = 0.1;
+        /// lower bound on the distance between dabs, in pixels
+        qreal minimumSpacing = 0.5;
+        Interpolation interpolation = Linear;
+    };
+
+    StrokeEngine() = default;
+    explicit StrokeEngine(const Settings& settings);
+
+    const Settings& settings() const { return m_settings; }
+    void setSettings(const Settings& settings) { m_settings = settings; }
+
+    void begin(const StrokeSample& sample, QVector<StrokeDab>& out);
+    void moveTo(const StrokeSample& sample, QVector<StrokeDab>& out);
+    void end(QVector<StrokeDab>& out);
+
+    bool isActive() const { return m_active; }
+    /// stays 0 when the settings have no velocityRadius
+    qreal velocity() const { return m_velocity; }
+    qreal radius() const;
+    qreal spacing() const;
+
+private:
+    void walk(const QPointF& from, const QPointF& to, qreal fromPressure, qreal toPressure, QVector<StrokeDab>& out);
+    qreal radius(qreal pressure) const;
+
+    Settings m_settings;
+    bool m_active = false;
+    /// last input
+    StrokeSample m_last;
+    /// where the curve drawn so far ends
+    QPointF m_curveEnd;
+    qreal m_curvePressure = 1.0;
+    qreal m_velocity = 0.0;
+    /// distance travelled since the last dab; can be more than spacing() once that shrinks
+    qreal m_carry = 0.0;
+};
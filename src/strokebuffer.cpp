@@ -0,0 +1,128 @@
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLShaderProgram>
+#include <QVector4D>
+#include "glresources.h"
+#include "gpumemory.h"
+#include "strokebuffer.h"
+
+namespace {
+
+const char* vsrc =
+    R"(
+    #version 330
+    in highp vec2 vertex;
+    uniform highp mat4 matrix;
+    uniform highp vec4 rect;
+    out highp vec2 TextureCoordinates;
+    void main()
+    {
+        gl_Position = matrix * vec4(rect.xy + vertex * rect.zw, 0.0, 1.0);
+        TextureCoordinates = vertex;
+    }
+    )";
+
+const char* fsrc =
+    R"(
+    #version 330
+    uniform sampler2D stroke;
+    in highp vec2 TextureCoordinates;
+    void main() {
+        gl_FragColor = texture(stroke, TextureCoordinates);
+    }
+    )";
+
+struct MergeProgram : GLResources::Resource
+{
+    QOpenGLShaderProgram program;
+    int vertexLocation;
+    int matrixLocation;
+    int rectLocation;
+    int strokeLocation;
+    QOpenGLBuffer quad = QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    GpuMemory::Allocation memory;
+
+    MergeProgram() {
+        program.addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vsrc);
+        program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fsrc);
+        program.link();
+
+        vertexLocation = program.attributeLocation("vertex");
+        matrixLocation = program.uniformLocation("matrix");
+        rectLocation = program.uniformLocation("rect");
+        strokeLocation = program.uniformLocation("stroke");
+
+        const GLfloat strip[] = {
+            0.0f, 0.0f,
+            1.0f, 0.0f,
+            0.0f, 1.0f,
+            1.0f, 1.0f,
+        };
+        quad.create();
+        quad.bind();
+        quad.allocate(strip, sizeof(strip));
+        quad.release();
+        memory.set(nullptr, GpuMemory::Buffers, sizeof(strip), QStringLiteral("merge quad"));
+    }
+};
+
+}
+
+void StrokeBuffer::beginDabs()
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+    fns.glEnable(GL_BLEND);
+    // alpha keeps the largest coverage; colour only fills in what isn't covered yet
+    fns.glBlendEquationSeparate(GL_FUNC_ADD, GL_MAX);
+    fns.glBlendFuncSeparate(GL_ONE_MINUS_DST_ALPHA, GL_DST_ALPHA, GL_ONE, GL_ONE);
+}
+
+void StrokeBuffer::endDabs()
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+    fns.glBlendEquation(GL_FUNC_ADD);
+}
+
+void StrokeBuffer::drawTile(const QPoint& tile, const QMatrix4x4& projection) const
+{
+    auto it = m_tiles.tile(tile);
+    if (it == nullptr)
+        return;
+
+    auto gl = GLResources::current()->get<MergeProgram>();
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    fns.glEnable(GL_BLEND);
+    fns.glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    fns.glActiveTexture(GL_TEXTURE0);
+    fns.glBindTexture(GL_TEXTURE_2D, it->fbo->texture());
+
+    const QRect rect = TiledSurface::tileRect(tile);
+    gl->program.bind();
+    gl->program.setUniformValue(gl->matrixLocation, projection);
+    gl->program.setUniformValue(gl->rectLocation, QVector4D(rect.x(), rect.y(), rect.width(), rect.height()));
+    gl->program.setUniformValue(gl->strokeLocation, 0);
+    gl->quad.bind();
+    gl->program.enableAttributeArray(gl->vertexLocation);
+    gl->program.setAttributeBuffer(gl->vertexLocation, GL_FLOAT, 0, 2);
+    gl->quad.release();
+    fns.glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    gl->program.disableAttributeArray(gl->vertexLocation);
+    gl->program.release();
+    fns.glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+DirtyRegion StrokeBuffer::merge(TiledSurface* target)
+{
+    DirtyRegion ret;
+    for (const auto& tile : m_tiles.tiles()) {
+        drawTile(tile, target->bind(tile));
+        ret.add(TiledSurface::tileRect(tile) & QRect(QPoint(0, 0), target->size()));
+    }
+    m_tiles.clear();
+    return ret;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QMatrix4x4>
+#include "dirtyregion.h"
+#include "tiledsurface.h"
+
+/// where the dabs of one stroke collect before they land on a surface
+///
+/// the buffer is a sparse set of single-sampled, transparent tiles. dabs are
+/// drawn into it with alpha blended by GL_MAX, so where dabs of the stroke
+/// overlap a pixel keeps the most coverage any of them gave it instead of
+/// piling up; colour is mostly left by the first dabs to cover a pixel. merge() blends the finished stroke onto its target in one go, and
+/// drawTile() shows it over the target's contents in the meantime.
+class StrokeBuffer
+{
+public:
+    StrokeBuffer() = default;
+    Q_DISABLE_COPY(StrokeBuffer)
+
+    void setSize(const QSize& size) { m_tiles.setSize(size); }
+    void setAccount(GpuMemory::Account* account) { m_tiles.setAccount(account, GpuMemory::Stroke); }
+    bool isEmpty() const { return m_tiles.tileCount() == 0; }
+    bool hasTile(const QPoint& tile) const { return m_tiles.tile(tile) != nullptr; }
+    QVector<QPoint> tilesIn(const QRectF& rect) const { return m_tiles.tilesIn(rect); }
+    qint64 bytes() const { return m_tiles.bytes(); }
+
+    /// sets up the blending dabs are drawn into the buffer with
+    static void beginDabs();
+    /// puts back the blend equation the scene graph expects
+    static void endDabs();
+    /// binds the tile for drawing dabs and returns the projection mapping surface pixels onto it
+    QMatrix4x4 bind(const QPoint& tile) { return m_tiles.bind(tile); }
+
+    /// blends the stroke's tile over whatever framebuffer is bound, through
+    /// projection, which maps surface pixels onto it
+    void drawTile(const QPoint& tile, const QMatrix4x4& projection) const;
+    /// blends the whole stroke onto target, going through its write hook,
+    /// and empties the buffer. returns the area that changed.
+    /// the target's endStroke() is still up to the caller.
+    DirtyRegion merge(TiledSurface* target);
+    /// throws the stroke away
+    void clear() { m_tiles.clear(); }
+
+private:
+    TiledSurface m_tiles = TiledSurface(Qt::transparent);
+};
@@ -1,310 +1,625 @@
-#define protected public
 #include <QQuickFramebufferObject>
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLFramebufferObjectFormat>
 #include <QQuickWindow>
-#undef protected
+#include <QSGSimpleTextureNode>
+#include <QGuiApplication>
+#include <QPointer>
+#include <utility>
 #include "subcanvas.h"
 #include "canvas.h"
+#include "blur.h"
+#include "brush.h"
+#include "dabpipeline.h"
+#include "cpusurface.h"
+#include "stroke.h"
+#include "strokebuffer.h"
+#include "dirtyregion.h"
+#include "exporter.h"
+#include "glresources.h"
+#include "gpumemory.h"
+#include "history.h"
+#include "inputchannel.h"
+#include "journal.h"
+#include "latency.h"
+#include "paths.h"
+#include "profiler.h"
+#include "rendererstats.h"
+#include "sharedsurface.h"
+#include "tiledsurface.h"
+#include "tilepyramid.h"
+#include "viewbuffer.h"
+#include "viewport.h"
 
-struct SubcanvassyMessage {
-    enum Type {
-        Down,
-        Move,
-        Up,
-        OtherRenderer,
-    };
-    Type tag;
-    union {
-        struct {
-            QPointF pos;
-        } down;
-        struct {
-            QPointF pos;
-        } move;
-        struct {
-        } up;
-        struct {
-            QQuickFramebufferObject::Renderer* ptr;
-        } other;
-    };
-    SubcanvassyMessage() { }
-    static SubcanvassyMessage CDown(const QPointF& pos) {
-        SubcanvassyMessage ret; { ret.tag = Down; ret.down = {pos}; }; return ret;
-    }
-    static SubcanvassyMessage CMove(const QPointF& pos) {
-        SubcanvassyMessage ret; { ret.tag = Move; ret.move = {pos}; }; return ret;
-    }
-    static SubcanvassyMessage CUp() {
-        SubcanvassyMessage ret; { ret.tag = Up; ret.up = {}; }; return ret;
-    }
-    static SubcanvassyMessage COtherRenderer(QQuickFramebufferObject::Renderer* other) {
-        SubcanvassyMessage ret; { ret.tag = OtherRenderer; ret.other = {other}; }; return ret;
-    }
+/// one corner of a dab's quad; every corner carries the dab it belongs to
+struct SubcanvassyVertex {
+    GLfloat x, y;
+    GLfloat cx, cy;
+    GLfloat radius;
 };
 
-class SubcanvassyRenderer : public QQuickFramebufferObject::Renderer
+/// what every SubcanvassyRenderer on a context draws with, compiled for one set of brush features
+struct SubcanvassyProgram : GLResources::Resource
 {
-    // opengl + inputs to opengl
     QOpenGLShaderProgram program;
     int vertexLocation;
-    int matrixLocation;
-    int colorLocation;
-    int viewportSizeLocation;
     int centerLocation;
-    int strokeSizeLocation;
-    int inputTextureLocation;
-    int directionLocation;
-
-    // inputs from item
-    QSize m_size;
-    float m_dpr;
+    int radiusLocation;
+    int matrixLocation;
+    int blurredLocation;
+    int blurOriginLocation;
+    int blurSizeLocation;
+    int hardnessLocation;
 
-    // messages
-    QPointF m_pos;
-    QPointF m_lastPos;
-    QVarLengthArray<SubcanvassyMessage, 10> m_messages;
-    bool m_initted = false;
-    Renderer* m_other = nullptr;
-    QOpenGLFramebufferObject* m_pass1 = nullptr;
-    /// also the output buffer
-    QOpenGLFramebufferObject* m_pass2 = nullptr;
-public:
-    SubcanvassyRenderer(Subcanvassy*) {
+    explicit SubcanvassyProgram(quint32 features) {
         const char* vsrc =
             R"(
             #version 330
             attribute highp vec4 vertex;
+            attribute highp vec2 center;
+            attribute highp float radius;
             uniform highp mat4 matrix;
-            out mediump vec2 TextureCoordinates;
+            out highp vec2 Position;
+            out highp vec2 Center;
+            out highp float Radius;
             void main()
             {
                 gl_Position = matrix * vertex;
-                TextureCoordinates = 0.5 * gl_Position.xy + vec2(0.5);
+                Position = vertex.xy;
+                Center = center;
+                Radius = radius;
             }
             )";
         const char* fsrc =
             R"(
-            #version 330
-            uniform mediump vec4 color;
-            uniform mediump vec2 viewportSize;
-            uniform mediump vec2 center;
-            uniform mediump float strokeSize;
-            uniform sampler2D inputTexture;
-            uniform mediump vec2 blurDirection;
-
-            in mediump vec2 TextureCoordinates;
-
-            const int M = 16;
-            const int N = 2 * M + 1;
-
-            const float coeffs[N] = float[N](
-                0.012318109844189502,
-                0.014381474814203989,
-                0.016623532195728208,
-                0.019024086115486723,
-                0.02155484948872149,
-                0.02417948052890078,
-                0.02685404941667096,
-                0.0295279624870386,
-                0.03214534135442581,
-                0.03464682117793548,
-                0.0369716985390341,
-                0.039060328279673276,
-                0.040856643282313365,
-                0.04231065439216247,
-                0.043380781642569775,
-                0.044035873841196206,
-                0.04425662519949865,
-                0.044035873841196206,
-                0.043380781642569775,
-                0.04231065439216247,
-                0.040856643282313365,
-                0.039060328279673276,
-                0.0369716985390341,
-                0.03464682117793548,
-                0.03214534135442581,
-                0.0295279624870386,
-                0.02685404941667096,
-                0.02417948052890078,
-                0.02155484948872149,
-                0.019024086115486723,
-                0.016623532195728208,
-                0.014381474814203989,
-                0.012318109844189502
-            );
+            uniform sampler2D blurred;
+            uniform highp vec2 blurOrigin;
+            uniform highp vec2 blurSize;
+            #ifdef SOFT
+            uniform mediump float hardness;
+            #endif
+
+            in highp vec2 Position;
+            in highp vec2 Center;
+            in highp float Radius;
 
             void main() {
-                vec2 cx = (center);
-                vec2 px = (gl_FragCoord.xy);
-                float dist = distance(cx, px);
-                if (dist >= strokeSize) {
-                    gl_FragColor.a = 0.0;
-                    gl_FragDepth = 0.0;
-                } else {
-                    vec4 sum = vec4(0.0);
-                    for (int i = 0; i < N; ++i) {
-                        vec2 tc = TextureCoordinates + blurDirection * float(i - M);
-                        sum += coeffs[i] * texture(inputTexture, tc);
-                    }
-                    gl_FragColor = sum;
-                    gl_FragDepth = 1.0;
-                }
+                highp float d = distance(Center, Position);
+                // how much of the pixel the disc covers, from its distance to the rim in pixels
+                mediump float coverage = clamp(Radius - d + 0.5, 0.0, 1.0);
+            #ifdef SOFT
+                coverage = min(coverage, 1.0 - smoothstep(hardness, 1.0, d / Radius));
+            #endif
+                if (coverage <= 0.0)
+                    discard;
+                mediump vec4 color = texture(blurred, (Position - blurOrigin) / blurSize);
+                gl_FragColor = vec4(color.rgb, color.a * coverage);
             }
             )";
         program.addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vsrc);
-        program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fsrc);
+        program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment,
+            "#version 330\n" + BrushPreset::defines(BrushPreset::Features(features)) + fsrc);
         program.link();
 
         vertexLocation = program.attributeLocation("vertex");
+        centerLocation = program.attributeLocation("center");
+        radiusLocation = program.attributeLocation("radius");
         matrixLocation = program.uniformLocation("matrix");
-        colorLocation = program.uniformLocation("color");
-        viewportSizeLocation = program.uniformLocation("viewportSize");
-        centerLocation = program.uniformLocation("center");
-        strokeSizeLocation = program.uniformLocation("strokeSize");
-        inputTextureLocation = program.uniformLocation("inputTexture");
-        directionLocation = program.uniformLocation("blurDirection");
+        blurredLocation = program.uniformLocation("blurred");
+        blurOriginLocation = program.uniformLocation("blurOrigin");
+        blurSizeLocation = program.uniformLocation("blurSize");
+        hardnessLocation = program.uniformLocation("hardness");
     }
-    ~SubcanvassyRenderer() { }
+};
+
+class SubcanvassyRenderer : public QQuickFramebufferObject::Renderer
+{
+    /// first, so it outlives everything accounted to it
+    QSharedPointer<GpuMemory::Account> m_account;
+    /// the item's fbo, which the view is drawn into. Qt owns it, but only
+    /// reallocates it when asked to, which is in ViewBuffer's coarse steps
+    GpuMemory::Allocation m_viewMemory;
+    /// how much of the item's fbo is in use, from its origin; the item shows no more than that
+    QSize m_viewSize = QSize(0, 0);
+    QSize m_viewCapacity;
+    /// GpuMemory's frame at the last resize
+    quint64 m_resized = 0;
+    /// the parts of the view resizes uncovered, which haven't been drawn yet
+    DirtyRegion m_exposed;
+    /// whether the item's fbo is new, so all of the view has to be drawn
+    bool m_fresh = true;
+    /// whether the last frame ended over the GPU budget, so it's only warned about once
+    bool m_overBudget = false;
+
+    // opengl + inputs to opengl
+    /// the permutation for m_brush
+    SubcanvassyProgram* m_gl = nullptr;
+    BlurEngine m_blur;
+
+    // inputs from item
+    QSize m_size;
+    float m_dpr = 0;
+
+    // messages
+    DabPipeline* m_pipeline = nullptr;
+    DabPipeline::Frame m_frame;
+    /// what the current stroke smudges with, from its Begin
+    BrushPreset m_brush;
+    /// what the item has picked, which the pipeline starts the next stroke with
+    BrushPreset m_nextBrush;
+    QVector<SubcanvassyVertex> m_vertices;
+    QVector<GLuint> m_indices;
+    QSharedPointer<LatencyTracker> m_latency;
+    QMetaObject::Connection m_swapped;
+    QSharedPointer<RendererStats> m_stats;
+    QSharedPointer<FrameProfiler> m_profiler;
+    QSharedPointer<SharedSurface> m_source;
+
+    // blurred dabs, in document pixels; the item's fbo is only a view of them
+    TiledSurface m_surface = TiledSurface(Qt::transparent);
+    TilePyramid m_pyramid = TilePyramid(&m_surface);
+    QSize m_documentSize;
+    /// has to match the canvas's, whose view the dabs sample
+    Viewport m_viewport;
+    bool m_viewDirty = true;
+    /// the stroke in progress, until it's merged into m_surface on release
+    StrokeBuffer m_strokeBuffer;
+    /// paints in place of the GL path when the GL implementation is a software one
+    QScopedPointer<CpuSurface> m_cpu;
+    /// what changed on the surface since the view was last updated
+    DirtyRegion m_dirty;
+    History m_history = History(&m_surface);
+    CanvasExporter m_exporter;
+    /// exports requested since the last frame, taken once the view is up to date
+    QVector<QPair<QString, CanvasExporter::Done>> m_exports;
+public:
+    SubcanvassyRenderer(Subcanvassy* item) : m_account(item->gpuAccount()), m_profiler(item->frameProfiler()) {
+        m_nextBrush = item->brushPreset();
+        setBrush(m_nextBrush);
+        m_blur.setProfiler(m_profiler.data());
+
+        m_surface.setAccount(m_account.data(), GpuMemory::Layers);
+        m_pyramid.setAccount(m_account.data());
+        m_strokeBuffer.setAccount(m_account.data());
+        m_history.setAccount(m_account.data());
+        m_exporter.setAccount(m_account.data());
+
+        if (CpuSurface::preferred() == CpuSurface::Cpu)
+            m_cpu.reset(new CpuSurface(m_surface.blank()));
+    }
+    ~SubcanvassyRenderer() {
+        QObject::disconnect(m_swapped);
+        m_profiler->release();
+    }
+
+    void setBrush(const BrushPreset& brush) {
+        m_brush = brush;
+        m_gl = GLResources::current()->get<SubcanvassyProgram>(brush.features());
+        m_blur.setRadius(brush.kernelRadius);
+    }
+
+    /// the pixels of the canvas's view a rect of the document shows up on
+    QRect toView(const QRectF& rect) const {
+        const QPointF origin = m_viewport.origin(m_dpr);
+        return QRectF((rect.topLeft() - origin) * m_viewport.zoom, rect.size() * m_viewport.zoom).toAlignedRect();
+    }
+
+    /// blurs the footprint of a run of the frame's dabs once, then stamps the dabs out of it
+    void draw(const DabPipeline::Op& op) {
+        m_stats->dabs.fetch_add(op.count, std::memory_order_relaxed);
+        const auto source = m_source ? m_source->acquire() : SharedSurface::Handle();
+        if (!source.isValid())
+            return;
+        const StrokeDab* const begin = m_frame.dabs.constData() + op.first;
+        const StrokeDab* const end = begin + op.count;
+
+        // the blur runs over the canvas's view, so these are in view pixels;
+        // each dab's footprint there ends up inside exactly one of them
+        DirtyRegion frame;
+        for (auto dab = begin; dab != end; dab++) {
+            const QRect bounds = DirtyRegion::dabBounds(dab->pos, dab->radius);
+            frame.add(toView(bounds));
+            m_dirty.add(bounds);
+        }
+        const QPointF origin = m_viewport.origin(m_dpr);
+        const qreal zoom = m_viewport.zoom;
 
-    void paint(QPointF p) {
         QOpenGLFunctions fns;
         fns.initializeOpenGLFunctions();
+        auto& program = m_gl->program;
+
+        if (m_cpu) {
+            for (const auto& rect : frame.rects()) {
+                const int radius = m_blur.radius();
+                const QRect reach = rect.adjusted(-radius, -radius, radius, radius) & QRect(QPoint(0, 0), source.size);
+                const auto blurred = CpuSurface::gaussian(CpuSurface::readTexture(source.texture, reach), rect, radius);
+
+                QVector<CpuSurface::Dab> dabs;
+                QRect bounds;
+                for (auto dab = begin; dab != end; dab++) {
+                    const QPointF p = dab->pos;
+                    const qreal r = dab->radius;
+                    const QRect dabBounds = DirtyRegion::dabBounds(p, r);
+                    if (!rect.contains(toView(dabBounds)))
+                        continue;
+                    dabs << CpuSurface::Dab{float(p.x()), float(p.y()), float(r)};
+                    bounds |= dabBounds;
+                }
+                // back from the view into document pixels
+                const auto stamped = CpuSurface::resampled(blurred, bounds, origin, zoom);
+                m_cpu->upload(&m_surface, m_cpu->stampDabs(dabs, stamped, m_brush.hardness));
+            }
+            return;
+        }
 
-        QMatrix4x4 pmvMatrix;
-        pmvMatrix.ortho(0, m_size.width(), 0, m_size.height(), -1, 1);
-
-        auto x = static_cast<GLfloat>(p.x());
-        auto y = static_cast<GLfloat>(p.y());
-        const float pointSize = 50.0f;
-
-        const GLfloat squareVertices[] = {
-            x - pointSize, y - pointSize, 0.0f,
-            x - pointSize, y + pointSize, 0.0f,
-            x + pointSize, y + pointSize, 0.0f,
-            x + pointSize, y - pointSize, 0.0f
-        };
-        const GLubyte squareIndices[] = {
-            0, 1, 2,
-            0, 2, 3
-        };
-
-        fns.glEnable(GL_BLEND);
-        fns.glEnable(GL_DEPTH_TEST);
-        fns.glDepthFunc(GL_GREATER);
-        fns.glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-        program.enableAttributeArray(vertexLocation);
-        program.setAttributeArray(vertexLocation, squareVertices, 3);
-        program.setUniformValue(matrixLocation, pmvMatrix);
-        program.setUniformValue(colorLocation, QColor(0, 255, 0, 255));
-        program.setUniformValue(viewportSizeLocation, m_size);
-        program.setUniformValue(centerLocation, p * m_dpr);
-        program.setUniformValue(strokeSizeLocation, pointSize * m_dpr);
-
-        fns.glActiveTexture(GL_TEXTURE0);
-        program.setUniformValue(inputTextureLocation, 0);
-
-        program.setUniformValue(directionLocation, QVector2D(1.0f / m_size.width(), 0.0f));
-        m_pass1->bind();
-        fns.glBindTexture(GL_TEXTURE_2D, m_other->framebufferObject()->texture());
-        fns.glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_BYTE, squareIndices);
-
-        program.setUniformValue(directionLocation, QVector2D(0.0f, 1.0f / m_size.height()));
-        m_pass2->bind();
-        fns.glBindTexture(GL_TEXTURE_2D, m_pass1->texture());
-        fns.glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_BYTE, squareIndices);
-
-        program.disableAttributeArray(vertexLocation);
+        for (const auto& rect : frame.rects()) {
+            const auto blurred = m_blur.blur(source.texture, source.size, rect, source.textureSize);
+            if (!blurred.isValid())
+                continue;
+
+            QSet<quint64> tiles;
+            m_vertices.clear();
+            m_indices.clear();
+            for (auto dab = begin; dab != end; dab++) {
+                const QPointF p = dab->pos;
+                const auto r = static_cast<GLfloat>(dab->radius);
+                const QRect bounds = DirtyRegion::dabBounds(p, r);
+                if (!rect.contains(toView(bounds)))
+                    continue;
+
+                for (const auto& tile : m_strokeBuffer.tilesIn(bounds)) {
+                    tiles << TiledSurface::key(tile);
+                }
+
+                // a pixel of slack around the disc for its antialiased rim
+                const auto x = static_cast<GLfloat>(p.x());
+                const auto y = static_cast<GLfloat>(p.y());
+                const auto e = r + 1.0f;
+                const GLuint base = m_vertices.size();
+                m_vertices << SubcanvassyVertex{x - e, y - e, x, y, r}
+                           << SubcanvassyVertex{x - e, y + e, x, y, r}
+                           << SubcanvassyVertex{x + e, y + e, x, y, r}
+                           << SubcanvassyVertex{x + e, y - e, x, y, r};
+                m_indices << base + 0 << base + 1 << base + 2
+                          << base + 0 << base + 2 << base + 3;
+            }
+            if (m_indices.isEmpty())
+                continue;
+
+            FrameProfiler::GpuScope pass(m_profiler.data(), "smudge dabs");
+            program.bind();
+            const int stride = sizeof(SubcanvassyVertex);
+            program.enableAttributeArray(m_gl->vertexLocation);
+            program.enableAttributeArray(m_gl->centerLocation);
+            program.enableAttributeArray(m_gl->radiusLocation);
+            program.setAttributeArray(m_gl->vertexLocation, GL_FLOAT, &m_vertices.constData()->x, 2, stride);
+            program.setAttributeArray(m_gl->centerLocation, GL_FLOAT, &m_vertices.constData()->cx, 2, stride);
+            program.setAttributeArray(m_gl->radiusLocation, GL_FLOAT, &m_vertices.constData()->radius, 1, stride);
+            program.setUniformValue(m_gl->blurredLocation, 0);
+            // dabs are in document pixels and the blur in view pixels, so the lookup
+            // is mapped through the viewport: (p - origin) * zoom - blur origin
+            program.setUniformValue(m_gl->blurOriginLocation, origin + QPointF(blurred.rect.topLeft()) / zoom);
+            program.setUniformValue(m_gl->blurSizeLocation, QSizeF(blurred.textureSize) / zoom);
+            if (m_brush.features() & BrushPreset::Soft)
+                program.setUniformValue(m_gl->hardnessLocation, GLfloat(m_brush.hardness));
+
+            fns.glActiveTexture(GL_TEXTURE0);
+            fns.glBindTexture(GL_TEXTURE_2D, blurred.texture);
+            StrokeBuffer::beginDabs();
+
+            for (auto key : qAsConst(tiles)) {
+                program.setUniformValue(m_gl->matrixLocation, m_strokeBuffer.bind(TiledSurface::fromKey(key)));
+                fns.glDrawElements(GL_TRIANGLES, m_indices.size(), GL_UNSIGNED_INT, m_indices.constData());
+            }
+            StrokeBuffer::endDabs();
+
+            program.disableAttributeArray(m_gl->vertexLocation);
+            program.disableAttributeArray(m_gl->centerLocation);
+            program.disableAttributeArray(m_gl->radiusLocation);
+            program.release();
+        }
+    }
+
+    void process(const DabPipeline::Op& op) {
+        switch (op.tag) {
+        case DabPipeline::Op::Begin: {
+            setBrush(op.brush);
+            break;
+        }
+        case DabPipeline::Op::Dabs: {
+            FrameProfiler::CpuScope scope(m_profiler.data(), "smudge");
+            draw(op);
+            break;
+        }
+        case DabPipeline::Op::End: {
+            FrameProfiler::Scope scope(m_profiler.data(), "merge");
+            m_strokeBuffer.merge(&m_surface);
+            m_surface.endStroke();
+
+            // the overlay only lives until release, so the step worth
+            // keeping is the clear: undoing it brings the smudge back
+            m_history.begin();
+            for (const auto& tile : m_surface.tiles()) {
+                m_history.touch(&m_surface, tile);
+                m_dirty.add(TiledSurface::tileRect(tile));
+            }
+            m_surface.clear();
+            if (m_cpu)
+                m_cpu->clear();
+            m_history.end();
+            break;
+        }
+        case DabPipeline::Op::Undo: {
+            FrameProfiler::Scope scope(m_profiler.data(), "history");
+            const DirtyRegion changed = m_history.undo();
+            if (m_cpu)
+                m_cpu->download(&m_surface, changed);
+            m_dirty.add(changed);
+            break;
+        }
+        case DabPipeline::Op::Redo: {
+            FrameProfiler::Scope scope(m_profiler.data(), "history");
+            const DirtyRegion changed = m_history.redo();
+            if (m_cpu)
+                m_cpu->download(&m_surface, changed);
+            m_dirty.add(changed);
+            break;
+        }
+        case DabPipeline::Op::Fill:
+        case DabPipeline::Op::Layer:
+            // our input never fills, and there's only the one layer
+            break;
+        }
+    }
+
+    /// gives GPU memory back while the process is over budget, whatever is cheapest to get back first
+    void relieve() {
+        if (GpuMemory::isOverBudget())
+            m_history.releaseGpu();
+        // parking takes a few frames, a few tiles at a time, and what it started finishes under budget too
+        int budget = GpuMemory::isOverBudget() ? TiledSurface::ParksPerFrame : 0;
+        const quint64 before = budget > 0 ? GpuMemory::coldBefore() : 0;
+        m_pyramid.park(before, budget);
+        m_surface.park(before, budget);
+        const bool parking = m_pyramid.isParking() || m_surface.isParking();
+        if (parking)
+            update();
+
+        const bool over = GpuMemory::isOverBudget() && !parking;
+        if (over && !m_overBudget)
+            qWarning("Subcanvassy: %lld MiB over the GPU budget after giving back what it could", GpuMemory::excess() / (1024 * 1024));
+        m_overBudget = over;
     }
 
     void render() override {
         QOpenGLFunctions fns;
         fns.initializeOpenGLFunctions();
-        if (!m_initted) {
-            fns.glClearColor(0.0, 0.0, 0.0, 0.00);
-            fns.glClearDepthf(0.0);
-            fns.glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-            m_initted = true;
+        GpuMemory::advanceFrame();
+        FrameProfiler::CpuScope frame(m_profiler.data(), "render");
+
+        // the worker has already turned the input into dabs; the journal replays through it too
+        m_pipeline->take(m_frame);
+        for (auto received : qAsConst(m_frame.received)) {
+            m_latency->taken(received);
+        }
+        for (const auto& op : qAsConst(m_frame.ops)) {
+            process(op);
         }
 
-        for (auto& msg : m_messages) {
-            switch (msg.tag) {
-            case SubcanvassyMessage::Down: {
-                m_lastPos = msg.down.pos;
-                m_pos = msg.down.pos;
-                program.bind();
-                paint(m_pos);
-                program.release();
-                break;
+        auto view = framebufferObject();
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "pyramid");
+            m_pyramid.update(m_dirty);
+        }
+        // only what the surface changed under and what a resize uncovered is redrawn;
+        // moving the viewport or a new fbo redraws it all
+        const QRect bounds(QPoint(0, 0), m_viewSize);
+        DirtyRegion redraw = m_exposed;
+        if (m_viewDirty || m_fresh) {
+            redraw.clear();
+            redraw.add(bounds);
+        } else {
+            for (const auto& rect : m_dirty.rects()) {
+                // a view pixel of slack for the pyramid's filtering across the edge
+                const QRect shown = toView(rect).adjusted(-1, -1, 1, 1) & bounds;
+                if (!shown.isEmpty())
+                    redraw.add(shown);
             }
-            case SubcanvassyMessage::Move: {
-                m_lastPos = m_pos;
-                m_pos = msg.move.pos;
-
-                auto line = QLineF(m_pos, m_lastPos);
-                program.bind();
-                if (line.length() > 1.0) {
-                    int n = line.length();
-                    for (int i = 0; i < n; i++) {
-                        auto t = qreal(i) / qreal(n);
-                        paint(line.pointAt(t));
-                    }
-                } else {
-                    paint(m_pos);
+        }
+        if (m_documentSize.isEmpty())
+            redraw.clear();
+        for (const auto& area : redraw.rects()) {
+            FrameProfiler::Scope scope(m_profiler.data(), "view");
+            const QPointF origin = m_viewport.origin(m_dpr);
+            m_pyramid.draw(view, area, origin, m_viewport.zoom, Qt::transparent);
+
+            // the stroke in progress goes over the surface, blended as it will be when merged.
+            // it's only as large as one stroke, so it's drawn from its full-size tiles
+            const QRect shown = toView(QRect(QPoint(0, 0), m_documentSize)) & area;
+            if (!m_strokeBuffer.isEmpty() && !shown.isEmpty()) {
+                QMatrix4x4 projection;
+                projection.ortho(0, view->width(), 0, view->height(), -1, 1);
+                projection.scale(m_viewport.zoom, m_viewport.zoom);
+                projection.translate(-origin.x(), -origin.y());
+                view->bind();
+                fns.glViewport(0, 0, view->width(), view->height());
+                fns.glEnable(GL_SCISSOR_TEST);
+                fns.glScissor(shown.x(), shown.y(), shown.width(), shown.height());
+                const QRectF visible(origin + QPointF(area.topLeft()) / m_viewport.zoom, QSizeF(area.size()) / m_viewport.zoom);
+                for (const auto& tile : m_strokeBuffer.tilesIn(visible)) {
+                    m_strokeBuffer.drawTile(tile, projection);
                 }
-                program.release();
-                break;
-            }
-            case SubcanvassyMessage::Up: {
-                m_lastPos = QPointF();
-                m_pos = QPointF();
-                fns.glClearColor(0.0, 0.0, 0.0, 0.00);
-                fns.glClearDepthf(0.0);
-                fns.glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-                break;
-            }
-            case SubcanvassyMessage::OtherRenderer: {
-                m_other = msg.other.ptr;
-            }
+                fns.glDisable(GL_SCISSOR_TEST);
             }
         }
+        m_dirty.clear();
+        m_exposed.clear();
+        m_viewDirty = false;
+        m_fresh = false;
+        m_latency->rendered();
+        m_stats->frames.fetch_add(1, std::memory_order_relaxed);
+
+        for (const auto& it : qAsConst(m_exports)) {
+            m_exporter.request(&m_surface, it.first, it.second);
+        }
+        m_exports.clear();
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "export");
+            m_exporter.step();
+        }
+        if (m_exporter.isBusy())
+            update();
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "demote");
+            m_history.step();
+        }
+        if (m_history.isBusy())
+            update();
+        {
+            FrameProfiler::Scope scope(m_profiler.data(), "relieve");
+            relieve();
+        }
+
+        view->bind();
+        fns.glViewport(0, 0, view->width(), view->height());
+        m_profiler->endFrame();
     }
 
     QOpenGLFramebufferObject *createFramebufferObject(const QSize &size) override {
-        if (m_pass1 != nullptr) {
-            delete m_pass1;
-            m_pass1 = nullptr;
-            m_pass2 = nullptr;
+        // with room to grow; resizeView() asks for another once the view outgrows it
+        auto ret = new QOpenGLFramebufferObject(ViewBuffer::allocationFor(size));
+        m_viewCapacity = ret->size();
+        m_fresh = true;
+        m_viewMemory.set(m_account.data(), GpuMemory::View, ret);
+        return ret;
+    }
+
+    /// changes how much of the item's fbo is in use. a new one is only asked for when the
+    /// view doesn't fit anymore, or has settled well inside it and the spare room can go back
+    void resizeView(const QSize& size) {
+        if (size != m_viewSize) {
+            // what's already drawn stays where it is; only what the resize uncovers is drawn
+            m_exposed.add(ViewBuffer::uncovered(m_viewSize, size));
+            m_viewSize = size;
+            m_resized = GpuMemory::frame();
         }
-        QOpenGLFramebufferObjectFormat format;
-        format.setAttachment(QOpenGLFramebufferObject::CombinedDepthStencil);
-        format.setSamples(4);
-        auto pass1 = new QOpenGLFramebufferObject(size, format);
-        auto pass2 = new QOpenGLFramebufferObject(size, format);
-        m_pass1 = pass1;
-        m_pass2 = pass2;
-        return m_pass2;
+        // until the first fbo, which Qt asks for anyway
+        if (m_viewCapacity.isEmpty())
+            return;
+        const QSize settled = ViewBuffer::allocationFor(size);
+        const bool outgrown = m_viewCapacity.width() < size.width() || m_viewCapacity.height() < size.height();
+        const bool spare = GpuMemory::frame() - m_resized >= ViewBuffer::SettleFrames
+            && (m_viewCapacity.width() > settled.width() || m_viewCapacity.height() > settled.height());
+        if (outgrown || spare)
+            invalidateFramebufferObject();
     }
 
     void synchronize(QQuickFramebufferObject* item) override {
+        m_profiler->beginFrame();
+        FrameProfiler::CpuScope scope(m_profiler.data(), "synchronize");
         auto canvas = static_cast<Subcanvassy*>(item);
-        m_messages = std::move(canvas->messages());
-        canvas->messages().clear();
+        m_pipeline = canvas->dabPipeline();
+        // a move that found the channel full goes in once the worker has caught up
+        if (canvas->input()->flush())
+            update();
+        for (const auto& path : canvas->takeExports()) {
+            // the pointer is only looked at back on the gui thread
+            m_exports << qMakePair(path, CanvasExporter::Done([canvas = QPointer<Subcanvassy>(canvas)](const QString& path, bool ok) {
+                QMetaObject::invokeMethod(qApp, [canvas, path, ok] {
+                    if (canvas)
+                        Q_EMIT canvas->exported(path, ok);
+                }, Qt::QueuedConnection);
+            })));
+        }
+        m_stats = canvas->rendererStats();
+        if (!m_latency) {
+            // frameSwapped is emitted on this thread, right after the swap
+            m_latency = canvas->latencyTracker();
+            m_swapped = QObject::connect(item->window(), &QQuickWindow::frameSwapped, [latency = m_latency] {
+                latency->swapped();
+            });
+        }
+        m_source = canvas->source();
         m_size = item->size().toSize();
-        m_dpr = item->window()->effectiveDevicePixelRatio();
+        const float dpr = item->window()->effectiveDevicePixelRatio();
+        if (dpr != m_dpr) {
+            m_dpr = dpr;
+            m_viewDirty = true;
+        }
+        resizeView((item->size() * m_dpr).toSize());
+
+        QSize documentSize = canvas->documentSize();
+        if (documentSize.isEmpty())
+            documentSize = (item->size() * m_dpr).toSize();
+        if (documentSize != m_documentSize) {
+            m_documentSize = documentSize;
+            m_surface.setSize(documentSize);
+            m_strokeBuffer.setSize(documentSize);
+            if (m_cpu)
+                m_cpu->setSize(documentSize);
+            m_pyramid.resize();
+            m_dirty.add(QRect(QPoint(0, 0), documentSize));
+            // the desk around the document moves with its edges
+            m_viewDirty = true;
+        }
+        m_pipeline->setSurface(m_dpr, documentSize);
+        const Viewport viewport = canvas->viewport();
+        if (viewport != m_viewport) {
+            m_viewport = viewport;
+            m_viewDirty = true;
+        }
+
+        const BrushPreset brush = canvas->brushPreset();
+        if (brush.name != m_nextBrush.name) {
+            m_nextBrush = brush;
+            // compile the permutation now rather than on the stroke's first frame
+            GLResources::current()->get<SubcanvassyProgram>(brush.features());
+        }
+        m_pipeline->setBrush(brush);
+        // after the surface, which the replayed dabs are generated for
+        m_pipeline->replay(canvas->takeJournalReplay());
+
+        const qint64 budget = qint64(canvas->historyBudget()) * 1024 * 1024;
+        if (budget != m_history.settings().budget) {
+            auto settings = m_history.settings();
+            settings.budget = budget;
+            m_history.setSettings(settings);
+        }
     }
 };
 
 struct Subcanvassy::Private
 {
-    QVarLengthArray<SubcanvassyMessage, 10> messages;
+    InputChannel* input = nullptr;
+    QScopedPointer<DabPipeline> dabPipeline;
+    QScopedPointer<StrokeJournal> journal;
+    QVector<InputMessage> replay;
+    QStringList exports;
+    QSharedPointer<LatencyTracker> latencyTracker = QSharedPointer<LatencyTracker>::create();
+    LatencyStats* latency = nullptr;
+    QSharedPointer<RendererStats> rendererStats = QSharedPointer<RendererStats>::create();
+    QSharedPointer<GpuMemory::Account> gpuAccount = QSharedPointer<GpuMemory::Account>::create(QStringLiteral("Subcanvassy"));
+    GpuMemoryStats* gpuMemory = nullptr;
+    QSharedPointer<FrameProfiler> frameProfiler = QSharedPointer<FrameProfiler>::create(QStringLiteral("Subcanvassy"));
+    ProfilerStats* profiler = nullptr;
+    QSharedPointer<SharedSurface> source;
+    int historyBudget = 256;
+    QSize documentSize;
+    Viewport viewport;
+    BrushPreset brush = BrushPreset::find(BrushPreset::Smudge, QString());
 };
 
 Subcanvassy::Subcanvassy(QQuickItem* parent) : QQuickFramebufferObject(parent), d(new Private)
 {
     setAcceptedMouseButtons(Qt::RightButton);
+    // the renderer reallocates the fbo itself, in coarse steps
+    setTextureFollowsItemSize(false);
+    d->latency = new LatencyStats(d->latencyTracker, this);
+    d->gpuMemory = new GpuMemoryStats(d->gpuAccount, this);
+    d->profiler = new ProfilerStats(d->frameProfiler, this);
+    d->input = new InputChannel(this, Qt::RightButton);
+    d->dabPipeline.reset(new DabPipeline(this, d->input));
 }
 
 Subcanvassy::~Subcanvassy()
@@ -315,26 +630,214 @@ Subcanvassy::Renderer* Subcanvassy::createRenderer() const
 {
     return new SubcanvassyRenderer(const_cast<Subcanvassy*>(this));
 }
-QVarLengthArray<SubcanvassyMessage, 10>& Subcanvassy::messages() const
+QSGNode* Subcanvassy::updatePaintNode(QSGNode* node, UpdatePaintNodeData* data)
+{
+    node = QQuickFramebufferObject::updatePaintNode(node, data);
+    // the fbo has room to grow; only the corner the renderer draws into is shown
+    if (auto texture = dynamic_cast<QSGSimpleTextureNode*>(node))
+        texture->setSourceRect(QRectF(QPointF(0, 0), (size() * window()->effectiveDevicePixelRatio()).toSize()));
+    return node;
+}
+InputChannel* Subcanvassy::input() const
+{
+    return d->input;
+}
+DabPipeline* Subcanvassy::dabPipeline() const
+{
+    return d->dabPipeline.data();
+}
+QSharedPointer<LatencyTracker> Subcanvassy::latencyTracker() const
+{
+    return d->latencyTracker;
+}
+LatencyStats* Subcanvassy::latency() const
+{
+    return d->latency;
+}
+QSharedPointer<RendererStats> Subcanvassy::rendererStats() const
+{
+    return d->rendererStats;
+}
+QSharedPointer<GpuMemory::Account> Subcanvassy::gpuAccount() const
+{
+    return d->gpuAccount;
+}
+GpuMemoryStats* Subcanvassy::gpuMemory() const
 {
-    return d->messages;
+    return d->gpuMemory;
 }
-void Subcanvassy::attach(Renderer* other)
+QSharedPointer<FrameProfiler> Subcanvassy::frameProfiler() const
 {
-    d->messages << SubcanvassyMessage::COtherRenderer(other);
+    return d->frameProfiler;
+}
+ProfilerStats* Subcanvassy::profiler() const
+{
+    return d->profiler;
+}
+QSharedPointer<SharedSurface> Subcanvassy::source() const
+{
+    return d->source;
+}
+void Subcanvassy::setSource(const QSharedPointer<SharedSurface>& source)
+{
+    d->source = source;
     update();
 }
 void Subcanvassy::mousePressEvent(QMouseEvent* event)
 {
-    d->messages << SubcanvassyMessage::CDown(event->pos());
-    update();
+    d->input->mousePressEvent(event);
 }
 void Subcanvassy::mouseMoveEvent(QMouseEvent* event)
 {
-    d->messages << SubcanvassyMessage::CMove(event->pos());
+    d->input->mouseMoveEvent(event);
+}
+void Subcanvassy::mouseReleaseEvent(QMouseEvent* event)
+{
+    d->input->mouseReleaseEvent(event);
+}
+QString Subcanvassy::journal() const
+{
+    return d->journal ? d->journal->path() : QString();
+}
+void Subcanvassy::setJournal(const QString& journal)
+{
+    const QString path = appDataPath(journal);
+    if (path == this->journal())
+        return;
+
+    d->input->setJournal(nullptr);
+    d->replay.clear();
+    d->journal.reset(path.isEmpty() ? nullptr : new StrokeJournal(path));
+    if (d->journal && d->journal->isOpen()) {
+        // a smudge only lasts until its release, so only what follows the last one is
+        // worth replaying; checkpointing past it keeps the file from growing across sessions
+        auto replay = d->journal->takeReplay();
+        int last = replay.size();
+        while (last > 0 && replay[last - 1].tag != InputMessage::Up)
+            last--;
+        d->journal->checkpoint(QByteArray(), quint64(last));
+        d->replay = replay.mid(last);
+        for (int i = last - 1; i >= 0; i--) {
+            if (replay[i].tag == InputMessage::Brush) {
+                d->replay.prepend(replay[i]);
+                break;
+            }
+        }
+
+        d->input->setJournal(d->journal.data());
+        // a replay starts out with whatever brush the app starts with
+        d->journal->append(InputMessage::CBrush(qHash(d->brush.name)));
+    }
+    Q_EMIT journalChanged();
     update();
 }
-void Subcanvassy::mouseReleaseEvent(QMouseEvent*) {
-    d->messages << SubcanvassyMessage::CUp();
+QVector<InputMessage> Subcanvassy::takeJournalReplay()
+{
+    return std::move(d->replay);
+}
+void Subcanvassy::exportImage(const QString& path)
+{
+    d->exports << path;
     update();
 }
+QStringList Subcanvassy::takeExports()
+{
+    return std::exchange(d->exports, {});
+}
+int Subcanvassy::historyBudget() const
+{
+    return d->historyBudget;
+}
+void Subcanvassy::setHistoryBudget(int budget)
+{
+    if (d->historyBudget == budget)
+        return;
+
+    d->historyBudget = budget;
+    Q_EMIT historyBudgetChanged();
+    update();
+}
+QString Subcanvassy::brush() const
+{
+    return d->brush.name;
+}
+void Subcanvassy::setBrush(const QString& name)
+{
+    if (d->brush.name == name)
+        return;
+
+    d->brush = BrushPreset::find(BrushPreset::Smudge, name);
+    if (d->journal)
+        d->journal->append(InputMessage::CBrush(qHash(d->brush.name)));
+    Q_EMIT brushChanged();
+    update();
+}
+QStringList Subcanvassy::brushes() const
+{
+    return BrushPreset::names(BrushPreset::Smudge);
+}
+BrushPreset Subcanvassy::brushPreset() const
+{
+    return d->brush;
+}
+QSize Subcanvassy::documentSize() const
+{
+    return d->documentSize;
+}
+void Subcanvassy::setDocumentSize(const QSize& size)
+{
+    if (d->documentSize == size)
+        return;
+
+    d->documentSize = size;
+    Q_EMIT documentSizeChanged();
+    update();
+}
+qreal Subcanvassy::zoom() const
+{
+    return d->viewport.zoom;
+}
+void Subcanvassy::setZoom(qreal zoom)
+{
+    Viewport viewport = d->viewport;
+    viewport.zoom = qBound(Viewport::MinimumZoom, zoom, Viewport::MaximumZoom);
+    setViewport(viewport);
+}
+QPointF Subcanvassy::pan() const
+{
+    return d->viewport.pan;
+}
+void Subcanvassy::setPan(const QPointF& pan)
+{
+    Viewport viewport = d->viewport;
+    viewport.pan = pan;
+    setViewport(viewport);
+}
+void Subcanvassy::zoomAt(const QPointF& pos, qreal factor)
+{
+    Viewport viewport = d->viewport;
+    viewport.zoomAt(pos, factor);
+    setViewport(viewport);
+}
+Viewport Subcanvassy::viewport() const
+{
+    return d->viewport;
+}
+void Subcanvassy::setViewport(const Viewport& viewport)
+{
+    if (d->viewport == viewport)
+        return;
+
+    d->viewport = viewport;
+    d->input->setTransform(viewport.toDocument());
+    Q_EMIT viewportChanged();
+    update();
+}
+void Subcanvassy::undo()
+{
+    d->input->push(InputMessage::CUndo());
+}
+void Subcanvassy::redo()
+{
+    d->input->push(InputMessage::CRedo());
+}
@@ -1,26 +1,110 @@
 #pragma once
 
 #include <QQuickFramebufferObject>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QVector>
+#include "gpumemory.h"
 
-struct SubcanvassyMessage;
+struct BrushPreset;
+class DabPipeline;
+class FrameProfiler;
+class InputChannel;
+struct InputMessage;
+class LatencyStats;
+class LatencyTracker;
+class ProfilerStats;
+struct RendererStats;
+class SharedSurface;
+struct Viewport;
 
 class Subcanvassy : public QQuickFramebufferObject
 {
     Q_OBJECT
     QML_NAMED_ELEMENT(Subcanvassy)
 
+    /// input-to-photon latency of this item's strokes
+    Q_PROPERTY(LatencyStats* latency READ latency CONSTANT)
+    /// GPU memory held by this item's renderer, and by the whole process
+    Q_PROPERTY(GpuMemoryStats* gpuMemory READ gpuMemory CONSTANT)
+    /// where this item's frames go, pass by pass, on the GPU and the render thread; off until enabled
+    Q_PROPERTY(ProfilerStats* profiler READ profiler CONSTANT)
+    /// where input is journaled for crash recovery; relative paths are under the app data directory.
+    /// whatever the file already holds is replayed when the canvas is first rendered
+    Q_PROPERTY(QString journal READ journal WRITE setJournal NOTIFY journalChanged)
+    /// how much memory undo history may hold, in MiB
+    Q_PROPERTY(int historyBudget READ historyBudget WRITE setHistoryBudget NOTIFY historyBudgetChanged)
+    /// the name of the smudge preset strokes use, one of brushes; takes effect on the next stroke
+    Q_PROPERTY(QString brush READ brush WRITE setBrush NOTIFY brushChanged)
+    Q_PROPERTY(QStringList brushes READ brushes CONSTANT)
+    /// the size of what's painted on, in pixels; empty follows the item
+    Q_PROPERTY(QSize documentSize READ documentSize WRITE setDocumentSize NOTIFY documentSizeChanged)
+    /// item pixels per document point
+    Q_PROPERTY(qreal zoom READ zoom WRITE setZoom NOTIFY viewportChanged)
+    /// the document point at the item's top left corner
+    Q_PROPERTY(QPointF pan READ pan WRITE setPan NOTIFY viewportChanged)
+
     struct Private;
     QScopedPointer<Private> d;
+    void setViewport(const Viewport& viewport);
 
 public:
     Subcanvassy(QQuickItem* parent = nullptr);
     ~Subcanvassy();
 
     Renderer* createRenderer() const override;
-    QVarLengthArray<SubcanvassyMessage, 10>& messages() const;
-    void attach(Renderer* other);
+    InputChannel* input() const;
+    /// where the renderer takes its dabs from
+    DabPipeline* dabPipeline() const;
+    QSharedPointer<LatencyTracker> latencyTracker() const;
+    LatencyStats* latency() const;
+    QSharedPointer<RendererStats> rendererStats() const;
+    QSharedPointer<GpuMemory::Account> gpuAccount() const;
+    GpuMemoryStats* gpuMemory() const;
+    QSharedPointer<FrameProfiler> frameProfiler() const;
+    ProfilerStats* profiler() const;
+    QSharedPointer<SharedSurface> source() const;
+    void setSource(const QSharedPointer<SharedSurface>& source);
+
+    QString journal() const;
+    void setJournal(const QString& journal);
+    Q_SIGNAL void journalChanged();
+    /// the journaled messages still to be replayed; empty after the first call
+    QVector<InputMessage> takeJournalReplay();
+
+    /// writes what's on the canvas to path without blocking painting; the format follows the suffix
+    Q_INVOKABLE void exportImage(const QString& path);
+    Q_SIGNAL void exported(const QString& path, bool ok);
+    /// export paths requested since the last call
+    QStringList takeExports();
+
+    int historyBudget() const;
+    void setHistoryBudget(int budget);
+    Q_SIGNAL void historyBudgetChanged();
+
+    QString brush() const;
+    void setBrush(const QString& name);
+    Q_SIGNAL void brushChanged();
+    QStringList brushes() const;
+    BrushPreset brushPreset() const;
+
+    QSize documentSize() const;
+    void setDocumentSize(const QSize& size);
+    Q_SIGNAL void documentSizeChanged();
+    qreal zoom() const;
+    void setZoom(qreal zoom);
+    QPointF pan() const;
+    void setPan(const QPointF& pan);
+    Q_SIGNAL void viewportChanged();
+    /// zooms by factor around pos, in item pixels
+    Q_INVOKABLE void zoomAt(const QPointF& pos, qreal factor);
+    Viewport viewport() const;
+
+    Q_INVOKABLE void undo();
+    Q_INVOKABLE void redo();
 
 protected:
+    QSGNode* updatePaintNode(QSGNode* node, UpdatePaintNodeData* data) override;
     void mousePressEvent(QMouseEvent* event) override;
     void mouseMoveEvent(QMouseEvent* event) override;
     void mouseReleaseEvent(QMouseEvent* event) override;
@@ -0,0 +1,402 @@
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QThreadPool>
+#include <QtMath>
+#include <utility>
+#include "tiledsurface.h"
+
+namespace {
+
+constexpr int TileBytes = TiledSurface::TileSize * TiledSurface::TileSize * 4;
+
+}
+
+TiledSurface::TiledSurface(const QColor& blank) : m_blank(blank)
+{
+}
+
+TiledSurface::~TiledSurface()
+{
+    if (!m_watchers.isEmpty()) {
+        const auto watchers = std::exchange(m_watchers, {});
+        for (const auto& tile : tiles()) {
+            for (const auto& it : watchers)
+                it.second.changing(tile);
+        }
+        for (const auto& it : watchers)
+            it.second.destroyed();
+    }
+    clear();
+
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+    for (const auto& parking : qAsConst(m_parking)) {
+        if (parking.fence != nullptr)
+            fns.glDeleteSync(parking.fence);
+        if (parking.buffer != nullptr)
+            m_buffers << parking.buffer;
+    }
+    for (auto buffer : qAsConst(m_buffers))
+        GpuMemory::untrack(buffer);
+    qDeleteAll(m_buffers);
+}
+
+void TiledSurface::setSize(const QSize& size)
+{
+    m_size = size;
+}
+
+void TiledSurface::setAccount(GpuMemory::Account* account, GpuMemory::Category category)
+{
+    m_account = account;
+    m_category = category;
+    for (auto it : qAsConst(m_tiles))
+        GpuMemory::track(it->fbo, m_account, m_category);
+}
+
+quint64 TiledSurface::key(const QPoint& tile)
+{
+    return (quint64(quint32(tile.x())) << 32) | quint64(quint32(tile.y()));
+}
+
+QPoint TiledSurface::fromKey(quint64 key)
+{
+    return QPoint(int(qint32(key >> 32)), int(qint32(key & 0xffffffff)));
+}
+
+QPoint TiledSurface::tileAt(const QPointF& pos)
+{
+    return QPoint(qFloor(pos.x() / TileSize), qFloor(pos.y() / TileSize));
+}
+
+QRect TiledSurface::tileRect(const QPoint& tile)
+{
+    return QRect(tile.x() * TileSize, tile.y() * TileSize, TileSize, TileSize);
+}
+
+QVector<QPoint> TiledSurface::tilesIn(const QRectF& rect, const QSize& size)
+{
+    QVector<QPoint> ret;
+
+    const QRectF clipped = rect & QRectF(QPointF(0, 0), size);
+    if (clipped.isEmpty())
+        return ret;
+
+    // the right and bottom edges are exclusive
+    const QPoint from = tileAt(clipped.topLeft());
+    const QPoint to = tileAt(clipped.bottomRight() - QPointF(0.5, 0.5));
+    for (int y = from.y(); y <= to.y(); y++) {
+        for (int x = from.x(); x <= to.x(); x++) {
+            ret << QPoint(x, y);
+        }
+    }
+    return ret;
+}
+
+TiledSurface::Tile* TiledSurface::tile(const QPoint& tile) const
+{
+    const quint64 k = key(tile);
+    Tile* ret = m_tiles.value(k, nullptr);
+    if (ret == nullptr) {
+        if (m_parked.isEmpty())
+            return nullptr;
+        const QByteArray parked = m_parked.take(k);
+        if (parked.isEmpty())
+            return nullptr;
+
+        const QByteArray pixels = qUncompress(parked);
+        ret = allocate(k);
+        QOpenGLFunctions fns;
+        fns.initializeOpenGLFunctions();
+        if (pixels.size() == TileSize * TileSize * 4) {
+            fns.glBindTexture(GL_TEXTURE_2D, ret->fbo->texture());
+            fns.glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TileSize, TileSize, GL_RGBA, GL_UNSIGNED_BYTE, pixels.constData());
+            fns.glBindTexture(GL_TEXTURE_2D, 0);
+        } else {
+            // a new fbo's contents are undefined; blank beats whatever was in that memory.
+            // callers may be in the middle of drawing elsewhere, so their target is put back
+            qWarning("TiledSurface: parked tile (%d, %d) didn't decompress, clearing it", tile.x(), tile.y());
+            GLint framebuffer = 0;
+            GLint viewport[4] = {};
+            fns.glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+            fns.glGetIntegerv(GL_VIEWPORT, viewport);
+            ret->fbo->bind();
+            fns.glViewport(0, 0, TileSize, TileSize);
+            fns.glClearColor(m_blank.redF(), m_blank.greenF(), m_blank.blueF(), m_blank.alphaF());
+            fns.glClear(GL_COLOR_BUFFER_BIT);
+            fns.glBindFramebuffer(GL_FRAMEBUFFER, GLuint(framebuffer));
+            fns.glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        }
+    }
+    ret->used = GpuMemory::frame();
+    return ret;
+}
+
+TiledSurface::Tile* TiledSurface::ensureTile(const QPoint& coord)
+{
+    changing(coord);
+    if (auto it = tile(coord))
+        return it;
+
+    auto ret = allocate(key(coord));
+    ret->fbo->bind();
+
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+    fns.glViewport(0, 0, TileSize, TileSize);
+    fns.glClearColor(m_blank.redF(), m_blank.greenF(), m_blank.blueF(), m_blank.alphaF());
+    fns.glClear(GL_COLOR_BUFFER_BIT);
+    return ret;
+}
+
+TiledSurface::Tile* TiledSurface::allocate(quint64 key) const
+{
+    auto ret = new Tile;
+    ret->fbo = new QOpenGLFramebufferObject(TileSize, TileSize);
+    ret->used = GpuMemory::frame();
+    GpuMemory::track(ret->fbo, m_account, m_category);
+    m_tiles.insert(key, ret);
+    return ret;
+}
+
+void TiledSurface::free(Tile* tile) const
+{
+    GpuMemory::untrack(tile->fbo);
+    delete tile->fbo;
+    delete tile;
+}
+
+QVector<QPoint> TiledSurface::tiles() const
+{
+    QVector<QPoint> ret;
+    ret.reserve(tileCount());
+    for (auto it = m_tiles.constBegin(); it != m_tiles.constEnd(); it++) {
+        ret << fromKey(it.key());
+    }
+    for (auto it = m_parked.constBegin(); it != m_parked.constEnd(); it++) {
+        ret << fromKey(it.key());
+    }
+    return ret;
+}
+
+qint64 TiledSurface::bytes() const
+{
+    // rgba8 colour
+    return qint64(m_tiles.size()) * TileSize * TileSize * 4;
+}
+
+qint64 TiledSurface::parkedBytes() const
+{
+    qint64 ret = 0;
+    for (const auto& it : qAsConst(m_parked))
+        ret += it.size();
+    return ret;
+}
+
+qint64 TiledSurface::park(quint64 before, int& budget)
+{
+    QOpenGLExtraFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    qint64 ret = 0;
+    for (auto it = m_parking.begin(); it != m_parking.end();) {
+        auto& parking = it.value();
+        if (parking.buffer != nullptr) {
+            if (fns.glClientWaitSync(parking.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+                it++;
+                continue;
+            }
+            fns.glDeleteSync(parking.fence);
+            parking.fence = nullptr;
+
+            parking.buffer->bind();
+            auto mapped = static_cast<const char*>(parking.buffer->mapRange(0, TileBytes, QOpenGLBuffer::RangeRead));
+            if (mapped != nullptr) {
+                QByteArray pixels(mapped, TileBytes);
+                parking.buffer->unmap();
+                parking.compression = QSharedPointer<Parking::Compression>::create();
+                QThreadPool::globalInstance()->start([compression = parking.compression, pixels] {
+                    compression->compressed = qCompress(pixels, 1);
+                    compression->done.store(true, std::memory_order_release);
+                });
+            } else {
+                // the tile stays on the GPU until it's cold again
+                qWarning("TiledSurface: couldn't map a parking tile's readback");
+            }
+            parking.buffer->release();
+            m_buffers << std::exchange(parking.buffer, nullptr);
+            if (!parking.compression) {
+                it = m_parking.erase(it);
+                continue;
+            }
+        }
+        if (!parking.compression->done.load(std::memory_order_acquire)) {
+            it++;
+            continue;
+        }
+
+        // a tile used since its readback may have been changed, and is warm again anyway
+        const auto tile = m_tiles.value(it.key(), nullptr);
+        if (tile != nullptr && tile->used < parking.started) {
+            m_parked.insert(it.key(), parking.compression->compressed);
+            m_tiles.remove(it.key());
+            free(tile);
+            ret += TileBytes;
+        }
+        it = m_parking.erase(it);
+    }
+
+    // the caller may be in the middle of drawing, so its target is put back
+    GLint framebuffer = -1;
+    for (auto it = m_tiles.constBegin(); it != m_tiles.constEnd() && budget > 0; it++) {
+        if (it.value()->used >= before || m_parking.contains(it.key()))
+            continue;
+        if (framebuffer < 0)
+            fns.glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+
+        QOpenGLBuffer* buffer = nullptr;
+        if (!m_buffers.isEmpty()) {
+            buffer = m_buffers.takeLast();
+        } else {
+            buffer = new QOpenGLBuffer(QOpenGLBuffer::PixelPackBuffer);
+            buffer->setUsagePattern(QOpenGLBuffer::StreamRead);
+            buffer->create();
+            buffer->bind();
+            buffer->allocate(TileBytes);
+            buffer->release();
+            GpuMemory::track(buffer, m_account, m_category, TileBytes, QStringLiteral("parking readback buffer"));
+        }
+
+        // with a pack buffer bound, glReadPixels only queues a copy and returns
+        it.value()->fbo->bind();
+        buffer->bind();
+        fns.glReadPixels(0, 0, TileSize, TileSize, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        buffer->release();
+
+        Parking parking;
+        parking.started = GpuMemory::frame();
+        parking.buffer = buffer;
+        parking.fence = fns.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        m_parking.insert(it.key(), parking);
+        budget--;
+    }
+    if (framebuffer >= 0)
+        fns.glBindFramebuffer(GL_FRAMEBUFFER, GLuint(framebuffer));
+
+    // a burst of parking is over; the buffers would only hold memory until the next one
+    if (m_parking.isEmpty() && !m_buffers.isEmpty()) {
+        for (auto buffer : qAsConst(m_buffers))
+            GpuMemory::untrack(buffer);
+        qDeleteAll(m_buffers);
+        m_buffers.clear();
+    }
+    return ret;
+}
+
+void TiledSurface::setParked(const QPoint& coord, const QByteArray& compressed)
+{
+    changing(coord);
+    if (auto it = m_tiles.take(key(coord)))
+        free(it);
+    m_parked.insert(key(coord), compressed);
+}
+
+QMatrix4x4 TiledSurface::bind(const QPoint& coord)
+{
+    if (!m_strokeTiles.contains(key(coord))) {
+        if (m_writeHook)
+            m_writeHook(coord);
+        m_strokeTiles << key(coord);
+    }
+
+    auto it = ensureTile(coord);
+    it->fbo->bind();
+
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+    fns.glViewport(0, 0, TileSize, TileSize);
+
+    const QRect rect = tileRect(coord);
+    QMatrix4x4 ret;
+    ret.ortho(rect.x(), rect.x() + TileSize, rect.y(), rect.y() + TileSize, -1, 1);
+    return ret;
+}
+
+void TiledSurface::addWatcher(const void* owner, const Watcher& watcher)
+{
+    m_watchers << qMakePair(owner, watcher);
+}
+
+void TiledSurface::removeWatcher(const void* owner)
+{
+    for (int i = m_watchers.size() - 1; i >= 0; i--) {
+        if (m_watchers[i].first == owner)
+            m_watchers.remove(i);
+    }
+}
+
+void TiledSurface::changing(const QPoint& coord) const
+{
+    // a copy, since a watcher may remove itself once it has nothing left to watch
+    const auto watchers = m_watchers;
+    for (const auto& it : watchers)
+        it.second.changing(coord);
+}
+
+void TiledSurface::endStroke()
+{
+    m_strokeTiles.clear();
+}
+
+void TiledSurface::dropTile(const QPoint& coord)
+{
+    changing(coord);
+    m_parked.remove(key(coord));
+    auto it = m_tiles.take(key(coord));
+    if (it == nullptr)
+        return;
+
+    free(it);
+}
+
+void TiledSurface::clear()
+{
+    if (!m_watchers.isEmpty()) {
+        for (const auto& tile : tiles())
+            changing(tile);
+    }
+    for (auto it : qAsConst(m_tiles))
+        free(it);
+    m_tiles.clear();
+    m_parked.clear();
+    m_strokeTiles.clear();
+}
+
+void TiledSurface::blit(QOpenGLFramebufferObject* target, const QRect& region)
+{
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    const QRect clipped = region & QRect(QPoint(0, 0), m_size);
+    if (clipped.isEmpty())
+        return;
+
+    target->bind();
+    fns.glEnable(GL_SCISSOR_TEST);
+    fns.glScissor(clipped.x(), clipped.y(), clipped.width(), clipped.height());
+    fns.glClearColor(m_blank.redF(), m_blank.greenF(), m_blank.blueF(), m_blank.alphaF());
+    fns.glClear(GL_COLOR_BUFFER_BIT);
+    fns.glDisable(GL_SCISSOR_TEST);
+
+    for (const auto& coord : tilesIn(clipped)) {
+        auto it = tile(coord);
+        if (it == nullptr)
+            continue;
+
+        const QRect rect = tileRect(coord) & clipped;
+        const QRect source = rect.translated(-tileRect(coord).topLeft());
+        QOpenGLFramebufferObject::blitFramebuffer(target, rect, it->fbo, source, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+}
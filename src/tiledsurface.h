@@ -0,0 +1,150 @@
+#pragma once
+
+#include <QByteArray>
+#include <QColor>
+#include <QHash>
+#include <QMatrix4x4>
+#include <QRect>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVector>
+#include <atomic>
+#include <functional>
+#include <qopengl.h>
+#include "gpumemory.h"
+
+class QOpenGLBuffer;
+class QOpenGLFramebufferObject;
+
+/// a sparse canvas made of fixed-size framebuffer tiles
+///
+/// tiles are only allocated once something paints into them; anything
+/// without a tile reads as the blank colour. coordinates are in surface
+/// pixels with the same orientation as GL framebuffers.
+///
+/// tiles that haven't been used for a while can be parked: read back and
+/// compressed into system memory. a parked tile is still allocated as far as
+/// anyone asking is concerned, and goes back on the GPU on its next access.
+/// parking takes a few frames: the readbacks go through pack buffers and
+/// fences, the compression through the thread pool, and a tile used in the
+/// meantime stays where it is.
+class TiledSurface
+{
+public:
+    static constexpr int TileSize = 256;
+    /// how many tiles park() starts reading back a frame, over all the surfaces sharing a budget
+    static constexpr int ParksPerFrame = 8;
+
+    struct Tile {
+        QOpenGLFramebufferObject* fbo = nullptr;
+        /// GpuMemory::frame() as of the last access
+        quint64 used = 0;
+    };
+
+    explicit TiledSurface(const QColor& blank);
+    ~TiledSurface();
+    Q_DISABLE_COPY(TiledSurface)
+
+    QSize size() const { return m_size; }
+    void setSize(const QSize& size);
+    QColor blank() const { return m_blank; }
+
+    /// who the tiles are accounted to, from now on and retroactively
+    void setAccount(GpuMemory::Account* account, GpuMemory::Category category);
+
+    static quint64 key(const QPoint& tile);
+    static QPoint fromKey(quint64 key);
+    static QPoint tileAt(const QPointF& pos);
+    static QRect tileRect(const QPoint& tile);
+
+    /// tiles that would be touched by painting inside rect, whether allocated or not
+    QVector<QPoint> tilesIn(const QRectF& rect) const { return tilesIn(rect, m_size); }
+    /// the same for a surface of the given size, without needing one
+    static QVector<QPoint> tilesIn(const QRectF& rect, const QSize& size);
+    /// the tile at the given tile coordinate, or nullptr if it's blank; unparks it if needed
+    Tile* tile(const QPoint& tile) const;
+    /// the tile at the given tile coordinate for writing to, allocating and clearing it if needed
+    Tile* ensureTile(const QPoint& tile);
+    /// every allocated tile, parked or not
+    QVector<QPoint> tiles() const;
+    int tileCount() const { return m_tiles.size() + m_parked.size(); }
+    /// what the tiles on the GPU hold
+    qint64 bytes() const;
+    /// what the parked tiles hold in system memory
+    qint64 parkedBytes() const;
+
+    /// starts parking up to budget tiles last used before the given frame, taking them off budget, and finishes
+    /// parking the ones read back on earlier frames; returns the GPU bytes freed. call once a frame while isParking()
+    qint64 park(quint64 before, int& budget);
+    /// whether park() has readbacks to finish on later frames
+    bool isParking() const { return !m_parking.isEmpty(); }
+    /// replaces a tile with compressed contents in the form park() leaves them, which only go up
+    /// to the GPU on its first access. they may point into a mapped file that has to outlive them
+    void setParked(const QPoint& tile, const QByteArray& compressed);
+    /// a parked tile's compressed contents, or nothing if it isn't parked
+    QByteArray parked(const QPoint& tile) const { return m_parked.value(key(tile)); }
+
+    /// binds the tile for painting and returns the projection mapping surface pixels onto it
+    QMatrix4x4 bind(const QPoint& tile);
+
+    /// called with a tile's coordinate right before its first write of a stroke,
+    /// while it still holds (or doesn't hold, if blank) its previous contents
+    void setWriteHook(const std::function<void(const QPoint&)>& hook) { m_writeHook = hook; }
+
+    /// what snapshots the surface is read out into over several frames get told, so they can copy a
+    /// tile before it changes instead of copying every tile up front
+    struct Watcher {
+        /// right before anything changes a tile, while it still holds (or doesn't hold, if blank) its contents
+        std::function<void(const QPoint&)> changing;
+        /// right before the surface goes away, after changing has been called for every tile
+        std::function<void()> destroyed;
+    };
+    /// owner only identifies the watcher to removeWatcher()
+    void addWatcher(const void* owner, const Watcher& watcher);
+    void removeWatcher(const void* owner);
+
+    /// forgets which tiles the stroke has written, so the next write to each fires the hook again
+    void endStroke();
+    /// frees a tile, turning it back into blank space
+    void dropTile(const QPoint& tile);
+    /// drops every tile
+    void clear();
+
+    /// copies the surface into target, filling unallocated tiles with the blank colour.
+    /// the target must be single-sampled and the same size as the surface.
+    void blit(QOpenGLFramebufferObject* target, const QRect& region);
+
+private:
+    /// a tile on its way into m_parked
+    struct Parking {
+        /// GpuMemory::frame() when the readback was queued; the tile stays if it's been used since
+        quint64 started = 0;
+        /// null once the readback has been mapped
+        QOpenGLBuffer* buffer = nullptr;
+        GLsync fence = nullptr;
+        struct Compression {
+            QByteArray compressed;
+            std::atomic<bool> done = {false};
+        };
+        QSharedPointer<Compression> compression;
+    };
+
+    Tile* allocate(quint64 key) const;
+    void free(Tile* tile) const;
+    void changing(const QPoint& tile) const;
+
+    QSize m_size;
+    QColor m_blank;
+    GpuMemory::Account* m_account = nullptr;
+    GpuMemory::Category m_category = GpuMemory::Layers;
+    // parked tiles come back on access, which doesn't change what the surface holds
+    mutable QHash<quint64, Tile*> m_tiles;
+    /// qCompress'd rgba8 pixels of the parked tiles
+    mutable QHash<quint64, QByteArray> m_parked;
+    QHash<quint64, Parking> m_parking;
+    /// pack buffers for parking, kept while any are in flight
+    QVector<QOpenGLBuffer*> m_buffers;
+    QSet<quint64> m_strokeTiles;
+    std::function<void(const QPoint&)> m_writeHook;
+    QVector<QPair<const void*, Watcher>> m_watchers;
+};
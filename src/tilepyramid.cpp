@@ -0,0 +1,278 @@
+#include <QOpenGLBuffer>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QOpenGLShaderProgram>
+#include <QSet>
+#include <QVector4D>
+#include <cmath>
+#include "glresources.h"
+#include "gpumemory.h"
+#include "tilepyramid.h"
+
+namespace {
+
+constexpr int TileSize = TiledSurface::TileSize;
+
+const char* vsrc =
+    R"(
+    #version 330
+    in highp vec2 vertex;
+    uniform highp mat4 matrix;
+    uniform highp vec4 rect;
+    out highp vec2 TextureCoordinates;
+    void main()
+    {
+        gl_Position = matrix * vec4(rect.xy + vertex * rect.zw, 0.0, 1.0);
+        TextureCoordinates = vertex;
+    }
+    )";
+
+const char* fsrc =
+    R"(
+    #version 330
+    uniform sampler2D tile;
+    in highp vec2 TextureCoordinates;
+    void main() {
+        gl_FragColor = texture(tile, TextureCoordinates);
+    }
+    )";
+
+/// draws a whole tile's texture into a rectangle of the bound framebuffer
+struct PyramidProgram : GLResources::Resource
+{
+    QOpenGLShaderProgram program;
+    int vertexLocation;
+    int matrixLocation;
+    int rectLocation;
+    int tileLocation;
+    QOpenGLBuffer quad = QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    GpuMemory::Allocation memory;
+
+    PyramidProgram() {
+        program.addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vsrc);
+        program.addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fsrc);
+        program.link();
+
+        vertexLocation = program.attributeLocation("vertex");
+        matrixLocation = program.uniformLocation("matrix");
+        rectLocation = program.uniformLocation("rect");
+        tileLocation = program.uniformLocation("tile");
+
+        const GLfloat strip[] = {
+            0.0f, 0.0f,
+            1.0f, 0.0f,
+            0.0f, 1.0f,
+            1.0f, 1.0f,
+        };
+        quad.create();
+        quad.bind();
+        quad.allocate(strip, sizeof(strip));
+        quad.release();
+        memory.set(nullptr, GpuMemory::Buffers, sizeof(strip), QStringLiteral("pyramid quad"));
+    }
+
+    void begin(const QSize& target) {
+        QMatrix4x4 matrix;
+        matrix.ortho(0, target.width(), 0, target.height(), -1, 1);
+        program.bind();
+        program.setUniformValue(matrixLocation, matrix);
+        program.setUniformValue(tileLocation, 0);
+        quad.bind();
+        program.enableAttributeArray(vertexLocation);
+        program.setAttributeBuffer(vertexLocation, GL_FLOAT, 0, 2);
+        quad.release();
+    }
+    void draw(GLuint texture, const QRectF& rect, GLint filter) {
+        QOpenGLFunctions fns;
+        fns.initializeOpenGLFunctions();
+        fns.glActiveTexture(GL_TEXTURE0);
+        fns.glBindTexture(GL_TEXTURE_2D, texture);
+        fns.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        fns.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+        program.setUniformValue(rectLocation, QVector4D(rect.x(), rect.y(), rect.width(), rect.height()));
+        fns.glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+    void end() {
+        QOpenGLFunctions fns;
+        fns.initializeOpenGLFunctions();
+        fns.glBindTexture(GL_TEXTURE_2D, 0);
+        program.disableAttributeArray(vertexLocation);
+        program.release();
+    }
+};
+
+}
+
+TilePyramid::TilePyramid(TiledSurface* base) : m_base(base)
+{
+}
+
+TilePyramid::~TilePyramid()
+{
+    qDeleteAll(m_levels);
+}
+
+void TilePyramid::setAccount(GpuMemory::Account* account)
+{
+    m_account = account;
+    for (auto it : qAsConst(m_levels))
+        it->setAccount(account, GpuMemory::Caches);
+}
+
+void TilePyramid::resize()
+{
+    qDeleteAll(m_levels);
+    m_levels.clear();
+
+    QSize size = m_base->size();
+    while (size.width() > TileSize || size.height() > TileSize) {
+        size = QSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+        auto it = new TiledSurface(m_base->blank());
+        it->setSize(size);
+        it->setAccount(m_account, GpuMemory::Caches);
+        m_levels << it;
+    }
+}
+
+void TilePyramid::update(const DirtyRegion& region)
+{
+    if (m_levels.isEmpty() || region.isEmpty())
+        return;
+
+    QSet<quint64> dirty;
+    for (const auto& rect : region.rects()) {
+        for (const auto& tile : m_base->tilesIn(rect)) {
+            dirty << TiledSurface::key(tile);
+        }
+    }
+
+    for (int index = 1; index < levelCount(); index++) {
+        QSet<quint64> parents;
+        for (auto key : qAsConst(dirty)) {
+            const QPoint child = TiledSurface::fromKey(key);
+            parents << TiledSurface::key(QPoint(child.x() >> 1, child.y() >> 1));
+        }
+        for (auto key : qAsConst(parents)) {
+            rebuild(index, TiledSurface::fromKey(key));
+        }
+        dirty = parents;
+    }
+}
+
+void TilePyramid::rebuild(int index, const QPoint& tile)
+{
+    TiledSurface* children = level(index - 1);
+    TiledSurface* parents = level(index);
+
+    TiledSurface::Tile* quadrants[4];
+    bool blank = true;
+    for (int i = 0; i < 4; i++) {
+        quadrants[i] = children->tile(QPoint(tile.x() * 2 + (i & 1), tile.y() * 2 + (i >> 1)));
+        blank = blank && quadrants[i] == nullptr;
+    }
+    if (blank) {
+        parents->dropTile(tile);
+        return;
+    }
+
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+    auto target = parents->ensureTile(tile);
+    target->fbo->bind();
+    fns.glViewport(0, 0, TileSize, TileSize);
+    fns.glDisable(GL_BLEND);
+    const QColor blankColor = parents->blank();
+    fns.glClearColor(blankColor.redF(), blankColor.greenF(), blankColor.blueF(), blankColor.alphaF());
+    fns.glClear(GL_COLOR_BUFFER_BIT);
+
+    // drawn at half size, each texel lands on the corner of four child texels
+    // and the bilinear fetch averages them
+    auto gl = GLResources::current()->get<PyramidProgram>();
+    gl->begin(QSize(TileSize, TileSize));
+    for (int i = 0; i < 4; i++) {
+        if (quadrants[i] == nullptr)
+            continue;
+        const QRectF rect((i & 1) * TileSize / 2, (i >> 1) * TileSize / 2, TileSize / 2, TileSize / 2);
+        gl->draw(quadrants[i]->fbo->texture(), rect, GL_LINEAR);
+    }
+    gl->end();
+}
+
+int TilePyramid::levelFor(qreal scale) const
+{
+    if (scale >= 1.0)
+        return 0;
+    return qBound(0, int(std::floor(std::log2(1.0 / scale))), levelCount() - 1);
+}
+
+qint64 TilePyramid::bytes() const
+{
+    qint64 ret = 0;
+    for (auto it : m_levels) {
+        ret += it->bytes();
+    }
+    return ret;
+}
+
+qint64 TilePyramid::park(quint64 before, int& budget)
+{
+    qint64 ret = 0;
+    for (auto it : qAsConst(m_levels))
+        ret += it->park(before, budget);
+    return ret;
+}
+
+bool TilePyramid::isParking() const
+{
+    for (auto it : m_levels) {
+        if (it->isParking())
+            return true;
+    }
+    return false;
+}
+
+void TilePyramid::draw(QOpenGLFramebufferObject* target, const QRect& area, const QPointF& origin, qreal scale, const QColor& outside) const
+{
+    QOpenGLFunctions fns;
+    fns.initializeOpenGLFunctions();
+
+    const QRect bounds = area & QRect(QPoint(0, 0), target->size());
+    if (bounds.isEmpty())
+        return;
+    target->bind();
+    fns.glViewport(0, 0, target->width(), target->height());
+    fns.glDisable(GL_BLEND);
+    fns.glEnable(GL_SCISSOR_TEST);
+    fns.glScissor(bounds.x(), bounds.y(), bounds.width(), bounds.height());
+    fns.glClearColor(outside.redF(), outside.greenF(), outside.blueF(), outside.alphaF());
+    fns.glClear(GL_COLOR_BUFFER_BIT);
+
+    const QRect surface = QRectF(-origin * scale, QSizeF(m_base->size()) * scale).toAlignedRect() & bounds;
+    if (surface.isEmpty()) {
+        fns.glDisable(GL_SCISSOR_TEST);
+        return;
+    }
+    fns.glScissor(surface.x(), surface.y(), surface.width(), surface.height());
+    const QColor blank = m_base->blank();
+    fns.glClearColor(blank.redF(), blank.greenF(), blank.blueF(), blank.alphaF());
+    fns.glClear(GL_COLOR_BUFFER_BIT);
+
+    const int index = levelFor(scale);
+    const qreal factor = qreal(1 << index);
+    const TiledSurface* source = level(index);
+    // magnified texels stay crisp; minified ones are at most halved, which bilinear covers
+    const GLint filter = scale * factor > 1.0 ? GL_NEAREST : GL_LINEAR;
+
+    auto gl = GLResources::current()->get<PyramidProgram>();
+    gl->begin(target->size());
+    const QRectF visible((origin + QPointF(bounds.topLeft()) / scale) / factor, QSizeF(bounds.size()) / scale / factor);
+    for (const auto& coord : source->tilesIn(visible)) {
+        auto tile = source->tile(coord);
+        if (tile == nullptr)
+            continue;
+        const QRectF rect = TiledSurface::tileRect(coord);
+        gl->draw(tile->fbo->texture(), QRectF((rect.topLeft() * factor - origin) * scale, rect.size() * factor * scale), filter);
+    }
+    gl->end();
+    fns.glDisable(GL_SCISSOR_TEST);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <QColor>
+#include <QPointF>
+#include <QVector>
+#include "dirtyregion.h"
+#include "tiledsurface.h"
+
+class QOpenGLFramebufferObject;
+
+/// successively halved copies of a TiledSurface, for showing it zoomed out
+///
+/// level 0 is the surface itself and each level after it halves the one
+/// before, down to the first level that fits in a single tile. update()
+/// only rebuilds the ancestors of the tiles that changed, each parent from
+/// its four children with one bilinear fetch per texel, and blank children
+/// keep their parents blank. draw() samples the one level that's closest
+/// to the view's scale, so a view of a huge surface reads about as many
+/// texels as it has pixels however far out it's zoomed.
+class TilePyramid
+{
+public:
+    explicit TilePyramid(TiledSurface* base);
+    ~TilePyramid();
+    Q_DISABLE_COPY(TilePyramid)
+
+    /// who the coarse levels are accounted to; they're caches, whatever the base is
+    void setAccount(GpuMemory::Account* account);
+    /// follows the base surface's size, which must already be set; the coarse levels start blank
+    void resize();
+    /// rebuilds the levels above region of the base surface
+    void update(const DirtyRegion& region);
+
+    int levelCount() const { return m_levels.size() + 1; }
+    /// the level to draw at scale view pixels per surface pixel
+    int levelFor(qreal scale) const;
+    qint64 bytes() const;
+    /// TiledSurface::park() over the tiles of the coarse levels, sharing budget
+    qint64 park(quint64 before, int& budget);
+    bool isParking() const;
+
+    /// fills area of target with the surface as seen from origin (the surface pixel at
+    /// the target's origin) at scale, and everything outside the surface with outside
+    void draw(QOpenGLFramebufferObject* target, const QRect& area, const QPointF& origin, qreal scale, const QColor& outside) const;
+
+private:
+    TiledSurface* level(int index) const { return index == 0 ? m_base : m_levels[index - 1]; }
+    void rebuild(int index, const QPoint& tile);
+
+    TiledSurface* m_base;
+    GpuMemory::Account* m_account = nullptr;
+    /// levels 1 and up
+    QVector<TiledSurface*> m_levels;
+};
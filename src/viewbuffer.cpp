@@ -0,0 +1,82 @@
+#include <QOpenGLFramebufferObject>
+#include "viewbuffer.h"
+
+QSize ViewBuffer::allocationFor(const QSize& size)
+{
+    const auto round = [](int value) { return (value + Step - 1) / Step * Step; };
+    return QSize(round(size.width()) + Step, round(size.height()) + Step);
+}
+
+DirtyRegion ViewBuffer::uncovered(const QSize& from, const QSize& to)
+{
+    // past the old size there may be pixels from an earlier, larger size, but they're stale
+    DirtyRegion ret;
+    const QSize kept = from.boundedTo(to);
+    if (to.width() > kept.width())
+        ret.add(QRect(kept.width(), 0, to.width() - kept.width(), to.height()));
+    if (to.height() > kept.height())
+        ret.add(QRect(0, kept.height(), kept.width(), to.height() - kept.height()));
+    return ret;
+}
+
+ViewBuffer::~ViewBuffer()
+{
+    release();
+}
+
+void ViewBuffer::setAccount(GpuMemory::Account* account)
+{
+    m_account = account;
+    if (m_fbo != nullptr)
+        GpuMemory::track(m_fbo, m_account, m_category);
+}
+
+DirtyRegion ViewBuffer::resize(const QSize& size)
+{
+    if (size == m_size)
+        return DirtyRegion();
+
+    m_resized = GpuMemory::frame();
+    if (m_fbo == nullptr || m_fbo->width() < size.width() || m_fbo->height() < size.height()) {
+        QSize allocation = allocationFor(size);
+        if (m_fbo != nullptr)
+            allocation = allocation.expandedTo(m_fbo->size());
+        reallocate(allocation);
+    }
+
+    const DirtyRegion ret = uncovered(m_size, size);
+    m_size = size;
+    return ret;
+}
+
+void ViewBuffer::step()
+{
+    if (m_fbo == nullptr || GpuMemory::frame() - m_resized < SettleFrames)
+        return;
+
+    const QSize allocation = allocationFor(m_size);
+    if (m_fbo->width() > allocation.width() || m_fbo->height() > allocation.height())
+        reallocate(allocation);
+}
+
+void ViewBuffer::release()
+{
+    GpuMemory::untrack(m_fbo);
+    delete m_fbo;
+    m_fbo = nullptr;
+    m_size = QSize(0, 0);
+}
+
+void ViewBuffer::reallocate(const QSize& allocation)
+{
+    auto fbo = new QOpenGLFramebufferObject(allocation);
+    GpuMemory::track(fbo, m_account, m_category);
+    if (m_fbo != nullptr) {
+        const QRect kept(QPoint(0, 0), m_size.boundedTo(allocation));
+        if (!kept.isEmpty())
+            QOpenGLFramebufferObject::blitFramebuffer(fbo, kept, m_fbo, kept, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        GpuMemory::untrack(m_fbo);
+        delete m_fbo;
+    }
+    m_fbo = fbo;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <QSize>
+#include "dirtyregion.h"
+#include "gpumemory.h"
+
+class QOpenGLFramebufferObject;
+
+/// a framebuffer for something that's resized a lot, like a view while its window is dragged
+///
+/// the allocation grows in coarse steps with a step to spare, so most
+/// resizes only change how much of it is in use, and when it does have to
+/// be reallocated the pixels still in use are blitted over. view pixels
+/// don't move when the view is resized, so only what a resize uncovers has
+/// to be drawn. the spare room is given back once the size has settled.
+class ViewBuffer
+{
+public:
+    /// allocations are multiples of this, with one of it to spare
+    static constexpr int Step = 256;
+    /// how many frames the size has to stay put before spare room is given back
+    static constexpr quint64 SettleFrames = 60;
+
+    /// what a view of size gets when it has to be reallocated
+    static QSize allocationFor(const QSize& size);
+    /// what going from one size in use to another uncovers
+    static DirtyRegion uncovered(const QSize& from, const QSize& to);
+
+    explicit ViewBuffer(GpuMemory::Category category) : m_category(category) { }
+    ~ViewBuffer();
+    Q_DISABLE_COPY(ViewBuffer)
+
+    void setAccount(GpuMemory::Account* account);
+    /// the part in use, from the framebuffer's origin
+    QSize size() const { return m_size; }
+    /// at least size() large; null until the first resize
+    QOpenGLFramebufferObject* fbo() const { return m_fbo; }
+
+    /// changes the part in use, reallocating only if it doesn't fit. returns what's
+    /// in use now but wasn't before, which holds nothing meaningful until it's drawn
+    DirtyRegion resize(const QSize& size);
+    /// once a frame; shrinks the allocation once the size has settled well below it
+    void step();
+    /// frees the framebuffer and forgets the size; must be called with its context current
+    void release();
+
+private:
+    void reallocate(const QSize& allocation);
+
+    GpuMemory::Category m_category;
+    GpuMemory::Account* m_account = nullptr;
+    QOpenGLFramebufferObject* m_fbo = nullptr;
+    QSize m_size = QSize(0, 0);
+    /// GpuMemory's frame at the last resize
+    quint64 m_resized = 0;
+};
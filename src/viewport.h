@@ -0,0 +1,37 @@
+#pragma once
+
+#include <QPointF>
+#include <QTransform>
+#include <QtMath>
+
+/// which part of a document an item shows
+///
+/// document positions are in points, which are item pixels at zoom 1 and
+/// what strokes are generated in. surfaces hold the document at the device
+/// pixel ratio, so the view shows surface pixel p at (p - origin(dpr)) * zoom.
+struct Viewport {
+    static constexpr qreal MinimumZoom = 1.0 / 64.0;
+    static constexpr qreal MaximumZoom = 32.0;
+
+    /// the document point at the item's origin
+    QPointF pan;
+    /// item pixels per document point
+    qreal zoom = 1.0;
+
+    /// maps item positions to document points
+    QTransform toDocument() const {
+        return QTransform::fromScale(1.0 / zoom, 1.0 / zoom) * QTransform::fromTranslate(pan.x(), pan.y());
+    }
+    /// the surface pixel at the view's origin
+    QPointF origin(qreal dpr) const { return pan * dpr; }
+
+    /// zooms by factor, keeping the document point under pos (in item pixels) where it is
+    void zoomAt(const QPointF& pos, qreal factor) {
+        const QPointF anchor = toDocument().map(pos);
+        zoom = qBound(MinimumZoom, zoom * factor, MaximumZoom);
+        pan = anchor - pos / zoom;
+    }
+
+    bool operator==(const Viewport& other) const { return pan == other.pan && qFuzzyCompare(zoom, other.zoom); }
+    bool operator!=(const Viewport& other) const { return !(*this == other); }
+};
@@ -0,0 +1,75 @@
+// unit tests for StrokeEngine; run with qbs build -p autotest-runner
+
+#include <QLineF>
+#include <QtTest>
+#include "stroke.h"
+
+class StrokeEngineTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void chunking();
+    void carryWithChangingPressure();
+};
+
+namespace {
+
+StrokeSample sample(qreal x, qint64 timestamp, qreal pressure = 1.0)
+{
+    return StrokeSample{QPointF(x, 0.0), timestamp, pressure, QPointF()};
+}
+
+}
+
+void StrokeEngineTest::chunking()
+{
+    StrokeEngine::Settings settings;
+    settings.baseRadius = 10.0;
+
+    // one long segment, and the same one in uneven pieces
+    StrokeEngine whole(settings);
+    QVector<StrokeDab> one;
+    whole.begin(sample(0.0, 0), one);
+    whole.moveTo(sample(99.0, 99), one);
+
+    StrokeEngine chunked(settings);
+    QVector<StrokeDab> many;
+    chunked.begin(sample(0.0, 0), many);
+    for (qreal x : {0.3, 1.7, 2.0, 9.1, 33.3, 50.0, 77.7, 99.0})
+        chunked.moveTo(sample(x, qint64(x)), many);
+
+    QCOMPARE(many.size(), one.size());
+    for (int i = 0; i < one.size(); i++)
+        QVERIFY(qAbs(many[i].pos.x() - one[i].pos.x()) < 1e-6);
+}
+
+void StrokeEngineTest::carryWithChangingPressure()
+{
+    StrokeEngine::Settings settings;
+    settings.baseRadius = 10.0;
+    settings.pressureRadius = 1.0;
+    StrokeEngine engine(settings);
+
+    QVector<StrokeDab> dabs;
+    engine.begin(sample(0.0, 0), dabs);
+    // full pressure steps 2 pixels, leaving 1.9 carried over
+    engine.moveTo(sample(9.9, 10), dabs);
+    const int before = dabs.size();
+    QCOMPARE(before, 5);
+
+    // a light touch steps 0.5 pixels, less than what's carried over
+    engine.moveTo(sample(20.0, 20, 0.1), dabs);
+    QVERIFY(dabs.size() > before);
+    qreal last = dabs[before - 1].pos.x();
+    for (int i = before; i < dabs.size(); i++) {
+        // nothing behind where the event started, and nothing out of order
+        QVERIFY(dabs[i].pos.x() >= 9.9 - 1e-6);
+        QVERIFY(dabs[i].pos.x() > last);
+        last = dabs[i].pos.x();
+    }
+    QVERIFY(qAbs(dabs[before].pos.x() - 9.9) < 1e-6);
+}
+
+QTEST_APPLESS_MAIN(StrokeEngineTest)
+#include "strokeenginetest.moc"